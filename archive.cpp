@@ -0,0 +1,153 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#include <algorithm>
+#include <chrono>
+
+#define SPDLOG_ACTIVE_LEVEL SPDLOG_LEVEL_TRACE
+#include <spdlog/spdlog.h>
+
+#include "telegram_recorder.hpp"
+
+#define TDLIB_NOT_FOUND_ERROR 404
+
+// Archiving pages through each chat's history with the backfill machinery,
+// from the newest message down to the first one, and checkpoints every page in
+// chat_archive_state. Chats archived completely are skipped the next time, and
+// interrupted ones resume from their last page.
+void TelegramRecorder::startArchive() {
+  if(!this->config.archiveParallelChats) {
+    SPDLOG_ERROR("Archiving needs archive_parallel_chats to be at least 1");
+    this->archiveDone = true;
+    return;
+  }
+  this->archiveThread = std::thread(&TelegramRecorder::runArchiveLister, this);
+  for(unsigned int i = 0; i < this->config.archiveParallelChats; ++i) {
+    this->archiveThreads.emplace_back(&TelegramRecorder::runBackfillWorker, this, true);
+  }
+  this->recorderMetrics.threads->add(1 + this->config.archiveParallelChats);
+}
+
+bool TelegramRecorder::archiveFinished() {
+  return this->archiveDone.load();
+}
+
+void TelegramRecorder::runArchiveLister() {
+  SPDLOG_DEBUG("Archive lister started");
+  std::vector<td_api::int53> chats;
+  if(!this->listChats(false, chats) || !this->listChats(true, chats)) {
+    if(!this->exitFlag.load()) {
+      SPDLOG_ERROR("Unable to list chats to archive");
+      this->archiveDone = true;
+    }
+    return;
+  }
+  std::map<td_api::int53, ArchiveCheckpoint> state = this->readArchiveState();
+
+  std::deque<BackfillJob> jobs;
+  std::size_t alreadyArchived = 0;
+  for(td_api::int53 chatID : chats) {
+    auto it = state.find(chatID);
+    if(it != state.end() && it->second.finished) {
+      ++alreadyArchived;
+      continue;
+    }
+    BackfillJob job;
+    job.chatID = chatID;
+    job.archive = true;
+    if(it != state.end()) {
+      job.cursor = it->second.cursor;
+      job.messages = it->second.messages;
+    }
+    job.resumedAt = job.messages;
+    jobs.push_back(job);
+    if(!this->retrieveChatFromDB(chatID)) {
+      this->retrieveAndWriteChatFromTelegram(chatID);
+    }
+  }
+  SPDLOG_INFO("Archiving {} chats, {} of {} were archived already", jobs.size(), alreadyArchived, chats.size());
+  this->archiveChatsLeft = jobs.size();
+  this->recorderMetrics.archiveChatsPending->set(jobs.size());
+  if(jobs.empty()) {
+    this->archiveDone = true;
+    return;
+  }
+  this->backfillMutex.lock();
+  this->archiveJobs.swap(jobs);
+  this->backfillMutex.unlock();
+  this->backfillJobsAvailable.notify_all();
+  SPDLOG_DEBUG("Archive lister stopped");
+}
+
+// TDLib only returns the chats it has loaded, so it has to be asked to load
+// them all first
+bool TelegramRecorder::listChats(bool archivedList, std::vector<td_api::int53>& chats) {
+  auto makeChatList = [archivedList]() -> td_api::object_ptr<td_api::ChatList> {
+    if(archivedList) {
+      return td_api::make_object<td_api::chatListArchive>();
+    }
+    return td_api::make_object<td_api::chatListMain>();
+  };
+  while(true) {
+    TDAPIObjectPtr object = this->waitForQuery([makeChatList]() {
+      td_api::object_ptr<td_api::loadChats> loadChats = td_api::make_object<td_api::loadChats>();
+      loadChats->chat_list_ = makeChatList();
+      loadChats->limit_ = ARCHIVE_LOAD_CHATS_LIMIT;
+      return loadChats;
+    });
+    if(!object) {
+      return false;
+    }
+    if(object->get_id() == td_api::error::ID) {
+      td_api::object_ptr<td_api::error> err = td::move_tl_object_as<td_api::error>(object);
+      if(err->code_ == TDLIB_NOT_FOUND_ERROR) {
+        // Everything is loaded
+        break;
+      }
+      SPDLOG_ERROR("Load chats failed: {}", err->message_);
+      return false;
+    }
+  }
+
+  TDAPIObjectPtr object = this->waitForQuery([makeChatList]() {
+    td_api::object_ptr<td_api::getChats> getChats = td_api::make_object<td_api::getChats>();
+    getChats->chat_list_ = makeChatList();
+    getChats->limit_ = ARCHIVE_MAX_CHATS;
+    return getChats;
+  });
+  if(!object) {
+    return false;
+  }
+  if(object->get_id() != td_api::chats::ID) {
+    SPDLOG_ERROR("Unexpected response to getChats");
+    return false;
+  }
+  td_api::object_ptr<td_api::chats> result = td::move_tl_object_as<td_api::chats>(object);
+  for(td_api::int53 chatID : result->chat_ids_) {
+    if(std::find(chats.begin(), chats.end(), chatID) == chats.end()) {
+      chats.push_back(chatID);
+    }
+  }
+  return true;
+}
+
+void TelegramRecorder::finishArchiveJob(BackfillJob& job) {
+  double elapsedSec = std::chrono::duration<double>(std::chrono::steady_clock::now() - job.started).count();
+  std::uint64_t messages = job.messages - job.resumedAt;
+  if(job.finished) {
+    SPDLOG_INFO(
+      "Archived chat ID {}: {} messages in {:0.1f} seconds ({:0.1f} msgs/s), {} in total",
+      job.chatID, messages, elapsedSec, elapsedSec > 0 ? messages / elapsedSec : 0.0, job.messages
+    );
+  } else if(!this->exitFlag.load()) {
+    SPDLOG_WARN("Archiving chat ID {} stopped after {} messages, it will resume on the next run", job.chatID, job.messages);
+  }
+  this->recorderMetrics.archiveChatsPending->add(-1);
+  if(--this->archiveChatsLeft == 0) {
+    SPDLOG_INFO("Finished archiving chats");
+    this->archiveDone = true;
+  }
+}
@@ -23,12 +23,15 @@ auto TelegramRecorder::createAuthQueryHandler() {
 
 void TelegramRecorder::onAuthStateUpdate() {
   ++this->authQueryID;
+  // Several accounts may be waiting to be logged in
+  std::string prompt = this->config.accountName != "" ? "[" + this->config.accountName + "] " : "";
   td_api::downcast_call(
     *this->authState,
     overload {
       [this](td_api::authorizationStateReady&) {
         this->authorized = true;
         SPDLOG_INFO("Got authorization");
+        this->onAuthorized();
       },
       [this](td_api::authorizationStateLoggingOut&) {
         this->authorized = false;
@@ -42,8 +45,8 @@ void TelegramRecorder::onAuthStateUpdate() {
         this->needRestart = true;
         SPDLOG_WARN("Authorisation terminated");
       },
-      [this](td_api::authorizationStateWaitCode&) {
-        std::cout << "Enter authentication code: " << std::flush;
+      [this, &prompt](td_api::authorizationStateWaitCode&) {
+        std::cout << prompt << "Enter authentication code: " << std::flush;
         std::string code;
         std::getline(std::cin, code);
         this->sendQuery(
@@ -54,8 +57,8 @@ void TelegramRecorder::onAuthStateUpdate() {
       [this](td_api::authorizationStateWaitRegistration &) {
         std::cout << "Unimplemented authorizationStateWaitRegistration" << std::flush;
       },
-      [this](td_api::authorizationStateWaitPassword&) {
-        std::cout << "Enter authentication password: " << std::flush;
+      [this, &prompt](td_api::authorizationStateWaitPassword&) {
+        std::cout << prompt << "Enter authentication password: " << std::flush;
         std::string password;
         std::getline(std::cin, password);
         this->sendQuery(
@@ -63,13 +66,13 @@ void TelegramRecorder::onAuthStateUpdate() {
           this->createAuthQueryHandler()
         );
       },
-      [this](
+      [this, &prompt](
         td_api::authorizationStateWaitOtherDeviceConfirmation& state) {
-          std::cout << "Confirm this login link on another device: "
+          std::cout << prompt << "Confirm this login link on another device: "
                     << state.link_ << std::endl;
       },
-      [this](td_api::authorizationStateWaitPhoneNumber&) {
-        std::cout << "Enter phone number: " << std::flush;
+      [this, &prompt](td_api::authorizationStateWaitPhoneNumber&) {
+        std::cout << prompt << "Enter phone number: " << std::flush;
         std::string phoneNumber;
         std::getline(std::cin, phoneNumber);
         this->sendQuery(
@@ -88,7 +91,7 @@ void TelegramRecorder::onAuthStateUpdate() {
       },
       [this](td_api::authorizationStateWaitTdlibParameters&) {
         auto params = td_api::make_object<td_api::setTdlibParameters>();
-        params->database_directory_ = "tdlib";
+        params->database_directory_ = this->config.tdlibDirectory;
         params->use_message_database_ = true;
         params->use_secret_chats_ = true;
         params->api_id_ = this->config.apiID;
@@ -0,0 +1,260 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#include <algorithm>
+#include <chrono>
+#include <future>
+#include <set>
+
+#define SPDLOG_ACTIVE_LEVEL SPDLOG_LEVEL_TRACE
+#include <spdlog/spdlog.h>
+
+#include "telegram_data.hpp"
+#include "telegram_recorder.hpp"
+#include "text_utils.hpp"
+
+// Every chat with a high-water mark gets its history paged from the newest
+// message back to the mark, so whatever arrived while the recorder was down
+// (or the client restarting) ends up in the DB. Starting a pass replaces any
+// unfinished one, which is then resumed from its cursor once the new gap is
+// covered.
+void TelegramRecorder::beginBackfill() {
+  if(!this->config.backfillParallelChats) {
+    return;
+  }
+  std::string statement = "SELECT chat_id, last_message_id, backfill_until, backfill_cursor FROM chat_sync_state;";
+  std::deque<BackfillJob> jobs;
+
+  sqlite3_stmt *stmt;
+  this->toWriteQueueMutex.lock();
+  int rc = sqlite3_prepare_v2(this->db, statement.c_str(), -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    SPDLOG_ERROR("Error preparing statement: {}", sqlite3_errmsg(this->db));
+    this->toWriteQueueMutex.unlock();
+    return;
+  }
+  SPDLOG_DEBUG("Executing SQL: {}", statement);
+  std::uint64_t generation = ++this->backfillGeneration;
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    BackfillJob job;
+    job.chatID = sqlite3_column_int64(stmt, 0);
+    job.until = sqlite3_column_int64(stmt, 1);
+    job.cursor = 0;
+    job.generation = generation;
+    job.archive = false;
+    if(sqlite3_column_type(stmt, 2) != SQLITE_NULL) {
+      td_api::int53 until = sqlite3_column_int64(stmt, 2);
+      td_api::int53 cursor = sqlite3_column_int64(stmt, 3);
+      if(!cursor) {
+        // Interrupted before its first page, so it goes down from the newest
+        // message too
+        job.until = std::min(job.until, until);
+      } else if(cursor > until) {
+        job.resumeUntil = until;
+        job.resumeCursor = cursor;
+      }
+    }
+    // Persisted before any message received from now on can raise the mark
+    this->toWriteCheckpoints[job.chatID] = {job.resumeUntil ? job.resumeUntil : job.until, 0};
+    jobs.push_back(job);
+  }
+  if (rc != SQLITE_DONE) {
+    SPDLOG_ERROR("Error executing SQL: {}", sqlite3_errmsg(this->db));
+  }
+  sqlite3_finalize(stmt);
+  this->toWriteQueueMutex.unlock();
+  this->notifyWriter();
+
+  SPDLOG_INFO("Backfilling gaps in {} chats", jobs.size());
+  this->recorderMetrics.backfillChatsPending->set(jobs.size());
+  this->backfillMutex.lock();
+  this->backfillJobs.swap(jobs);
+  this->backfillMutex.unlock();
+  this->backfillJobsAvailable.notify_all();
+}
+
+// Archive workers take their jobs from archiveJobs instead, but share the
+// page budget with backfilling
+void TelegramRecorder::runBackfillWorker(bool archive) {
+  SPDLOG_DEBUG("{} worker started", archive ? "Archive" : "Backfill");
+  std::deque<BackfillJob>& jobs = archive ? this->archiveJobs : this->backfillJobs;
+  while(true) {
+    BackfillJob job;
+    {
+      std::unique_lock<std::mutex> lk(this->backfillMutex);
+      this->backfillJobsAvailable.wait(lk, [this, &jobs]{return (jobs.size() != 0 || this->exitFlag.load());});
+      if(this->exitFlag.load()) {
+        break;
+      }
+      job = jobs.front();
+      jobs.pop_front();
+    }
+    job.started = std::chrono::steady_clock::now();
+    // A newer backfill pass supersedes this one, archiving is never
+    // superseded
+    while(!this->exitFlag.load() && (job.archive || job.generation == this->backfillGeneration.load())) {
+      if(this->backfillChatPage(job)) {
+        break;
+      }
+    }
+    if(job.archive) {
+      this->finishArchiveJob(job);
+    } else if(job.generation == this->backfillGeneration.load()) {
+      this->recorderMetrics.backfillChatsPending->add(-1);
+    }
+  }
+  SPDLOG_DEBUG("{} worker stopped", archive ? "Archive" : "Backfill");
+}
+
+// Returns true once there's nothing else to do for the job
+bool TelegramRecorder::backfillChatPage(BackfillJob& job) {
+  // Live traffic goes first
+  while(this->recorderMetrics.writeQueueMessages->get() > BACKFILL_MAX_WRITE_QUEUE) {
+    if(this->sleepUntilExit(std::chrono::steady_clock::now() + std::chrono::milliseconds(SHUTDOWN_POLL_INTERVAL_MS))) {
+      return true;
+    }
+  }
+  std::chrono::steady_clock::time_point slot;
+  this->backfillMutex.lock();
+  slot = std::max(std::chrono::steady_clock::now(), this->backfillNextPage);
+  this->backfillNextPage = slot + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1.0 / this->config.backfillMaxPagesPerSec));
+  this->backfillMutex.unlock();
+  if(this->sleepUntilExit(slot)) {
+    return true;
+  }
+
+  TDAPIObjectPtr object = this->waitForQuery([chatID = job.chatID, cursor = job.cursor]() {
+    td_api::object_ptr<td_api::getChatHistory> getChatHistory = td_api::make_object<td_api::getChatHistory>();
+    getChatHistory->chat_id_ = chatID;
+    getChatHistory->from_message_id_ = cursor;
+    getChatHistory->offset_ = 0;
+    getChatHistory->limit_ = BACKFILL_PAGE_SIZE;
+    getChatHistory->only_local_ = false;
+    return getChatHistory;
+  });
+  if(!object) {
+    return true;
+  }
+  if(object->get_id() == td_api::error::ID) {
+    td_api::object_ptr<td_api::error> err = td::move_tl_object_as<td_api::error>(object);
+    // The checkpoint stays, so it's retried on the next pass
+    SPDLOG_ERROR("Retrieve history for chat ID {} failed: {}", job.chatID, err->message_);
+    return true;
+  }
+  if(object->get_id() != td_api::messages::ID) {
+    SPDLOG_ERROR("Unexpected response to getChatHistory for chat ID {}", job.chatID);
+    return true;
+  }
+
+  // Checked once the page arrives, as TDLib has sent the chat's type and
+  // title by then. The checkpoint stays, in case the rules change.
+  if(!this->chatFilter.allows(job.chatID)) {
+    return true;
+  }
+  td_api::object_ptr<td_api::messages> page = td::move_tl_object_as<td_api::messages>(object);
+  std::vector<std::shared_ptr<td_api::message>> missing;
+  std::set<td_api::int53> senders;
+  bool reachedMark = false;
+  td_api::int53 oldest = job.cursor;
+  for(auto& m : page->messages_) {
+    if(!m) {
+      continue;
+    }
+    if(job.archive && this->config.archiveMaxMessagesPerChat && job.messages >= this->config.archiveMaxMessagesPerChat) {
+      // Deep enough
+      reachedMark = true;
+      break;
+    }
+    if(job.cursor && m->id_ >= job.cursor) {
+      // The page starts at the cursor, which was already handled
+      continue;
+    }
+    if(m->id_ <= job.until) {
+      reachedMark = true;
+      continue;
+    }
+    if(!oldest || m->id_ < oldest) {
+      oldest = m->id_;
+    }
+    ++job.messages;
+    std::shared_ptr<td_api::message> message = std::shared_ptr<td_api::message>(m.release());
+    if(!this->isKnownMessage(message->chat_id_, message->id_)) {
+      senders.insert(getMessageSenderID(message));
+      missing.push_back(message);
+    }
+  }
+  // Nothing older than the cursor means the start of the chat
+  bool finished = reachedMark || oldest == job.cursor;
+  job.cursor = oldest;
+  if(reachedMark && job.resumeUntil) {
+    // On to the gap the interrupted pass left
+    job.until = job.resumeUntil;
+    job.cursor = job.resumeCursor;
+    job.resumeUntil = 0;
+    job.resumeCursor = 0;
+    finished = false;
+  }
+
+  // The user cache belongs to the recorder thread, so go straight to the DB
+  for(td_api::int53 senderID : senders) {
+    if(senderID && !this->retrieveUserFromDB(senderID)) {
+      this->retrieveAndWriteUserFromTelegram(senderID);
+    }
+  }
+  if(!this->enqueueBackfillPage(job, missing, finished)) {
+    return true;
+  }
+  if(job.archive) {
+    this->recorderMetrics.archivedMessages->inc(missing.size());
+    job.finished = finished;
+  } else {
+    this->recorderMetrics.backfilledMessages->inc(missing.size());
+  }
+  if(finished) {
+    SPDLOG_DEBUG("{} of chat ID {} finished", job.archive ? "Archival" : "Backfill", job.chatID);
+  }
+  return finished;
+}
+
+bool TelegramRecorder::enqueueBackfillPage(BackfillJob& job, std::vector<std::shared_ptr<td_api::message>>& messages, bool finished) {
+  this->toWriteQueueMutex.lock();
+  // Checked with the lock held, so a stale page can't overwrite the
+  // checkpoint of a newer pass, nor be enqueued after the writer is gone
+  if(this->exitFlag.load() || (!job.archive && job.generation != this->backfillGeneration.load())) {
+    this->toWriteQueueMutex.unlock();
+    return false;
+  }
+  for(auto& message : messages) {
+    this->toWriteMessageQueue[message->chat_id_].push_back(message);
+  }
+  this->recorderMetrics.writeQueueMessages->add(messages.size());
+  if(job.archive) {
+    this->toWriteArchiveCheckpoints[job.chatID] = {job.cursor, job.messages, finished};
+  } else {
+    // Until the new gap is covered, both are saved as one, from the cursor
+    // down to the interrupted pass's mark. What's between them is paged
+    // again if this pass is interrupted too, but nothing is missed.
+    td_api::int53 until = job.resumeUntil ? job.resumeUntil : job.until;
+    this->toWriteCheckpoints[job.chatID] = finished ? BackfillCheckpoint{0, 0} : BackfillCheckpoint{until, job.cursor};
+  }
+  this->toWriteQueueMutex.unlock();
+  this->notifyWriter();
+  return true;
+}
+
+TDAPIObjectPtr TelegramRecorder::waitForQuery(std::function<td_api::object_ptr<td_api::Function>()> makeQuery) {
+  std::shared_ptr<std::promise<TDAPIObjectPtr>> result = std::make_shared<std::promise<TDAPIObjectPtr>>();
+  std::future<TDAPIObjectPtr> response = result->get_future();
+  this->sendIdempotentQuery(std::move(makeQuery), [result](TDAPIObjectPtr object) {
+    result->set_value(std::move(object));
+  });
+  while(response.wait_for(std::chrono::milliseconds(SHUTDOWN_POLL_INTERVAL_MS)) != std::future_status::ready) {
+    if(this->exitFlag.load()) {
+      return nullptr;
+    }
+  }
+  return response.get();
+}
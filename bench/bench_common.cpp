@@ -0,0 +1,88 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <thread>
+
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "bench_common.hpp"
+#include "metrics.hpp"
+
+bool enterBenchDir(char* workDir) {
+  if(!mkdtemp(workDir) || chdir(workDir)) {
+    std::cerr << "Unable to create working directory" << std::endl;
+    return false;
+  }
+  std::ofstream conf("tgrec.conf");
+  // Reading is made as fast as possible, so it doesn't hold back message
+  // traces, and so is backfilling, as there's no server to be polite to
+  conf << "api_id = 0;" << std::endl
+       << "api_hash = \"bench\";" << std::endl
+       << "first_name = \"Bench\";" << std::endl
+       << "last_name = \"Bench\";" << std::endl
+       << "read_msg_frequency_mean = 1.0;" << std::endl
+       << "read_msg_frequency_std_dev = 0.0;" << std::endl
+       << "read_msg_min_wait_sec = 0.0;" << std::endl
+       << "text_read_speed_wpm = 1000000000.0;" << std::endl
+       << "photo_read_speed_sec = 0.0;" << std::endl
+       << "read_max_open_chats = 64;" << std::endl
+       << "backfill_max_pages_per_sec = 1000.0;" << std::endl
+       << "download_folder = \"download\";" << std::endl;
+  if(!conf.good()) {
+    std::cerr << "Unable to write config file in " << workDir << std::endl;
+    return false;
+  }
+  return true;
+}
+
+void leaveBenchDir(const char* workDir, bool keep) {
+  if(keep) {
+    std::cout << "working directory:    " << workDir << std::endl;
+  } else {
+    std::filesystem::remove_all(workDir);
+  }
+}
+
+double waitForWrites(std::function<bool(std::uint64_t)> done, unsigned int timeoutSec, std::uint64_t& written, std::function<std::uint64_t()> count) {
+  if(!count) {
+    Counter& messagesWritten = metrics().counter("tgrec_messages_written_total", "Messages inserted in the DB");
+    count = [&messagesWritten]() {
+      return messagesWritten.get();
+    };
+  }
+  auto start = std::chrono::steady_clock::now();
+  auto lastWrite = start;
+  written = count();
+  while(!done(written)) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(BENCH_POLL_MSEC));
+    if(count() != written) {
+      written = count();
+      lastWrite = std::chrono::steady_clock::now();
+    } else if(std::chrono::steady_clock::now() - start > std::chrono::seconds(timeoutSec)) {
+      std::cerr << "Timed out after writing " << written << " messages" << std::endl;
+      break;
+    }
+  }
+  return std::chrono::duration<double>(lastWrite - start).count();
+}
+
+void printIngestReport(std::uint64_t written, double elapsedSec) {
+  Histogram& durable = metrics().histogram("tgrec_message_durable_seconds", "", "", 1e-6);
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  std::cout << "messages written:     " << written << std::endl;
+  std::cout << "elapsed:              " << elapsedSec << " s" << std::endl;
+  std::cout << "throughput:           " << (elapsedSec > 0 ? written / elapsedSec : 0) << " msgs/s" << std::endl;
+  std::cout << "durable latency p50:  " << durable.percentile(0.5) / 1000.0 << " ms" << std::endl;
+  std::cout << "durable latency p99:  " << durable.percentile(0.99) / 1000.0 << " ms" << std::endl;
+  std::cout << "peak RSS:             " << usage.ru_maxrss / 1024 << " MiB" << std::endl;
+}
@@ -0,0 +1,27 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#ifndef BENCH_COMMON_HPP
+#define BENCH_COMMON_HPP
+
+#include <cstdint>
+#include <functional>
+#include <string>
+
+#define BENCH_DIR_TEMPLATE "/tmp/tgrec-bench-XXXXXX"
+#define BENCH_POLL_MSEC 10
+
+// Creates a temporary directory with a config file for the recorder and
+// makes it the working directory. workDir is a BENCH_DIR_TEMPLATE copy.
+bool enterBenchDir(char* workDir);
+void leaveBenchDir(const char* workDir, bool keep);
+// Polls the written messages counter until done() holds or timeoutSec pass.
+// Returns the seconds from the call until the last message was written.
+// count replaces the counter, e.g. to add up the ones of several accounts.
+double waitForWrites(std::function<bool(std::uint64_t)> done, unsigned int timeoutSec, std::uint64_t& written, std::function<std::uint64_t()> count = nullptr);
+void printIngestReport(std::uint64_t written, double elapsedSec);
+
+#endif
@@ -0,0 +1,394 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#include <filesystem>
+#include <thread>
+
+#include "fake_client.hpp"
+
+static const char* words[] = {
+  "hello", "there", "meeting", "tomorrow", "at", "the", "office", "can", "you",
+  "send", "me", "photos", "from", "yesterday", "lol", "ok", "thanks", "see",
+  "later", "what", "time", "is", "dinner", "I", "think", "so", "maybe", "not",
+  "sure", "about", "that", "great", "idea", "let's", "do", "it", "weekend"
+};
+
+FakeClientBackend::FakeClientBackend(FakeLoadParams params, unsigned int seed) : params(params), rng(seed) {
+  if(this->params.payloadFile != "") {
+    this->payloadSize = std::filesystem::file_size(this->params.payloadFile);
+  }
+  this->generated = this->params.historyMessages;
+}
+
+std::int32_t FakeClientBackend::create_client_id() {
+  std::lock_guard<std::mutex> lk(this->mutex);
+  ++this->clientID;
+  td_api::object_ptr<td_api::updateAuthorizationState> update = td_api::make_object<td_api::updateAuthorizationState>();
+  update->authorization_state_ = td_api::make_object<td_api::authorizationStateReady>();
+  this->pushUpdate(std::move(update));
+  this->closed = false;
+  if(!this->started) {
+    this->started = true;
+    this->startTime = std::chrono::steady_clock::now();
+  }
+  return this->clientID;
+}
+
+void FakeClientBackend::send(std::int32_t clientID, std::uint64_t requestID, td_api::object_ptr<td_api::Function> request) {
+  std::lock_guard<std::mutex> lk(this->mutex);
+  td::ClientManager::Response response;
+  response.client_id = clientID;
+  response.request_id = requestID;
+  response.object = this->answer(std::move(request));
+  this->responses.push_back(std::move(response));
+  this->responsesAvailable.notify_one();
+}
+
+td::ClientManager::Response FakeClientBackend::receive(double timeout) {
+  std::unique_lock<std::mutex> lk(this->mutex);
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(timeout));
+  while(true) {
+    if(this->responses.size()) {
+      td::ClientManager::Response response = std::move(this->responses.front());
+      this->responses.pop_front();
+      return response;
+    }
+    auto wakeUp = deadline;
+    if(this->started && !this->closed && this->generated.load() < this->params.totalMessages) {
+      auto due = this->startTime;
+      if(this->params.messagesPerSec > 0) {
+        due += std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>((this->generated.load() - this->params.historyMessages) / this->params.messagesPerSec));
+      }
+      if(std::chrono::steady_clock::now() >= due) {
+        this->generate();
+        continue;
+      }
+      wakeUp = std::min(due, deadline);
+    }
+    if(std::chrono::steady_clock::now() >= deadline) {
+      break;
+    }
+    this->responsesAvailable.wait_until(lk, wakeUp);
+  }
+  td::ClientManager::Response empty;
+  empty.client_id = 0;
+  empty.request_id = 0;
+  return empty;
+}
+
+unsigned long FakeClientBackend::messagesGenerated() {
+  return this->generated.load();
+}
+
+void FakeClientBackend::pushUpdate(td_api::object_ptr<td_api::Object> update) {
+  td::ClientManager::Response response;
+  response.client_id = this->clientID;
+  response.request_id = 0;
+  response.object = std::move(update);
+  this->responses.push_back(std::move(response));
+}
+
+void FakeClientBackend::generate() {
+  std::uniform_real_distribution<double> chance(0.0, 1.0);
+  unsigned long sequence = ++this->generated;
+  td_api::int53 messageID = this->messageIDFor(sequence);
+
+  td_api::object_ptr<td_api::updateNewMessage> update = td_api::make_object<td_api::updateNewMessage>();
+  update->message_ = this->makeMessage(FAKE_CHAT_ID_BASE + messageID % this->params.chats, messageID);
+  td_api::int53 senderID = static_cast<td_api::messageSenderUser*>(update->message_->sender_id_.get())->user_id_;
+  this->pushUpdate(std::move(update));
+
+  // Only messages old enough to be in the DB already are edited
+  if(sequence > FAKE_EDIT_MIN_AGE && chance(this->rng) < this->params.editRatio) {
+    td_api::int53 editedID = this->messageIDFor(this->rng() % (sequence - FAKE_EDIT_MIN_AGE) + 1);
+    td_api::object_ptr<td_api::updateMessageEdited> edit = td_api::make_object<td_api::updateMessageEdited>();
+    edit->chat_id_ = FAKE_CHAT_ID_BASE + editedID % this->params.chats;
+    edit->message_id_ = editedID;
+    edit->edit_date_ = time(0);
+    this->pushUpdate(std::move(edit));
+  }
+  if(chance(this->rng) < this->params.userUpdateRatio) {
+    td_api::object_ptr<td_api::updateUser> userUpdate = td_api::make_object<td_api::updateUser>();
+    userUpdate->user_ = this->makeUser(senderID);
+    this->pushUpdate(std::move(userUpdate));
+  }
+  if(this->params.restartEvery && sequence % this->params.restartEvery == 0 && sequence < this->params.totalMessages) {
+    // Nothing else is generated until the recorder creates a new client
+    td_api::object_ptr<td_api::updateAuthorizationState> closedUpdate = td_api::make_object<td_api::updateAuthorizationState>();
+    closedUpdate->authorization_state_ = td_api::make_object<td_api::authorizationStateClosed>();
+    this->pushUpdate(std::move(closedUpdate));
+    this->closed = true;
+    // The recorder has to backfill these
+    this->generated = std::min(sequence + FAKE_MISSED_PER_RESTART, this->params.totalMessages - 1);
+  }
+}
+
+td_api::int53 FakeClientBackend::messageIDFor(unsigned long sequence) {
+  // Spread consecutive messages over the chats with a splitmix64 step, the
+  // chat a message belongs to is its ID modulo the number of chats
+  std::uint64_t z = sequence + 0x9e3779b97f4a7c15ULL;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  z ^= z >> 31;
+  return static_cast<td_api::int53>(sequence) * this->params.chats + z % this->params.chats;
+}
+
+td_api::object_ptr<td_api::Object> FakeClientBackend::answer(td_api::object_ptr<td_api::Function> request) {
+  switch(request->get_id()) {
+    case td_api::getUser::ID:
+    case td_api::getUserFullInfo::ID:
+    case td_api::getChat::ID:
+    case td_api::getMessage::ID:
+    case td_api::downloadFile::ID:
+      if(std::uniform_real_distribution<double>(0.0, 1.0)(this->rng) < this->params.floodWaitRatio) {
+        return td_api::make_object<td_api::error>(429, "Too Many Requests: retry after " + std::to_string(FAKE_FLOOD_WAIT_SEC));
+      }
+      break;
+  }
+  switch(request->get_id()) {
+    case td_api::getOption::ID: {
+      td_api::object_ptr<td_api::optionValueString> value = td_api::make_object<td_api::optionValueString>();
+      value->value_ = "fake";
+      return value;
+    }
+    case td_api::close::ID: {
+      td_api::object_ptr<td_api::updateAuthorizationState> update = td_api::make_object<td_api::updateAuthorizationState>();
+      update->authorization_state_ = td_api::make_object<td_api::authorizationStateClosed>();
+      this->pushUpdate(std::move(update));
+      return td_api::make_object<td_api::ok>();
+    }
+    case td_api::getUser::ID: {
+      td_api::object_ptr<td_api::getUser> getUser = td::move_tl_object_as<td_api::getUser>(request);
+      return this->makeUser(getUser->user_id_);
+    }
+    case td_api::getUserFullInfo::ID: {
+      td_api::object_ptr<td_api::userFullInfo> info = td_api::make_object<td_api::userFullInfo>();
+      info->bio_ = this->makeText();
+      return info;
+    }
+    case td_api::getChat::ID: {
+      td_api::object_ptr<td_api::getChat> getChat = td::move_tl_object_as<td_api::getChat>(request);
+      td_api::object_ptr<td_api::chat> chat = td_api::make_object<td_api::chat>();
+      td_api::object_ptr<td_api::chatTypePrivate> type = td_api::make_object<td_api::chatTypePrivate>();
+      type->user_id_ = FAKE_SENDER_ID_BASE + getChat->chat_id_ % this->params.senders;
+      chat->id_ = getChat->chat_id_;
+      chat->type_ = std::move(type);
+      chat->title_ = "Chat " + std::to_string(getChat->chat_id_);
+      return chat;
+    }
+    case td_api::getMessage::ID: {
+      td_api::object_ptr<td_api::getMessage> getMessage = td::move_tl_object_as<td_api::getMessage>(request);
+      td_api::object_ptr<td_api::message> message = this->makeMessage(getMessage->chat_id_, getMessage->message_id_);
+      td_api::object_ptr<td_api::messageText> content = td_api::make_object<td_api::messageText>();
+      content->text_ = this->makeText();
+      message->content_ = std::move(content);
+      return message;
+    }
+    case td_api::loadChats::ID: {
+      // Every chat is known from the start
+      return td_api::make_object<td_api::error>(404, "Not Found");
+    }
+    case td_api::getChats::ID: {
+      td_api::object_ptr<td_api::getChats> getChats = td::move_tl_object_as<td_api::getChats>(request);
+      td_api::object_ptr<td_api::chats> chats = td_api::make_object<td_api::chats>();
+      if(getChats->chat_list_ && getChats->chat_list_->get_id() == td_api::chatListMain::ID) {
+        for(unsigned int i = 0; i < this->params.chats && chats->chat_ids_.size() < static_cast<std::size_t>(getChats->limit_); ++i) {
+          chats->chat_ids_.push_back(FAKE_CHAT_ID_BASE + i);
+        }
+      }
+      chats->total_count_ = chats->chat_ids_.size();
+      return chats;
+    }
+    case td_api::getChatHistory::ID: {
+      td_api::object_ptr<td_api::getChatHistory> getChatHistory = td::move_tl_object_as<td_api::getChatHistory>(request);
+      return this->makeHistory(getChatHistory->chat_id_, getChatHistory->from_message_id_, getChatHistory->limit_);
+    }
+    case td_api::downloadFile::ID: {
+      td_api::object_ptr<td_api::downloadFile> downloadFile = td::move_tl_object_as<td_api::downloadFile>(request);
+      td_api::object_ptr<td_api::file> file = this->makeFile();
+      file->id_ = downloadFile->file_id_;
+      file->local_->path_ = this->params.payloadFile;
+      file->local_->is_downloading_completed_ = this->params.payloadFile != "";
+      file->local_->downloaded_size_ = this->payloadSize;
+      return file;
+    }
+    default:
+      return td_api::make_object<td_api::ok>();
+  }
+}
+
+// Newest first, starting at fromMessageID itself if it exists, or at the
+// last message sent when it's 0
+td_api::object_ptr<td_api::messages> FakeClientBackend::makeHistory(td_api::int53 chatID, td_api::int53 fromMessageID, td_api::int32 limit) {
+  td_api::object_ptr<td_api::messages> history = td_api::make_object<td_api::messages>();
+  unsigned long sequence = this->generated.load();
+  if(fromMessageID) {
+    sequence = std::min<unsigned long>(sequence, fromMessageID / this->params.chats);
+  }
+  for(; sequence > 0 && history->messages_.size() < static_cast<std::size_t>(limit); --sequence) {
+    td_api::int53 messageID = this->messageIDFor(sequence);
+    if(FAKE_CHAT_ID_BASE + messageID % this->params.chats == chatID && (!fromMessageID || messageID <= fromMessageID)) {
+      history->messages_.push_back(this->makeMessage(chatID, messageID));
+    }
+  }
+  history->total_count_ = history->messages_.size();
+  return history;
+}
+
+td_api::object_ptr<td_api::message> FakeClientBackend::makeMessage(td_api::int53 chatID, td_api::int53 messageID) {
+  td_api::object_ptr<td_api::message> message = td_api::make_object<td_api::message>();
+  td_api::object_ptr<td_api::messageSenderUser> sender = td_api::make_object<td_api::messageSenderUser>();
+  sender->user_id_ = FAKE_SENDER_ID_BASE + this->rng() % this->params.senders;
+  message->id_ = messageID;
+  message->chat_id_ = chatID;
+  message->sender_id_ = std::move(sender);
+  message->date_ = time(0);
+  message->content_ = this->makeContent();
+  return message;
+}
+
+td_api::object_ptr<td_api::MessageContent> FakeClientBackend::makeContent() {
+  double kind = std::uniform_real_distribution<double>(0.0, 1.0)(this->rng);
+  if(kind < this->params.photoRatio) {
+    td_api::object_ptr<td_api::photoSize> size = td_api::make_object<td_api::photoSize>();
+    size->type_ = "x";
+    size->width_ = 1280;
+    size->height_ = 960;
+    size->photo_ = this->makeFile();
+    td_api::object_ptr<td_api::photo> photo = td_api::make_object<td_api::photo>();
+    photo->sizes_.push_back(std::move(size));
+    td_api::object_ptr<td_api::messagePhoto> content = td_api::make_object<td_api::messagePhoto>();
+    content->photo_ = std::move(photo);
+    content->caption_ = td_api::make_object<td_api::formattedText>();
+    return content;
+  }
+  if(kind < this->params.photoRatio + this->params.documentRatio) {
+    td_api::object_ptr<td_api::document> document = td_api::make_object<td_api::document>();
+    document->file_name_ = "document.bin";
+    document->mime_type_ = "application/octet-stream";
+    document->document_ = this->makeFile();
+    td_api::object_ptr<td_api::messageDocument> content = td_api::make_object<td_api::messageDocument>();
+    content->document_ = std::move(document);
+    content->caption_ = this->makeText();
+    return content;
+  }
+  td_api::object_ptr<td_api::messageText> content = td_api::make_object<td_api::messageText>();
+  content->text_ = this->makeText();
+  return content;
+}
+
+td_api::object_ptr<td_api::formattedText> FakeClientBackend::makeText() {
+  unsigned int numWords = FAKE_MIN_WORDS + this->rng() % (FAKE_MAX_WORDS - FAKE_MIN_WORDS + 1);
+  td_api::object_ptr<td_api::formattedText> text = td_api::make_object<td_api::formattedText>();
+  for(unsigned int i = 0; i < numWords; ++i) {
+    if(i) {
+      text->text_ += ' ';
+    }
+    text->text_ += words[this->rng() % (sizeof(words) / sizeof(words[0]))];
+  }
+  return text;
+}
+
+td_api::object_ptr<td_api::file> FakeClientBackend::makeFile() {
+  td_api::object_ptr<td_api::file> file = td_api::make_object<td_api::file>();
+  file->id_ = ++this->lastFileID;
+  file->size_ = this->payloadSize;
+  file->expected_size_ = this->payloadSize;
+  file->local_ = td_api::make_object<td_api::localFile>();
+  file->remote_ = td_api::make_object<td_api::remoteFile>();
+  file->remote_->unique_id_ = "fake" + std::to_string(file->id_);
+  return file;
+}
+
+td_api::object_ptr<td_api::user> FakeClientBackend::makeUser(td_api::int53 userID) {
+  td_api::object_ptr<td_api::user> user = td_api::make_object<td_api::user>();
+  user->id_ = userID;
+  user->first_name_ = "User";
+  user->last_name_ = std::to_string(userID);
+  user->usernames_ = td_api::make_object<td_api::usernames>();
+  user->usernames_->active_usernames_.push_back("user" + std::to_string(userID));
+  user->profile_photo_ = td_api::make_object<td_api::profilePhoto>();
+  user->profile_photo_->id_ = userID;
+  user->profile_photo_->small_ = this->makeFile();
+  user->profile_photo_->big_ = this->makeFile();
+  user->profile_photo_->big_->id_ = FAKE_PROFILE_FILE_ID_BASE + userID - FAKE_SENDER_ID_BASE;
+  return user;
+}
+
+FakeAccountsBackend::FakeAccountsBackend(FakeLoadParams params, unsigned int accounts) {
+  for(unsigned int i = 0; i < accounts; ++i) {
+    this->backends.push_back(std::make_unique<FakeClientBackend>(params, i + 1));
+  }
+}
+
+std::int32_t FakeAccountsBackend::create_client_id() {
+  std::lock_guard<std::mutex> lk(this->mutex);
+  std::size_t backend = this->clients.size();
+  if(backend >= this->backends.size()) {
+    if(this->closedBackends.empty()) {
+      // No account is left to restart, reuse the last one
+      backend = this->backends.size() - 1;
+    } else {
+      backend = this->closedBackends.front();
+      this->closedBackends.pop_front();
+    }
+  }
+  std::int32_t clientID = ++this->lastClientID;
+  std::int32_t innerID = this->backends[backend]->create_client_id();
+  this->clients[clientID] = {backend, innerID};
+  this->clientIDs[{backend, innerID}] = clientID;
+  return clientID;
+}
+
+void FakeAccountsBackend::send(std::int32_t clientID, std::uint64_t requestID, td_api::object_ptr<td_api::Function> request) {
+  std::unique_lock<std::mutex> lk(this->mutex);
+  auto it = this->clients.find(clientID);
+  if(it == this->clients.end()) {
+    return;
+  }
+  std::pair<std::size_t, std::int32_t> client = it->second;
+  lk.unlock();
+  this->backends[client.first]->send(client.second, requestID, std::move(request));
+}
+
+td::ClientManager::Response FakeAccountsBackend::receive(double timeout) {
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(timeout));
+  while(true) {
+    // Every backend gets its turn, so none of the accounts starves the others
+    for(std::size_t i = 0; i < this->backends.size(); ++i) {
+      std::size_t backend = this->nextBackend++ % this->backends.size();
+      td::ClientManager::Response response = this->backends[backend]->receive(0);
+      if(!response.object) {
+        continue;
+      }
+      std::lock_guard<std::mutex> lk(this->mutex);
+      response.client_id = this->clientIDs[{backend, response.client_id}];
+      if(response.object->get_id() == td_api::updateAuthorizationState::ID) {
+        td_api::updateAuthorizationState& update = static_cast<td_api::updateAuthorizationState&>(*response.object);
+        if(update.authorization_state_->get_id() == td_api::authorizationStateClosed::ID) {
+          this->closedBackends.push_back(backend);
+        }
+      }
+      return response;
+    }
+    if(std::chrono::steady_clock::now() >= deadline) {
+      break;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  td::ClientManager::Response empty;
+  empty.client_id = 0;
+  empty.request_id = 0;
+  return empty;
+}
+
+unsigned long FakeAccountsBackend::messagesGenerated() {
+  unsigned long generated = 0;
+  for(auto& backend : this->backends) {
+    generated += backend->messagesGenerated();
+  }
+  return generated;
+}
@@ -0,0 +1,123 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#ifndef FAKE_CLIENT_HPP
+#define FAKE_CLIENT_HPP
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "client_backend.hpp"
+
+#define FAKE_SENDER_ID_BASE 1000000
+#define FAKE_CHAT_ID_BASE 1
+// Profile photos keep their file ID, like in TDLib, unlike message media
+#define FAKE_PROFILE_FILE_ID_BASE 1000000000
+#define FAKE_MIN_WORDS 3
+#define FAKE_MAX_WORDS 40
+#define FAKE_EDIT_MIN_AGE 1000
+// Messages sent while the client is closed, only found in the chat history
+#define FAKE_MISSED_PER_RESTART 50
+#define FAKE_FLOOD_WAIT_SEC 1
+
+typedef struct FakeLoadParams {
+  // Messages per second, 0 generates them as fast as they're consumed
+  double messagesPerSec;
+  unsigned long totalMessages;
+  unsigned int chats;
+  unsigned int senders;
+  // Fractions of the generated messages, the rest are text messages
+  double photoRatio;
+  double documentRatio;
+  // Chance of following a message with an edit of a previous one, and with
+  // an update of its sender
+  double editRatio;
+  double userUpdateRatio;
+  // Local file handed over as the result of every download
+  std::string payloadFile;
+  // Close the client every N messages, like TDLib does when it has to be
+  // restarted. 0 never does.
+  unsigned long restartEvery;
+  // Messages of totalMessages already sent before starting, which are only
+  // in the chat history
+  unsigned long historyMessages;
+  // Chance of turning down a query for user, chat, message or file data with
+  // a flood wait, like Telegram does when they're sent too often
+  double floodWaitRatio;
+} FakeLoadParams;
+
+// In-process stand-in for TDLib. Logs in straight away, then produces a
+// synthetic stream of updates at the configured pace and answers the queries
+// the recorder sends about them with made up users, chats and files. Message
+// IDs are derived from their sequence number, so edits and chat history can
+// point back at earlier messages without keeping them around.
+class FakeClientBackend : public ClientBackend {
+  public:
+    FakeClientBackend(FakeLoadParams params, unsigned int seed = 1);
+    std::int32_t create_client_id() override;
+    void send(std::int32_t clientID, std::uint64_t requestID, td_api::object_ptr<td_api::Function> request) override;
+    td::ClientManager::Response receive(double timeout) override;
+    unsigned long messagesGenerated();
+
+  private:
+    td_api::object_ptr<td_api::Object> answer(td_api::object_ptr<td_api::Function> request);
+    void generate();
+    td_api::int53 messageIDFor(unsigned long sequence);
+    td_api::object_ptr<td_api::messages> makeHistory(td_api::int53 chatID, td_api::int53 fromMessageID, td_api::int32 limit);
+    void pushUpdate(td_api::object_ptr<td_api::Object> update);
+    td_api::object_ptr<td_api::message> makeMessage(td_api::int53 chatID, td_api::int53 messageID);
+    td_api::object_ptr<td_api::MessageContent> makeContent();
+    td_api::object_ptr<td_api::formattedText> makeText();
+    td_api::object_ptr<td_api::file> makeFile();
+    td_api::object_ptr<td_api::user> makeUser(td_api::int53 userID);
+
+    FakeLoadParams params;
+    std::mt19937_64 rng;
+    std::mutex mutex;
+    std::condition_variable responsesAvailable;
+    std::deque<td::ClientManager::Response> responses;
+    std::int32_t clientID{0};
+    std::atomic<unsigned long> generated{0};
+    std::int32_t lastFileID{0};
+    std::int64_t payloadSize{0};
+    bool started{false};
+    bool closed{false};
+    std::chrono::steady_clock::time_point startTime;
+};
+
+// Several accounts behind one ClientManager, like TDLib hosting many clients.
+// Each client is served by its own FakeClientBackend, a closed one being
+// handed over to the next client created, so an account that restarts keeps
+// its stream of messages.
+class FakeAccountsBackend : public ClientBackend {
+  public:
+    FakeAccountsBackend(FakeLoadParams params, unsigned int accounts);
+    std::int32_t create_client_id() override;
+    void send(std::int32_t clientID, std::uint64_t requestID, td_api::object_ptr<td_api::Function> request) override;
+    td::ClientManager::Response receive(double timeout) override;
+    unsigned long messagesGenerated();
+
+  private:
+    std::vector<std::unique_ptr<FakeClientBackend>> backends;
+    std::mutex mutex;
+    std::int32_t lastClientID{0};
+    // Client ID to backend, and back from each backend's own client IDs
+    std::map<std::int32_t, std::pair<std::size_t, std::int32_t>> clients;
+    std::map<std::pair<std::size_t, std::int32_t>, std::int32_t> clientIDs;
+    // Backends whose client was closed, in the order it was reported
+    std::deque<std::size_t> closedBackends;
+    std::size_t nextBackend{0};
+};
+
+#endif
@@ -0,0 +1,306 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#include <benchmark/benchmark.h>
+
+#define SPDLOG_ACTIVE_LEVEL SPDLOG_LEVEL_TRACE
+#include <spdlog/spdlog.h>
+
+#include "telegram_data.hpp"
+#include "telegram_recorder.hpp"
+#include "tests/alloc_counter.hpp"
+
+// Allocations writing a message may take, from the caller's side of
+// operator new. Recording a text message allocates nothing.
+#define WRITE_MESSAGE_ALLOC_BUDGET 0
+
+// Drops every query, nothing here needs an answer
+class NullClientBackend : public ClientBackend {
+  public:
+    std::int32_t create_client_id() override { return 1; }
+    void send(std::int32_t clientID, std::uint64_t requestID, td_api::object_ptr<td_api::Function> request) override {}
+    td::ClientManager::Response receive(double timeout) override {
+      td::ClientManager::Response empty;
+      empty.client_id = 0;
+      empty.request_id = 0;
+      return empty;
+    }
+};
+
+class TelegramRecorderBenchAccess {
+  public:
+    static bool openDB(TelegramRecorder& recorder, const std::string& path) {
+      recorder.config.dbFile = path;
+      return recorder.initDB();
+    }
+    static bool execSQL(TelegramRecorder& recorder, const std::string& statement) {
+      return recorder.execSQL(statement);
+    }
+    static bool writeMessageToDB(TelegramRecorder& recorder, std::shared_ptr<td_api::message>& message) {
+      return recorder.writeMessageToDB(message);
+    }
+};
+
+td_api::object_ptr<td_api::formattedText> makeText(const std::string& text) {
+  td_api::object_ptr<td_api::formattedText> formattedText = td_api::make_object<td_api::formattedText>();
+  formattedText->text_ = text;
+  return formattedText;
+}
+
+td_api::object_ptr<td_api::file> makeFile(td_api::int32 id) {
+  td_api::object_ptr<td_api::file> file = td_api::make_object<td_api::file>();
+  file->id_ = id;
+  file->local_ = td_api::make_object<td_api::localFile>();
+  file->remote_ = td_api::make_object<td_api::remoteFile>();
+  return file;
+}
+
+td_api::object_ptr<td_api::MessageContent> makeContent(td_api::int32 contentType) {
+  const std::string caption = "look at this, it's from the trip last weekend";
+  switch(contentType) {
+    case td_api::messageText::ID: {
+      td_api::object_ptr<td_api::messageText> content = td_api::make_object<td_api::messageText>();
+      content->text_ = makeText("see you tomorrow at the office, bring the photos from yesterday");
+      return content;
+    }
+    case td_api::messagePhoto::ID: {
+      td_api::object_ptr<td_api::messagePhoto> content = td_api::make_object<td_api::messagePhoto>();
+      content->photo_ = td_api::make_object<td_api::photo>();
+      for(int i = 1; i <= 4; ++i) {
+        td_api::object_ptr<td_api::photoSize> size = td_api::make_object<td_api::photoSize>();
+        size->width_ = 320 * i;
+        size->height_ = 240 * i;
+        size->photo_ = makeFile(i);
+        content->photo_->sizes_.push_back(std::move(size));
+      }
+      content->caption_ = makeText(caption);
+      return content;
+    }
+    case td_api::messageVideo::ID: {
+      td_api::object_ptr<td_api::messageVideo> content = td_api::make_object<td_api::messageVideo>();
+      content->video_ = td_api::make_object<td_api::video>();
+      content->video_->duration_ = 30;
+      content->video_->video_ = makeFile(1);
+      content->caption_ = makeText(caption);
+      return content;
+    }
+    case td_api::messageDocument::ID: {
+      td_api::object_ptr<td_api::messageDocument> content = td_api::make_object<td_api::messageDocument>();
+      content->document_ = td_api::make_object<td_api::document>();
+      content->document_->document_ = makeFile(1);
+      content->caption_ = makeText(caption);
+      return content;
+    }
+    case td_api::messageVoiceNote::ID: {
+      td_api::object_ptr<td_api::messageVoiceNote> content = td_api::make_object<td_api::messageVoiceNote>();
+      content->voice_note_ = td_api::make_object<td_api::voiceNote>();
+      content->voice_note_->voice_ = makeFile(1);
+      content->caption_ = makeText("");
+      return content;
+    }
+    case td_api::messageVideoNote::ID: {
+      td_api::object_ptr<td_api::messageVideoNote> content = td_api::make_object<td_api::messageVideoNote>();
+      content->video_note_ = td_api::make_object<td_api::videoNote>();
+      content->video_note_->video_ = makeFile(1);
+      return content;
+    }
+    case td_api::messageAnimation::ID: {
+      td_api::object_ptr<td_api::messageAnimation> content = td_api::make_object<td_api::messageAnimation>();
+      content->animation_ = td_api::make_object<td_api::animation>();
+      content->animation_->animation_ = makeFile(1);
+      content->caption_ = makeText(caption);
+      return content;
+    }
+    case td_api::messageSticker::ID: {
+      td_api::object_ptr<td_api::messageSticker> content = td_api::make_object<td_api::messageSticker>();
+      content->sticker_ = td_api::make_object<td_api::sticker>();
+      content->sticker_->sticker_ = makeFile(1);
+      return content;
+    }
+    case td_api::messageLocation::ID: {
+      td_api::object_ptr<td_api::messageLocation> content = td_api::make_object<td_api::messageLocation>();
+      content->location_ = td_api::make_object<td_api::location>();
+      return content;
+    }
+    case td_api::messageAudio::ID: {
+      td_api::object_ptr<td_api::messageAudio> content = td_api::make_object<td_api::messageAudio>();
+      content->audio_ = td_api::make_object<td_api::audio>();
+      content->audio_->duration_ = 180;
+      content->audio_->performer_ = "The Band";
+      content->audio_->title_ = "The Song";
+      content->audio_->audio_ = makeFile(1);
+      content->caption_ = makeText("");
+      return content;
+    }
+    case td_api::messageContact::ID: {
+      td_api::object_ptr<td_api::messageContact> content = td_api::make_object<td_api::messageContact>();
+      content->contact_ = td_api::make_object<td_api::contact>();
+      content->contact_->first_name_ = "Jane";
+      content->contact_->last_name_ = "Doe";
+      content->contact_->phone_number_ = "+15550100";
+      return content;
+    }
+    case td_api::messagePoll::ID: {
+      td_api::object_ptr<td_api::messagePoll> content = td_api::make_object<td_api::messagePoll>();
+      content->poll_ = td_api::make_object<td_api::poll>();
+      content->poll_->question_ = "Where do we go for dinner on friday?";
+      for(const char* text : {"the usual place", "the new italian one", "pizza at home"}) {
+        td_api::object_ptr<td_api::pollOption> option = td_api::make_object<td_api::pollOption>();
+        option->text_ = text;
+        content->poll_->options_.push_back(std::move(option));
+      }
+      return content;
+    }
+    default:
+      return td_api::make_object<td_api::messageUnsupported>();
+  }
+}
+
+std::shared_ptr<td_api::message> makeMessage(td_api::int32 contentType, td_api::int32 originType = 0) {
+  std::shared_ptr<td_api::message> message = std::make_shared<td_api::message>();
+  td_api::object_ptr<td_api::messageSenderUser> sender = td_api::make_object<td_api::messageSenderUser>();
+  sender->user_id_ = 123456789;
+  message->id_ = 1048576;
+  message->chat_id_ = -1001234567890;
+  message->sender_id_ = std::move(sender);
+  message->date_ = 1660000000;
+  message->content_ = makeContent(contentType);
+  if(originType) {
+    message->forward_info_ = td_api::make_object<td_api::messageForwardInfo>();
+    switch(originType) {
+      case td_api::messageOriginChannel::ID: {
+        td_api::object_ptr<td_api::messageOriginChannel> origin = td_api::make_object<td_api::messageOriginChannel>();
+        origin->chat_id_ = -1009876543210;
+        origin->message_id_ = 2097152;
+        message->forward_info_->origin_ = std::move(origin);
+        break;
+      }
+      case td_api::messageOriginChat::ID: {
+        td_api::object_ptr<td_api::messageOriginChat> origin = td_api::make_object<td_api::messageOriginChat>();
+        origin->sender_chat_id_ = -1009876543210;
+        message->forward_info_->origin_ = std::move(origin);
+        break;
+      }
+      case td_api::messageOriginHiddenUser::ID: {
+        td_api::object_ptr<td_api::messageOriginHiddenUser> origin = td_api::make_object<td_api::messageOriginHiddenUser>();
+        origin->sender_name_ = "Somebody";
+        message->forward_info_->origin_ = std::move(origin);
+        break;
+      }
+      default: {
+        td_api::object_ptr<td_api::messageOriginUser> origin = td_api::make_object<td_api::messageOriginUser>();
+        origin->sender_user_id_ = 987654321;
+        message->forward_info_->origin_ = std::move(origin);
+        break;
+      }
+    }
+  }
+  return message;
+}
+
+static const td_api::int32 contentTypes[] = {
+  td_api::messageText::ID,
+  td_api::messagePhoto::ID,
+  td_api::messageVideo::ID,
+  td_api::messageDocument::ID,
+  td_api::messageVoiceNote::ID,
+  td_api::messageVideoNote::ID,
+  td_api::messageAnimation::ID,
+  td_api::messageSticker::ID,
+  td_api::messageLocation::ID,
+  td_api::messageAudio::ID,
+  td_api::messageContact::ID,
+  td_api::messagePoll::ID,
+  td_api::messageUnsupported::ID
+};
+
+static const td_api::int32 originTypes[] = {
+  td_api::messageOriginUser::ID,
+  td_api::messageOriginChat::ID,
+  td_api::messageOriginHiddenUser::ID,
+  td_api::messageOriginChannel::ID
+};
+
+static void contentTypeArgs(benchmark::internal::Benchmark* b) {
+  for(td_api::int32 contentType : contentTypes) {
+    b->Arg(contentType);
+  }
+}
+
+static void originTypeArgs(benchmark::internal::Benchmark* b) {
+  for(td_api::int32 originType : originTypes) {
+    b->Arg(originType);
+  }
+}
+
+static void BM_GetMessageText(benchmark::State& state) {
+  std::shared_ptr<td_api::message> message = makeMessage(state.range(0));
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(getMessageText(message));
+  }
+}
+BENCHMARK(BM_GetMessageText)->Apply(contentTypeArgs);
+
+static void BM_GetMessageContentFileReference(benchmark::State& state) {
+  std::shared_ptr<td_api::message> message = makeMessage(state.range(0));
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(getMessageContentFileReference(message->content_));
+  }
+}
+BENCHMARK(BM_GetMessageContentFileReference)->Apply(contentTypeArgs);
+
+// Text, file and read time together, like the DB writer and the reader use
+static void BM_GetMessageContentInfo(benchmark::State& state) {
+  std::shared_ptr<td_api::message> message = makeMessage(state.range(0));
+  for (auto _ : state) {
+    MessageContentInfo info;
+    getMessageContentInfo(*message->content_, info);
+    benchmark::DoNotOptimize(info);
+  }
+}
+BENCHMARK(BM_GetMessageContentInfo)->Apply(contentTypeArgs);
+
+static void BM_GetMessageOrigin(benchmark::State& state) {
+  std::shared_ptr<td_api::message> message = makeMessage(td_api::messageText::ID, state.range(0));
+  for (auto _ : state) {
+    IDBuffer buffer;
+    benchmark::DoNotOptimize(getMessageOrigin(message, buffer));
+  }
+}
+BENCHMARK(BM_GetMessageOrigin)->Apply(originTypeArgs);
+
+// One bind/step cycle of the messages INSERT per iteration, grouped in a
+// single transaction like the DB writer does. Fails if it allocates more than
+// WRITE_MESSAGE_ALLOC_BUDGET per message.
+static void BM_WriteMessageToDB(benchmark::State& state) {
+  spdlog::set_level(spdlog::level::warn);
+  TelegramRecorder recorder(std::make_unique<NullClientBackend>(), DEFAULT_CONFIG_FILE);
+  if(!TelegramRecorderBenchAccess::openDB(recorder, ":memory:")) {
+    state.SkipWithError("Unable to open DB");
+    return;
+  }
+  std::shared_ptr<td_api::message> message = makeMessage(td_api::messageText::ID);
+  TelegramRecorderBenchAccess::execSQL(recorder, "BEGIN;");
+  // The first one prepares the statement
+  TelegramRecorderBenchAccess::writeMessageToDB(recorder, message);
+  std::uint64_t allocations = 0;
+  for (auto _ : state) {
+    ++message->id_;
+    std::uint64_t before = allocationCount();
+    if(!TelegramRecorderBenchAccess::writeMessageToDB(recorder, message)) {
+      state.SkipWithError("Unable to write message");
+      break;
+    }
+    allocations += allocationCount() - before;
+  }
+  TelegramRecorderBenchAccess::execSQL(recorder, "COMMIT;");
+  double allocationsPerMessage = state.iterations() ? static_cast<double>(allocations) / state.iterations() : 0;
+  state.counters["allocs_per_msg"] = allocationsPerMessage;
+  if(allocationsPerMessage > WRITE_MESSAGE_ALLOC_BUDGET) {
+    state.SkipWithError("Over the allocation budget per message");
+  }
+}
+BENCHMARK(BM_WriteMessageToDB);
@@ -0,0 +1,238 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+
+#include <getopt.h>
+#include <stdlib.h>
+
+#define SPDLOG_ACTIVE_LEVEL SPDLOG_LEVEL_TRACE
+#include <spdlog/spdlog.h>
+
+#include "bench_common.hpp"
+#include "fake_client.hpp"
+#include "recorder_host.hpp"
+#include "telegram_recorder.hpp"
+
+#define DEFAULT_BENCH_MESSAGES 20000
+#define DEFAULT_BENCH_CHATS 50
+#define DEFAULT_BENCH_SENDERS 500
+#define DEFAULT_BENCH_PAYLOAD_BYTES 65536
+#define DEFAULT_BENCH_TIMEOUT_SEC 600
+
+static struct option longopts[] = {
+    { "rate",               required_argument,  NULL, 'r'},
+    { "messages",           required_argument,  NULL, 'n'},
+    { "chats",              required_argument,  NULL, 'c'},
+    { "senders",            required_argument,  NULL, 's'},
+    { "photo-ratio",        required_argument,  NULL, 'p'},
+    { "document-ratio",     required_argument,  NULL, 'd'},
+    { "edit-ratio",         required_argument,  NULL, 'e'},
+    { "user-update-ratio",  required_argument,  NULL, 'u'},
+    { "payload-bytes",      required_argument,  NULL, 'b'},
+    { "restart-every",      required_argument,  NULL, 'R'},
+    { "history",            required_argument,  NULL, 'H'},
+    { "timeout",            required_argument,  NULL, 't'},
+    { "accounts",           required_argument,  NULL, 'A'},
+    { "flood-ratio",        required_argument,  NULL, 'F'},
+    { "search-index",       no_argument,        NULL, 'S'},
+    { "db-partition",       required_argument,  NULL, 'P'},
+    { "keep",               no_argument,        NULL, 'k'},
+    { "help",               no_argument,        NULL, 'h'},
+    { NULL,                 0,                  NULL, 0  }
+};
+
+void printHelp(const char* argv) {
+    std::cout << argv << " [options]" << std::endl;
+    std::cout << " -r | --rate N              Messages per second, 0 is as fast as possible (default 0)" << std::endl;
+    std::cout << " -n | --messages N          Messages to generate (default " << DEFAULT_BENCH_MESSAGES << ")" << std::endl;
+    std::cout << " -c | --chats N             Number of chats (default " << DEFAULT_BENCH_CHATS << ")" << std::endl;
+    std::cout << " -s | --senders N           Number of different senders (default " << DEFAULT_BENCH_SENDERS << ")" << std::endl;
+    std::cout << " -p | --photo-ratio F       Fraction of photo messages (default 0.1)" << std::endl;
+    std::cout << " -d | --document-ratio F    Fraction of document messages (default 0.02)" << std::endl;
+    std::cout << " -e | --edit-ratio F        Edits per message (default 0.05)" << std::endl;
+    std::cout << " -u | --user-update-ratio F User updates per message (default 0.01)" << std::endl;
+    std::cout << " -b | --payload-bytes N     Size of every downloaded file (default " << DEFAULT_BENCH_PAYLOAD_BYTES << ")" << std::endl;
+    std::cout << " -R | --restart-every N     Restart the client every N messages, 0 never does (default 0)" << std::endl;
+    std::cout << " -H | --history N           Messages sent before starting, recorded by archiving (default 0)" << std::endl;
+    std::cout << " -F | --flood-ratio F       Fraction of metadata and file queries turned down with a flood wait (default 0)" << std::endl;
+    std::cout << " -t | --timeout N           Give up after N seconds (default " << DEFAULT_BENCH_TIMEOUT_SEC << ")" << std::endl;
+    std::cout << " -A | --accounts N          Record N accounts in one process, each one getting every message (default 1)" << std::endl;
+    std::cout << " -S | --search-index        Keep the full-text search index up to date" << std::endl;
+    std::cout << " -P | --db-partition P      Write messages to a DB file per day, month or year (default none)" << std::endl;
+    std::cout << " -k | --keep                Keep the working directory with the DB" << std::endl;
+    std::cout << " -h | --help                Show this help" << std::endl;
+}
+
+bool writePayload(const std::string& path, unsigned long size) {
+  std::ofstream payload(path, std::ios::binary);
+  std::string block(4096, 'x');
+  for(unsigned long written = 0; written < size; written += block.size()) {
+    payload.write(block.data(), std::min<unsigned long>(block.size(), size - written));
+  }
+  return payload.good();
+}
+
+std::string accountName(unsigned int account) {
+  return "bench" + std::to_string(account);
+}
+
+// Adds up the counter of every account, or returns the only one
+std::uint64_t counterTotal(const std::string& name, const std::string& help, unsigned int accounts) {
+  if(!accounts) {
+    return metrics().counter(name, help).get();
+  }
+  std::uint64_t total = 0;
+  for(unsigned int i = 0; i < accounts; ++i) {
+    total += metrics().counter(name, help, "account=\"" + accountName(i) + "\"").get();
+  }
+  return total;
+}
+
+template<class Recorder>
+double record(Recorder& recorder, bool archive, std::uint64_t total, unsigned int accounts, unsigned int timeoutSec, std::uint64_t& written, unsigned int& threads) {
+  recorder.start();
+  if(archive) {
+    recorder.startArchive();
+  }
+  double elapsedSec = waitForWrites([&](std::uint64_t count) {
+    return count >= total;
+  }, timeoutSec, written, [accounts]() {
+    return counterTotal("tgrec_messages_written_total", "Messages inserted in the DB", accounts);
+  });
+  // Before the recorder's own threads are joined
+  threads = processStats().threads;
+  recorder.stop();
+  return elapsedSec;
+}
+
+int main(int argc, char** argv) {
+  FakeLoadParams params = {0.0, DEFAULT_BENCH_MESSAGES, DEFAULT_BENCH_CHATS, DEFAULT_BENCH_SENDERS, 0.1, 0.02, 0.05, 0.01, "", 0, 0, 0.0};
+  unsigned long payloadBytes = DEFAULT_BENCH_PAYLOAD_BYTES;
+  unsigned int timeoutSec = DEFAULT_BENCH_TIMEOUT_SEC;
+  unsigned int accounts = 0;
+  bool keep = false;
+  bool searchIndex = false;
+  std::string dbPartition;
+
+  int longIndex = 0;
+  int c;
+  while ((c = getopt_long(argc, argv, "r:n:c:s:p:d:e:u:b:R:H:t:A:F:SP:kh", longopts, &longIndex)) != -1) {
+    if(c == 'r') {
+      params.messagesPerSec = atof(optarg);
+    } else if(c == 'n') {
+      params.totalMessages = strtoul(optarg, NULL, 10);
+    } else if(c == 'c') {
+      params.chats = strtoul(optarg, NULL, 10);
+    } else if(c == 's') {
+      params.senders = strtoul(optarg, NULL, 10);
+    } else if(c == 'p') {
+      params.photoRatio = atof(optarg);
+    } else if(c == 'd') {
+      params.documentRatio = atof(optarg);
+    } else if(c == 'e') {
+      params.editRatio = atof(optarg);
+    } else if(c == 'u') {
+      params.userUpdateRatio = atof(optarg);
+    } else if(c == 'b') {
+      payloadBytes = strtoul(optarg, NULL, 10);
+    } else if(c == 'R') {
+      params.restartEvery = strtoul(optarg, NULL, 10);
+    } else if(c == 'H') {
+      params.historyMessages = strtoul(optarg, NULL, 10);
+    } else if(c == 't') {
+      timeoutSec = strtoul(optarg, NULL, 10);
+    } else if(c == 'A') {
+      accounts = strtoul(optarg, NULL, 10);
+    } else if(c == 'F') {
+      params.floodWaitRatio = atof(optarg);
+    } else if(c == 'S') {
+      searchIndex = true;
+    } else if(c == 'P') {
+      dbPartition = optarg;
+    } else if(c == 'k') {
+      keep = true;
+    } else {
+      printHelp(argv[0]);
+      return c == 'h' ? 0 : 1;
+    }
+  }
+  if(!params.chats || !params.senders || !params.totalMessages) {
+    std::cerr << "Messages, chats and senders must be greater than 0" << std::endl;
+    return 1;
+  }
+  if(params.historyMessages >= params.totalMessages) {
+    std::cerr << "History must be shorter than the total number of messages" << std::endl;
+    return 1;
+  }
+
+  char workDir[] = BENCH_DIR_TEMPLATE;
+  if(!enterBenchDir(workDir)) {
+    return 1;
+  }
+  if(searchIndex) {
+    std::ofstream("tgrec.conf", std::ios::app) << "search_index = true;" << std::endl;
+  }
+  if(dbPartition != "") {
+    std::ofstream("tgrec.conf", std::ios::app) << "db_partition = \"" << dbPartition << "\";" << std::endl;
+  }
+  params.payloadFile = std::string(workDir) + "/payload.bin";
+  if(!writePayload(params.payloadFile, payloadBytes)) {
+    std::cerr << "Unable to write payload file in " << workDir << std::endl;
+    return 1;
+  }
+  spdlog::set_level(spdlog::level::warn);
+
+  std::uint64_t written;
+  unsigned int threads;
+  double elapsedSec;
+  unsigned long generated;
+  // Every account gets the whole load
+  std::uint64_t total = params.totalMessages * std::max(accounts, 1u);
+  if(accounts) {
+    ConfigParams config;
+    if(!loadConfig("tgrec.conf", config)) {
+      return 1;
+    }
+    for(unsigned int i = 0; i < accounts; ++i) {
+      config.accounts.push_back({accountName(i), accountName(i) + ".db", "tdlib/" + accountName(i)});
+    }
+    FakeAccountsBackend* backend = new FakeAccountsBackend(params, accounts);
+    RecorderHost host(std::unique_ptr<ClientBackend>(backend), config);
+    elapsedSec = record(host, params.historyMessages, total, accounts, timeoutSec, written, threads);
+    generated = backend->messagesGenerated();
+  } else {
+    FakeClientBackend* backend = new FakeClientBackend(params);
+    TelegramRecorder recorder(std::unique_ptr<ClientBackend>(backend), "tgrec.conf");
+    elapsedSec = record(recorder, params.historyMessages, total, accounts, timeoutSec, written, threads);
+    generated = backend->messagesGenerated();
+  }
+
+  std::cout << "messages generated:   " << generated << std::endl;
+  if(params.restartEvery) {
+    std::cout << "restarts:             " << counterTotal("tgrec_restarts_total", "TDLib client restarts", accounts) << std::endl;
+    if(!accounts) {
+      Histogram& recovery = metrics().histogram("tgrec_restart_recovery_seconds", "Time from a TDLib client restart until it's authorized again", "", 1e-6);
+      std::cout << "recovery p99:         " << recovery.percentile(0.99) / 1000.0 << " ms" << std::endl;
+    }
+    std::cout << "backfilled:           " << counterTotal("tgrec_backfilled_messages_total", "Messages missed while offline and recovered from the chat history", accounts) << std::endl;
+  }
+  if(params.historyMessages) {
+    std::cout << "archived:             " << counterTotal("tgrec_archived_messages_total", "Messages recorded from the history of archived chats", accounts) << std::endl;
+  }
+  if(params.floodWaitRatio > 0) {
+    std::cout << "flood waits:          " << counterTotal("tgrec_query_flood_waits_total", "Queries Telegram asked to send again later", accounts) << std::endl;
+  }
+  std::cout << "queries throttled:    " << counterTotal("tgrec_queries_throttled_total", "Queries held back to stay under the query rate limits", accounts) << std::endl;
+  std::cout << "downloads skipped:    " << counterTotal("tgrec_downloads_skipped_total", "Downloads not requested because the file is stored already", accounts) << std::endl;
+  std::cout << "threads:              " << threads << std::endl;
+  printIngestReport(written, elapsedSec);
+  leaveBenchDir(workDir, keep);
+  spdlog::shutdown();
+  return written >= total ? 0 : 1;
+}
@@ -0,0 +1,89 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#include <iostream>
+
+#include <getopt.h>
+#include <stdlib.h>
+
+#define SPDLOG_ACTIVE_LEVEL SPDLOG_LEVEL_TRACE
+#include <spdlog/spdlog.h>
+
+#include "bench_common.hpp"
+#include "capture_backend.hpp"
+#include "metrics.hpp"
+#include "telegram_recorder.hpp"
+
+#define DEFAULT_REPLAY_TIMEOUT_SEC 3600
+
+static struct option longopts[] = {
+    { "speed",    required_argument,  NULL, 's'},
+    { "timeout",  required_argument,  NULL, 't'},
+    { "keep",     no_argument,        NULL, 'k'},
+    { "help",     no_argument,        NULL, 'h'},
+    { NULL,       0,                  NULL, 0  }
+};
+
+void printHelp(const char* argv) {
+    std::cout << argv << " [options] <capture file>" << std::endl;
+    std::cout << " -s | --speed N    Replay N times faster than recorded, 0 is as fast as possible (default 1)" << std::endl;
+    std::cout << " -t | --timeout N  Give up after N seconds (default " << DEFAULT_REPLAY_TIMEOUT_SEC << ")" << std::endl;
+    std::cout << " -k | --keep       Keep the working directory with the DB" << std::endl;
+    std::cout << " -h | --help       Show this help" << std::endl;
+}
+
+int main(int argc, char** argv) {
+  double speed = 1.0;
+  unsigned int timeoutSec = DEFAULT_REPLAY_TIMEOUT_SEC;
+  bool keep = false;
+
+  int longIndex = 0;
+  int c;
+  while ((c = getopt_long(argc, argv, "s:t:kh", longopts, &longIndex)) != -1) {
+    if(c == 's') {
+      speed = atof(optarg);
+    } else if(c == 't') {
+      timeoutSec = strtoul(optarg, NULL, 10);
+    } else if(c == 'k') {
+      keep = true;
+    } else {
+      printHelp(argv[0]);
+      return c == 'h' ? 0 : 1;
+    }
+  }
+  if(optind != argc - 1) {
+    printHelp(argv[0]);
+    return 1;
+  }
+
+  // Loaded before moving to the working directory, the path may be relative
+  ReplayClientBackend* backend = new ReplayClientBackend(speed);
+  if(!backend->load(argv[optind])) {
+    return 1;
+  }
+  char workDir[] = BENCH_DIR_TEMPLATE;
+  if(!enterBenchDir(workDir)) {
+    return 1;
+  }
+  spdlog::set_level(spdlog::level::warn);
+
+  TelegramRecorder recorder(std::unique_ptr<ClientBackend>(backend), "tgrec.conf");
+  Gauge& writeQueue = metrics().gauge("tgrec_write_queue_messages", "Messages waiting to be written to DB");
+
+  recorder.start();
+  std::uint64_t written;
+  double elapsedSec = waitForWrites([&](std::uint64_t) {
+    return backend->finished() && writeQueue.get() == 0;
+  }, timeoutSec, written);
+  recorder.stop();
+
+  std::cout << "updates replayed:     " << backend->updatesReplayed() << std::endl;
+  std::cout << "queries unanswered:   " << backend->queriesUnanswered() << std::endl;
+  printIngestReport(written, elapsedSec);
+  leaveBenchDir(workDir, keep);
+  spdlog::shutdown();
+  return backend->finished() ? 0 : 1;
+}
@@ -0,0 +1,135 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#include "bloom_filter.hpp"
+
+#define BLOOM_FILTER_MAX_PROBES 16
+
+static std::uint64_t mix(std::uint64_t z) {
+  // splitmix64 finalizer
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+BloomFilter::BloomFilter(std::uint64_t capacity, double falsePositiveRate) {
+  capacity = std::max<std::uint64_t>(capacity, 1);
+  falsePositiveRate = std::min(std::max(falsePositiveRate, 1e-9), 0.5);
+  double ln2 = std::log(2.0);
+  double optimalBits = std::ceil(-static_cast<double>(capacity) * std::log(falsePositiveRate) / (ln2 * ln2));
+  // Whole words, so the bits can be stored as they are
+  std::uint64_t words = std::max<std::uint64_t>(1, (static_cast<std::uint64_t>(optimalBits) + 63) / 64);
+  this->numBits = words * 64;
+  double optimalProbes = std::round(static_cast<double>(this->numBits) / capacity * ln2);
+  this->numProbes = static_cast<std::uint32_t>(std::min<double>(std::max(optimalProbes, 1.0), BLOOM_FILTER_MAX_PROBES));
+  this->bits.assign(words, 0);
+}
+
+void BloomFilter::add(std::int64_t chatID, std::int64_t messageID) {
+  std::uint64_t h1 = mix(mix(static_cast<std::uint64_t>(chatID)) ^ static_cast<std::uint64_t>(messageID));
+  std::uint64_t h2 = mix(h1) | 1;
+  for(std::uint32_t i = 0; i < this->numProbes; ++i) {
+    std::uint64_t bit = (h1 + i * h2) % this->numBits;
+    this->bits[bit / 64] |= 1ULL << (bit % 64);
+  }
+  ++this->numItems;
+}
+
+bool BloomFilter::mightContain(std::int64_t chatID, std::int64_t messageID) const {
+  std::uint64_t h1 = mix(mix(static_cast<std::uint64_t>(chatID)) ^ static_cast<std::uint64_t>(messageID));
+  std::uint64_t h2 = mix(h1) | 1;
+  for(std::uint32_t i = 0; i < this->numProbes; ++i) {
+    std::uint64_t bit = (h1 + i * h2) % this->numBits;
+    if(!(this->bits[bit / 64] & (1ULL << (bit % 64)))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void BloomFilter::clear() {
+  std::fill(this->bits.begin(), this->bits.end(), 0);
+  this->numItems = 0;
+}
+
+std::uint64_t BloomFilter::items() const {
+  return this->numItems;
+}
+
+std::uint64_t BloomFilter::sizeBytes() const {
+  return this->bits.size() * sizeof(std::uint64_t);
+}
+
+double BloomFilter::estimatedFalsePositiveRate() const {
+  return std::pow(1.0 - std::exp(-static_cast<double>(this->numProbes) * this->numItems / this->numBits), this->numProbes);
+}
+
+bool BloomFilter::save(const std::string& path, std::int64_t tag) const {
+  std::string tmpPath = path + ".tmp";
+  std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+  if(!file.is_open()) {
+    return false;
+  }
+  file.write(BLOOM_FILTER_MAGIC, BLOOM_FILTER_MAGIC_SIZE);
+  file.write(reinterpret_cast<const char*>(&this->numBits), sizeof(this->numBits));
+  file.write(reinterpret_cast<const char*>(&this->numProbes), sizeof(this->numProbes));
+  file.write(reinterpret_cast<const char*>(&this->numItems), sizeof(this->numItems));
+  file.write(reinterpret_cast<const char*>(&tag), sizeof(tag));
+  file.write(reinterpret_cast<const char*>(this->bits.data()), this->sizeBytes());
+  file.close();
+  if(!file.good()) {
+    std::remove(tmpPath.c_str());
+    return false;
+  }
+  return std::rename(tmpPath.c_str(), path.c_str()) == 0;
+}
+
+bool BloomFilter::load(const std::string& path, std::int64_t& tag) {
+  std::ifstream file(path, std::ios::binary);
+  if(!file.is_open()) {
+    return false;
+  }
+  char magic[BLOOM_FILTER_MAGIC_SIZE];
+  std::uint64_t fileBits;
+  std::uint32_t fileProbes;
+  std::uint64_t fileItems;
+  std::int64_t fileTag;
+  file.read(magic, BLOOM_FILTER_MAGIC_SIZE);
+  file.read(reinterpret_cast<char*>(&fileBits), sizeof(fileBits));
+  file.read(reinterpret_cast<char*>(&fileProbes), sizeof(fileProbes));
+  file.read(reinterpret_cast<char*>(&fileItems), sizeof(fileItems));
+  file.read(reinterpret_cast<char*>(&fileTag), sizeof(fileTag));
+  if(!file.good() || memcmp(magic, BLOOM_FILTER_MAGIC, BLOOM_FILTER_MAGIC_SIZE) ||
+     !fileBits || fileBits % 64 || !fileProbes || fileProbes > BLOOM_FILTER_MAX_PROBES) {
+    return false;
+  }
+  // The bits must be all that's left, checked before allocating them so a
+  // corrupt size can't ask for more memory than there is
+  std::streampos bitsStart = file.tellg();
+  file.seekg(0, std::ios::end);
+  std::streampos fileEnd = file.tellg();
+  if(!file.good() || bitsStart < 0 || static_cast<std::uint64_t>(fileEnd - bitsStart) != fileBits / 8) {
+    return false;
+  }
+  file.seekg(bitsStart);
+  std::vector<std::uint64_t> fileWords(fileBits / 64);
+  file.read(reinterpret_cast<char*>(fileWords.data()), fileWords.size() * sizeof(std::uint64_t));
+  if(!file.good()) {
+    return false;
+  }
+  this->bits.swap(fileWords);
+  this->numBits = fileBits;
+  this->numProbes = fileProbes;
+  this->numItems = fileItems;
+  tag = fileTag;
+  return true;
+}
@@ -0,0 +1,45 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#ifndef BLOOM_FILTER_HPP
+#define BLOOM_FILTER_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#define BLOOM_FILTER_MAGIC "TGRBLM1\n"
+#define BLOOM_FILTER_MAGIC_SIZE 8
+
+// Set of (chat ID, message ID) pairs with no false negatives and a bounded
+// rate of false positives, sized for a number of items and a target rate.
+// Lookups hash the pair once and derive every probe from it (Kirsch and
+// Mitzenmacher's double hashing).
+class BloomFilter {
+  public:
+    BloomFilter(std::uint64_t capacity = 1, double falsePositiveRate = 0.01);
+    void add(std::int64_t chatID, std::int64_t messageID);
+    bool mightContain(std::int64_t chatID, std::int64_t messageID) const;
+    void clear();
+    std::uint64_t items() const;
+    std::uint64_t sizeBytes() const;
+    // For the items added so far
+    double estimatedFalsePositiveRate() const;
+    // The file is the magic string, then the number of bits, probes and
+    // items, the user supplied tag and the bits themselves. It's written to
+    // a temporary file first, so a crash never leaves a partial one behind.
+    bool save(const std::string& path, std::int64_t tag) const;
+    // Fails, leaving the filter as it was, if the file is missing or corrupt
+    bool load(const std::string& path, std::int64_t& tag);
+
+  private:
+    std::vector<std::uint64_t> bits;
+    std::uint64_t numBits;
+    std::uint32_t numProbes;
+    std::uint64_t numItems{0};
+};
+
+#endif
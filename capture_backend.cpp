@@ -0,0 +1,200 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#include <td/telegram/td_api_json.h>
+#include <td/utils/JsonBuilder.h>
+#include <td/utils/Slice.h>
+
+#define SPDLOG_ACTIVE_LEVEL SPDLOG_LEVEL_TRACE
+#include <spdlog/spdlog.h>
+
+#include "capture_backend.hpp"
+
+#define CAPTURE_NOT_FOUND_ERROR 404
+
+std::string objectToJSON(const td_api::Object& object) {
+  return td::json_encode<std::string>(td::ToJson(object));
+}
+
+td_api::object_ptr<td_api::Object> objectFromJSON(std::string json) {
+  // Decoding happens in place
+  auto value = td::json_decode(td::MutableSlice(json));
+  if(value.is_error()) {
+    SPDLOG_ERROR("Malformed JSON in capture: {}", value.error().message().str());
+    return nullptr;
+  }
+  td_api::object_ptr<td_api::Object> object;
+  auto status = td::td_api::from_json(object, value.move_as_ok());
+  if(status.is_error()) {
+    SPDLOG_ERROR("Unable to decode object in capture: {}", status.message().str());
+    return nullptr;
+  }
+  return object;
+}
+
+// Every object starts with {"@type":"<name>"
+std::string getJSONType(const std::string& json) {
+  std::size_t start = json.find("\"@type\":\"");
+  if(start == std::string::npos) {
+    return "";
+  }
+  start += 9;
+  return json.substr(start, json.find('"', start) - start);
+}
+
+RecordingClientBackend::RecordingClientBackend(std::unique_ptr<ClientBackend> backend) : backend(std::move(backend)) {}
+
+bool RecordingClientBackend::open(const std::string& path) {
+  if(!this->capture.open(path)) {
+    return false;
+  }
+  SPDLOG_INFO("Capturing TDLib traffic to {}", path);
+  return true;
+}
+
+void RecordingClientBackend::close() {
+  this->capture.close();
+}
+
+std::int32_t RecordingClientBackend::create_client_id() {
+  return this->backend->create_client_id();
+}
+
+void RecordingClientBackend::send(std::int32_t clientID, std::uint64_t requestID, td_api::object_ptr<td_api::Function> request) {
+  this->capture.write(CAPTURE_SENT, requestID, objectToJSON(*request));
+  this->backend->send(clientID, requestID, std::move(request));
+}
+
+td::ClientManager::Response RecordingClientBackend::receive(double timeout) {
+  td::ClientManager::Response response = this->backend->receive(timeout);
+  if(response.object) {
+    this->capture.write(CAPTURE_RECEIVED, response.request_id, objectToJSON(*response.object));
+  }
+  return response;
+}
+
+ReplayClientBackend::ReplayClientBackend(double speed) : speed(speed) {}
+
+bool ReplayClientBackend::load(const std::string& path) {
+  CaptureReader reader;
+  if(!reader.open(path)) {
+    return false;
+  }
+  // Request IDs are only unique within a capture, so each query is matched
+  // with its response as they're read
+  std::unordered_map<std::uint64_t, std::string> pendingQueries;
+  CaptureRecord record;
+  while(reader.next(record)) {
+    if(record.type == CAPTURE_SENT) {
+      pendingQueries[record.requestID] = std::move(record.payload);
+    } else if(!record.requestID) {
+      this->updates.push_back({record.timestampMicros, std::move(record.payload)});
+    } else {
+      auto query = pendingQueries.find(record.requestID);
+      if(query == pendingQueries.end()) {
+        continue;
+      }
+      if(getJSONType(record.payload) == "ok") {
+        this->answeredWithOk.insert(getJSONType(query->second));
+      }
+      this->answers[query->second] = std::move(record.payload);
+      pendingQueries.erase(query);
+    }
+  }
+  SPDLOG_INFO("Loaded {} updates and {} query responses from {}", this->updates.size(), this->answers.size(), path);
+  return true;
+}
+
+std::int32_t ReplayClientBackend::create_client_id() {
+  std::lock_guard<std::mutex> lk(this->mutex);
+  if(!this->started) {
+    this->started = true;
+    this->startTime = std::chrono::steady_clock::now();
+  }
+  return 1;
+}
+
+void ReplayClientBackend::send(std::int32_t clientID, std::uint64_t requestID, td_api::object_ptr<td_api::Function> request) {
+  std::string query = objectToJSON(*request);
+  td::ClientManager::Response response;
+  response.client_id = clientID;
+  response.request_id = requestID;
+  auto answer = this->answers.find(query);
+  if(answer != this->answers.end()) {
+    response.object = objectFromJSON(answer->second);
+  } else if(this->answeredWithOk.count(getJSONType(query))) {
+    response.object = td_api::make_object<td_api::ok>();
+  } else {
+    SPDLOG_DEBUG("No response in capture for {}", query);
+    ++this->unanswered;
+    response.object = td_api::make_object<td_api::error>(CAPTURE_NOT_FOUND_ERROR, "Not found in capture");
+  }
+  std::lock_guard<std::mutex> lk(this->mutex);
+  this->responses.push_back(std::move(response));
+  if(getJSONType(query) == "close") {
+    // Updates are replayed by time only, so play TDLib's part in closing
+    td::ClientManager::Response closed;
+    closed.client_id = clientID;
+    closed.request_id = 0;
+    td_api::object_ptr<td_api::updateAuthorizationState> update = td_api::make_object<td_api::updateAuthorizationState>();
+    update->authorization_state_ = td_api::make_object<td_api::authorizationStateClosed>();
+    closed.object = std::move(update);
+    this->responses.push_back(std::move(closed));
+  }
+  this->responsesAvailable.notify_one();
+}
+
+td::ClientManager::Response ReplayClientBackend::receive(double timeout) {
+  std::unique_lock<std::mutex> lk(this->mutex);
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(timeout));
+  while(true) {
+    if(this->responses.size()) {
+      td::ClientManager::Response response = std::move(this->responses.front());
+      this->responses.pop_front();
+      return response;
+    }
+    auto wakeUp = deadline;
+    if(this->started && this->nextUpdate.load() < this->updates.size()) {
+      ReplayUpdate& update = this->updates[this->nextUpdate.load()];
+      auto due = this->startTime;
+      if(this->speed > 0) {
+        due += std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::microseconds(update.timestampMicros) / this->speed);
+      }
+      if(std::chrono::steady_clock::now() >= due) {
+        ++this->nextUpdate;
+        td::ClientManager::Response response;
+        response.client_id = 1;
+        response.request_id = 0;
+        response.object = objectFromJSON(std::move(update.payload));
+        if(response.object) {
+          return response;
+        }
+        continue;
+      }
+      wakeUp = std::min(due, deadline);
+    }
+    if(std::chrono::steady_clock::now() >= deadline) {
+      break;
+    }
+    this->responsesAvailable.wait_until(lk, wakeUp);
+  }
+  td::ClientManager::Response empty;
+  empty.client_id = 0;
+  empty.request_id = 0;
+  return empty;
+}
+
+bool ReplayClientBackend::finished() {
+  return this->nextUpdate.load() >= this->updates.size();
+}
+
+std::uint64_t ReplayClientBackend::updatesReplayed() {
+  return this->nextUpdate.load();
+}
+
+std::uint64_t ReplayClientBackend::queriesUnanswered() {
+  return this->unanswered.load();
+}
@@ -0,0 +1,74 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#ifndef CAPTURE_BACKEND_HPP
+#define CAPTURE_BACKEND_HPP
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "capture_log.hpp"
+#include "client_backend.hpp"
+
+// Passes everything through to another backend, writing every query sent and
+// every update and response received to a capture, in TDLib's JSON format.
+class RecordingClientBackend : public ClientBackend {
+  public:
+    RecordingClientBackend(std::unique_ptr<ClientBackend> backend);
+    bool open(const std::string& path);
+    void close();
+    std::int32_t create_client_id() override;
+    void send(std::int32_t clientID, std::uint64_t requestID, td_api::object_ptr<td_api::Function> request) override;
+    td::ClientManager::Response receive(double timeout) override;
+
+  private:
+    std::unique_ptr<ClientBackend> backend;
+    CaptureWriter capture;
+};
+
+// Plays the updates of a capture back with their original timing, scaled by
+// speed (0 plays them as fast as they're consumed). Queries are answered
+// with the response recorded for an identical query. Failing that, with ok
+// if that's what TDLib answered to that kind of query, or an error otherwise.
+class ReplayClientBackend : public ClientBackend {
+  public:
+    ReplayClientBackend(double speed);
+    bool load(const std::string& path);
+    std::int32_t create_client_id() override;
+    void send(std::int32_t clientID, std::uint64_t requestID, td_api::object_ptr<td_api::Function> request) override;
+    td::ClientManager::Response receive(double timeout) override;
+    bool finished();
+    std::uint64_t updatesReplayed();
+    std::uint64_t queriesUnanswered();
+
+  private:
+    typedef struct ReplayUpdate {
+      std::uint64_t timestampMicros;
+      std::string payload;
+    } ReplayUpdate;
+
+    double speed;
+    std::vector<ReplayUpdate> updates;
+    std::unordered_map<std::string, std::string> answers;
+    std::unordered_set<std::string> answeredWithOk;
+    std::mutex mutex;
+    std::condition_variable responsesAvailable;
+    std::deque<td::ClientManager::Response> responses;
+    std::atomic<std::size_t> nextUpdate{0};
+    std::atomic<std::uint64_t> unanswered{0};
+    bool started{false};
+    std::chrono::steady_clock::time_point startTime;
+};
+
+#endif
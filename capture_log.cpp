@@ -0,0 +1,126 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#include <cstring>
+
+#define SPDLOG_ACTIVE_LEVEL SPDLOG_LEVEL_TRACE
+#include <spdlog/spdlog.h>
+
+#include "capture_log.hpp"
+
+CaptureWriter::~CaptureWriter() {
+  this->close();
+}
+
+bool CaptureWriter::open(const std::string& path) {
+  std::lock_guard<std::mutex> lk(this->writerMutex);
+  this->file.open(path, std::ios::out | std::ios::trunc | std::ios::binary);
+  if(!this->file.is_open()) {
+    SPDLOG_ERROR("Unable to open capture file {}", path);
+    return false;
+  }
+  this->file.write(CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE);
+  this->epoch = std::chrono::steady_clock::now();
+  this->lastTimestamp = 0;
+  this->records = 0;
+  return true;
+}
+
+void CaptureWriter::write(CaptureRecordType type, std::uint64_t requestID, const std::string& payload) {
+  std::lock_guard<std::mutex> lk(this->writerMutex);
+  if(!this->file.is_open()) {
+    return;
+  }
+  // Taken with the lock held, so timestamps never go backwards
+  std::uint64_t timestamp = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - this->epoch).count();
+  this->writeVarint(type);
+  this->writeVarint(timestamp - this->lastTimestamp);
+  this->writeVarint(requestID);
+  this->writeVarint(payload.size());
+  this->file.write(payload.data(), payload.size());
+  this->lastTimestamp = timestamp;
+  ++this->records;
+}
+
+void CaptureWriter::close() {
+  std::lock_guard<std::mutex> lk(this->writerMutex);
+  if(this->file.is_open()) {
+    this->file.close();
+    SPDLOG_INFO("Capture closed after {} records", this->records);
+  }
+}
+
+std::uint64_t CaptureWriter::recordsWritten() {
+  std::lock_guard<std::mutex> lk(this->writerMutex);
+  return this->records;
+}
+
+void CaptureWriter::writeVarint(std::uint64_t value) {
+  char buffer[10];
+  int size = 0;
+  do {
+    buffer[size] = value & 0x7F;
+    value >>= 7;
+    if(value) {
+      buffer[size] |= 0x80;
+    }
+    ++size;
+  } while(value);
+  this->file.write(buffer, size);
+}
+
+bool CaptureReader::open(const std::string& path) {
+  this->file.open(path, std::ios::in | std::ios::binary);
+  if(!this->file.is_open()) {
+    SPDLOG_ERROR("Unable to open capture file {}", path);
+    return false;
+  }
+  char magic[CAPTURE_MAGIC_SIZE];
+  if(!this->file.read(magic, CAPTURE_MAGIC_SIZE) || memcmp(magic, CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE)) {
+    SPDLOG_ERROR("{} is not a capture file", path);
+    this->file.close();
+    return false;
+  }
+  this->lastTimestamp = 0;
+  return true;
+}
+
+bool CaptureReader::next(CaptureRecord& record) {
+  std::uint64_t type;
+  std::uint64_t delta;
+  std::uint64_t size;
+  if(!this->readVarint(type) || !this->readVarint(delta) || !this->readVarint(record.requestID) || !this->readVarint(size)) {
+    return false;
+  }
+  if(type > CAPTURE_SENT) {
+    SPDLOG_ERROR("Unknown capture record type {}", type);
+    return false;
+  }
+  record.payload.resize(size);
+  if(!this->file.read(record.payload.data(), size)) {
+    SPDLOG_WARN("Capture ends with a truncated record");
+    return false;
+  }
+  record.type = static_cast<CaptureRecordType>(type);
+  this->lastTimestamp += delta;
+  record.timestampMicros = this->lastTimestamp;
+  return true;
+}
+
+bool CaptureReader::readVarint(std::uint64_t& value) {
+  value = 0;
+  for(int shift = 0; shift < 64; shift += 7) {
+    int c = this->file.get();
+    if(c == EOF) {
+      return false;
+    }
+    value |= static_cast<std::uint64_t>(c & 0x7F) << shift;
+    if(!(c & 0x80)) {
+      return true;
+    }
+  }
+  return false;
+}
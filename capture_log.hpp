@@ -0,0 +1,68 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#ifndef CAPTURE_LOG_HPP
+#define CAPTURE_LOG_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+
+#define CAPTURE_MAGIC "TGRCAP1\n"
+#define CAPTURE_MAGIC_SIZE 8
+
+typedef enum CaptureRecordType {
+  // Updates and query responses received from TDLib
+  CAPTURE_RECEIVED,
+  // Queries sent to TDLib
+  CAPTURE_SENT
+} CaptureRecordType;
+
+typedef struct CaptureRecord {
+  CaptureRecordType type;
+  // Since the capture was opened
+  std::uint64_t timestampMicros;
+  std::uint64_t requestID;
+  std::string payload;
+} CaptureRecord;
+
+// A capture is the magic string followed by one record after another, each
+// one made of varints for the type, the microseconds since the previous
+// record, the request ID and the payload size, and then the payload itself.
+class CaptureWriter {
+  public:
+    ~CaptureWriter();
+    bool open(const std::string& path);
+    void write(CaptureRecordType type, std::uint64_t requestID, const std::string& payload);
+    void close();
+    std::uint64_t recordsWritten();
+
+  private:
+    void writeVarint(std::uint64_t value);
+
+    std::mutex writerMutex;
+    std::ofstream file;
+    std::chrono::steady_clock::time_point epoch;
+    std::uint64_t lastTimestamp{0};
+    std::uint64_t records{0};
+};
+
+class CaptureReader {
+  public:
+    bool open(const std::string& path);
+    // False once the capture is over, a truncated last record is skipped
+    bool next(CaptureRecord& record);
+
+  private:
+    bool readVarint(std::uint64_t& value);
+
+    std::ifstream file;
+    std::uint64_t lastTimestamp{0};
+};
+
+#endif
@@ -0,0 +1,126 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#define SPDLOG_ACTIVE_LEVEL SPDLOG_LEVEL_TRACE
+#include <spdlog/spdlog.h>
+
+#include "chat_filter.hpp"
+
+unsigned int chatTypeFromName(const std::string& name) {
+  if(name == "private") {
+    return CHAT_TYPE_PRIVATE;
+  } else if(name == "basic_group") {
+    return CHAT_TYPE_BASIC_GROUP;
+  } else if(name == "supergroup") {
+    return CHAT_TYPE_SUPERGROUP;
+  } else if(name == "channel") {
+    return CHAT_TYPE_CHANNEL;
+  }
+  return 0;
+}
+
+bool ChatFilter::load(const std::vector<ChatFilterParams>& rules, const std::string& labels) {
+  std::vector<CompiledRule> compiled;
+  bool includes = false;
+  for(const ChatFilterParams& rule : rules) {
+    CompiledRule compiledRule;
+    compiledRule.include = rule.include;
+    compiledRule.chatIDs.insert(rule.chatIDs.begin(), rule.chatIDs.end());
+    compiledRule.types = 0;
+    for(const std::string& typeName : rule.chatTypes) {
+      unsigned int type = chatTypeFromName(typeName);
+      if(!type) {
+        SPDLOG_ERROR("Unknown chat type {} in chat filter {}", typeName, rule.name);
+        return false;
+      }
+      compiledRule.types |= type;
+    }
+    compiledRule.hasTitle = rule.titlePattern != "";
+    if(compiledRule.hasTitle) {
+      try {
+        compiledRule.title = std::regex(rule.titlePattern, std::regex::ECMAScript | std::regex::icase | std::regex::optimize);
+      } catch(const std::regex_error& e) {
+        SPDLOG_ERROR("Invalid title pattern in chat filter {}: {}", rule.name, e.what());
+        return false;
+      }
+    }
+    std::string ruleLabel = "rule=\"" + rule.name + "\"";
+    compiledRule.dropped = rule.include ? nullptr : &metrics().counter("tgrec_chat_filter_dropped_total", "Updates dropped by chat filter rules", labels == "" ? ruleLabel : labels + "," + ruleLabel);
+    includes = includes || rule.include;
+    compiled.push_back(std::move(compiledRule));
+  }
+  std::string defaultLabel = "rule=\"default\"";
+  Counter* defaultDropped = includes ? &metrics().counter("tgrec_chat_filter_dropped_total", "Updates dropped by chat filter rules", labels == "" ? defaultLabel : labels + "," + defaultLabel) : nullptr;
+
+  this->mutex.lock();
+  this->compiled.swap(compiled);
+  this->defaultDropped = defaultDropped;
+  this->verdicts.clear();
+  this->enabled = !this->compiled.empty();
+  this->mutex.unlock();
+  SPDLOG_INFO("Loaded {} chat filter rules", rules.size());
+  return true;
+}
+
+void ChatFilter::learnChat(std::int64_t chatID, unsigned int type, const std::string& title) {
+  std::lock_guard<std::mutex> lk(this->mutex);
+  this->chats[chatID] = {type, title};
+  this->verdicts.erase(chatID);
+}
+
+void ChatFilter::learnTitle(std::int64_t chatID, const std::string& title) {
+  std::lock_guard<std::mutex> lk(this->mutex);
+  this->chats[chatID].title = title;
+  this->verdicts.erase(chatID);
+}
+
+// Must be called with mutex held
+Counter* ChatFilter::evaluate(std::int64_t chatID, const KnownChat* chat) {
+  for(CompiledRule& rule : this->compiled) {
+    if(!rule.chatIDs.empty() && !rule.chatIDs.count(chatID)) {
+      continue;
+    }
+    if(rule.types && (!chat || !(rule.types & chat->type))) {
+      continue;
+    }
+    if(rule.hasTitle && (!chat || !std::regex_search(chat->title, rule.title))) {
+      continue;
+    }
+    return rule.dropped;
+  }
+  return this->defaultDropped;
+}
+
+bool ChatFilter::allows(std::int64_t chatID) {
+  if(!this->enabled.load()) {
+    return true;
+  }
+  Counter* dropped;
+  this->mutex.lock();
+  auto verdict = this->verdicts.find(chatID);
+  if(verdict != this->verdicts.end()) {
+    dropped = verdict->second;
+  } else {
+    auto chat = this->chats.find(chatID);
+    const KnownChat* known = chat != this->chats.end() ? &chat->second : nullptr;
+    dropped = this->evaluate(chatID, known);
+    // Chats TDLib hasn't told about yet are decided again once it does
+    if(known) {
+      this->verdicts[chatID] = dropped;
+    }
+  }
+  this->mutex.unlock();
+  if(dropped) {
+    dropped->inc();
+    return false;
+  }
+  return true;
+}
+
+std::size_t ChatFilter::rules() {
+  std::lock_guard<std::mutex> lk(this->mutex);
+  return this->compiled.size();
+}
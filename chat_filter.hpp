@@ -0,0 +1,77 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#ifndef CHAT_FILTER_HPP
+#define CHAT_FILTER_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <regex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "config.hpp"
+#include "metrics.hpp"
+
+#define CHAT_TYPE_PRIVATE 0x1
+#define CHAT_TYPE_BASIC_GROUP 0x2
+#define CHAT_TYPE_SUPERGROUP 0x4
+#define CHAT_TYPE_CHANNEL 0x8
+
+// 0 if the name isn't one of the chat types
+unsigned int chatTypeFromName(const std::string& name);
+
+// Decides which chats are recorded, from the chat_filters rules. Every rule
+// is compiled once, into a set of chat IDs, a mask of chat types and a
+// regex, and the verdict for each chat is kept until its title or the rules
+// change, so checking an update is a single hash lookup. If any rule
+// includes chats, chats no rule matches are dropped, otherwise they're
+// recorded.
+class ChatFilter {
+  public:
+    // Replaces the rules. If any of them is invalid, it's logged and the
+    // current ones are kept. labels are added to the metrics of every rule.
+    bool load(const std::vector<ChatFilterParams>& rules, const std::string& labels = "");
+    // Type and title of a chat, which every rule but chat IDs needs
+    void learnChat(std::int64_t chatID, unsigned int type, const std::string& title);
+    void learnTitle(std::int64_t chatID, const std::string& title);
+    // False if updates of the chat have to be dropped, which is counted for
+    // the rule that drops them
+    bool allows(std::int64_t chatID);
+    std::size_t rules();
+
+  private:
+    typedef struct CompiledRule {
+      bool include;
+      std::unordered_set<std::int64_t> chatIDs;
+      unsigned int types;
+      bool hasTitle;
+      std::regex title;
+      Counter* dropped;
+    } CompiledRule;
+
+    typedef struct KnownChat {
+      unsigned int type;
+      std::string title;
+    } KnownChat;
+
+    Counter* evaluate(std::int64_t chatID, const KnownChat* chat);
+
+    // Skips the lock while there are no rules
+    std::atomic<bool> enabled{false};
+    std::mutex mutex;
+    std::vector<CompiledRule> compiled;
+    // Chats no rule matches, when there are include rules
+    Counter* defaultDropped{nullptr};
+    std::unordered_map<std::int64_t, KnownChat> chats;
+    // Counter of the rule that drops each chat evaluated, NULL if it's allowed
+    std::unordered_map<std::int64_t, Counter*> verdicts;
+};
+
+#endif
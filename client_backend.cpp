@@ -0,0 +1,23 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+// 
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#include "client_backend.hpp"
+
+TDClientBackend::TDClientBackend() {
+  this->clientManager = std::make_unique<td::ClientManager>();
+}
+
+std::int32_t TDClientBackend::create_client_id() {
+  return this->clientManager->create_client_id();
+}
+
+void TDClientBackend::send(std::int32_t clientID, std::uint64_t requestID, td_api::object_ptr<td_api::Function> request) {
+  this->clientManager->send(clientID, requestID, std::move(request));
+}
+
+td::ClientManager::Response TDClientBackend::receive(double timeout) {
+  return this->clientManager->receive(timeout);
+}
@@ -0,0 +1,39 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+// 
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#ifndef CLIENT_BACKEND_HPP
+#define CLIENT_BACKEND_HPP
+
+#include <memory>
+
+#include <td/telegram/Client.h>
+#include <td/telegram/td_api.h>
+
+namespace td_api = td::td_api;
+
+// Whatever the recorder talks to in order to reach Telegram. Mirrors the
+// td::ClientManager interface so the real one can be swapped by an
+// in-process stand-in (benchmarks, replays).
+class ClientBackend {
+  public:
+    virtual ~ClientBackend() = default;
+    virtual std::int32_t create_client_id() = 0;
+    virtual void send(std::int32_t clientID, std::uint64_t requestID, td_api::object_ptr<td_api::Function> request) = 0;
+    virtual td::ClientManager::Response receive(double timeout) = 0;
+};
+
+class TDClientBackend : public ClientBackend {
+  public:
+    TDClientBackend();
+    std::int32_t create_client_id() override;
+    void send(std::int32_t clientID, std::uint64_t requestID, td_api::object_ptr<td_api::Function> request) override;
+    td::ClientManager::Response receive(double timeout) override;
+
+  private:
+    std::unique_ptr<td::ClientManager> clientManager;
+};
+
+#endif
@@ -10,13 +10,52 @@
 #include <spdlog/spdlog.h>
 
 #include "config.hpp"
+#include "db_partition.hpp"
 #include "telegram_recorder.hpp"
 
 bool TelegramRecorder::loadConfig() {
+  return ::loadConfig(this->configFile, this->config);
+}
+
+static bool loadChatFilters(libconfig::Setting& filters, std::vector<ChatFilterParams>& rules) {
+  try {
+    for(int i = 0; i < filters.getLength(); ++i) {
+      ChatFilterParams rule;
+      rule.name = "rule" + std::to_string(i);
+      filters[i].lookupValue("name", rule.name);
+      std::string action;
+      if(!filters[i].lookupValue("action", action) || (action != "include" && action != "exclude")) {
+        SPDLOG_ERROR("Chat filter {} must have an action of include or exclude", rule.name);
+        return false;
+      }
+      rule.include = action == "include";
+      if(filters[i].exists("chat_ids")) {
+        libconfig::Setting& chatIDs = filters[i]["chat_ids"];
+        for(int j = 0; j < chatIDs.getLength(); ++j) {
+          rule.chatIDs.push_back(static_cast<long long>(chatIDs[j]));
+        }
+      }
+      if(filters[i].exists("chat_types")) {
+        libconfig::Setting& chatTypes = filters[i]["chat_types"];
+        for(int j = 0; j < chatTypes.getLength(); ++j) {
+          rule.chatTypes.push_back(static_cast<std::string>(chatTypes[j]));
+        }
+      }
+      filters[i].lookupValue("title", rule.titlePattern);
+      rules.push_back(rule);
+    }
+  } catch(const libconfig::SettingTypeException &stex) {
+    SPDLOG_ERROR("Malformed config found: {}", stex.getPath());
+    return false;
+  }
+  return true;
+}
+
+bool loadConfig(const std::string& configFile, ConfigParams& config) {
   libconfig::Config cfg;
 
   try {
-    cfg.readFile(DEFAULT_CONFIG_FILE);
+    cfg.readFile(configFile.c_str());
   } catch(const libconfig::FileIOException &fioex) {
     SPDLOG_ERROR("I/O error while reading config file");
     return false;
@@ -25,21 +64,19 @@ bool TelegramRecorder::loadConfig() {
     return false;
   }
 
+  // Reloads start over from the defaults
+  config = ConfigParams();
   try {
-    this->config = {
-      std::move(cfg.lookup("api_id")),
-      std::move(cfg.lookup("api_hash")),
-      std::move(cfg.lookup("first_name")),
-      std::move(cfg.lookup("first_name")),
-      std::move(cfg.lookup("download_folder")),
-      {
-        std::move(cfg.lookup("read_msg_frequency_mean")),
-        std::move(cfg.lookup("read_msg_frequency_std_dev")),
-        std::move(cfg.lookup("read_msg_min_wait_sec")),
-        std::move(cfg.lookup("text_read_speed_wpm")),
-        std::move(cfg.lookup("photo_read_speed_sec"))
-      }
-    };
+    config.apiID = cfg.lookup("api_id");
+    config.apiHash = cfg.lookup("api_hash").c_str();
+    config.firstName = cfg.lookup("first_name").c_str();
+    config.lastName = cfg.lookup("last_name").c_str();
+    config.downloadFolder = cfg.lookup("download_folder").c_str();
+    config.humanParams.readMsgFrequencyMean = cfg.lookup("read_msg_frequency_mean");
+    config.humanParams.readMsgFrequencyStdDev = cfg.lookup("read_msg_frequency_std_dev");
+    config.humanParams.readMsgMinWaitSec = cfg.lookup("read_msg_min_wait_sec");
+    config.humanParams.textReadSpeedWPM = cfg.lookup("text_read_speed_wpm");
+    config.humanParams.photoReadSpeedSec = cfg.lookup("photo_read_speed_sec");
   } catch(const libconfig::SettingNotFoundException &nfex) {
     SPDLOG_ERROR("Missing configuration parameters: {}", nfex.getPath());
     return false;
@@ -47,5 +84,75 @@ bool TelegramRecorder::loadConfig() {
     SPDLOG_ERROR("Malformed config found: {}", stex.getPath());
     return false;
   }
+
+  // Optional settings, defaults are kept if they're missing
+  cfg.lookupValue("read_max_open_chats", config.humanParams.readMaxOpenChats);
+  cfg.lookupValue("db_file", config.dbFile);
+  cfg.lookupValue("db_journal_mode", config.dbParams.journalMode);
+  cfg.lookupValue("db_page_size", config.dbParams.pageSize);
+  cfg.lookupValue("db_mmap_size_mb", config.dbParams.mmapSizeMB);
+  cfg.lookupValue("db_cache_size_mb", config.dbParams.cacheSizeMB);
+  cfg.lookupValue("db_partition", config.dbPartition);
+  if(!validPartitioning(config.dbPartition)) {
+    SPDLOG_ERROR("Unknown DB partitioning {}", config.dbPartition);
+    return false;
+  }
+  cfg.lookupValue("search_index", config.searchIndex);
+  cfg.lookupValue("search_tokenizer", config.searchTokenizer);
+  cfg.lookupValue("metrics_port", config.metricsPort);
+  cfg.lookupValue("metrics_socket", config.metricsSocket);
+  cfg.lookupValue("trace_log_file", config.traceLogFile);
+  cfg.lookupValue("trace_sample_every", config.traceSampleEvery);
+  cfg.lookupValue("log_async", config.logAsync);
+  cfg.lookupValue("log_queue_size", config.logQueueSize);
+  cfg.lookupValue("log_message_bodies", config.logMessageBodies);
+  cfg.lookupValue("log_message_rate_limit", config.logMessageRateLimit);
+  cfg.lookupValue("log_message_sample_every", config.logMessageSampleEvery);
+  cfg.lookupValue("capture_file", config.captureFile);
+  cfg.lookupValue("shutdown_timeout_sec", config.shutdownTimeoutSec);
+  cfg.lookupValue("backfill_parallel_chats", config.backfillParallelChats);
+  cfg.lookupValue("backfill_max_pages_per_sec", config.backfillMaxPagesPerSec);
+  cfg.lookupValue("archive_parallel_chats", config.archiveParallelChats);
+  cfg.lookupValue("archive_max_messages_per_chat", config.archiveMaxMessagesPerChat);
+  cfg.lookupValue("dedup_filter_file", config.dedupFilterFile);
+  cfg.lookupValue("dedup_filter_capacity", config.dedupFilterCapacity);
+  cfg.lookupValue("dedup_filter_fp_rate", config.dedupFilterFPRate);
+  cfg.lookupValue("download_layout", config.downloadLayout);
+  if(config.downloadLayout != DOWNLOAD_LAYOUT_SHARDED && config.downloadLayout != DOWNLOAD_LAYOUT_FLAT) {
+    SPDLOG_ERROR("Unknown download layout {}", config.downloadLayout);
+    return false;
+  }
+  cfg.lookupValue("tdlib_directory", config.tdlibDirectory);
+  cfg.lookupValue("download_max_in_flight", config.downloadMaxInFlight);
+  cfg.lookupValue("query_bulk_per_sec", config.queryBulkPerSec);
+  cfg.lookupValue("query_metadata_per_sec", config.queryMetadataPerSec);
+  cfg.lookupValue("query_history_per_sec", config.queryHistoryPerSec);
+  cfg.lookupValue("query_download_per_sec", config.queryDownloadPerSec);
+  cfg.lookupValue("account_write_batch", config.accountWriteBatch);
+  if(cfg.exists("chat_filters") && !loadChatFilters(cfg.lookup("chat_filters"), config.chatFilters)) {
+    return false;
+  }
+  if(!cfg.exists("accounts")) {
+    return true;
+  }
+  libconfig::Setting& accounts = cfg.lookup("accounts");
+  for(int i = 0; i < accounts.getLength(); ++i) {
+    AccountParams account;
+    if(!accounts[i].lookupValue("name", account.name) || account.name == "") {
+      SPDLOG_ERROR("Account {} has no name", i);
+      return false;
+    }
+    for(AccountParams& other : config.accounts) {
+      if(other.name == account.name) {
+        SPDLOG_ERROR("Account {} is listed more than once", account.name);
+        return false;
+      }
+    }
+    account.dbFile = account.name + ".db";
+    account.tdlibDirectory = config.tdlibDirectory + "/" + account.name;
+    accounts[i].lookupValue("db_file", account.dbFile);
+    accounts[i].lookupValue("tdlib_directory", account.tdlibDirectory);
+    config.accounts.push_back(account);
+  }
   return true;
 }
\ No newline at end of file
@@ -7,7 +7,33 @@
 #ifndef CONFIG_HPP
 #define CONFIG_HPP
 
+#include <cstdint>
+#include <string>
+#include <vector>
+
 #define DEFAULT_CONFIG_FILE "tgrec.conf"
+#define DEFAULT_DB_FILE "tgrec.db"
+#define DEFAULT_READ_MAX_OPEN_CHATS 4
+#define DEFAULT_TRACE_SAMPLE_EVERY 100
+#define DEFAULT_LOG_QUEUE_SIZE 8192
+#define DEFAULT_SHUTDOWN_TIMEOUT_SEC 30
+#define DEFAULT_BACKFILL_PARALLEL_CHATS 2
+#define DEFAULT_BACKFILL_MAX_PAGES_PER_SEC 5
+#define DEFAULT_ARCHIVE_PARALLEL_CHATS 4
+#define DEFAULT_DEDUP_FILTER_CAPACITY 1000000
+#define DEFAULT_DEDUP_FILTER_FP_RATE 0.01
+#define DEFAULT_DOWNLOAD_LAYOUT "sharded"
+#define DEFAULT_TDLIB_DIRECTORY "tdlib"
+#define DEFAULT_ACCOUNT_WRITE_BATCH 1000
+#define DEFAULT_QUERY_BULK_PER_SEC 30.0
+#define DEFAULT_QUERY_METADATA_PER_SEC 10.0
+#define DEFAULT_QUERY_HISTORY_PER_SEC 5.0
+#define DEFAULT_DB_JOURNAL_MODE "WAL"
+#define DEFAULT_DB_PAGE_SIZE 4096
+#define DEFAULT_DB_MMAP_SIZE_MB 256
+#define DEFAULT_DB_CACHE_SIZE_MB 64
+#define DEFAULT_DB_PARTITION "none"
+#define DEFAULT_SEARCH_TOKENIZER "unicode61 remove_diacritics 2"
 
 typedef struct HumanBehaviourParams {
   double readMsgFrequencyMean;
@@ -15,8 +41,38 @@ typedef struct HumanBehaviourParams {
   double readMsgMinWaitSec;
   double textReadSpeedWPM;
   double photoReadSpeedSec;
+  unsigned int readMaxOpenChats{DEFAULT_READ_MAX_OPEN_CHATS};
 } HumanBehaviourParams;
 
+typedef struct DBTuningParams {
+  std::string journalMode{DEFAULT_DB_JOURNAL_MODE};
+  unsigned int pageSize{DEFAULT_DB_PAGE_SIZE};
+  unsigned int mmapSizeMB{DEFAULT_DB_MMAP_SIZE_MB};
+  unsigned int cacheSizeMB{DEFAULT_DB_CACHE_SIZE_MB};
+} DBTuningParams;
+
+// An account recorded along with others in the same process. Everything
+// else is shared with the rest.
+typedef struct AccountParams {
+  std::string name;
+  // Default to <name>.db and tdlib/<name>
+  std::string dbFile;
+  std::string tdlibDirectory;
+} AccountParams;
+
+// A chat filter rule matches the chats that meet all of its criteria, and
+// any chat if it has none. Rules are tried in order and the first one that
+// matches decides.
+typedef struct ChatFilterParams {
+  std::string name;
+  bool include;
+  std::vector<std::int64_t> chatIDs;
+  // "private", "basic_group", "supergroup" or "channel"
+  std::vector<std::string> chatTypes;
+  // Searched for in the title, ignoring case
+  std::string titlePattern;
+} ChatFilterParams;
+
 typedef struct ConfigParams {
   int apiID;
   std::string apiHash;
@@ -24,6 +80,58 @@ typedef struct ConfigParams {
   std::string lastName;
   std::string downloadFolder;
   HumanBehaviourParams humanParams;
+  std::string dbFile{DEFAULT_DB_FILE};
+  DBTuningParams dbParams;
+  // "none", "day", "month" or "year", see db_partition.hpp
+  std::string dbPartition{DEFAULT_DB_PARTITION};
+  // Full-text index over the messages, see search_index.hpp
+  bool searchIndex{false};
+  // An FTS5 tokenizer with its options. Changing it rebuilds the index.
+  std::string searchTokenizer{DEFAULT_SEARCH_TOKENIZER};
+  int metricsPort{0};
+  std::string metricsSocket;
+  std::string traceLogFile;
+  unsigned int traceSampleEvery{DEFAULT_TRACE_SAMPLE_EVERY};
+  bool logAsync{false};
+  unsigned int logQueueSize{DEFAULT_LOG_QUEUE_SIZE};
+  bool logMessageBodies{true};
+  unsigned int logMessageRateLimit{0};
+  unsigned int logMessageSampleEvery{1};
+  std::string captureFile;
+  unsigned int shutdownTimeoutSec{DEFAULT_SHUTDOWN_TIMEOUT_SEC};
+  unsigned int backfillParallelChats{DEFAULT_BACKFILL_PARALLEL_CHATS};
+  double backfillMaxPagesPerSec{DEFAULT_BACKFILL_MAX_PAGES_PER_SEC};
+  unsigned int archiveParallelChats{DEFAULT_ARCHIVE_PARALLEL_CHATS};
+  // 0 archives whole chats
+  unsigned int archiveMaxMessagesPerChat{0};
+  // Defaults to the DB file with a .bloom extension
+  std::string dedupFilterFile;
+  // 0 disables the filter
+  unsigned int dedupFilterCapacity{DEFAULT_DEDUP_FILTER_CAPACITY};
+  double dedupFilterFPRate{DEFAULT_DEDUP_FILTER_FP_RATE};
+  // "sharded" or "flat"
+  std::string downloadLayout{DEFAULT_DOWNLOAD_LAYOUT};
+  std::string tdlibDirectory{DEFAULT_TDLIB_DIRECTORY};
+  // Downloads requested to TDLib at once, 0 doesn't limit them
+  unsigned int downloadMaxInFlight{0};
+  // User, chat and message lookups per second, all together and for each
+  // kind of lookup, chat history pages and downloads requested per second.
+  // 0 doesn't limit them.
+  double queryBulkPerSec{DEFAULT_QUERY_BULK_PER_SEC};
+  double queryMetadataPerSec{DEFAULT_QUERY_METADATA_PER_SEC};
+  double queryHistoryPerSec{DEFAULT_QUERY_HISTORY_PER_SEC};
+  double queryDownloadPerSec{0};
+  // Empty records a single account, set up with the rest of the settings
+  std::vector<AccountParams> accounts;
+  // Labels the account's metrics when recording several
+  std::string accountName;
+  // Messages written from an account in a single commit, before the writer
+  // moves on to the next
+  unsigned int accountWriteBatch{DEFAULT_ACCOUNT_WRITE_BATCH};
+  // Empty records every chat
+  std::vector<ChatFilterParams> chatFilters;
 } ConfigParams;
 
+bool loadConfig(const std::string& configFile, ConfigParams& config);
+
 #endif
\ No newline at end of file
@@ -4,223 +4,526 @@
 // 
 // Distributed under BSD 3-Clause License. See LICENSE.
 
+#include <algorithm>
+#include <chrono>
+#include <ctime>
 #include <mutex>
 
 #define SPDLOG_ACTIVE_LEVEL SPDLOG_LEVEL_TRACE
 #include <spdlog/spdlog.h>
 
+#include "db_partition.hpp"
+#include "db_schema.hpp"
 #include "hash.hpp"
+#include "logging.hpp"
+#include "metrics.hpp"
+#include "recorder_host.hpp"
+#include "search_index.hpp"
 #include "telegram_data.hpp"
 #include "telegram_recorder.hpp"
+#include "text_kernel.hpp"
 
-bool checkTableExists(sqlite3* db, std::string tableName) {
-  std::string statement = "SELECT COUNT(type) FROM sqlite_master WHERE type='table' AND name = ? ;";
-  char *errMsg = NULL;
-  int rc;
-  bool exists = false;
+Histogram& statementLatency(const std::string& statementName) {
+  return metrics().histogram("tgrec_sqlite_statement_seconds", "Latency of executing SQLite statements", "statement=\"" + statementName + "\"", 1e-6);
+}
 
-  sqlite3_stmt *stmt;
-  rc = sqlite3_prepare_v2(db, statement.c_str(), -1, &stmt, NULL);
-  if (rc != SQLITE_OK) {
-    SPDLOG_ERROR("Error preparing statement: {}", sqlite3_errmsg(db));
-    return false;
-  }
+int timedStep(sqlite3_stmt* stmt, Histogram& latency) {
+  auto start = std::chrono::steady_clock::now();
+  int rc = sqlite3_step(stmt);
+  latency.record(elapsedMicros(start));
+  return rc;
+}
 
-  rc = sqlite3_bind_text64(stmt, 1, tableName.c_str(), tableName.length(), SQLITE_STATIC, SQLITE_UTF8);
-  if (rc != SQLITE_OK) {
-    SPDLOG_ERROR("Error preparing SQL statement: {}", sqlite3_errmsg(db));
-    return false;
+// Text from Telegram is only bound as UTF-8 once it's known to be valid. The
+// repaired copy, if it needs one, has to outlive the statement.
+int TelegramRecorder::bindText(sqlite3_stmt* stmt, int index, std::string_view text, std::string& repaired) {
+  if(!scanText(text).validUTF8) {
+    repaired = repairUTF8(text);
+    text = repaired;
+    this->recorderMetrics.textsRepaired->inc();
   }
+  return sqlite3_bind_text64(stmt, index, text.data(), text.size(), SQLITE_STATIC, SQLITE_UTF8);
+}
 
-  SPDLOG_DEBUG("Executing SQL: {}", statement);
-  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
-    if(sqlite3_column_int(stmt, 0)) {
-      exists = true;
+bool TelegramRecorder::initDB() {
+  auto start = std::chrono::steady_clock::now();
+  if(this->config.dbPartition != DB_PARTITION_NONE) {
+    if(!this->openPartitions()) {
+      SPDLOG_ERROR("Unable to open the DB partitions");
+      return false;
+    }
+  } else {
+    int rc = sqlite3_open(this->config.dbFile.c_str(), &this->db);
+    if(rc) {
+      SPDLOG_ERROR("Unable to open database: {}", sqlite3_errmsg(this->db));
+      return false;
+    }
+    if(!applyStartupPragmas(this->db, this->config.dbParams)) {
+      SPDLOG_ERROR("Unable to configure database");
+      return false;
+    }
+    if(!migrateSchema(this->db)) {
+      SPDLOG_ERROR("Unable to migrate database schema");
+      return false;
+    }
+    std::vector<Partition> partitions;
+    if(!listPartitions(this->db, 0, 0, partitions)) {
+      return false;
+    }
+    // Its messages would be split between the catalog and the partitions
+    if(partitions.size()) {
+      SPDLOG_ERROR("DB {} is partitioned, db_partition has to be set", this->config.dbFile);
+      return false;
+    }
+    if(!configureSearchIndex(this->db, this->config.searchIndex, this->config.searchTokenizer)) {
+      SPDLOG_ERROR("Unable to configure the search index");
+      return false;
     }
   }
-  if (rc != SQLITE_DONE) {
-    SPDLOG_ERROR("Error executing SQL: {}", sqlite3_errmsg(db));
+  if(!this->loadKnownFiles()) {
+    SPDLOG_ERROR("Unable to load the files stored");
     return false;
   }
-  sqlite3_finalize(stmt);
-  return exists;
+  if(!this->loadKnownMessages()) {
+    SPDLOG_ERROR("Unable to load the filter of recorded messages");
+    return false;
+  }
+  std::uint64_t startupMicros = elapsedMicros(start);
+  metrics().gauge("tgrec_db_startup_seconds", "Time taken to open the DB and migrate its schema", this->metricLabels()).set(startupMicros / 1e6);
+  SPDLOG_INFO("DB {} ready in {} ms (schema version {})", this->config.dbFile, startupMicros / 1000.0, latestSchemaVersion());
+  return true;
 }
 
-bool TelegramRecorder::initDB() {
-  char* errMsg = NULL;
-  int rc = sqlite3_open("tgrec.db", &this->db);
-  if(rc) {
+// The DB file becomes the catalog, attached along with the current and
+// previous partitions to an in-memory main DB. Unqualified table names are
+// looked up in the order they are attached, so messages are read from and
+// written to the current partition, and everything else to the catalog,
+// without changing any statement.
+bool TelegramRecorder::openPartitions() {
+  sqlite3* catalog;
+  if(sqlite3_open(this->config.dbFile.c_str(), &catalog) != SQLITE_OK) {
+    SPDLOG_ERROR("Unable to open database: {}", sqlite3_errmsg(catalog));
+    sqlite3_close(catalog);
+    return false;
+  }
+  std::vector<Partition> partitions;
+  bool ok = applyStartupPragmas(catalog, this->config.dbParams) && migrateSchema(catalog) &&
+            registerLegacyPartition(catalog, this->config.dbFile) && listPartitions(catalog, 0, 0, partitions);
+  this->currentPeriod = partitionPeriod(this->config.dbPartition, std::time(nullptr));
+  this->currentPartition = partitionFileName(this->config.dbFile, this->currentPeriod);
+  // The newest one written to before, which still takes the edits of its
+  // messages. Older ones are sealed in the background.
+  for(Partition& partition : partitions) {
+    if(!partition.sealed && partition.file != this->currentPartition) {
+      this->previousPartition = partition.file;
+    }
+  }
+  for(const std::string& file : {this->currentPartition, this->previousPartition}) {
+    ok = ok && (file == "" || preparePartition(partitionPath(this->config.dbFile, file), this->config.dbParams, this->config.searchIndex, this->config.searchTokenizer));
+  }
+  ok = ok && registerPartition(catalog, this->currentPartition, this->currentPeriod);
+  sqlite3_close(catalog);
+  if(!ok) {
+    return false;
+  }
+  if(sqlite3_open(":memory:", &this->db) != SQLITE_OK) {
     SPDLOG_ERROR("Unable to open database: {}", sqlite3_errmsg(this->db));
     return false;
   }
-  if(!checkTableExists(this->db, std::move("messages"))) {
-    std::string statement = "CREATE TABLE messages("
-                              "id TEXT PRIMARY KEY,"
-                              "timestamp INTEGER,"
-                              "message TEXT,"
-                              "message_type INTEGER,"
-                              "content_file_id TEXT,"
-                              "chat_id INTEGER,"
-                              "sender_id INTEGER,"
-                              "in_reply_of TEXT,"
-                              "forwarded_from TEXT"
-                            ");"
-                            "CREATE INDEX from_sender_in_chat ON messages (sender_id, chat_id);";
-    SPDLOG_DEBUG("Executing SQL: {}", statement);
-    rc = sqlite3_exec(this->db, statement.c_str(), 0, 0, &errMsg);
-    if (rc != SQLITE_OK ) {
-      SPDLOG_ERROR("Error creating messages table: {}", errMsg);
-      sqlite3_free(errMsg);
+  if(!this->attachPartitions(this->currentPartition, this->previousPartition)) {
+    return false;
+  }
+  for(Partition& partition : partitions) {
+    if(partition.sealed && !this->openSealedPartition(partitionPath(this->config.dbFile, partition.file))) {
       return false;
     }
   }
-  if(!checkTableExists(this->db, std::move("users"))) {
-    std::string statement = "CREATE TABLE users("
-                              "user_id INTEGER PRIMARY KEY,"
-                              "fullname TEXT,"
-                              "username TEXT,"
-                              "usernames TEXT,"
-                              "disabled_usernames TEXT,"
-                              "bio TEXT,"
-                              "profile_pic_file_id TEXT"
-                            ");";
-    SPDLOG_DEBUG("Executing SQL: {}", statement);
-    rc = sqlite3_exec(this->db, statement.c_str(), 0, 0, &errMsg);
-    if (rc != SQLITE_OK ) {
-      SPDLOG_ERROR("Error creating users table: {}", errMsg);
-      sqlite3_free(errMsg);
+  SPDLOG_INFO("Writing messages to partition {}", this->currentPartition);
+  return true;
+}
+
+// Detaches whatever is attached, so they can be attached again in order
+bool TelegramRecorder::attachPartitions(const std::string& current, const std::string& previous) {
+  for(const char* schema : {"previous", "catalog", "current"}) {
+    if(sqlite3_db_filename(this->db, schema) && !this->execSQL(std::string("DETACH DATABASE ") + schema + ";")) {
       return false;
     }
   }
-  if(!checkTableExists(this->db, std::move("chats"))) {
-    std::string statement = "CREATE TABLE chats("
-                              "chat_id INTEGER PRIMARY KEY,"
-                              "group_id INTEGER,"
-                              "name TEXT,"
-                              "about TEXT,"
-                              "pic_file_id TEXT"
-                            ");";
-    SPDLOG_DEBUG("Executing SQL: {}", statement);
-    rc = sqlite3_exec(this->db, statement.c_str(), 0, 0, &errMsg);
-    if (rc != SQLITE_OK ) {
-      SPDLOG_ERROR("Error creating chats table: {}", errMsg);
-      sqlite3_free(errMsg);
+  std::vector<std::pair<std::string, std::string>> schemas = {{"current", current}, {"catalog", this->config.dbFile}};
+  if(previous != "") {
+    schemas.emplace_back("previous", previous);
+  }
+  for(auto& [schema, file] : schemas) {
+    std::string path = schema == "catalog" ? file : partitionPath(this->config.dbFile, file);
+    if(!attachDB(this->db, path, schema) || !applyStartupPragmas(this->db, this->config.dbParams, schema)) {
       return false;
     }
   }
-  if(!checkTableExists(this->db, std::move("files"))) {
-    std::string statement = "CREATE TABLE files("
-                              "file_id TEXT PRIMARY KEY,"
-                              "downloaded_as TEXT,"
-                              "origin_id TEXT"
-                            ");";
-    SPDLOG_DEBUG("Executing SQL: {}", statement);
-    rc = sqlite3_exec(this->db, statement.c_str(), 0, 0, &errMsg);
-    if (rc != SQLITE_OK ) {
-      SPDLOG_ERROR("Error creating files table: {}", errMsg);
-      sqlite3_free(errMsg);
-      return false;
+  return true;
+}
+
+// Must be called with toWriteQueueMutex held and no transaction open. The
+// partition written to until now becomes the previous one, and the one
+// before that is left for the sealer.
+bool TelegramRecorder::rotatePartition(const std::string& period) {
+  std::string file = partitionFileName(this->config.dbFile, period);
+  SPDLOG_INFO("Rotating DB partition from {} to {}", this->currentPartition, file);
+  if(!preparePartition(partitionPath(this->config.dbFile, file), this->config.dbParams, this->config.searchIndex, this->config.searchTokenizer)) {
+    return false;
+  }
+  // Statements can't be running on a DB that's detached
+  sqlite3_finalize(this->insertMessageStmt);
+  this->insertMessageStmt = nullptr;
+  if(!this->attachPartitions(file, this->currentPartition)) {
+    SPDLOG_ERROR("Unable to attach partition {}, going back to {}", file, this->currentPartition);
+    if(!this->attachPartitions(this->currentPartition, this->previousPartition)) {
+      SPDLOG_ERROR("Unable to attach partition {} again, messages can't be written", this->currentPartition);
     }
+    return false;
+  }
+  if(!registerPartition(this->db, file, period)) {
+    SPDLOG_ERROR("Unable to register partition {} in the catalog", file);
   }
+  this->previousPartition = this->currentPartition;
+  this->currentPartition = file;
+  this->currentPeriod = period;
+  this->recorderMetrics.partitionRotations->inc();
   return true;
 }
 
+bool TelegramRecorder::openSealedPartition(const std::string& path) {
+  sqlite3* partition;
+  if(sqlite3_open_v2(path.c_str(), &partition, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+    SPDLOG_ERROR("Unable to open partition {}: {}", path, sqlite3_errmsg(partition));
+    sqlite3_close(partition);
+    return false;
+  }
+  this->sealedPartitions.push_back(partition);
+  return true;
+}
+
+// Partitions the writer has moved two periods past are sealed: finished,
+// optimized, vacuumed and made read-only, with the bounds of their messages
+// recorded in the catalog, so the query tools only open the ones a time
+// range needs. Each one is sealed with a connection of its own, outside of
+// toWriteQueueMutex, as it's not attached to the writer's anymore.
+void TelegramRecorder::runPartitionSealer() {
+  SPDLOG_DEBUG("Partition sealer started");
+  while(!this->exitFlag.load()) {
+    std::vector<Partition> partitions;
+    this->toWriteQueueMutex.lock();
+    listPartitions(this->db, 0, 0, partitions);
+    std::string current = this->currentPartition;
+    std::string previous = this->previousPartition;
+    this->toWriteQueueMutex.unlock();
+    for(Partition& partition : partitions) {
+      if(this->exitFlag.load()) {
+        break;
+      }
+      if(partition.sealed || partition.file == current || partition.file == previous) {
+        continue;
+      }
+      std::string path = partitionPath(this->config.dbFile, partition.file);
+      auto start = std::chrono::steady_clock::now();
+      if(!sealPartition(path, partition)) {
+        SPDLOG_WARN("Unable to seal partition {}, retrying in {} seconds", partition.file, PARTITION_SEAL_INTERVAL_SEC);
+        continue;
+      }
+      this->toWriteQueueMutex.lock();
+      bool marked = markPartitionSealed(this->db, partition) && this->openSealedPartition(path);
+      this->toWriteQueueMutex.unlock();
+      if(!marked) {
+        SPDLOG_ERROR("Unable to record partition {} as sealed", partition.file);
+        continue;
+      }
+      this->recorderMetrics.partitionsSealed->inc();
+      SPDLOG_INFO("Sealed partition {} with {} messages in {:0.1f} s", partition.file, partition.messages, elapsedMicros(start) / 1e6);
+    }
+    this->sleepUntilExit(std::chrono::steady_clock::now() + std::chrono::seconds(PARTITION_SEAL_INTERVAL_SEC));
+  }
+  SPDLOG_DEBUG("Partition sealer stopped");
+}
+
 void TelegramRecorder::runDBWriter() {
   SPDLOG_DEBUG("DB Writer thread started");
-  this->initDB();
   std::unique_lock<std::mutex> lk(this->toWriteQueueMutex);
   while(true) {
-    this->messagesAvailableToWrite.wait(lk, [this]{return (this->toWriteMessageQueue.size() != 0 || this->exitFlag.load());});
-    SPDLOG_INFO("DB Writer woke up!");
-    while(this->toWriteMessageQueue.size()) {
-      std::vector<td_api::int53> chats;
-      for(auto it = this->toWriteMessageQueue.begin(); it != this->toWriteMessageQueue.end(); ++it) {
-        std::cerr << it->first << " ";
-        chats.push_back(it->first);
-      }
-      std::cerr << std::endl;
-      this->toWriteQueueMutex.unlock();
-      for(td_api::int53& chat : chats) {
-        this->toWriteQueueMutex.lock();
-        for(auto& message : this->toWriteMessageQueue[chat]) {
-          if (!message.get()) {
-            SPDLOG_ERROR("Empty message in chat {}", chat);
-            continue;
-          }
-          this->writeMessageToDB(message);
-        }
-        this->toWriteMessageQueue.erase(chat);
-        this->toWriteQueueMutex.unlock();
-      }
+    this->messagesAvailableToWrite.wait(lk, [this]{return (this->writesPending() || this->exitFlag.load());});
+    TGREC_LOG_LIMITED(INFO, "DB Writer woke up!");
+    // Capped, so other threads get the lock between commits
+    while(this->writesPending()) {
+      this->writePass(this->config.accountWriteBatch);
+      lk.unlock();
+      lk.lock();
     }
-    SPDLOG_INFO("Finished writing messages to DB!");
+    TGREC_LOG_LIMITED(INFO, "Finished writing messages to DB!");
+    // Checked with the queue empty and its lock held, so nothing can be
+    // enqueued after this
     if(this->exitFlag.load()) {
       break;
     }
   }
+  SPDLOG_DEBUG("DB Writer thread stopped");
+}
+
+// Must be called with toWriteQueueMutex held
+bool TelegramRecorder::writesPending() {
+  return this->toWriteMessageQueue.size() || this->toWriteCheckpoints.size() || this->toWriteArchiveCheckpoints.size();
+}
+
+// Checkpoints of the chats in the pass, or with nothing queued
+template<class Checkpoint>
+static std::map<td_api::int53, Checkpoint> takeCheckpoints(
+  std::map<td_api::int53, Checkpoint>& pending,
+  std::map<td_api::int53, std::vector<std::shared_ptr<td_api::message>>>& queue,
+  std::vector<td_api::int53>& chats
+) {
+  std::map<td_api::int53, Checkpoint> taken;
+  for(auto it = pending.begin(); it != pending.end();) {
+    if(queue.find(it->first) == queue.end() || std::find(chats.begin(), chats.end(), it->first) != chats.end()) {
+      taken.insert(*it);
+      it = pending.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  return taken;
+}
+
+// Writes the queued messages in a single commit. With maxMessages set, only
+// whole chats up to that many messages (one at least) are written, starting
+// where the last pass left off. Must be called with toWriteQueueMutex held,
+// which is kept until the pass is committed: every thread writes on the same
+// connection, so anything written meanwhile would be part of the pass.
+void TelegramRecorder::writePass(std::size_t maxMessages) {
+  if(this->currentPeriod != "") {
+    std::string period = partitionPeriod(this->config.dbPartition, std::time(nullptr));
+    if(period != this->currentPeriod && !this->rotatePartition(period)) {
+      SPDLOG_ERROR("Unable to rotate DB partition, writing to {} until the next pass", this->currentPartition);
+    }
+  }
+  std::vector<td_api::int53> chats;
+  std::size_t messages = 0;
+  auto start = maxMessages ? this->toWriteMessageQueue.lower_bound(this->writerNextChat) : this->toWriteMessageQueue.begin();
+  for(std::size_t i = 0; i < this->toWriteMessageQueue.size(); ++i, ++start) {
+    if(start == this->toWriteMessageQueue.end()) {
+      start = this->toWriteMessageQueue.begin();
+    }
+    if(maxMessages && chats.size() && messages + start->second.size() > maxMessages) {
+      this->writerNextChat = start->first;
+      break;
+    }
+    chats.push_back(start->first);
+    messages += start->second.size();
+  }
+  // Only the messages enqueued before a checkpoint are in this pass, so
+  // it's never committed ahead of them
+  std::map<td_api::int53, BackfillCheckpoint> checkpoints;
+  std::map<td_api::int53, ArchiveCheckpoint> archiveCheckpoints;
+  if(chats.size() == this->toWriteMessageQueue.size()) {
+    checkpoints.swap(this->toWriteCheckpoints);
+    archiveCheckpoints.swap(this->toWriteArchiveCheckpoints);
+  } else {
+    checkpoints = takeCheckpoints(this->toWriteCheckpoints, this->toWriteMessageQueue, chats);
+    archiveCheckpoints = takeCheckpoints(this->toWriteArchiveCheckpoints, this->toWriteMessageQueue, chats);
+  }
+  std::map<td_api::int53, td_api::int53> lastMessageIDs;
+  SPDLOG_DEBUG("Writing messages from {} chats", chats.size());
+  // Group every message of this pass in a single commit
+  std::vector<std::shared_ptr<td_api::message>> committed;
+  this->passMessagesWritten = 0;
+  // Outside a transaction every statement would be committed on its own, so
+  // nothing is written if it can't be started
+  bool began = this->execSQL("BEGIN;");
+  for(td_api::int53& chat : chats) {
+    for(auto& message : this->toWriteMessageQueue[chat]) {
+      if (!message.get()) {
+        SPDLOG_ERROR("Empty message in chat {}", chat);
+        continue;
+      }
+      if(began && this->writeMessageToDB(message)) {
+        committed.push_back(message);
+      } else {
+        this->tracer.abandon(getCompoundMessageID(message->chat_id_, message->id_));
+      }
+      if(message->id_ > lastMessageIDs[chat]) {
+        lastMessageIDs[chat] = message->id_;
+      }
+    }
+    this->recorderMetrics.writeQueueMessages->add(-static_cast<double>(this->toWriteMessageQueue[chat].size()));
+    this->toWriteMessageQueue.erase(chat);
+  }
+  if(began) {
+    for(auto it = lastMessageIDs.begin(); it != lastMessageIDs.end(); ++it) {
+      this->updateChatSyncState(it->first, it->second);
+    }
+    for(auto it = checkpoints.begin(); it != checkpoints.end(); ++it) {
+      this->writeBackfillCheckpoint(it->first, it->second);
+    }
+    for(auto it = archiveCheckpoints.begin(); it != archiveCheckpoints.end(); ++it) {
+      this->writeArchiveCheckpoint(it->first, it->second);
+    }
+    // In a single statement, as FTS5 writes a segment for each one
+    if(this->config.searchIndex && committed.size() && indexNewMessages(this->db) < 0) {
+      SPDLOG_ERROR("Unable to add messages to the search index, retrying in the next pass");
+    }
+  }
+  auto commitStart = std::chrono::steady_clock::now();
+  if(!began || !this->execSQL("COMMIT;")) {
+    // A failed COMMIT leaves the transaction open, and every later BEGIN
+    // would fail with it
+    if(began && !this->execSQL("ROLLBACK;")) {
+      SPDLOG_ERROR("Unable to roll back failed DB writer pass");
+    }
+    SPDLOG_ERROR("Unable to commit DB writer pass, dropping {} messages from {} chats", messages, chats.size());
+    this->recorderMetrics.messagesWriteFailed->inc(messages);
+    for(auto& message : committed) {
+      this->tracer.abandon(getCompoundMessageID(message->chat_id_, message->id_));
+    }
+    return;
+  }
+  this->recorderMetrics.commitLatency->record(elapsedMicros(commitStart));
+  this->recorderMetrics.messagesWritten->inc(this->passMessagesWritten);
+  this->knownMessagesMutex.lock();
+  for(auto& message : committed) {
+    this->knownMessages.add(message->chat_id_, message->id_);
+  }
+  this->recorderMetrics.dedupFilterFalsePositiveRate->set(this->knownMessages.estimatedFalsePositiveRate());
+  this->knownMessagesMutex.unlock();
+  for(auto& message : committed) {
+    this->tracer.stamp(getCompoundMessageID(message->chat_id_, message->id_), TRACE_COMMITTED);
+  }
+}
+
+// A host's turn at writing the account's messages. Returns whether some are
+// left for its next turn.
+bool TelegramRecorder::writeQueued(std::size_t maxMessages) {
+  this->toWriteQueueMutex.lock();
+  if(this->writesPending()) {
+    this->writePass(maxMessages);
+  }
+  bool pending = this->writesPending();
+  this->toWriteQueueMutex.unlock();
+  return pending;
+}
+
+void TelegramRecorder::notifyWriter() {
+  if(this->host) {
+    this->host->wakeWriter(this);
+  } else {
+    this->messagesAvailableToWrite.notify_one();
+  }
+}
+
+void TelegramRecorder::closeDB() {
+  if(!this->db) {
+    return;
+  }
+  this->saveKnownMessages();
+  // Leave everything in the main DB file, so it can be copied on its own
+  int rc = sqlite3_wal_checkpoint_v2(this->db, NULL, SQLITE_CHECKPOINT_TRUNCATE, NULL, NULL);
+  if(rc != SQLITE_OK) {
+    SPDLOG_WARN("Unable to checkpoint DB: {}", sqlite3_errmsg(this->db));
+  }
+  sqlite3_finalize(this->insertMessageStmt);
+  this->insertMessageStmt = nullptr;
   sqlite3_close(this->db);
+  this->db = nullptr;
+  for(sqlite3* partition : this->sealedPartitions) {
+    sqlite3_close(partition);
+  }
+  this->sealedPartitions.clear();
   SPDLOG_INFO("DB is closed");
 }
 
+bool TelegramRecorder::execSQL(const std::string& statement) {
+  char* errMsg = NULL;
+  SPDLOG_DEBUG("Executing SQL: {}", statement);
+  int rc = sqlite3_exec(this->db, statement.c_str(), 0, 0, &errMsg);
+  if (rc != SQLITE_OK) {
+    SPDLOG_ERROR("Error executing SQL: {}", errMsg);
+    sqlite3_free(errMsg);
+    return false;
+  }
+  return true;
+}
+
 void TelegramRecorder::enqueueMessageToWrite(std::shared_ptr<td_api::message>& message) {
+  this->tracer.stamp(getCompoundMessageID(message->chat_id_, message->id_), TRACE_ENQUEUED);
   this->toWriteQueueMutex.lock();
+  if(this->exitFlag.load()) {
+    // The writer might be gone already
+    ++this->messagesIgnoredOnExit;
+    this->toWriteQueueMutex.unlock();
+    return;
+  }
   SPDLOG_DEBUG("Enqueueing message {} from chat {}", message->id_, message->chat_id_);
   if(this->toWriteMessageQueue.find(message->chat_id_) == this->toWriteMessageQueue.end()) {
     this->toWriteMessageQueue[message->chat_id_] = std::vector<std::shared_ptr<td_api::message>>();
   }
   this->toWriteMessageQueue[message->chat_id_].push_back(message);
+  this->recorderMetrics.writeQueueMessages->add(1);
   this->toWriteQueueMutex.unlock();
-  this->messagesAvailableToWrite.notify_one();
+  this->notifyWriter();
 }
 
+// Binds views into the message and stack buffers, so recording a text message
+// doesn't allocate. The statement is prepared once and reset after each run.
 bool TelegramRecorder::writeMessageToDB(std::shared_ptr<td_api::message>& message) {
   SPDLOG_DEBUG("Writing message {} from chat {} to DB", message->id_, message->chat_id_);
   int rc;
-  char* errMsg = NULL;
 
   int32_t msgType = message->content_->get_id();
   td_api::int53 senderID = getMessageSenderID(message);
-  std::string text = getMessageText(message);
-  std::string origin = getMessageOrigin(message);
-  std::string compoundMessageID = std::to_string(message->chat_id_) + ":" + std::to_string(message->id_);
-  
-  std::string fileOriginID;
-  
-  try {
-    td_api::file* f = getMessageContentFileReference(message->content_);
-    if(f) {
-      std::string fileIDStr = std::to_string(f->id_) + ":" + compoundMessageID;
-      fileOriginID = SHA256(fileIDStr.c_str(), fileIDStr.size());
-      this->downloadFile(*f, compoundMessageID);
+  MessageContentInfo content;
+  getMessageContentInfo(*message->content_, content);
+  IDBuffer originBuffer;
+  std::string_view origin = getMessageOrigin(message, originBuffer);
+  IDBuffer messageIDBuffer;
+  std::string_view compoundMessageID = formatCompoundID(messageIDBuffer, {message->chat_id_, message->id_});
+
+  td_api::file* f = content.file;
+  SHA256Buffer fileOriginBuffer;
+  std::string_view fileOriginID;
+  if(f) {
+    IDBuffer fileIDBuffer;
+    std::string_view fileIDStr = formatCompoundID(fileIDBuffer, {f->id_, message->chat_id_, message->id_});
+    fileOriginID = SHA256(fileIDStr.data(), fileIDStr.size(), fileOriginBuffer);
+  }
+
+  if(this->config.logMessageBodies) {
+    TGREC_LOG_LIMITED(INFO, "Got message: [chat_id: {}] [from: {}]: {}", message->chat_id_, senderID, content.text);
+  } else {
+    TGREC_LOG_LIMITED(INFO, "Got message: [chat_id: {}] [from: {}] ({} bytes)", message->chat_id_, senderID, content.text.size());
+  }
+
+  // We don't do REPLACE here because we rely on the hidden rowid column to
+  // preserve message order. Messages already recorded, which backfilling may
+  // come across again, are left as they are.
+  static const char* statement = "INSERT OR IGNORE INTO messages ("
+                                   "id,"
+                                   "timestamp,"
+                                   "message,"
+                                   "message_type,"
+                                   "content_file_id,"
+                                   "chat_id,"
+                                   "sender_id,"
+                                   "in_reply_of,"
+                                   "forwarded_from"
+                                 ") VALUES "
+                                 "( ?, ?, ?, ?, ?, ?, ?, ?, ?);";
+
+  if(!this->insertMessageStmt) {
+    rc = sqlite3_prepare_v3(db, statement, -1, SQLITE_PREPARE_PERSISTENT, &this->insertMessageStmt, NULL);
+    if (rc != SQLITE_OK) {
+      SPDLOG_ERROR("Error preparing SQL statement: {}", sqlite3_errmsg(db));
+      this->insertMessageStmt = nullptr;
+      return false;
     }
-  } catch(const std::runtime_error& e) {
-    SPDLOG_WARN("Unable to download message data for message_id {} from chat_id {}. Storing anyway...", message->id_, message->chat_id_);
-  }
-
-  SPDLOG_INFO("Got message: [chat_id: {}] [from: {}]: {}", message->chat_id_, senderID, text);
-
-  // We don't do REPLACE here because we rely on the hidden rowid column to preserve message order
-  std::string statement = "INSERT INTO messages ("
-                            "id,"
-                            "timestamp,"
-                            "message,"
-                            "message_type,"
-                            "content_file_id,"
-                            "chat_id,"
-                            "sender_id,"
-                            "in_reply_of,"
-                            "forwarded_from"
-                          ") VALUES "
-                          "( ?, ?, ?, ?, ?, ?, ?, ?, ?);";
-
-  sqlite3_stmt *stmt;
-  rc = sqlite3_prepare_v2(db, statement.c_str(), -1, &stmt, NULL);
-  if (rc != SQLITE_OK) {
-    SPDLOG_ERROR("Error preparing SQL statement: {}", sqlite3_errmsg(db));
-    return false;
   }
+  sqlite3_stmt *stmt = this->insertMessageStmt;
   
-  rc = sqlite3_bind_text64(stmt, 1, compoundMessageID.c_str(), compoundMessageID.length(), SQLITE_STATIC, SQLITE_UTF8);
+  rc = sqlite3_bind_text64(stmt, 1, compoundMessageID.data(), compoundMessageID.size(), SQLITE_STATIC, SQLITE_UTF8);
   if (rc != SQLITE_OK) {
     SPDLOG_ERROR("Error preparing SQL statement: {}", sqlite3_errmsg(db));
     return false;
@@ -230,7 +533,8 @@ bool TelegramRecorder::writeMessageToDB(std::shared_ptr<td_api::message>& messag
     SPDLOG_ERROR("Error preparing SQL statement: {}", sqlite3_errmsg(db));
     return false;
   }
-  rc = sqlite3_bind_text64(stmt, 3, text.c_str(), text.length(), SQLITE_STATIC, SQLITE_UTF8);
+  std::string repairedText;
+  rc = this->bindText(stmt, 3, content.text, repairedText);
   if (rc != SQLITE_OK) {
     SPDLOG_ERROR("Error preparing SQL statement: {}", sqlite3_errmsg(db));
     return false;
@@ -240,8 +544,11 @@ bool TelegramRecorder::writeMessageToDB(std::shared_ptr<td_api::message>& messag
     SPDLOG_ERROR("Error preparing SQL statement: {}", sqlite3_errmsg(db));
     return false;
   }
-  std::string contentFileID = (fileOriginID == "" ? "NULL" : fileOriginID);
-  rc = sqlite3_bind_text64(stmt, 5, contentFileID.c_str(), contentFileID.length(), SQLITE_STATIC, SQLITE_UTF8);
+  if(f) {
+    rc = sqlite3_bind_text64(stmt, 5, fileOriginID.data(), fileOriginID.size(), SQLITE_STATIC, SQLITE_UTF8);
+  } else {
+    rc = sqlite3_bind_null(stmt, 5);
+  }
   if (rc != SQLITE_OK) {
     SPDLOG_ERROR("Error preparing SQL statement: {}", sqlite3_errmsg(db));
     return false;
@@ -256,17 +563,24 @@ bool TelegramRecorder::writeMessageToDB(std::shared_ptr<td_api::message>& messag
     SPDLOG_ERROR("Error preparing SQL statement: {}", sqlite3_errmsg(db));
     return false;
   }
-  std::string reply_to = "NULL";
+  IDBuffer replyBuffer;
   if (message->reply_to_.get() && message->reply_to_->get_id() == td_api::messageReplyToMessage::ID) {
     auto& replied_on = static_cast<td_api::messageReplyToMessage&>(*message->reply_to_);
-    reply_to = std::to_string(replied_on.chat_id_) + ":" + std::to_string(replied_on.message_id_);
+    std::string_view reply_to = formatCompoundID(replyBuffer, {replied_on.chat_id_, replied_on.message_id_});
+    rc = sqlite3_bind_text64(stmt, 8, reply_to.data(), reply_to.size(), SQLITE_STATIC, SQLITE_UTF8);
+  } else {
+    rc = sqlite3_bind_null(stmt, 8);
   }
-  rc = sqlite3_bind_text64(stmt, 8, reply_to.c_str(), reply_to.length(), SQLITE_STATIC, SQLITE_UTF8);
   if (rc != SQLITE_OK) {
     SPDLOG_ERROR("Error preparing SQL statement: {}", sqlite3_errmsg(db));
     return false;
   }
-  rc = sqlite3_bind_text64(stmt, 9, origin.c_str(), origin.length(), SQLITE_STATIC, SQLITE_UTF8);
+  std::string repairedOrigin;
+  if(origin != "") {
+    rc = this->bindText(stmt, 9, origin, repairedOrigin);
+  } else {
+    rc = sqlite3_bind_null(stmt, 9);
+  }
   if (rc != SQLITE_OK) {
     SPDLOG_ERROR("Error preparing SQL statement: {}", sqlite3_errmsg(db));
     return false;
@@ -274,15 +588,379 @@ bool TelegramRecorder::writeMessageToDB(std::shared_ptr<td_api::message>& messag
 
   SPDLOG_DEBUG("Executing SQL: {}", statement);
 
-  rc = sqlite3_exec(this->db, statement.c_str(), 0, 0, &errMsg);
-  if (rc != SQLITE_OK ) {
-    SPDLOG_ERROR("Error inserting data: {}", errMsg);
-    sqlite3_free(errMsg);
+  static Histogram& latency = statementLatency("insert_message");
+  rc = timedStep(stmt, latency);
+  if (rc != SQLITE_DONE) {
+    SPDLOG_ERROR("Error inserting data: {}", sqlite3_errmsg(this->db));
+    sqlite3_reset(stmt);
+    return false;
+  }
+  sqlite3_reset(stmt);
+  if(sqlite3_changes(this->db) > 0) {
+    // Counted once the pass is committed
+    ++this->passMessagesWritten;
+    // Only once it's known not to be a duplicate
+    if(f) {
+      this->downloadFile(*f, compoundMessageID, fileOriginID);
+    }
+  } else if(f) {
+    this->tracer.skipDownload(std::string(compoundMessageID));
+  }
+  return true;
+}
+
+// Must be called by the writer, with toWriteQueueMutex held
+bool TelegramRecorder::updateChatSyncState(td_api::int53 chatID, td_api::int53 lastMessageID) {
+  std::string statement = "INSERT INTO chat_sync_state (chat_id, last_message_id) VALUES (?, ?) "
+                          "ON CONFLICT(chat_id) DO UPDATE SET last_message_id = MAX(IFNULL(last_message_id, 0), excluded.last_message_id);";
+  sqlite3_stmt *stmt;
+  int rc = sqlite3_prepare_v2(this->db, statement.c_str(), -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    SPDLOG_ERROR("Error preparing SQL statement: {}", sqlite3_errmsg(this->db));
+    return false;
+  }
+  if (sqlite3_bind_int64(stmt, 1, chatID) != SQLITE_OK || sqlite3_bind_int64(stmt, 2, lastMessageID) != SQLITE_OK) {
+    SPDLOG_ERROR("Error preparing SQL statement: {}", sqlite3_errmsg(this->db));
+    sqlite3_finalize(stmt);
+    return false;
+  }
+  SPDLOG_DEBUG("Executing SQL: {}", statement);
+  static Histogram& latency = statementLatency("update_chat_sync_state");
+  rc = timedStep(stmt, latency);
+  sqlite3_finalize(stmt);
+  if (rc != SQLITE_DONE) {
+    SPDLOG_ERROR("Error updating chat sync state: {}", sqlite3_errmsg(this->db));
+    return false;
+  }
+  return true;
+}
+
+// Must be called by the writer, with toWriteQueueMutex held
+bool TelegramRecorder::writeBackfillCheckpoint(td_api::int53 chatID, BackfillCheckpoint& checkpoint) {
+  std::string statement = "UPDATE chat_sync_state SET backfill_until = ?, backfill_cursor = ? WHERE chat_id = ?;";
+  sqlite3_stmt *stmt;
+  int rc = sqlite3_prepare_v2(this->db, statement.c_str(), -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    SPDLOG_ERROR("Error preparing SQL statement: {}", sqlite3_errmsg(this->db));
+    return false;
+  }
+  // A finished backfill leaves nothing behind
+  if (checkpoint.until) {
+    rc = sqlite3_bind_int64(stmt, 1, checkpoint.until);
+  } else {
+    rc = sqlite3_bind_null(stmt, 1);
+  }
+  if (rc == SQLITE_OK) {
+    rc = checkpoint.until ? sqlite3_bind_int64(stmt, 2, checkpoint.cursor) : sqlite3_bind_null(stmt, 2);
+  }
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_bind_int64(stmt, 3, chatID);
+  }
+  if (rc != SQLITE_OK) {
+    SPDLOG_ERROR("Error preparing SQL statement: {}", sqlite3_errmsg(this->db));
+    sqlite3_finalize(stmt);
+    return false;
+  }
+  SPDLOG_DEBUG("Executing SQL: {}", statement);
+  rc = sqlite3_step(stmt);
+  sqlite3_finalize(stmt);
+  if (rc != SQLITE_DONE) {
+    SPDLOG_ERROR("Error writing backfill checkpoint: {}", sqlite3_errmsg(this->db));
+    return false;
+  }
+  return true;
+}
+
+// Must be called by the writer, with toWriteQueueMutex held
+bool TelegramRecorder::writeArchiveCheckpoint(td_api::int53 chatID, ArchiveCheckpoint& checkpoint) {
+  std::string statement = "REPLACE INTO chat_archive_state (chat_id, cursor, messages, finished) VALUES (?, ?, ?, ?);";
+  sqlite3_stmt *stmt;
+  int rc = sqlite3_prepare_v2(this->db, statement.c_str(), -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    SPDLOG_ERROR("Error preparing SQL statement: {}", sqlite3_errmsg(this->db));
+    return false;
+  }
+  if (sqlite3_bind_int64(stmt, 1, chatID) != SQLITE_OK ||
+      sqlite3_bind_int64(stmt, 2, checkpoint.cursor) != SQLITE_OK ||
+      sqlite3_bind_int64(stmt, 3, checkpoint.messages) != SQLITE_OK ||
+      sqlite3_bind_int(stmt, 4, checkpoint.finished) != SQLITE_OK) {
+    SPDLOG_ERROR("Error preparing SQL statement: {}", sqlite3_errmsg(this->db));
+    sqlite3_finalize(stmt);
+    return false;
+  }
+  SPDLOG_DEBUG("Executing SQL: {}", statement);
+  rc = sqlite3_step(stmt);
+  sqlite3_finalize(stmt);
+  if (rc != SQLITE_DONE) {
+    SPDLOG_ERROR("Error writing archive checkpoint: {}", sqlite3_errmsg(this->db));
+    return false;
+  }
+  return true;
+}
+
+std::map<td_api::int53, ArchiveCheckpoint> TelegramRecorder::readArchiveState() {
+  std::string statement = "SELECT chat_id, cursor, messages, finished FROM chat_archive_state;";
+  std::map<td_api::int53, ArchiveCheckpoint> state;
+  sqlite3_stmt *stmt;
+  this->toWriteQueueMutex.lock();
+  int rc = sqlite3_prepare_v2(this->db, statement.c_str(), -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    SPDLOG_ERROR("Error preparing statement: {}", sqlite3_errmsg(this->db));
+    this->toWriteQueueMutex.unlock();
+    return state;
+  }
+  SPDLOG_DEBUG("Executing SQL: {}", statement);
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    state[sqlite3_column_int64(stmt, 0)] = {sqlite3_column_int64(stmt, 1), static_cast<std::uint64_t>(sqlite3_column_int64(stmt, 2)), sqlite3_column_int(stmt, 3) != 0};
+  }
+  if (rc != SQLITE_DONE) {
+    SPDLOG_ERROR("Error executing SQL: {}", sqlite3_errmsg(this->db));
+  }
+  sqlite3_finalize(stmt);
+  this->toWriteQueueMutex.unlock();
+  return state;
+}
+
+// A positive from the filter is always confirmed against the DB, so a stale
+// filter, or one that doesn't match the DB at all, only costs performance.
+// Without the filter, duplicates are left to INSERT OR IGNORE.
+bool TelegramRecorder::isKnownMessage(td_api::int53 chatID, td_api::int53 messageID) {
+  if(!this->config.dedupFilterCapacity) {
+    return false;
+  }
+  this->knownMessagesMutex.lock();
+  bool maybeKnown = this->knownMessages.mightContain(chatID, messageID);
+  this->knownMessagesMutex.unlock();
+  if(!maybeKnown) {
+    this->recorderMetrics.dedupNew->inc();
+    return false;
+  }
+  if(!this->messageInDB(getCompoundMessageID(chatID, messageID))) {
+    this->recorderMetrics.dedupFalsePositives->inc();
+    return false;
+  }
+  this->recorderMetrics.dedupDuplicates->inc();
+  return true;
+}
+
+// With partitions, messages are only inserted in the current one, or in the
+// previous one if there are none yet, and the rowid of the partition in the
+// catalog goes in the upper bits to tell them apart
+std::int64_t TelegramRecorder::lastMessageRowID() {
+  std::vector<std::string> statements;
+  if(this->currentPeriod == "") {
+    statements.push_back("SELECT IFNULL(MAX(rowid), 0) FROM messages;");
+  }
+  std::pair<const char*, std::string> partitions[] = {{"current", this->currentPartition}, {"previous", this->previousPartition}};
+  for(auto& [schema, file] : partitions) {
+    if(this->currentPeriod == "" || file == "") {
+      continue;
+    }
+    char* statement = sqlite3_mprintf(
+      "SELECT IFNULL(MAX(m.rowid) | (SELECT p.rowid << 40 FROM catalog.partitions p WHERE p.file = %Q), 0) FROM %s.messages m;",
+      file.c_str(), schema
+    );
+    statements.push_back(statement);
+    sqlite3_free(statement);
+  }
+  for(std::string& statement : statements) {
+    sqlite3_stmt *stmt;
+    int rc = sqlite3_prepare_v2(this->db, statement.c_str(), -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+      SPDLOG_ERROR("Error preparing statement: {}", sqlite3_errmsg(this->db));
+      return -1;
+    }
+    SPDLOG_DEBUG("Executing SQL: {}", statement);
+    std::int64_t rowID = -1;
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+      rowID = sqlite3_column_int64(stmt, 0);
+    } else {
+      SPDLOG_ERROR("Error executing SQL: {}", sqlite3_errmsg(this->db));
+    }
+    sqlite3_finalize(stmt);
+    if(rowID != 0) {
+      return rowID;
+    }
+  }
+  return 0;
+}
+
+// The filter is saved on shutdown along with the last rowid in messages. If
+// that doesn't match the DB when it's loaded, some messages were written
+// without it (e.g. tgrec crashed), so it's built again from the DB.
+bool TelegramRecorder::loadKnownMessages() {
+  if(!this->config.dedupFilterCapacity) {
+    return true;
+  }
+  this->knownMessagesFile = this->config.dedupFilterFile != "" ? this->config.dedupFilterFile : this->config.dbFile + ".bloom";
+  std::int64_t savedRowID;
+  std::int64_t rowID = this->lastMessageRowID();
+  if(rowID < 0) {
+    return false;
+  }
+  BloomFilter filter;
+  if(!filter.load(this->knownMessagesFile, savedRowID)) {
+    SPDLOG_INFO("No usable filter of recorded messages in {}, building it", this->knownMessagesFile);
+    return this->rebuildKnownMessages();
+  }
+  if(savedRowID != rowID) {
+    SPDLOG_INFO("Filter of recorded messages in {} is out of date, building it again", this->knownMessagesFile);
+    return this->rebuildKnownMessages();
+  }
+  if(filter.estimatedFalsePositiveRate() > 2 * this->config.dedupFilterFPRate) {
+    SPDLOG_INFO("Filter of recorded messages in {} is full, building a bigger one", this->knownMessagesFile);
+    return this->rebuildKnownMessages();
+  }
+  this->knownMessages = std::move(filter);
+  this->recorderMetrics.dedupFilterBytes->set(this->knownMessages.sizeBytes());
+  this->recorderMetrics.dedupFilterFalsePositiveRate->set(this->knownMessages.estimatedFalsePositiveRate());
+  SPDLOG_INFO(
+    "Loaded filter of {} recorded messages: {:0.1f} MiB, estimated false positive rate {:0.5f}",
+    this->knownMessages.items(), this->knownMessages.sizeBytes() / (1024.0 * 1024.0), this->knownMessages.estimatedFalsePositiveRate()
+  );
+  return true;
+}
+
+// Only called on startup, before any other thread uses the DB
+bool TelegramRecorder::rebuildKnownMessages() {
+  auto start = std::chrono::steady_clock::now();
+  std::uint64_t count = 0;
+  std::vector<std::pair<sqlite3*, std::string>> tables = this->messageTables();
+  for(auto& [db, table] : tables) {
+    std::string statement = "SELECT COUNT(*) FROM " + table + ";";
+    sqlite3_stmt *stmt;
+    int rc = sqlite3_prepare_v2(db, statement.c_str(), -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+      SPDLOG_ERROR("Error preparing statement: {}", sqlite3_errmsg(db));
+      return false;
+    }
+    SPDLOG_DEBUG("Executing SQL: {}", statement);
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+      count += sqlite3_column_int64(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+  }
+
+  // Room to keep growing before it has to be built again
+  BloomFilter filter(std::max<std::uint64_t>(this->config.dedupFilterCapacity, 2 * count), this->config.dedupFilterFPRate);
+  for(auto& [db, table] : tables) {
+    // Message IDs are stored as chat_id:message_id
+    std::string statement = "SELECT chat_id, CAST(substr(id, instr(id, ':') + 1) AS INTEGER) FROM " + table + ";";
+    sqlite3_stmt *stmt;
+    int rc = sqlite3_prepare_v2(db, statement.c_str(), -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+      SPDLOG_ERROR("Error preparing statement: {}", sqlite3_errmsg(db));
+      return false;
+    }
+    SPDLOG_DEBUG("Executing SQL: {}", statement);
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+      filter.add(sqlite3_column_int64(stmt, 0), sqlite3_column_int64(stmt, 1));
+    }
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE) {
+      SPDLOG_ERROR("Error executing SQL: {}", sqlite3_errmsg(db));
+      return false;
+    }
+  }
+  this->knownMessages = std::move(filter);
+  this->recorderMetrics.dedupFilterBytes->set(this->knownMessages.sizeBytes());
+  this->recorderMetrics.dedupFilterFalsePositiveRate->set(this->knownMessages.estimatedFalsePositiveRate());
+  SPDLOG_INFO(
+    "Built filter of {} recorded messages in {:0.3f} seconds: {:0.1f} MiB, estimated false positive rate {:0.5f}",
+    this->knownMessages.items(), elapsedMicros(start) / 1e6, this->knownMessages.sizeBytes() / (1024.0 * 1024.0), this->knownMessages.estimatedFalsePositiveRate()
+  );
+  return true;
+}
+
+// Must be called once the writer is gone
+void TelegramRecorder::saveKnownMessages() {
+  if(!this->config.dedupFilterCapacity || this->knownMessagesFile == "") {
+    return;
+  }
+  std::int64_t rowID = this->lastMessageRowID();
+  if(rowID < 0 || !this->knownMessages.save(this->knownMessagesFile, rowID)) {
+    SPDLOG_WARN("Unable to save the filter of recorded messages to {}, it will be built again on startup", this->knownMessagesFile);
+    return;
+  }
+  std::uint64_t falsePositives = this->recorderMetrics.dedupFalsePositives->get();
+  std::uint64_t notDuplicates = this->recorderMetrics.dedupNew->get() + falsePositives;
+  SPDLOG_INFO(
+    "Saved filter of {} recorded messages: {:0.1f} MiB, {} duplicates dropped, false positive rate {:0.5f} observed, {:0.5f} estimated",
+    this->knownMessages.items(), this->knownMessages.sizeBytes() / (1024.0 * 1024.0), this->recorderMetrics.dedupDuplicates->get(),
+    notDuplicates ? static_cast<double>(falsePositives) / notDuplicates : 0.0, this->knownMessages.estimatedFalsePositiveRate()
+  );
+}
+
+bool TelegramRecorder::loadKnownFiles() {
+  std::string statement = "SELECT file_id FROM files;";
+  sqlite3_stmt *stmt;
+  int rc = sqlite3_prepare_v2(this->db, statement.c_str(), -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    SPDLOG_ERROR("Error preparing statement: {}", sqlite3_errmsg(this->db));
+    return false;
+  }
+  SPDLOG_DEBUG("Executing SQL: {}", statement);
+  this->knownFilesMutex.lock();
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    if(sqlite3_column_text(stmt, 0)) {
+      this->knownFiles.insert(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0)));
+    }
+  }
+  std::size_t count = this->knownFiles.size();
+  this->knownFilesMutex.unlock();
+  sqlite3_finalize(stmt);
+  if (rc != SQLITE_DONE) {
+    SPDLOG_ERROR("Error executing SQL: {}", sqlite3_errmsg(this->db));
     return false;
   }
+  SPDLOG_INFO("{} files are stored already", count);
   return true;
 }
 
+// Tables the recorded messages are in, with the connection to read each one
+// with. Must be called with toWriteQueueMutex held.
+std::vector<std::pair<sqlite3*, std::string>> TelegramRecorder::messageTables() {
+  if(this->currentPeriod == "") {
+    return {{this->db, "messages"}};
+  }
+  std::vector<std::pair<sqlite3*, std::string>> tables = {{this->db, "current.messages"}};
+  if(this->previousPartition != "") {
+    tables.emplace_back(this->db, "previous.messages");
+  }
+  for(sqlite3* partition : this->sealedPartitions) {
+    tables.emplace_back(partition, "messages");
+  }
+  return tables;
+}
+
+bool TelegramRecorder::messageInDB(const std::string& compoundMessageID) {
+  this->toWriteQueueMutex.lock();
+  bool exists = false;
+  for(auto& [db, table] : this->messageTables()) {
+    std::string statement = "SELECT 1 FROM " + table + " WHERE id = ?;";
+    sqlite3_stmt *stmt;
+    int rc = sqlite3_prepare_v2(db, statement.c_str(), -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+      SPDLOG_ERROR("Error preparing statement: {}", sqlite3_errmsg(db));
+      break;
+    }
+    rc = sqlite3_bind_text64(stmt, 1, compoundMessageID.c_str(), compoundMessageID.length(), SQLITE_STATIC, SQLITE_UTF8);
+    if (rc != SQLITE_OK) {
+      SPDLOG_ERROR("Error preparing SQL statement: {}", sqlite3_errmsg(db));
+      sqlite3_finalize(stmt);
+      break;
+    }
+    SPDLOG_DEBUG("Executing SQL: {}", statement);
+    exists = sqlite3_step(stmt) == SQLITE_ROW;
+    sqlite3_finalize(stmt);
+    if(exists) {
+      break;
+    }
+  }
+  this->toWriteQueueMutex.unlock();
+  return exists;
+}
+
 std::unique_ptr<TelegramChat> TelegramRecorder::retrieveChatFromDB(td_api::int53 chatID) {
   std::string statement = "SELECT name, group_id, about, pic_file_id FROM chats WHERE chat_id = ? ;";
   char *errMsg = NULL;
@@ -295,12 +973,15 @@ std::unique_ptr<TelegramChat> TelegramRecorder::retrieveChatFromDB(td_api::int53
   rc = sqlite3_prepare_v2(this->db, statement.c_str(), -1, &stmt, NULL);
   if (rc != SQLITE_OK) {
       SPDLOG_ERROR("Error preparing statement: {}", sqlite3_errmsg(db));
+      this->toWriteQueueMutex.unlock();
       return std::unique_ptr<TelegramChat>(chat);
   }
 
   rc = sqlite3_bind_int64(stmt, 1, chatID);
   if (rc != SQLITE_OK) {
     SPDLOG_ERROR("Error preparing SQL statement: {}", sqlite3_errmsg(db));
+    sqlite3_finalize(stmt);
+    this->toWriteQueueMutex.unlock();
     return nullptr;
   }
   SPDLOG_DEBUG("Executing SQL: {}", statement);
@@ -333,12 +1014,15 @@ std::unique_ptr<TelegramUser> TelegramRecorder::retrieveUserFromDB(td_api::int53
   rc = sqlite3_prepare_v2(this->db, statement.c_str(), -1, &stmt, NULL);
   if (rc != SQLITE_OK) {
       SPDLOG_ERROR("Error preparing statement: {}", sqlite3_errmsg(db));
+      this->toWriteQueueMutex.unlock();
       return std::unique_ptr<TelegramUser>(user);
   }
 
   rc = sqlite3_bind_int64(stmt, 1, userID);
   if (rc != SQLITE_OK) {
     SPDLOG_ERROR("Error preparing SQL statement: {}", sqlite3_errmsg(db));
+    sqlite3_finalize(stmt);
+    this->toWriteQueueMutex.unlock();
     return nullptr;
   }
 
@@ -365,7 +1049,6 @@ std::unique_ptr<TelegramUser> TelegramRecorder::retrieveUserFromDB(td_api::int53
 bool TelegramRecorder::writeUserToDB(std::unique_ptr<TelegramUser>& user) {
   SPDLOG_DEBUG("Writing user {} to DB", user->userID);
   int rc;
-  char* errMsg = NULL;
 
   std::string statement = "REPLACE INTO users ("
                             "user_id,"
@@ -388,61 +1071,86 @@ bool TelegramRecorder::writeUserToDB(std::unique_ptr<TelegramUser>& user) {
   rc = sqlite3_bind_int64(stmt, 1, user->userID);
   if (rc != SQLITE_OK) {
     SPDLOG_ERROR("Error preparing SQL statement: {}", sqlite3_errmsg(db));
+    sqlite3_finalize(stmt);
     return false;
   }
-  rc = sqlite3_bind_text64(stmt, 2, user->fullName.c_str(), user->fullName.length(), SQLITE_STATIC, SQLITE_UTF8);
+  std::string repairedName;
+  rc = this->bindText(stmt, 2, user->fullName, repairedName);
   if (rc != SQLITE_OK) {
     SPDLOG_ERROR("Error preparing SQL statement: {}", sqlite3_errmsg(db));
+    sqlite3_finalize(stmt);
     return false;
   }
-  std::string activeUserName = (user->activeUserName == "" ? "NULL" : user->activeUserName);
-  rc = sqlite3_bind_text64(stmt, 3, activeUserName.c_str(), activeUserName.length(), SQLITE_STATIC, SQLITE_UTF8);
+  if (user->activeUserName != "") {
+    rc = sqlite3_bind_text64(stmt, 3, user->activeUserName.c_str(), user->activeUserName.length(), SQLITE_STATIC, SQLITE_UTF8);
+  } else {
+    rc = sqlite3_bind_null(stmt, 3);
+  }
   if (rc != SQLITE_OK) {
     SPDLOG_ERROR("Error preparing SQL statement: {}", sqlite3_errmsg(db));
+    sqlite3_finalize(stmt);
     return false;
   }
-  std::string userNames = (user->userNames == "" ? "NULL" : user->userNames);
-  rc = sqlite3_bind_text64(stmt, 4, userNames.c_str(), userNames.length(), SQLITE_STATIC, SQLITE_UTF8);
+  if (user->userNames != "") {
+    rc = sqlite3_bind_text64(stmt, 4, user->userNames.c_str(), user->userNames.length(), SQLITE_STATIC, SQLITE_UTF8);
+  } else {
+    rc = sqlite3_bind_null(stmt, 4);
+  }
   if (rc != SQLITE_OK) {
     SPDLOG_ERROR("Error preparing SQL statement: {}", sqlite3_errmsg(db));
+    sqlite3_finalize(stmt);
     return false;
   }
-  std::string disabledUserNames = (user->disabledUserNames == "" ? "NULL" : user->disabledUserNames);
-  rc = sqlite3_bind_text64(stmt, 5, disabledUserNames.c_str(), disabledUserNames.length(), SQLITE_STATIC, SQLITE_UTF8);
+  if (user->disabledUserNames != "") {
+    rc = sqlite3_bind_text64(stmt, 5, user->disabledUserNames.c_str(), user->disabledUserNames.length(), SQLITE_STATIC, SQLITE_UTF8);
+  } else {
+    rc = sqlite3_bind_null(stmt, 5);
+  }
   if (rc != SQLITE_OK) {
     SPDLOG_ERROR("Error preparing SQL statement: {}", sqlite3_errmsg(db));
+    sqlite3_finalize(stmt);
     return false;
   }
-  std::string bio = (user->bio == "" ? "NULL" : user->bio);
-  rc = sqlite3_bind_text64(stmt, 6, bio.c_str(), bio.length(), SQLITE_STATIC, SQLITE_UTF8);
+  std::string repairedBio;
+  if (user->bio != "") {
+    rc = this->bindText(stmt, 6, user->bio, repairedBio);
+  } else {
+    rc = sqlite3_bind_null(stmt, 6);
+  }
   if (rc != SQLITE_OK) {
     SPDLOG_ERROR("Error preparing SQL statement: {}", sqlite3_errmsg(db));
+    sqlite3_finalize(stmt);
     return false;
   }
-  std::string profilePicFileID = (user->profilePicFileID == "" ? "NULL" : user->profilePicFileID);
-  rc = sqlite3_bind_text64(stmt, 7, profilePicFileID.c_str(), profilePicFileID.length(), SQLITE_STATIC, SQLITE_UTF8);
+  if (user->profilePicFileID != "") {
+    rc = sqlite3_bind_text64(stmt, 7, user->profilePicFileID.c_str(), user->profilePicFileID.length(), SQLITE_STATIC, SQLITE_UTF8);
+  } else {
+    rc = sqlite3_bind_null(stmt, 7);
+  }
   if (rc != SQLITE_OK) {
     SPDLOG_ERROR("Error preparing SQL statement: {}", sqlite3_errmsg(db));
+    sqlite3_finalize(stmt);
     return false;
   }
 
   SPDLOG_DEBUG("Executing SQL: {}", statement);
 
+  static Histogram& latency = statementLatency("replace_user");
   this->toWriteQueueMutex.lock();
-  rc = sqlite3_exec(this->db, statement.c_str(), 0, 0, &errMsg);
+  rc = timedStep(stmt, latency);
   this->toWriteQueueMutex.unlock();
-  if (rc != SQLITE_OK ) {
-    SPDLOG_ERROR("Error inserting data: {}", errMsg);
-    sqlite3_free(errMsg);
+  if (rc != SQLITE_DONE) {
+    SPDLOG_ERROR("Error inserting data: {}", sqlite3_errmsg(this->db));
+    sqlite3_finalize(stmt);
     return false;
   }
+  sqlite3_finalize(stmt);
   return true;
 }
 
 bool TelegramRecorder::writeChatToDB(std::unique_ptr<TelegramChat>& chat) {
   SPDLOG_DEBUG("Writing chat {} to DB", chat->chatID);
   int rc;
-  char* errMsg = NULL;
 
   std::string statement = "REPLACE INTO chats ("
                             "chat_id,"
@@ -463,6 +1171,7 @@ bool TelegramRecorder::writeChatToDB(std::unique_ptr<TelegramChat>& chat) {
   rc = sqlite3_bind_int64(stmt, 1, chat->chatID);
   if (rc != SQLITE_OK) {
     SPDLOG_ERROR("Error preparing SQL statement: {}", sqlite3_errmsg(db));
+    sqlite3_finalize(stmt);
     return false;
   }
   if (!chat->groupID) {
@@ -472,44 +1181,57 @@ bool TelegramRecorder::writeChatToDB(std::unique_ptr<TelegramChat>& chat) {
   }
   if (rc != SQLITE_OK) {
     SPDLOG_ERROR("Error preparing SQL statement: {}", sqlite3_errmsg(db));
+    sqlite3_finalize(stmt);
     return false;
   }
 
-  rc = sqlite3_bind_text64(stmt, 3, chat->name.c_str(), chat->name.length(), SQLITE_STATIC, SQLITE_UTF8);
+  std::string repairedName;
+  rc = this->bindText(stmt, 3, chat->name, repairedName);
   if (rc != SQLITE_OK) {
     SPDLOG_ERROR("Error preparing SQL statement: {}", sqlite3_errmsg(db));
+    sqlite3_finalize(stmt);
     return false;
   }
-  std::string about = (chat->about == "" ? "NULL" : chat->about);
-  rc = sqlite3_bind_text64(stmt, 4, about.c_str(), about.length(), SQLITE_STATIC, SQLITE_UTF8);
+  std::string repairedAbout;
+  if (chat->about != "") {
+    rc = this->bindText(stmt, 4, chat->about, repairedAbout);
+  } else {
+    rc = sqlite3_bind_null(stmt, 4);
+  }
   if (rc != SQLITE_OK) {
     SPDLOG_ERROR("Error preparing SQL statement: {}", sqlite3_errmsg(db));
+    sqlite3_finalize(stmt);
     return false;
   }
-  std::string profilePicFileID = (chat->profilePicFileID == "" ? "NULL" : chat->profilePicFileID);
-  rc = sqlite3_bind_text64(stmt, 5, profilePicFileID.c_str(), profilePicFileID.length(), SQLITE_STATIC, SQLITE_UTF8);
+  if (chat->profilePicFileID != "") {
+    rc = sqlite3_bind_text64(stmt, 5, chat->profilePicFileID.c_str(), chat->profilePicFileID.length(), SQLITE_STATIC, SQLITE_UTF8);
+  } else {
+    rc = sqlite3_bind_null(stmt, 5);
+  }
   if (rc != SQLITE_OK) {
     SPDLOG_ERROR("Error preparing SQL statement: {}", sqlite3_errmsg(db));
+    sqlite3_finalize(stmt);
     return false;
   }
   
   SPDLOG_DEBUG("Executing SQL: {}", statement);
 
+  static Histogram& latency = statementLatency("replace_chat");
   this->toWriteQueueMutex.lock();
-  rc = sqlite3_exec(this->db, statement.c_str(), 0, 0, &errMsg);
+  rc = timedStep(stmt, latency);
   this->toWriteQueueMutex.unlock();
-  if (rc != SQLITE_OK ) {
-    SPDLOG_ERROR("Error inserting data: {}", errMsg);
-    sqlite3_free(errMsg);
+  if (rc != SQLITE_DONE) {
+    SPDLOG_ERROR("Error inserting data: {}", sqlite3_errmsg(this->db));
+    sqlite3_finalize(stmt);
     return false;
   }
+  sqlite3_finalize(stmt);
   return true;
 }
 
-bool TelegramRecorder::writeFileToDB(std::string& fileID, std::string& downloadedAs, const std::string& originID) {
+bool TelegramRecorder::writeFileToDB(const std::string& fileID, std::string& downloadedAs, const std::string& originID) {
   SPDLOG_DEBUG("Writing file {} to DB", fileID);
   int rc;
-  char* errMsg = NULL;
 
   std::string statement = "REPLACE INTO files ("
                             "file_id,"
@@ -528,37 +1250,142 @@ bool TelegramRecorder::writeFileToDB(std::string& fileID, std::string& downloade
   rc = sqlite3_bind_text64(stmt, 1, fileID.c_str(), fileID.length(), SQLITE_STATIC, SQLITE_UTF8);
   if (rc != SQLITE_OK) {
     SPDLOG_ERROR("Error preparing SQL statement: {}", sqlite3_errmsg(db));
+    sqlite3_finalize(stmt);
     return false;
   }
   rc = sqlite3_bind_text64(stmt, 2, downloadedAs.c_str(), downloadedAs.length(), SQLITE_STATIC, SQLITE_UTF8);
   if (rc != SQLITE_OK) {
     SPDLOG_ERROR("Error preparing SQL statement: {}", sqlite3_errmsg(db));
+    sqlite3_finalize(stmt);
     return false;
   }
   rc = sqlite3_bind_text64(stmt, 3, originID.c_str(), originID.length(), SQLITE_STATIC, SQLITE_UTF8);
   if (rc != SQLITE_OK) {
     SPDLOG_ERROR("Error preparing SQL statement: {}", sqlite3_errmsg(db));
+    sqlite3_finalize(stmt);
     return false;
   }
 
   SPDLOG_DEBUG("Executing SQL: {}", statement);
 
+  static Histogram& latency = statementLatency("replace_file");
   this->toWriteQueueMutex.lock();
-  rc = sqlite3_exec(this->db, statement.c_str(), 0, 0, &errMsg);
+  rc = timedStep(stmt, latency);
   this->toWriteQueueMutex.unlock();
-  if (rc != SQLITE_OK ) {
-    SPDLOG_ERROR("Error inserting data: {}", errMsg);
-    sqlite3_free(errMsg);
+  if (rc != SQLITE_DONE) {
+    SPDLOG_ERROR("Error inserting data: {}", sqlite3_errmsg(this->db));
+    sqlite3_finalize(stmt);
+    return false;
+  }
+  sqlite3_finalize(stmt);
+  return true;
+}
+
+// Paths of the files after the one at afterRowID, in rowid order
+bool TelegramRecorder::readDownloadedFiles(std::int64_t afterRowID, std::vector<std::pair<std::int64_t, std::string>>& files) {
+  std::string statement = "SELECT rowid, downloaded_as FROM files WHERE rowid > ? ORDER BY rowid LIMIT ?;";
+  sqlite3_stmt *stmt;
+  this->toWriteQueueMutex.lock();
+  int rc = sqlite3_prepare_v2(this->db, statement.c_str(), -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    this->toWriteQueueMutex.unlock();
+    SPDLOG_ERROR("Error preparing statement: {}", sqlite3_errmsg(this->db));
+    return false;
+  }
+  sqlite3_bind_int64(stmt, 1, afterRowID);
+  sqlite3_bind_int(stmt, 2, DOWNLOAD_MIGRATION_BATCH_SIZE);
+  SPDLOG_DEBUG("Executing SQL: {}", statement);
+  static Histogram& latency = statementLatency("select_files");
+  while ((rc = timedStep(stmt, latency)) == SQLITE_ROW) {
+    const unsigned char* downloadedAs = sqlite3_column_text(stmt, 1);
+    files.emplace_back(sqlite3_column_int64(stmt, 0), downloadedAs ? reinterpret_cast<const char*>(downloadedAs) : "");
+  }
+  this->toWriteQueueMutex.unlock();
+  sqlite3_finalize(stmt);
+  if (rc != SQLITE_DONE) {
+    SPDLOG_ERROR("Error executing SQL: {}", sqlite3_errmsg(this->db));
+    return false;
+  }
+  return true;
+}
+
+// Every file stored at from, as files downloaded more than once share it
+bool TelegramRecorder::updateDownloadedAs(const std::string& from, const std::string& to) {
+  std::string statement = "UPDATE files SET downloaded_as = ? WHERE downloaded_as = ?;";
+  sqlite3_stmt *stmt;
+  int rc = sqlite3_prepare_v2(this->db, statement.c_str(), -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    SPDLOG_ERROR("Error preparing statement: {}", sqlite3_errmsg(this->db));
     return false;
   }
+  sqlite3_bind_text64(stmt, 1, to.c_str(), to.length(), SQLITE_STATIC, SQLITE_UTF8);
+  sqlite3_bind_text64(stmt, 2, from.c_str(), from.length(), SQLITE_STATIC, SQLITE_UTF8);
+  SPDLOG_DEBUG("Executing SQL: {}", statement);
+  static Histogram& latency = statementLatency("update_file_path");
+  this->toWriteQueueMutex.lock();
+  rc = timedStep(stmt, latency);
+  this->toWriteQueueMutex.unlock();
+  if (rc != SQLITE_DONE) {
+    SPDLOG_ERROR("Error updating data: {}", sqlite3_errmsg(this->db));
+    sqlite3_finalize(stmt);
+    return false;
+  }
+  sqlite3_finalize(stmt);
   return true;
 }
 
+// Messages recorded before the search index existed are added to it in the
+// background, a batch at a time. Messages written from now on are indexed by
+// the writer itself.
+void TelegramRecorder::runSearchIndexer() {
+  SPDLOG_DEBUG("Search indexer started");
+  this->toWriteQueueMutex.lock();
+  std::int64_t pending = searchIndexPendingRows(this->db);
+  this->toWriteQueueMutex.unlock();
+  if(pending > 0) {
+    SPDLOG_INFO("Adding {} messages to the search index", pending);
+  }
+  this->recorderMetrics.searchIndexPending->set(std::max<std::int64_t>(pending, 0));
+  auto start = std::chrono::steady_clock::now();
+  std::uint64_t indexed = 0;
+  while(pending > 0 && !this->exitFlag.load()) {
+    // Live traffic goes first
+    if(this->recorderMetrics.writeQueueMessages->get() > SEARCH_INDEX_MAX_WRITE_QUEUE) {
+      this->sleepUntilExit(std::chrono::steady_clock::now() + std::chrono::milliseconds(SHUTDOWN_POLL_INTERVAL_MS));
+      continue;
+    }
+    static Histogram& latency = statementLatency("build_search_index");
+    auto batchStart = std::chrono::steady_clock::now();
+    this->toWriteQueueMutex.lock();
+    std::int64_t batch = buildSearchIndex(this->db);
+    this->toWriteQueueMutex.unlock();
+    latency.record(elapsedMicros(batchStart));
+    if(batch < 0) {
+      SPDLOG_ERROR("Unable to build the search index, searches will miss older messages until the next start");
+      break;
+    }
+    if(batch == 0) {
+      break;
+    }
+    indexed += batch;
+    pending -= batch;
+    this->recorderMetrics.searchIndexBuilt->inc(batch);
+    this->recorderMetrics.searchIndexPending->set(std::max<std::int64_t>(pending, 0));
+  }
+  if(indexed) {
+    double elapsedSec = elapsedMicros(start) / 1e6;
+    SPDLOG_INFO("Added {} messages to the search index in {:0.1f} s ({:0.0f} messages/s)", indexed, elapsedSec, indexed / elapsedSec);
+  }
+  SPDLOG_DEBUG("Search indexer stopped");
+}
+
 void TelegramRecorder::updateMessageText(td_api::int53 chatID, td_api::int53 messageID, td_api::int32 editDate) {
-  td_api::object_ptr<td_api::getMessage> getMessage = td_api::make_object<td_api::getMessage>();
-  getMessage->chat_id_ = chatID;
-  getMessage->message_id_ = messageID;
-  this->sendQuery(std::move(getMessage), [this, messageID, editDate](TDAPIObjectPtr object) {
+  this->sendIdempotentQuery([chatID, messageID]() {
+    td_api::object_ptr<td_api::getMessage> getMessage = td_api::make_object<td_api::getMessage>();
+    getMessage->chat_id_ = chatID;
+    getMessage->message_id_ = messageID;
+    return getMessage;
+  }, [this, messageID, editDate](TDAPIObjectPtr object) {
     if(!object) {
       SPDLOG_ERROR("NULL response received when calling getMessage for message ID {}", messageID);
       return;
@@ -573,47 +1400,14 @@ void TelegramRecorder::updateMessageText(td_api::int53 chatID, td_api::int53 mes
     std::string compoundMessageID = std::to_string(newMessage->chat_id_) + ":" + std::to_string(newMessage->id_);
     SPDLOG_DEBUG("Updating message {}", compoundMessageID);
 
-    int rc;
-    char* errMsg = NULL;
-
-    std::string statement = "UPDATE messages SET message = ?, timestamp = ? WHERE id = ?;";
-
-    sqlite3_stmt *stmt;
-    rc = sqlite3_prepare_v2(db, statement.c_str(), -1, &stmt, NULL);
-    if (rc != SQLITE_OK) {
-      SPDLOG_ERROR("Error preparing SQL statement: {}", sqlite3_errmsg(db));
-      return;
-    }
-
-    rc = sqlite3_bind_text64(stmt, 1, newText.c_str(), newText.length(), SQLITE_STATIC, SQLITE_UTF8);
-    if (rc != SQLITE_OK) {
-      SPDLOG_ERROR("Error preparing SQL statement: {}", sqlite3_errmsg(db));
-      return;
-    }
-    rc = sqlite3_bind_int64(stmt, 2, editDate);
-    if (rc != SQLITE_OK) {
-      SPDLOG_ERROR("Error preparing SQL statement: {}", sqlite3_errmsg(db));
-      return;
-    }
-    rc = sqlite3_bind_text64(stmt, 3, compoundMessageID.c_str(), compoundMessageID.length(), SQLITE_STATIC, SQLITE_UTF8);
-    if (rc != SQLITE_OK) {
-      SPDLOG_ERROR("Error preparing SQL statement: {}", sqlite3_errmsg(db));
-      return;
-    }
-
-    SPDLOG_DEBUG("Executing SQL: {}", statement);
-
-    this->toWriteQueueMutex.lock();
-    rc = sqlite3_exec(this->db, statement.c_str(), 0, 0, &errMsg);
-    this->toWriteQueueMutex.unlock();
-    if (rc != SQLITE_OK ) {
-      SPDLOG_ERROR("Error inserting data: {}", errMsg);
-      sqlite3_free(errMsg);
-    }
-
-    if(!sqlite3_changes(this->db)) {
+    std::string repairedText;
+    static Histogram& latency = statementLatency("update_message_text");
+    int changes = this->updateMessage("message = ?, timestamp = ?", compoundMessageID, [&](sqlite3_stmt* stmt) {
+      int rc = this->bindText(stmt, 1, newText, repairedText);
+      return rc != SQLITE_OK ? rc : sqlite3_bind_int64(stmt, 2, editDate);
+    }, latency);
+    if(changes == 0) {
       SPDLOG_ERROR("No message was found with message ID: {}", compoundMessageID);
-      return;
     }
   });
 }
@@ -629,49 +1423,17 @@ bool TelegramRecorder::updateMessageContent(std::string compoundMessageID, td_ap
 
   std::string fileOrigin = std::to_string(f->id_) + ":" + compoundMessageID;
   std::string fileOriginID = SHA256(fileOrigin.c_str(), fileOrigin.size());
-  this->downloadFile(*f, compoundMessageID);
-
-  int rc;
-  char* errMsg = NULL;
-
-  
-  std::string statement = "UPDATE messages SET content_file_id = ?, timestamp = ? WHERE id = ?;";
-
-  sqlite3_stmt *stmt;
-  rc = sqlite3_prepare_v2(db, statement.c_str(), -1, &stmt, NULL);
-  if (rc != SQLITE_OK) {
-    SPDLOG_ERROR("Error preparing SQL statement: {}", sqlite3_errmsg(db));
-    return false;
-  }
-
-  rc = sqlite3_bind_text64(stmt, 1, fileOriginID.c_str(), fileOriginID.length(), SQLITE_STATIC, SQLITE_UTF8);
-  if (rc != SQLITE_OK) {
-    SPDLOG_ERROR("Error preparing SQL statement: {}", sqlite3_errmsg(db));
-    return false;
-  }
-  rc = sqlite3_bind_int64(stmt, 2, editDate);
-  if (rc != SQLITE_OK) {
-    SPDLOG_ERROR("Error preparing SQL statement: {}", sqlite3_errmsg(db));
-    return false;
-  }
-  rc = sqlite3_bind_text64(stmt, 3, compoundMessageID.c_str(), compoundMessageID.length(), SQLITE_STATIC, SQLITE_UTF8);
-  if (rc != SQLITE_OK) {
-    SPDLOG_ERROR("Error preparing SQL statement: {}", sqlite3_errmsg(db));
+  this->downloadFile(*f, compoundMessageID, fileOriginID);
+
+  static Histogram& latency = statementLatency("update_message_content");
+  int changes = this->updateMessage("content_file_id = ?, timestamp = ?", compoundMessageID, [&](sqlite3_stmt* stmt) {
+    int rc = sqlite3_bind_text64(stmt, 1, fileOriginID.c_str(), fileOriginID.length(), SQLITE_STATIC, SQLITE_UTF8);
+    return rc != SQLITE_OK ? rc : sqlite3_bind_int64(stmt, 2, editDate);
+  }, latency);
+  if(changes < 0) {
     return false;
   }
-
-  SPDLOG_DEBUG("Executing SQL: {}", statement);
-
-  this->toWriteQueueMutex.lock();
-  rc = sqlite3_exec(this->db, statement.c_str(), 0, 0, &errMsg);
-  this->toWriteQueueMutex.unlock();
-  if (rc != SQLITE_OK ) {
-    SPDLOG_ERROR("Error inserting data: {}", errMsg);
-    sqlite3_free(errMsg);
-    return false;
-  }
-
-  if(!sqlite3_changes(this->db)) {
+  if(!changes) {
     SPDLOG_ERROR("No message was found with message ID: {}", compoundMessageID);
     return false;
   }
@@ -679,9 +1441,49 @@ bool TelegramRecorder::updateMessageContent(std::string compoundMessageID, td_ap
   return true;
 }
 
+// Updates a message in the partition it was written to, the current or the
+// previous one: messages of sealed partitions can't change anymore. bind
+// binds the parameters of the assignments, the message ID is bound after
+// them. Returns the rows changed, or -1 on errors.
+int TelegramRecorder::updateMessage(const char* assignments, const std::string& compoundMessageID, std::function<int(sqlite3_stmt*)> bind, Histogram& latency) {
+  std::lock_guard<std::mutex> lock(this->toWriteQueueMutex);
+  for(auto& [db, table] : this->messageTables()) {
+    if(db != this->db) {
+      break;
+    }
+    std::string statement = "UPDATE " + table + " SET " + assignments + " WHERE id = ?;";
+    sqlite3_stmt *stmt;
+    int rc = sqlite3_prepare_v2(this->db, statement.c_str(), -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+      SPDLOG_ERROR("Error preparing SQL statement: {}", sqlite3_errmsg(this->db));
+      return -1;
+    }
+    rc = bind(stmt);
+    if (rc == SQLITE_OK) {
+      rc = sqlite3_bind_text64(stmt, sqlite3_bind_parameter_count(stmt), compoundMessageID.c_str(), compoundMessageID.length(), SQLITE_STATIC, SQLITE_UTF8);
+    }
+    if (rc != SQLITE_OK) {
+      SPDLOG_ERROR("Error preparing SQL statement: {}", sqlite3_errmsg(this->db));
+      sqlite3_finalize(stmt);
+      return -1;
+    }
+    SPDLOG_DEBUG("Executing SQL: {}", statement);
+    rc = timedStep(stmt, latency);
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE) {
+      SPDLOG_ERROR("Error updating data: {}", sqlite3_errmsg(this->db));
+      return -1;
+    }
+    int changes = sqlite3_changes(this->db);
+    if(changes) {
+      return changes;
+    }
+  }
+  return 0;
+}
+
 bool TelegramRecorder::updateGroupData(TDAPIObjectPtr groupData, td_api::int53 groupID) {
   int rc;
-  char* errMsg = NULL;
 
   std::string description;
 
@@ -707,29 +1509,37 @@ bool TelegramRecorder::updateGroupData(TDAPIObjectPtr groupData, td_api::int53 g
     return false;
   }
 
-  rc = sqlite3_bind_text64(stmt, 1, description.c_str(), description.length(), SQLITE_STATIC, SQLITE_UTF8);
+  std::string repairedDescription;
+  rc = this->bindText(stmt, 1, description, repairedDescription);
   if (rc != SQLITE_OK) {
     SPDLOG_ERROR("Error preparing SQL statement: {}", sqlite3_errmsg(db));
+    sqlite3_finalize(stmt);
     return false;
   }
   rc = sqlite3_bind_int64(stmt, 2, groupID);
   if (rc != SQLITE_OK) {
     SPDLOG_ERROR("Error preparing SQL statement: {}", sqlite3_errmsg(db));
+    sqlite3_finalize(stmt);
     return false;
   }
 
   SPDLOG_DEBUG("Executing SQL: {}", statement);
 
+  static Histogram& latency = statementLatency("update_group");
+  // Read with the lock held, as any other thread's statement changes them
   this->toWriteQueueMutex.lock();
-  rc = sqlite3_exec(this->db, statement.c_str(), 0, 0, &errMsg);
+  rc = timedStep(stmt, latency);
+  std::string error = rc != SQLITE_DONE ? sqlite3_errmsg(this->db) : "";
+  int changes = sqlite3_changes(this->db);
   this->toWriteQueueMutex.unlock();
-  if (rc != SQLITE_OK ) {
-    SPDLOG_ERROR("Error updating data: {}", errMsg);
-    sqlite3_free(errMsg);
+  if (rc != SQLITE_DONE) {
+    SPDLOG_ERROR("Error updating data: {}", error);
+    sqlite3_finalize(stmt);
     return false;
   }
+  sqlite3_finalize(stmt);
 
-  if(!sqlite3_changes(this->db)) {
+  if(!changes) {
     SPDLOG_ERROR("No chat was found with group ID: {}", groupID);
     return false;
   }
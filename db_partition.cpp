@@ -0,0 +1,258 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#include <algorithm>
+#include <filesystem>
+#include <initializer_list>
+
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define SPDLOG_ACTIVE_LEVEL SPDLOG_LEVEL_TRACE
+#include <spdlog/spdlog.h>
+
+#include "db_partition.hpp"
+#include "db_schema.hpp"
+#include "search_index.hpp"
+
+// The messages table and its indexes as of the latest schema version, which
+// partitions are stamped with. Migrations of the messages table have to be
+// applied to every partition as well.
+static const char* partitionSchema =
+  "CREATE TABLE IF NOT EXISTS messages("
+    "id TEXT PRIMARY KEY,"
+    "timestamp INTEGER,"
+    "message TEXT,"
+    "message_type INTEGER,"
+    "content_file_id TEXT,"
+    "chat_id INTEGER,"
+    "sender_id INTEGER,"
+    "in_reply_of TEXT,"
+    "forwarded_from TEXT"
+  ");"
+  "CREATE INDEX IF NOT EXISTS from_sender_in_chat ON messages (sender_id, chat_id);"
+  "CREATE INDEX IF NOT EXISTS messages_chat ON messages (chat_id);";
+
+static const char* partitionFormats[][2] = {
+  {DB_PARTITION_DAY, "%Y-%m-%d"},
+  {DB_PARTITION_MONTH, "%Y-%m"},
+  {DB_PARTITION_YEAR, "%Y"},
+};
+
+static std::string columnText(sqlite3_stmt* stmt, int column) {
+  const unsigned char* text = sqlite3_column_text(stmt, column);
+  return text ? reinterpret_cast<const char*>(text) : "";
+}
+
+// Runs a statement taking text parameters, reading the integers in the first
+// row it returns, if any, into columns
+static bool runStatement(sqlite3* db, const char* statement, std::initializer_list<std::string> params, std::vector<std::int64_t>* columns = nullptr) {
+  sqlite3_stmt* stmt;
+  int rc = sqlite3_prepare_v2(db, statement, -1, &stmt, NULL);
+  if(rc != SQLITE_OK) {
+    SPDLOG_ERROR("Error preparing statement: {}", sqlite3_errmsg(db));
+    return false;
+  }
+  int index = 1;
+  for(const std::string& param : params) {
+    sqlite3_bind_text64(stmt, index++, param.c_str(), param.size(), SQLITE_STATIC, SQLITE_UTF8);
+  }
+  SPDLOG_DEBUG("Executing SQL: {}", statement);
+  rc = sqlite3_step(stmt);
+  if(rc == SQLITE_ROW && columns) {
+    for(int i = 0; i < sqlite3_column_count(stmt); ++i) {
+      columns->push_back(sqlite3_column_int64(stmt, i));
+    }
+  }
+  sqlite3_finalize(stmt);
+  if(rc != SQLITE_ROW && rc != SQLITE_DONE) {
+    SPDLOG_ERROR("Error executing SQL: {}", sqlite3_errmsg(db));
+    return false;
+  }
+  return true;
+}
+
+// Full scan, as timestamps aren't indexed
+static bool readBounds(sqlite3* db, Partition& partition) {
+  std::vector<std::int64_t> bounds;
+  if(!runStatement(db, "SELECT IFNULL(MIN(timestamp), 0), IFNULL(MAX(timestamp), 0), COUNT(*) FROM messages;", {}, &bounds) || bounds.size() != 3) {
+    return false;
+  }
+  partition.firstTimestamp = bounds[0];
+  partition.lastTimestamp = bounds[1];
+  partition.messages = bounds[2];
+  return true;
+}
+
+bool validPartitioning(const std::string& partitioning) {
+  if(partitioning == DB_PARTITION_NONE) {
+    return true;
+  }
+  return std::any_of(std::begin(partitionFormats), std::end(partitionFormats), [&](auto& format) { return partitioning == format[0]; });
+}
+
+std::string partitionPeriod(const std::string& partitioning, std::time_t time) {
+  for(auto& format : partitionFormats) {
+    if(partitioning != format[0]) {
+      continue;
+    }
+    struct tm tm;
+    char period[16];
+    strftime(period, sizeof(period), format[1], gmtime_r(&time, &tm));
+    return period;
+  }
+  return "";
+}
+
+std::string partitionFileName(const std::string& catalogFile, const std::string& period) {
+  std::filesystem::path catalog(catalogFile);
+  return catalog.stem().string() + "-" + period + catalog.extension().string();
+}
+
+std::string partitionPath(const std::string& catalogFile, const std::string& file) {
+  return (std::filesystem::path(catalogFile).parent_path() / file).string();
+}
+
+bool preparePartition(const std::string& path, const DBTuningParams& params, bool searchIndex, const std::string& tokenizer) {
+  sqlite3* db;
+  if(sqlite3_open(path.c_str(), &db) != SQLITE_OK) {
+    SPDLOG_ERROR("Unable to open partition {}: {}", path, sqlite3_errmsg(db));
+    sqlite3_close(db);
+    return false;
+  }
+  bool ok = applyStartupPragmas(db, params) && execSchemaSQL(db, "BEGIN IMMEDIATE;");
+  if(ok) {
+    ok = execSchemaSQL(db, partitionSchema) && execSchemaSQL(db, "PRAGMA user_version = " + std::to_string(latestSchemaVersion()) + ";");
+    ok = execSchemaSQL(db, ok ? "COMMIT;" : "ROLLBACK;") && ok;
+  }
+  ok = ok && configureSearchIndex(db, searchIndex, tokenizer);
+  sqlite3_close(db);
+  if(!ok) {
+    SPDLOG_ERROR("Unable to prepare partition {}", path);
+  }
+  return ok;
+}
+
+// Attached DBs are opened with the same flags as the main one, so they are
+// read-only if it is
+bool attachDB(sqlite3* db, const std::string& path, const std::string& schema) {
+  std::string statement = "ATTACH DATABASE ? AS " + schema + ";";
+  if(!runStatement(db, statement.c_str(), {path})) {
+    SPDLOG_ERROR("Unable to attach {} as {}", path, schema);
+    return false;
+  }
+  return true;
+}
+
+bool registerPartition(sqlite3* catalog, const std::string& file, const std::string& period) {
+  return runStatement(catalog, "INSERT OR IGNORE INTO partitions (file, period, sealed) VALUES (?, ?, 0);", {file, period});
+}
+
+bool registerLegacyPartition(sqlite3* catalog, const std::string& catalogFile) {
+  std::vector<std::int64_t> registered;
+  if(!runStatement(catalog, "SELECT COUNT(*) FROM partitions;", {}, &registered)) {
+    return false;
+  }
+  // The catalog's messages aren't written to after that
+  if(registered[0]) {
+    return true;
+  }
+  Partition legacy;
+  legacy.file = std::filesystem::path(catalogFile).filename().string();
+  if(!readBounds(catalog, legacy)) {
+    return false;
+  }
+  if(!legacy.messages) {
+    return true;
+  }
+  SPDLOG_INFO("Keeping the {} messages recorded until now in {}, new ones go to time partitions", legacy.messages, catalogFile);
+  return registerPartition(catalog, legacy.file, DB_PARTITION_LEGACY_PERIOD) && markPartitionSealed(catalog, legacy);
+}
+
+bool listPartitions(sqlite3* catalog, std::int64_t since, std::int64_t until, std::vector<Partition>& partitions) {
+  static const char* statement =
+    "SELECT file, period, first_timestamp, last_timestamp, messages, sealed FROM partitions "
+    "WHERE sealed = 0 OR (messages > 0 AND (?1 = 0 OR last_timestamp >= ?1) AND (?2 = 0 OR first_timestamp < ?2)) "
+    "ORDER BY rowid;";
+  sqlite3_stmt* stmt;
+  int rc = sqlite3_prepare_v2(catalog, statement, -1, &stmt, NULL);
+  if(rc != SQLITE_OK) {
+    SPDLOG_ERROR("Error preparing statement: {}", sqlite3_errmsg(catalog));
+    return false;
+  }
+  sqlite3_bind_int64(stmt, 1, since);
+  sqlite3_bind_int64(stmt, 2, until);
+  SPDLOG_DEBUG("Executing SQL: {}", statement);
+  while((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    partitions.push_back({
+      columnText(stmt, 0),
+      columnText(stmt, 1),
+      sqlite3_column_int64(stmt, 2),
+      sqlite3_column_int64(stmt, 3),
+      sqlite3_column_int64(stmt, 4),
+      sqlite3_column_int(stmt, 5) != 0
+    });
+  }
+  sqlite3_finalize(stmt);
+  if(rc != SQLITE_DONE) {
+    SPDLOG_ERROR("Error listing partitions: {}", sqlite3_errmsg(catalog));
+    return false;
+  }
+  return true;
+}
+
+bool sealPartition(const std::string& path, Partition& partition) {
+  sqlite3* db;
+  if(sqlite3_open_v2(path.c_str(), &db, SQLITE_OPEN_READWRITE, NULL) != SQLITE_OK) {
+    SPDLOG_ERROR("Unable to open partition {}: {}", path, sqlite3_errmsg(db));
+    sqlite3_close(db);
+    return false;
+  }
+  // Whatever the writer left for the background indexer, or didn't get to
+  // index before rotating
+  std::int64_t batch;
+  while((batch = buildSearchIndex(db)) > 0);
+  bool ok = batch == 0 && indexNewMessages(db) >= 0 && optimizeSearchIndex(db) && execSchemaSQL(db, "ANALYZE;") && readBounds(db, partition);
+  // Opening a WAL DB needs write access to its shared memory file, even to
+  // read it
+  std::string journalMode;
+  ok = ok && queryPragma(db, "journal_mode = DELETE", journalMode);
+  if(ok && journalMode != "delete") {
+    SPDLOG_WARN("Unable to switch partition {} out of WAL, it's open somewhere else", path);
+    ok = false;
+  }
+  ok = ok && execSchemaSQL(db, "VACUUM;");
+  sqlite3_close(db);
+  if(ok && chmod(path.c_str(), S_IRUSR | S_IRGRP | S_IROTH) < 0) {
+    SPDLOG_ERROR("Unable to make partition {} read-only: {}", path, strerror(errno));
+    ok = false;
+  }
+  partition.sealed = ok;
+  return ok;
+}
+
+bool markPartitionSealed(sqlite3* catalog, const Partition& partition) {
+  static const char* statement = "UPDATE partitions SET first_timestamp = ?, last_timestamp = ?, messages = ?, sealed = 1 WHERE file = ?;";
+  sqlite3_stmt* stmt;
+  int rc = sqlite3_prepare_v2(catalog, statement, -1, &stmt, NULL);
+  if(rc != SQLITE_OK) {
+    SPDLOG_ERROR("Error preparing statement: {}", sqlite3_errmsg(catalog));
+    return false;
+  }
+  sqlite3_bind_int64(stmt, 1, partition.firstTimestamp);
+  sqlite3_bind_int64(stmt, 2, partition.lastTimestamp);
+  sqlite3_bind_int64(stmt, 3, partition.messages);
+  sqlite3_bind_text64(stmt, 4, partition.file.c_str(), partition.file.size(), SQLITE_STATIC, SQLITE_UTF8);
+  SPDLOG_DEBUG("Executing SQL: {}", statement);
+  rc = sqlite3_step(stmt);
+  sqlite3_finalize(stmt);
+  if(rc != SQLITE_DONE) {
+    SPDLOG_ERROR("Error updating data: {}", sqlite3_errmsg(catalog));
+    return false;
+  }
+  return true;
+}
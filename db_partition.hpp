@@ -0,0 +1,77 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#ifndef DB_PARTITION_HPP
+#define DB_PARTITION_HPP
+
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <vector>
+
+#include <sqlite3.h>
+
+#include "config.hpp"
+
+#define DB_PARTITION_NONE "none"
+#define DB_PARTITION_DAY "day"
+#define DB_PARTITION_MONTH "month"
+#define DB_PARTITION_YEAR "year"
+// Period of the messages recorded before partitioning, left in the catalog
+#define DB_PARTITION_LEGACY_PERIOD "legacy"
+// The first schema version with the partitions table
+#define PARTITIONS_SCHEMA_VERSION 6
+// How often partitions that aren't written to anymore are looked for
+#define PARTITION_SEAL_INTERVAL_SEC 60
+
+// With db_partition set, the DB file becomes a catalog of users, chats, files
+// and sync state, and messages are written to a partition file per period
+// next to it, e.g. tgrec-2026-10.db, listed in the catalog's partitions
+// table. Partitions only hold the messages table and its search index.
+// Messages go to the partition of the period they were written in, whatever
+// their date, so the time bounds of a partition are only known once it's
+// sealed: made read-only after the writer has moved two periods past it.
+typedef struct Partition {
+  // Relative to the catalog's directory
+  std::string file;
+  std::string period;
+  // Bounds of the message timestamps, only set once it's sealed
+  std::int64_t firstTimestamp{0};
+  std::int64_t lastTimestamp{0};
+  std::int64_t messages{0};
+  bool sealed{false};
+} Partition;
+
+bool validPartitioning(const std::string& partitioning);
+// The period a time falls in, in UTC: 2026-10-18, 2026-10 or 2026
+std::string partitionPeriod(const std::string& partitioning, std::time_t time);
+// tgrec.db and 2026-10 make tgrec-2026-10.db
+std::string partitionFileName(const std::string& catalogFile, const std::string& period);
+// Where a partition listed in the catalog is
+std::string partitionPath(const std::string& catalogFile, const std::string& file);
+// Creates the messages table if the partition is new, and sets up its search
+// index like configureSearchIndex()
+bool preparePartition(const std::string& path, const DBTuningParams& params, bool searchIndex, const std::string& tokenizer);
+bool attachDB(sqlite3* db, const std::string& path, const std::string& schema);
+
+// The catalog functions take a connection where the partitions table is the
+// first one found by its unqualified name, like the recorder's.
+//
+// Registers the partition, unsealed, unless it's registered already
+bool registerPartition(sqlite3* catalog, const std::string& file, const std::string& period);
+// On the first start with partitions, registers the messages recorded until
+// then in the catalog as a sealed partition
+bool registerLegacyPartition(sqlite3* catalog, const std::string& catalogFile);
+// In the order they were created. With since or until set (0 is no limit),
+// sealed partitions with no message in [since, until) are left out.
+bool listPartitions(sqlite3* catalog, std::int64_t since, std::int64_t until, std::vector<Partition>& partitions);
+// Finishes and optimizes the partition's search index, analyzes it, reads its
+// bounds into partition, vacuums it and makes the file read-only. It has to be
+// detached from every connection.
+bool sealPartition(const std::string& path, Partition& partition);
+bool markPartitionSealed(sqlite3* catalog, const Partition& partition);
+
+#endif
@@ -0,0 +1,207 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#include <algorithm>
+#include <cstdint>
+
+#define SPDLOG_ACTIVE_LEVEL SPDLOG_LEVEL_TRACE
+#include <spdlog/spdlog.h>
+
+#include "db_schema.hpp"
+
+// Version 1 is the schema tgrec had before it was versioned, so it has to be
+// a no-op on DBs created back then, which have user_version 0
+static const Migration migrations[] = {
+  {1, "Initial schema",
+    "CREATE TABLE IF NOT EXISTS messages("
+      "id TEXT PRIMARY KEY,"
+      "timestamp INTEGER,"
+      "message TEXT,"
+      "message_type INTEGER,"
+      "content_file_id TEXT,"
+      "chat_id INTEGER,"
+      "sender_id INTEGER,"
+      "in_reply_of TEXT,"
+      "forwarded_from TEXT"
+    ");"
+    "CREATE INDEX IF NOT EXISTS from_sender_in_chat ON messages (sender_id, chat_id);"
+    "CREATE TABLE IF NOT EXISTS users("
+      "user_id INTEGER PRIMARY KEY,"
+      "fullname TEXT,"
+      "username TEXT,"
+      "usernames TEXT,"
+      "disabled_usernames TEXT,"
+      "bio TEXT,"
+      "profile_pic_file_id TEXT"
+    ");"
+    "CREATE TABLE IF NOT EXISTS chats("
+      "chat_id INTEGER PRIMARY KEY,"
+      "group_id INTEGER,"
+      "name TEXT,"
+      "about TEXT,"
+      "pic_file_id TEXT"
+    ");"
+    "CREATE TABLE IF NOT EXISTS files("
+      "file_id TEXT PRIMARY KEY,"
+      "downloaded_as TEXT,"
+      "origin_id TEXT"
+    ");"
+  },
+  {2, "Track the last message recorded from each chat",
+    "CREATE TABLE chat_sync_state("
+      "chat_id INTEGER PRIMARY KEY,"
+      "last_message_id INTEGER,"
+      "backfill_until INTEGER,"
+      "backfill_cursor INTEGER"
+    ");"
+    // Message IDs are stored as chat_id:message_id
+    "INSERT INTO chat_sync_state (chat_id, last_message_id) "
+      "SELECT chat_id, MAX(CAST(substr(id, instr(id, ':') + 1) AS INTEGER)) FROM messages GROUP BY chat_id;"
+  },
+  {3, "Track the progress of archiving each chat's history",
+    "CREATE TABLE chat_archive_state("
+      "chat_id INTEGER PRIMARY KEY,"
+      "cursor INTEGER,"
+      "messages INTEGER,"
+      "finished INTEGER"
+    ");"
+  },
+  {4, "Index files by where they're stored",
+    // Files downloaded before the sharded layout are moved by path
+    "CREATE INDEX files_downloaded_as ON files (downloaded_as);"
+  },
+  {5, "Index messages by chat and files by the message they came from",
+    // Exports read each chat in order, which the index has as it ends with
+    // the rowid
+    "CREATE INDEX messages_chat ON messages (chat_id);"
+    "CREATE INDEX files_origin_id ON files (origin_id);"
+  },
+  {6, "List the time partitions messages are written to",
+    // Empty unless db_partition is set
+    "CREATE TABLE partitions("
+      "file TEXT PRIMARY KEY,"
+      "period TEXT,"
+      "first_timestamp INTEGER,"
+      "last_timestamp INTEGER,"
+      "messages INTEGER,"
+      "sealed INTEGER"
+    ");"
+  },
+};
+
+static const char* journalModes[] = {"DELETE", "TRUNCATE", "PERSIST", "MEMORY", "WAL", "OFF"};
+
+bool execSchemaSQL(sqlite3* db, const std::string& statement) {
+  char* errMsg = NULL;
+  SPDLOG_DEBUG("Executing SQL: {}", statement);
+  int rc = sqlite3_exec(db, statement.c_str(), 0, 0, &errMsg);
+  if (rc != SQLITE_OK) {
+    SPDLOG_ERROR("Error executing SQL: {}", errMsg);
+    sqlite3_free(errMsg);
+    return false;
+  }
+  return true;
+}
+
+bool queryPragma(sqlite3* db, const std::string& pragma, std::string& result) {
+  std::string statement = "PRAGMA " + pragma + ";";
+  sqlite3_stmt *stmt;
+  int rc = sqlite3_prepare_v2(db, statement.c_str(), -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    SPDLOG_ERROR("Error preparing statement: {}", sqlite3_errmsg(db));
+    return false;
+  }
+  SPDLOG_DEBUG("Executing SQL: {}", statement);
+  rc = sqlite3_step(stmt);
+  if (rc == SQLITE_ROW) {
+    const unsigned char* text = sqlite3_column_text(stmt, 0);
+    result = text ? reinterpret_cast<const char*>(text) : "";
+  } else if (rc != SQLITE_DONE) {
+    SPDLOG_ERROR("Error executing SQL: {}", sqlite3_errmsg(db));
+    sqlite3_finalize(stmt);
+    return false;
+  }
+  sqlite3_finalize(stmt);
+  return true;
+}
+
+int latestSchemaVersion() {
+  return migrations[sizeof(migrations) / sizeof(migrations[0]) - 1].version;
+}
+
+int getSchemaVersion(sqlite3* db) {
+  std::string version;
+  if(!queryPragma(db, "user_version", version)) {
+    return -1;
+  }
+  return std::stoi(version);
+}
+
+bool migrateSchema(sqlite3* db) {
+  // Take the write lock before reading the version, so nobody else can
+  // migrate in between
+  if(!execSchemaSQL(db, "BEGIN IMMEDIATE;")) {
+    return false;
+  }
+  int version = getSchemaVersion(db);
+  if(version < 0) {
+    execSchemaSQL(db, "ROLLBACK;");
+    return false;
+  }
+  if(version > latestSchemaVersion()) {
+    SPDLOG_ERROR("DB schema version {} is newer than the latest one supported ({})", version, latestSchemaVersion());
+    execSchemaSQL(db, "ROLLBACK;");
+    return false;
+  }
+  if(version == latestSchemaVersion()) {
+    return execSchemaSQL(db, "COMMIT;");
+  }
+  for(const Migration& migration : migrations) {
+    if(migration.version <= version) {
+      continue;
+    }
+    SPDLOG_INFO("Migrating DB schema to version {}: {}", migration.version, migration.description);
+    if(!execSchemaSQL(db, migration.statement)) {
+      SPDLOG_ERROR("DB schema migration to version {} failed, rolling back", migration.version);
+      execSchemaSQL(db, "ROLLBACK;");
+      return false;
+    }
+  }
+  if(!execSchemaSQL(db, "PRAGMA user_version = " + std::to_string(latestSchemaVersion()) + ";") || !execSchemaSQL(db, "COMMIT;")) {
+    execSchemaSQL(db, "ROLLBACK;");
+    return false;
+  }
+  SPDLOG_INFO("Migrated DB schema from version {} to {}", version, latestSchemaVersion());
+  return true;
+}
+
+bool applyStartupPragmas(sqlite3* db, const DBTuningParams& params, const std::string& schema) {
+  std::string journalMode = params.journalMode;
+  std::transform(journalMode.begin(), journalMode.end(), journalMode.begin(), ::toupper);
+  if(std::find(std::begin(journalModes), std::end(journalModes), journalMode) == std::end(journalModes)) {
+    SPDLOG_ERROR("Unknown DB journal mode: {}", params.journalMode);
+    return false;
+  }
+  std::string prefix = schema != "" ? schema + "." : "";
+  // Ignored by SQLite unless the DB is still empty
+  if(!execSchemaSQL(db, "PRAGMA " + prefix + "page_size = " + std::to_string(params.pageSize) + ";")) {
+    return false;
+  }
+  std::string result;
+  if(!queryPragma(db, prefix + "journal_mode = " + journalMode, result)) {
+    return false;
+  }
+  std::transform(result.begin(), result.end(), result.begin(), ::toupper);
+  if(result != journalMode) {
+    // In-memory DBs can't use WAL, for instance
+    SPDLOG_WARN("Unable to set DB journal mode to {}, using {}", journalMode, result);
+  }
+  std::int64_t mmapSize = static_cast<std::int64_t>(params.mmapSizeMB) * 1024 * 1024;
+  // A negative cache_size is in KiB instead of pages
+  std::int64_t cacheSize = -static_cast<std::int64_t>(params.cacheSizeMB) * 1024;
+  return execSchemaSQL(db, "PRAGMA " + prefix + "mmap_size = " + std::to_string(mmapSize) + ";") &&
+         execSchemaSQL(db, "PRAGMA " + prefix + "cache_size = " + std::to_string(cacheSize) + ";");
+}
@@ -0,0 +1,40 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#ifndef DB_SCHEMA_HPP
+#define DB_SCHEMA_HPP
+
+#include <string>
+
+#include <sqlite3.h>
+
+#include "config.hpp"
+
+// Each migration takes the schema from version - 1 to version. They are
+// applied in order, and never modified once released: schema changes go in a
+// new migration at the end of the list.
+typedef struct Migration {
+  int version;
+  const char* description;
+  const char* statement;
+} Migration;
+
+int latestSchemaVersion();
+// Returns -1 if it can't be read
+int getSchemaVersion(sqlite3* db);
+// Applies every migration newer than the DB's user_version in a single
+// transaction. Fails, leaving the DB untouched, if any of them fails or the DB
+// was created by a newer version of tgrec.
+bool migrateSchema(sqlite3* db);
+// Must run before migrateSchema, as page_size only applies to new DBs. On an
+// attached DB if schema is set.
+bool applyStartupPragmas(sqlite3* db, const DBTuningParams& params, const std::string& schema = "");
+// Logs the error, if there's one
+bool execSchemaSQL(sqlite3* db, const std::string& statement);
+// Runs a PRAGMA and returns the first column of its first row
+bool queryPragma(sqlite3* db, const std::string& pragma, std::string& result);
+
+#endif
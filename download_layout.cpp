@@ -0,0 +1,158 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#include <atomic>
+#include <cctype>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <sstream>
+#include <vector>
+
+#include <openssl/evp.h>
+#include <unistd.h>
+
+#define SPDLOG_ACTIVE_LEVEL SPDLOG_LEVEL_TRACE
+#include <spdlog/spdlog.h>
+
+#include "download_layout.hpp"
+
+// Hashes whatever is read from in, writing it to out too if it's open
+static bool hashStream(std::ifstream& in, std::ofstream* out, std::string& contentHash) {
+  unsigned char hash[EVP_MAX_MD_SIZE] = { 0 };
+  unsigned int hashLength = 0;
+  std::vector<char> block(DOWNLOAD_COPY_BLOCK_SIZE);
+  std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> ctx(EVP_MD_CTX_new(), EVP_MD_CTX_free);
+  if(!ctx || !EVP_DigestInit_ex(ctx.get(), EVP_sha256(), NULL)) {
+    return false;
+  }
+  while(in) {
+    in.read(block.data(), block.size());
+    std::streamsize read = in.gcount();
+    if(read <= 0) {
+      break;
+    }
+    if(!EVP_DigestUpdate(ctx.get(), block.data(), read)) {
+      return false;
+    }
+    if(out && !out->write(block.data(), read)) {
+      return false;
+    }
+  }
+  if(in.bad() || !EVP_DigestFinal_ex(ctx.get(), hash, &hashLength)) {
+    return false;
+  }
+
+  std::stringstream sstream;
+  sstream << std::hex << std::setfill('0');
+  for (unsigned int i = 0; i < hashLength; ++i) {
+    sstream << std::setw(2) << static_cast<unsigned int>(hash[i]);
+  }
+  contentHash = sstream.str();
+  return true;
+}
+
+std::string shardedPath(const std::string& folder, const std::string& contentHash, const std::string& extension) {
+  return (std::filesystem::path(folder) / contentHash.substr(0, 2) / contentHash.substr(2, 2) / (contentHash + extension)).string();
+}
+
+bool isShardedPath(const std::string& folder, const std::string& path) {
+  std::filesystem::path relative = std::filesystem::path(path).lexically_relative(folder);
+  std::vector<std::string> parts;
+  for(auto& part : relative) {
+    parts.push_back(part.string());
+  }
+  if(parts.size() != 3 || parts[0].size() != 2 || parts[1].size() != 2 || parts[2].compare(0, 4, parts[0] + parts[1])) {
+    return false;
+  }
+  for(char c : parts[0] + parts[1]) {
+    if(!std::isxdigit(static_cast<unsigned char>(c))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Puts the file at from in its place, or drops it if there's one already
+static bool placeSharded(const std::string& from, const std::string& to) {
+  std::error_code ec;
+  std::filesystem::create_directories(std::filesystem::path(to).parent_path(), ec);
+  if(ec) {
+    SPDLOG_ERROR("Unable to create directory for {}: {}", to, ec.message());
+    return false;
+  }
+  if(std::filesystem::exists(to, ec)) {
+    // Same hash, same contents
+    std::filesystem::remove(from, ec);
+    return true;
+  }
+  std::filesystem::rename(from, to, ec);
+  if(ec) {
+    SPDLOG_ERROR("Unable to move {} to {}: {}", from, to, ec.message());
+    return false;
+  }
+  return true;
+}
+
+bool storeSharded(const std::string& source, const std::string& folder, std::string& storedAs) {
+  std::ifstream in(source, std::ios::binary);
+  if(!in.is_open()) {
+    SPDLOG_ERROR("Unable to open {}", source);
+    return false;
+  }
+  // Copied inside the folder first, so it can be renamed into place
+  static std::atomic<std::uint64_t> incomingCounter{0};
+  std::string incoming = (std::filesystem::path(folder) / (".incoming-" + std::to_string(getpid()) + "-" + std::to_string(incomingCounter++))).string();
+  std::ofstream out(incoming, std::ios::binary | std::ios::trunc);
+  std::string contentHash;
+  bool copied = out.is_open() && hashStream(in, &out, contentHash);
+  out.close();
+  std::error_code ec;
+  if(!copied || !out.good()) {
+    SPDLOG_ERROR("Unable to copy {} to {}", source, incoming);
+    std::filesystem::remove(incoming, ec);
+    return false;
+  }
+  storedAs = shardedPath(folder, contentHash, std::filesystem::path(source).extension().string());
+  if(!placeSharded(incoming, storedAs)) {
+    std::filesystem::remove(incoming, ec);
+    return false;
+  }
+  return true;
+}
+
+bool linkToSharded(const std::string& path, const std::string& folder, std::string& storedAs) {
+  std::ifstream in(path, std::ios::binary);
+  if(!in.is_open()) {
+    SPDLOG_ERROR("Unable to open {}", path);
+    return false;
+  }
+  std::string contentHash;
+  if(!hashStream(in, nullptr, contentHash)) {
+    SPDLOG_ERROR("Unable to read {}", path);
+    return false;
+  }
+  in.close();
+  storedAs = shardedPath(folder, contentHash, std::filesystem::path(path).extension().string());
+  std::error_code ec;
+  std::filesystem::create_directories(std::filesystem::path(storedAs).parent_path(), ec);
+  if(ec) {
+    SPDLOG_ERROR("Unable to create directory for {}: {}", storedAs, ec.message());
+    return false;
+  }
+  if(std::filesystem::exists(storedAs, ec)) {
+    return true;
+  }
+  std::filesystem::create_hard_link(path, storedAs, ec);
+  if(ec) {
+    // Hard links aren't supported everywhere, fall back to a copy
+    SPDLOG_DEBUG("Unable to link {} to {}: {}", path, storedAs, ec.message());
+    return storeSharded(path, folder, storedAs);
+  }
+  return true;
+}
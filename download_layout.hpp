@@ -0,0 +1,31 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#ifndef DOWNLOAD_LAYOUT_HPP
+#define DOWNLOAD_LAYOUT_HPP
+
+#include <string>
+
+#define DOWNLOAD_LAYOUT_FLAT "flat"
+#define DOWNLOAD_LAYOUT_SHARDED "sharded"
+#define DOWNLOAD_COPY_BLOCK_SIZE 65536
+
+// In the sharded layout every file is named after the SHA-256 of its
+// contents, keeping its extension, and lives two directories deep under the
+// first two pairs of hex digits of the hash: <folder>/ab/cd/abcd...<ext>.
+// Directories stay small however many files there are, and files with the
+// same name but different contents can't collide.
+std::string shardedPath(const std::string& folder, const std::string& contentHash, const std::string& extension);
+bool isShardedPath(const std::string& folder, const std::string& path);
+// Copies source into the folder, hashing it on the way. If the folder has a
+// file with the same contents already, the copy is discarded.
+bool storeSharded(const std::string& source, const std::string& folder, std::string& storedAs);
+// Links a file that's in the folder already to where it belongs in the
+// sharded layout, unless the same contents are there already. The original
+// is left for the caller to remove once nothing refers to it.
+bool linkToSharded(const std::string& path, const std::string& folder, std::string& storedAs);
+
+#endif
@@ -0,0 +1,57 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#include "download_scheduler.hpp"
+
+DownloadScheduler::DownloadScheduler(unsigned int maxInFlight) : maxInFlight(maxInFlight) {}
+
+void DownloadScheduler::submit(const std::string& account, std::function<void()> start) {
+  this->mutex.lock();
+  if(!this->maxInFlight || this->running < this->maxInFlight) {
+    ++this->running;
+    this->mutex.unlock();
+    start();
+    return;
+  }
+  std::deque<std::function<void()>>& queue = this->queues[account];
+  if(queue.empty()) {
+    this->turns.push_back(account);
+  }
+  queue.push_back(std::move(start));
+  ++this->waiting;
+  this->mutex.unlock();
+}
+
+void DownloadScheduler::finished() {
+  this->mutex.lock();
+  if(this->turns.empty()) {
+    --this->running;
+    this->mutex.unlock();
+    return;
+  }
+  // The slot goes straight to the next account in turn
+  std::string account = this->turns.front();
+  this->turns.pop_front();
+  std::deque<std::function<void()>>& queue = this->queues[account];
+  std::function<void()> start = std::move(queue.front());
+  queue.pop_front();
+  if(!queue.empty()) {
+    this->turns.push_back(account);
+  }
+  --this->waiting;
+  this->mutex.unlock();
+  start();
+}
+
+std::size_t DownloadScheduler::queued() {
+  std::lock_guard<std::mutex> lk(this->mutex);
+  return this->waiting;
+}
+
+std::size_t DownloadScheduler::inFlight() {
+  std::lock_guard<std::mutex> lk(this->mutex);
+  return this->running;
+}
@@ -0,0 +1,44 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#ifndef DOWNLOAD_SCHEDULER_HPP
+#define DOWNLOAD_SCHEDULER_HPP
+
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+
+// Caps the downloads requested to TDLib at once, across every account
+// recorded in the process. Downloads over the cap wait in a queue per
+// account, and free slots are handed to the accounts in turn, so one account
+// catching up on a backlog of media can't hold back the others.
+class DownloadScheduler {
+  public:
+    // 0 doesn't limit them, downloads start as soon as they're submitted
+    DownloadScheduler(unsigned int maxInFlight = 0);
+    // Calls start straight away if there's a free slot, or once there's one
+    // and it's the account's turn. It's never called with the lock held, so
+    // it can submit more downloads.
+    void submit(const std::string& account, std::function<void()> start);
+    // Every download started must be finished, whether it failed or not
+    void finished();
+    std::size_t queued();
+    std::size_t inFlight();
+
+  private:
+    unsigned int maxInFlight;
+    std::size_t running{0};
+    std::size_t waiting{0};
+    std::map<std::string, std::deque<std::function<void()>>> queues;
+    // Accounts with downloads waiting, in the order they get a slot
+    std::deque<std::string> turns;
+    std::mutex mutex;
+};
+
+#endif
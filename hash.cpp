@@ -4,27 +4,30 @@
   // 
   // Distributed under BSD 3-Clause License. See LICENSE.
 
-#include <iomanip>
-#include <sstream>
-
 #include <stdint.h>
 
 #include <openssl/sha.h>
 
+#include "hash.hpp"
+
 std::string SHA256(const char* data, size_t dataLen) {
+  SHA256Buffer buffer;
+  return std::string(SHA256(data, dataLen, buffer));
+}
+
+std::string_view SHA256(const char* data, size_t dataLen, SHA256Buffer& buffer) {
+  static const char hexDigits[] = "0123456789abcdef";
   unsigned char hash[SHA256_DIGEST_LENGTH] = { 0 };
 
   SHA256_CTX ctx;
   SHA256_Init(&ctx);
   SHA256_Update(&ctx, data, dataLen);
   SHA256_Final(hash, &ctx);
-  
-  std::stringstream sstream;
-  sstream << std::hex << std::setfill('0');
 
   for (unsigned int i = 0; i < SHA256_DIGEST_LENGTH; ++i) {
-    sstream << std::setw(2) << static_cast<unsigned int>(hash[i]);
+    buffer[2 * i] = hexDigits[hash[i] >> 4];
+    buffer[2 * i + 1] = hexDigits[hash[i] & 0xf];
   }
 
-  return sstream.str();
+  return std::string_view(buffer.data(), buffer.size());
 }
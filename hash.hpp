@@ -4,4 +4,21 @@
 // 
 // Distributed under BSD 3-Clause License. See LICENSE.
 
-std::string SHA256(const char* data, size_t dataLen);
\ No newline at end of file
+#ifndef HASH_HPP
+#define HASH_HPP
+
+#include <array>
+#include <string>
+#include <string_view>
+
+// Hex encoded, two characters per byte of the digest
+#define SHA256_HEX_LENGTH 64
+
+typedef std::array<char, SHA256_HEX_LENGTH> SHA256Buffer;
+
+std::string SHA256(const char* data, size_t dataLen);
+// Same as above, into the buffer instead of a new string. The view returned is
+// valid as long as the buffer is.
+std::string_view SHA256(const char* data, size_t dataLen, SHA256Buffer& buffer);
+
+#endif
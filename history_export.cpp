@@ -0,0 +1,544 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <ctime>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sqlite3.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define SPDLOG_ACTIVE_LEVEL SPDLOG_LEVEL_TRACE
+#include <spdlog/spdlog.h>
+
+#include "db_partition.hpp"
+#include "db_schema.hpp"
+#include "history_export.hpp"
+#include "text_kernel.hpp"
+
+// Capped by SQLite to what it was built with, 2 GiB by default
+#define EXPORT_MMAP_SIZE (1LL << 40)
+// The first schema version with messages indexed by chat
+#define EXPORT_SCHEMA_VERSION 5
+
+typedef enum ColumnType {
+  COLUMN_INTEGER,
+  COLUMN_TEXT
+} ColumnType;
+
+typedef struct ExportColumn {
+  const char* name;
+  ColumnType type;
+} ExportColumn;
+
+// In the order they are selected
+static const ExportColumn columns[] = {
+  {"id", COLUMN_TEXT},
+  {"timestamp", COLUMN_INTEGER},
+  {"chat_id", COLUMN_INTEGER},
+  {"chat", COLUMN_TEXT},
+  {"sender_id", COLUMN_INTEGER},
+  {"sender", COLUMN_TEXT},
+  {"sender_username", COLUMN_TEXT},
+  {"message_type", COLUMN_INTEGER},
+  {"text", COLUMN_TEXT},
+  {"in_reply_of", COLUMN_TEXT},
+  {"forwarded_from", COLUMN_TEXT},
+  {"file_id", COLUMN_TEXT},
+  {"file", COLUMN_TEXT},
+};
+
+#define EXPORT_COLUMNS (sizeof(columns) / sizeof(columns[0]))
+// Selected after the exported ones, to read the next page after it
+#define ROWID_COLUMN EXPORT_COLUMNS
+
+// The sender is a chat when a channel or group posts as itself. Files are
+// stored by the origin ID messages refer to them with, a subquery so a file
+// stored twice doesn't export its message twice.
+static const char* selectStatement =
+  "SELECT m.id, m.timestamp, m.chat_id, c.name, m.sender_id, IFNULL(u.fullname, s.name), u.username, m.message_type, "
+    "m.message, m.in_reply_of, m.forwarded_from, m.content_file_id, "
+    "(SELECT downloaded_as FROM files WHERE origin_id = m.content_file_id LIMIT 1), m.rowid "
+  "FROM messages m "
+  "LEFT JOIN chats c ON c.chat_id = m.chat_id "
+  "LEFT JOIN users u ON u.user_id = m.sender_id "
+  "LEFT JOIN chats s ON s.chat_id = m.sender_id "
+  "WHERE m.chat_id = ?1 AND m.rowid > ?2 AND m.rowid <= ?3";
+
+typedef struct ExportOutput {
+  int fd;
+  std::mutex mutex;
+  std::uint64_t bytes{0};
+  // With a message exported, from any partition
+  std::unordered_set<std::int64_t> chats;
+} ExportOutput;
+
+// The DB itself, or each of its partitions a time range needs
+typedef struct ExportFile {
+  std::string path;
+  // Attached to partitions, for the names of chats, users and files
+  std::string catalog;
+  // The last message recorded when the export started
+  std::int64_t maxRowID{0};
+} ExportFile;
+
+typedef struct ExportJob {
+  const ExportParams& params;
+  const ExportFile& file;
+  ExportOutput& output;
+  std::vector<std::int64_t> chatIDs;
+  std::atomic<std::size_t> nextChat{0};
+  std::atomic<bool> failed{false};
+  std::atomic<std::uint64_t> messages{0};
+} ExportJob;
+
+typedef struct ExportWorker {
+  sqlite3* db{nullptr};
+  sqlite3_stmt* stmt{nullptr};
+  std::string buffer;
+  std::string compressed;
+#ifdef HAVE_ZSTD
+  ZSTD_CCtx* zstd{nullptr};
+#endif
+} ExportWorker;
+
+bool exportCompressionAvailable() {
+#ifdef HAVE_ZSTD
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool parseExportTime(const char* text, std::int64_t& timestamp) {
+  const char* end = text + strlen(text);
+  auto [ptr, ec] = std::from_chars(text, end, timestamp);
+  if(ec == std::errc() && ptr == end) {
+    return true;
+  }
+  for(const char* format : {"%Y-%m-%dT%H:%M:%S", "%Y-%m-%d"}) {
+    struct tm tm = {};
+    const char* parsed = strptime(text, format, &tm);
+    if(parsed && *parsed == '\0') {
+      timestamp = timegm(&tm);
+      return true;
+    }
+  }
+  return false;
+}
+
+void appendJSONString(std::string& out, std::string_view value) {
+  static const char hex[] = "0123456789abcdef";
+  out += '"';
+  std::size_t run = 0;
+  for(std::size_t i = 0; i < value.size(); ++i) {
+    unsigned char c = value[i];
+    if(c >= 0x20 && c != '"' && c != '\\') {
+      continue;
+    }
+    out.append(value.data() + run, i - run);
+    run = i + 1;
+    out += '\\';
+    if(c == '"' || c == '\\') {
+      out += c;
+    } else if(c == '\n') {
+      out += 'n';
+    } else if(c == '\r') {
+      out += 'r';
+    } else if(c == '\t') {
+      out += 't';
+    } else {
+      out += "u00";
+      out += hex[c >> 4];
+      out += hex[c & 0xf];
+    }
+  }
+  out.append(value.data() + run, value.size() - run);
+  out += '"';
+}
+
+void appendCSVField(std::string& out, std::string_view value) {
+  if(value.find_first_of(",\"\r\n") == std::string_view::npos) {
+    out += value;
+    return;
+  }
+  out += '"';
+  std::size_t run = 0;
+  for(std::size_t quote = value.find('"'); quote != std::string_view::npos; quote = value.find('"', quote + 1)) {
+    out.append(value.data() + run, quote + 1 - run);
+    out += '"';
+    run = quote + 1;
+  }
+  out.append(value.data() + run, value.size() - run);
+  out += '"';
+}
+
+static void appendInteger(std::string& out, std::int64_t value) {
+  char digits[24];
+  auto [end, ec] = std::to_chars(digits, digits + sizeof(digits), value);
+  out.append(digits, end - digits);
+}
+
+static void appendRow(std::string& out, sqlite3_stmt* stmt, ExportFormat format) {
+  if(format == EXPORT_JSONL) {
+    out += '{';
+  }
+  for(unsigned int i = 0; i < EXPORT_COLUMNS; ++i) {
+    if(i) {
+      out += ',';
+    }
+    if(format == EXPORT_JSONL) {
+      out += '"';
+      out += columns[i].name;
+      out += "\":";
+    }
+    if(sqlite3_column_type(stmt, i) == SQLITE_NULL) {
+      if(format == EXPORT_JSONL) {
+        out += "null";
+      }
+      continue;
+    }
+    if(columns[i].type == COLUMN_INTEGER) {
+      appendInteger(out, sqlite3_column_int64(stmt, i));
+      continue;
+    }
+    const char* text = reinterpret_cast<const char*>(sqlite3_column_text(stmt, i));
+    std::string_view value(text, sqlite3_column_bytes(stmt, i));
+    // Recorded before texts were validated
+    std::string repaired;
+    if(!scanText(value).validUTF8) {
+      repaired = repairUTF8(value);
+      value = repaired;
+    }
+    if(format == EXPORT_JSONL) {
+      appendJSONString(out, value);
+    } else {
+      appendCSVField(out, value);
+    }
+  }
+  if(format == EXPORT_JSONL) {
+    out += '}';
+  }
+  out += '\n';
+}
+
+static bool writeOutput(ExportOutput& output, const std::string& data) {
+  std::lock_guard<std::mutex> lock(output.mutex);
+  std::size_t written = 0;
+  while(written < data.size()) {
+    ssize_t n = write(output.fd, data.data() + written, data.size() - written);
+    if(n < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+      SPDLOG_ERROR("Error writing the export: {}", strerror(errno));
+      return false;
+    }
+    written += n;
+  }
+  output.bytes += written;
+  return true;
+}
+
+static bool flushWorker(ExportWorker& worker, ExportOutput& output, int zstdLevel) {
+  if(worker.buffer.empty()) {
+    return true;
+  }
+  bool ok;
+  if(zstdLevel) {
+#ifdef HAVE_ZSTD
+    worker.compressed.resize(ZSTD_compressBound(worker.buffer.size()));
+    std::size_t size = ZSTD_compressCCtx(worker.zstd, worker.compressed.data(), worker.compressed.size(),
+                                         worker.buffer.data(), worker.buffer.size(), zstdLevel);
+    if(ZSTD_isError(size)) {
+      SPDLOG_ERROR("Error compressing the export: {}", ZSTD_getErrorName(size));
+      return false;
+    }
+    worker.compressed.resize(size);
+    ok = writeOutput(output, worker.compressed);
+#else
+    ok = false;
+#endif
+  } else {
+    ok = writeOutput(output, worker.buffer);
+  }
+  worker.buffer.clear();
+  return ok;
+}
+
+static bool openDB(const std::string& path, sqlite3** db) {
+  if(sqlite3_open_v2(path.c_str(), db, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, NULL) != SQLITE_OK) {
+    SPDLOG_ERROR("Unable to open database {}: {}", path, sqlite3_errmsg(*db));
+    return false;
+  }
+  return true;
+}
+
+static bool openWorker(ExportWorker& worker, const ExportParams& params, const ExportFile& file) {
+  if(!openDB(file.path, &worker.db) || (file.catalog != "" && !attachDB(worker.db, file.catalog, "catalog"))) {
+    return false;
+  }
+  // Messages of a chat are spread all over the file, mapping as much of it as
+  // SQLite allows saves reading most pages again and again
+  if(!execSchemaSQL(worker.db, "PRAGMA mmap_size = " + std::to_string(EXPORT_MMAP_SIZE) + ";")) {
+    return false;
+  }
+  std::string statement = selectStatement;
+  if(params.since) {
+    statement += " AND m.timestamp >= " + std::to_string(params.since);
+  }
+  if(params.until) {
+    statement += " AND m.timestamp < " + std::to_string(params.until);
+  }
+  if(params.senderIDs.size()) {
+    statement += " AND m.sender_id IN (";
+    for(std::size_t i = 0; i < params.senderIDs.size(); ++i) {
+      statement += (i ? "," : "") + std::to_string(params.senderIDs[i]);
+    }
+    statement += ")";
+  }
+  statement += " ORDER BY m.rowid LIMIT ?4;";
+  if(sqlite3_prepare_v2(worker.db, statement.c_str(), -1, &worker.stmt, NULL) != SQLITE_OK) {
+    SPDLOG_ERROR("Error preparing SQL statement: {}", sqlite3_errmsg(worker.db));
+    return false;
+  }
+#ifdef HAVE_ZSTD
+  if(params.zstdLevel) {
+    worker.zstd = ZSTD_createCCtx();
+  }
+#endif
+  worker.buffer.reserve(EXPORT_FLUSH_BYTES + EXPORT_FLUSH_BYTES / 4);
+  return true;
+}
+
+static void closeWorker(ExportWorker& worker) {
+  sqlite3_finalize(worker.stmt);
+  sqlite3_close(worker.db);
+#ifdef HAVE_ZSTD
+  ZSTD_freeCCtx(worker.zstd);
+#endif
+}
+
+static void exportChats(ExportJob& job, ExportWorker& worker) {
+  const ExportParams& params = job.params;
+  while(!job.failed) {
+    std::size_t next = job.nextChat++;
+    if(next >= job.chatIDs.size()) {
+      break;
+    }
+    std::int64_t cursor = 0;
+    std::uint64_t messages = 0;
+    while(true) {
+      sqlite3_bind_int64(worker.stmt, 1, job.chatIDs[next]);
+      sqlite3_bind_int64(worker.stmt, 2, cursor);
+      sqlite3_bind_int64(worker.stmt, 3, job.file.maxRowID);
+      sqlite3_bind_int(worker.stmt, 4, params.pageRows);
+      unsigned int rows = 0;
+      int rc;
+      while((rc = sqlite3_step(worker.stmt)) == SQLITE_ROW) {
+        appendRow(worker.buffer, worker.stmt, params.format);
+        cursor = sqlite3_column_int64(worker.stmt, ROWID_COLUMN);
+        ++rows;
+      }
+      sqlite3_reset(worker.stmt);
+      if(rc != SQLITE_DONE) {
+        SPDLOG_ERROR("Error exporting chat {}: {}", job.chatIDs[next], sqlite3_errmsg(worker.db));
+        job.failed = true;
+        return;
+      }
+      messages += rows;
+      if(worker.buffer.size() >= EXPORT_FLUSH_BYTES && !flushWorker(worker, job.output, params.zstdLevel)) {
+        job.failed = true;
+        return;
+      }
+      if(rows < params.pageRows) {
+        break;
+      }
+    }
+    if(messages) {
+      job.messages += messages;
+      std::lock_guard<std::mutex> lock(job.output.mutex);
+      job.output.chats.insert(job.chatIDs[next]);
+    }
+  }
+  if(!flushWorker(worker, job.output, params.zstdLevel)) {
+    job.failed = true;
+  }
+}
+
+// Every chat with a message to export, the ones asked for if there are any
+static bool listChats(sqlite3* db, ExportJob& job) {
+  const ExportParams& params = job.params;
+  if(params.chatIDs.size()) {
+    job.chatIDs = params.chatIDs;
+    std::sort(job.chatIDs.begin(), job.chatIDs.end());
+    job.chatIDs.erase(std::unique(job.chatIDs.begin(), job.chatIDs.end()), job.chatIDs.end());
+    return true;
+  }
+  std::string statement = "SELECT DISTINCT chat_id FROM messages";
+  if(params.senderIDs.size()) {
+    statement += " WHERE sender_id IN (";
+    for(std::size_t i = 0; i < params.senderIDs.size(); ++i) {
+      statement += (i ? "," : "") + std::to_string(params.senderIDs[i]);
+    }
+    statement += ")";
+  }
+  statement += " ORDER BY chat_id;";
+  sqlite3_stmt* stmt;
+  if(sqlite3_prepare_v2(db, statement.c_str(), -1, &stmt, NULL) != SQLITE_OK) {
+    SPDLOG_ERROR("Error preparing SQL statement: {}", sqlite3_errmsg(db));
+    return false;
+  }
+  int rc;
+  while((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    job.chatIDs.push_back(sqlite3_column_int64(stmt, 0));
+  }
+  sqlite3_finalize(stmt);
+  if(rc != SQLITE_DONE) {
+    SPDLOG_ERROR("Error listing chats: {}", sqlite3_errmsg(db));
+    return false;
+  }
+  return true;
+}
+
+static bool readMaxRowID(sqlite3* db, std::int64_t& maxRowID) {
+  sqlite3_stmt* stmt;
+  if(sqlite3_prepare_v2(db, "SELECT IFNULL(MAX(rowid), 0) FROM messages;", -1, &stmt, NULL) != SQLITE_OK) {
+    SPDLOG_ERROR("Error preparing SQL statement: {}", sqlite3_errmsg(db));
+    return false;
+  }
+  bool found = sqlite3_step(stmt) == SQLITE_ROW;
+  if(found) {
+    maxRowID = sqlite3_column_int64(stmt, 0);
+  } else {
+    SPDLOG_ERROR("Error reading the last message: {}", sqlite3_errmsg(db));
+  }
+  sqlite3_finalize(stmt);
+  return found;
+}
+
+// Sealed partitions without messages in the time range are left out
+static bool listExportFiles(const ExportParams& params, std::vector<ExportFile>& files) {
+  sqlite3* db;
+  if(!openDB(params.dbFile, &db)) {
+    sqlite3_close(db);
+    return false;
+  }
+  int version = getSchemaVersion(db);
+  bool ok = version >= 0;
+  if(version > latestSchemaVersion()) {
+    SPDLOG_ERROR("DB schema version {} is newer than the latest one supported ({})", version, latestSchemaVersion());
+    ok = false;
+  } else if(ok && version < EXPORT_SCHEMA_VERSION) {
+    SPDLOG_WARN("Messages aren't indexed by chat in DB schema version {}, the export will be slow. Running tgrec once migrates the DB.", version);
+  }
+  std::vector<Partition> partitions;
+  std::vector<Partition> needed;
+  if(ok && version >= PARTITIONS_SCHEMA_VERSION) {
+    ok = listPartitions(db, 0, 0, partitions) && listPartitions(db, params.since, params.until, needed);
+  }
+  if(ok && partitions.empty()) {
+    files.push_back({params.dbFile, "", 0});
+    ok = readMaxRowID(db, files.back().maxRowID);
+  }
+  sqlite3_close(db);
+  if(!ok || partitions.empty()) {
+    return ok;
+  }
+  SPDLOG_INFO("Exporting {} of {} partitions", needed.size(), partitions.size());
+  for(Partition& partition : needed) {
+    // Messages recorded before partitioning are in the catalog itself
+    bool legacy = partition.period == DB_PARTITION_LEGACY_PERIOD;
+    files.push_back({partitionPath(params.dbFile, partition.file), legacy ? "" : params.dbFile, 0});
+    if(!openDB(files.back().path, &db) || !readMaxRowID(db, files.back().maxRowID)) {
+      sqlite3_close(db);
+      return false;
+    }
+    sqlite3_close(db);
+  }
+  return true;
+}
+
+// Exports the chats of a file, several at a time
+static bool exportFile(const ExportParams& params, const ExportFile& file, ExportOutput& output, std::uint64_t& messages) {
+  ExportJob job{params, file, output, {}};
+  unsigned int threads = std::max(params.threads, 1u);
+  std::vector<ExportWorker> workers(threads);
+  bool ok = true;
+  for(ExportWorker& worker : workers) {
+    if(!openWorker(worker, params, file)) {
+      ok = false;
+      break;
+    }
+  }
+  ok = ok && listChats(workers[0].db, job);
+  if(ok) {
+    std::vector<std::thread> running;
+    for(ExportWorker& worker : workers) {
+      running.emplace_back([&job, &worker]() { exportChats(job, worker); });
+    }
+    for(std::thread& thread : running) {
+      thread.join();
+    }
+    ok = !job.failed;
+  }
+  for(ExportWorker& worker : workers) {
+    closeWorker(worker);
+  }
+  messages += job.messages;
+  return ok;
+}
+
+bool exportHistory(const ExportParams& params, int fd, ExportStats& stats) {
+  if(params.zstdLevel && !exportCompressionAvailable()) {
+    SPDLOG_ERROR("Unable to compress the export, tgrec-export was built without zstd");
+    return false;
+  }
+  // Read before anything is exported, so messages recorded meanwhile are left
+  // out of every partition
+  std::vector<ExportFile> files;
+  if(!listExportFiles(params, files)) {
+    return false;
+  }
+  ExportOutput output;
+  output.fd = fd;
+  bool ok = true;
+  if(params.format == EXPORT_CSV) {
+    ExportWorker header;
+#ifdef HAVE_ZSTD
+    if(params.zstdLevel) {
+      header.zstd = ZSTD_createCCtx();
+    }
+#endif
+    for(unsigned int i = 0; i < EXPORT_COLUMNS; ++i) {
+      header.buffer += i ? "," : "";
+      header.buffer += columns[i].name;
+    }
+    header.buffer += '\n';
+    ok = flushWorker(header, output, params.zstdLevel);
+    closeWorker(header);
+  }
+  std::uint64_t messages = 0;
+  // One after the other, so messages of a chat stay in the order they were
+  // recorded
+  for(std::size_t i = 0; ok && i < files.size(); ++i) {
+    ok = exportFile(params, files[i], output, messages);
+  }
+  stats.messages = messages;
+  stats.chats = output.chats.size();
+  stats.bytes = output.bytes;
+  return ok;
+}
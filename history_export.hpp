@@ -0,0 +1,67 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#ifndef HISTORY_EXPORT_HPP
+#define HISTORY_EXPORT_HPP
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Messages read from the DB by each query
+#define EXPORT_PAGE_ROWS 2000
+// Output each thread holds before writing it, compressed if it's enabled
+#define EXPORT_FLUSH_BYTES (1024 * 1024)
+#define DEFAULT_EXPORT_THREADS 4
+#define DEFAULT_EXPORT_ZSTD_LEVEL 3
+
+typedef enum ExportFormat {
+  EXPORT_JSONL,
+  EXPORT_CSV
+} ExportFormat;
+
+typedef struct ExportParams {
+  std::string dbFile;
+  ExportFormat format{EXPORT_JSONL};
+  // Every chat and sender if empty
+  std::vector<std::int64_t> chatIDs;
+  std::vector<std::int64_t> senderIDs;
+  // Messages sent from since (inclusive) until until (exclusive), 0 is no limit
+  std::int64_t since{0};
+  std::int64_t until{0};
+  unsigned int threads{DEFAULT_EXPORT_THREADS};
+  unsigned int pageRows{EXPORT_PAGE_ROWS};
+  // 0 doesn't compress
+  int zstdLevel{0};
+} ExportParams;
+
+typedef struct ExportStats {
+  std::uint64_t messages{0};
+  std::uint64_t chats{0};
+  // Written to the output, after compressing
+  std::uint64_t bytes{0};
+} ExportStats;
+
+// Streams the messages recorded until it's called, joined with their chat,
+// sender and file, to fd. Each thread exports a chat at a time, reading it a
+// page at a time after the last message it read, so memory stays the same
+// however big the DB is, and no read transaction is held open for long.
+// Messages of a chat are written in the order they were recorded, but pages of
+// chats exported at the same time are interleaved. A zstd compressed output is
+// a series of frames, one per write, which any zstd decoder reads as a
+// single stream.
+bool exportHistory(const ExportParams& params, int fd, ExportStats& stats);
+// False if tgrec-export was built without zstd
+bool exportCompressionAvailable();
+// Unix timestamps, or dates as YYYY-MM-DD or YYYY-MM-DDTHH:MM:SS in UTC
+bool parseExportTime(const char* text, std::int64_t& timestamp);
+
+// Append the value quoted and escaped as needed
+void appendJSONString(std::string& out, std::string_view value);
+void appendCSVField(std::string& out, std::string_view value);
+
+#endif
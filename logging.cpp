@@ -0,0 +1,65 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+// 
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#include <chrono>
+
+#define SPDLOG_ACTIVE_LEVEL SPDLOG_LEVEL_TRACE
+#include <spdlog/spdlog.h>
+#include <spdlog/async.h>
+
+#include "logging.hpp"
+#include "metrics.hpp"
+
+static std::atomic<unsigned int> limiterMaxPerSecond{0};
+static std::atomic<unsigned int> limiterSampleEvery{1};
+
+void LogRateLimiter::configure(unsigned int maxPerSecond, unsigned int sampleEvery) {
+  limiterMaxPerSecond = maxPerSecond;
+  limiterSampleEvery = sampleEvery ? sampleEvery : 1;
+}
+
+Counter& LogRateLimiter::suppressed() {
+  static Counter& counter = metrics().counter("tgrec_logs_suppressed_total", "Log lines dropped by rate limiting or sampling");
+  return counter;
+}
+
+bool LogRateLimiter::allow() {
+  unsigned int sampleEvery = limiterSampleEvery.load(std::memory_order_relaxed);
+  if(sampleEvery > 1 && this->calls.fetch_add(1, std::memory_order_relaxed) % sampleEvery) {
+    suppressed().inc();
+    return false;
+  }
+  unsigned int maxPerSecond = limiterMaxPerSecond.load(std::memory_order_relaxed);
+  if(!maxPerSecond) {
+    return true;
+  }
+  std::int64_t now = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+  std::int64_t current = this->window.load(std::memory_order_relaxed);
+  if(current != now && this->window.compare_exchange_strong(current, now, std::memory_order_relaxed)) {
+    this->inWindow.store(0, std::memory_order_relaxed);
+  }
+  if(this->inWindow.fetch_add(1, std::memory_order_relaxed) >= maxPerSecond) {
+    suppressed().inc();
+    return false;
+  }
+  return true;
+}
+
+void enableAsyncLogging(std::size_t queueSize) {
+  std::shared_ptr<spdlog::logger> current = spdlog::default_logger();
+  spdlog::init_thread_pool(queueSize, 1);
+  std::shared_ptr<spdlog::async_logger> asyncLogger = std::make_shared<spdlog::async_logger>(
+    current->name(),
+    current->sinks().begin(),
+    current->sinks().end(),
+    spdlog::thread_pool(),
+    spdlog::async_overflow_policy::overrun_oldest
+  );
+  asyncLogger->set_level(current->level());
+  asyncLogger->flush_on(spdlog::level::err);
+  spdlog::set_default_logger(asyncLogger);
+  SPDLOG_INFO("Asynchronous logging enabled, queue size {}", queueSize);
+}
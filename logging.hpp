@@ -0,0 +1,47 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+// 
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#ifndef LOGGING_HPP
+#define LOGGING_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "metrics.hpp"
+
+// Shared by every rate limited call site: at most maxPerSecond messages per
+// second per call site (0 is unlimited), and only 1 in every sampleEvery
+// calls is considered at all
+class LogRateLimiter {
+  public:
+    bool allow();
+    static void configure(unsigned int maxPerSecond, unsigned int sampleEvery);
+    static Counter& suppressed();
+
+  private:
+    std::atomic<std::uint64_t> calls{0};
+    std::atomic<std::int64_t> window{0};
+    std::atomic<unsigned int> inWindow{0};
+};
+
+// Logs through a per call site LogRateLimiter. Use for logs that happen for
+// every message, they would otherwise dominate the ingest hot path under load
+#define TGREC_LOG_LIMITED(LEVEL, ...)                    \
+  do {                                                   \
+    static LogRateLimiter tgrecCallSiteLimiter;          \
+    if(tgrecCallSiteLimiter.allow()) {                   \
+      SPDLOG_##LEVEL(__VA_ARGS__);                       \
+    }                                                    \
+  } while(0)
+
+// Replaces the default logger with an asynchronous one writing to the same
+// sinks. Formatting and I/O happen in a dedicated thread fed through a
+// preallocated ring buffer of queueSize entries. When it's full the oldest
+// entries are dropped instead of blocking the caller.
+void enableAsyncLogging(std::size_t queueSize);
+
+#endif
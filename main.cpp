@@ -4,7 +4,9 @@
 // 
 // Distributed under BSD 3-Clause License. See LICENSE.
 
+#include <algorithm>
 #include <atomic>
+#include <ctime>
 #include <iostream>
 #include <thread>
 
@@ -18,15 +20,22 @@
 #include <spdlog/spdlog.h>
 #include <spdlog/sinks/daily_file_sink.h>
 
+#include "db_partition.hpp"
+#include "db_schema.hpp"
+#include "recorder_host.hpp"
+#include "search_index.hpp"
 #include "telegram_recorder.hpp"
 
 #define VERSION "1.0"
 
 static struct option longopts[] = {
-    { "verbose",  no_argument,  NULL, 'v'},
-    { "help",     no_argument,  NULL, 'h'},
-    { "version",  no_argument,  NULL, 'V'},
-    { NULL,       0,            NULL, 0  }
+    { "verbose", no_argument,       NULL, 'v'},
+    { "archive", no_argument,       NULL, 'a'},
+    { "search",  required_argument, NULL, 's'},
+    { "limit",   required_argument, NULL, 'l'},
+    { "help",    no_argument,       NULL, 'h'},
+    { "version", no_argument,       NULL, 'V'},
+    { NULL,      0,                 NULL, 0  }
 };
 
 void printVersion(const char* argv) {
@@ -34,14 +43,136 @@ void printVersion(const char* argv) {
 }
 
 void printHelp(const char* argv, bool longVersion = true) {
-    std::cout << argv << "  [-v --verbose | -h --help | -V --version]" << std::endl;
+    std::cout << argv << "  [-v --verbose | -a --archive | -s --search QUERY [-l --limit N] | -h --help | -V --version]" << std::endl;
     if(longVersion) {
         std::cout << " -v | --verbose Increase log level to DEBUG" << std::endl;
+        std::cout << " -a | --archive Record the whole history of every chat, then exit" << std::endl;
+        std::cout << " -s | --search  Print the recorded messages that best match the query, then exit" << std::endl;
+        std::cout << " -l | --limit   Maximum number of search results (default " << DEFAULT_SEARCH_LIMIT << ")" << std::endl;
         std::cout << " -h | --help    Show this help" << std::endl;
         std::cout << " -V | --version Show current program version" << std::endl;
     }
 }
 
+template<class Recorder>
+void record(Recorder& recorder, bool archive, sigset_t& sigset) {
+  SPDLOG_INFO("Starting Telegram Recorder...");
+  recorder.start();
+  if(archive) {
+    recorder.startArchive();
+  }
+
+  // Wait until SIGINT or SIGTERM is pending (generated but not delivered),
+  // reloading the chat filters on every SIGHUP
+  int sig;
+  struct timespec pollInterval = {1, 0};
+  while(true) {
+    if(archive) {
+      // or until every chat is archived
+      if(recorder.archiveFinished()) {
+        break;
+      }
+      sig = sigtimedwait(&sigset, NULL, &pollInterval);
+      if(sig < 0) {
+        if(errno != EAGAIN && errno != EINTR) {
+          SPDLOG_ERROR("Error calling sigtimedwait: {}",  strerror(errno));
+          break;
+        }
+        continue;
+      }
+    } else if(sigwait(&sigset, &sig)) {
+      SPDLOG_ERROR("Error calling sigwait: {}",  strerror(errno));
+      break;
+    }
+    if(sig != SIGHUP) {
+      break;
+    }
+    SPDLOG_INFO("Reloading chat filters");
+    recorder.reloadChatFilters();
+  }
+
+  SPDLOG_INFO("Stopping Telegram Recorder...");
+  recorder.stop();
+}
+
+static bool openReadOnly(const std::string& dbFile, sqlite3** db) {
+  if(sqlite3_open_v2(dbFile.c_str(), db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+    SPDLOG_ERROR("Unable to open database {}: {}", dbFile, sqlite3_errmsg(*db));
+    sqlite3_close(*db);
+    return false;
+  }
+  return true;
+}
+
+// Searches each partition on its own, with the catalog attached for the
+// chat and sender names, and keeps the best matches of all of them
+bool searchPartitions(const std::string& dbFile, const std::string& query, unsigned int limit, std::vector<SearchResult>& results) {
+  sqlite3* db;
+  if(!openReadOnly(dbFile, &db)) {
+    return false;
+  }
+  std::vector<Partition> partitions;
+  bool ok = getSchemaVersion(db) < PARTITIONS_SCHEMA_VERSION || listPartitions(db, 0, 0, partitions);
+  if(!ok || partitions.empty()) {
+    ok = ok && searchMessages(db, query, limit, results);
+    sqlite3_close(db);
+    return ok;
+  }
+  sqlite3_close(db);
+  for(Partition& partition : partitions) {
+    std::string path = partitionPath(dbFile, partition.file);
+    if(!openReadOnly(path, &db)) {
+      return false;
+    }
+    if(partition.period == DB_PARTITION_LEGACY_PERIOD || attachDB(db, dbFile, "catalog")) {
+      if(searchIndexExists(db)) {
+        ok = searchMessages(db, query, limit, results);
+      } else {
+        SPDLOG_WARN("Partition {} has no search index, skipping it", partition.file);
+      }
+    } else {
+      ok = false;
+    }
+    sqlite3_close(db);
+    if(!ok) {
+      return false;
+    }
+  }
+  std::stable_sort(results.begin(), results.end(), [](const SearchResult& a, const SearchResult& b) { return a.rank < b.rank; });
+  if(results.size() > limit) {
+    results.resize(limit);
+  }
+  return true;
+}
+
+// Searches the DB of every account, without starting any of them
+int search(const ConfigParams& config, const std::string& query, unsigned int limit) {
+  std::vector<std::pair<std::string, std::string>> dbs;
+  if(config.accounts.empty()) {
+    dbs.emplace_back("", config.dbFile);
+  }
+  for(const AccountParams& account : config.accounts) {
+    dbs.emplace_back(account.name, account.dbFile);
+  }
+  for(auto& [account, dbFile] : dbs) {
+    std::vector<SearchResult> results;
+    if(!searchPartitions(dbFile, query, limit, results)) {
+      return 1;
+    }
+    if(account != "") {
+      std::cout << "== " << account << " (" << results.size() << " results)" << std::endl;
+    }
+    for(SearchResult& result : results) {
+      char date[32];
+      struct tm tm;
+      time_t timestamp = result.timestamp;
+      strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime_r(&timestamp, &tm));
+      std::cout << date << " [" << result.chatName << "] " << result.senderName << " (" << result.messageID << "): " << result.snippet << std::endl;
+    }
+  }
+  return 0;
+}
+
 int main(int argc, char** argv) {
   // info - 2022-06-18 00:58:54 +01:00 [main.cpp:105 main() TID:156399] whatever
   spdlog::set_pattern("%l - %Y-%m-%d %H:%M:%S %z [%s:%# %!() TID:%t] %^%v%$");
@@ -50,8 +181,12 @@ int main(int argc, char** argv) {
 
   int longIndex = 0;
   int c;
+  bool archive = false;
+  bool searching = false;
+  std::string query;
+  unsigned int limit = DEFAULT_SEARCH_LIMIT;
 
-  while ((c = getopt_long(argc, argv, "Vhv", longopts, &longIndex)) != -1) {
+  while ((c = getopt_long(argc, argv, "Vhvas:l:", longopts, &longIndex)) != -1) {
     if(c == 'V') {
       printVersion(argv[0]);
       return 0;
@@ -61,6 +196,13 @@ int main(int argc, char** argv) {
     } else if(c == 'v') {
       spdlog::default_logger_raw()->set_level(spdlog::level::debug);
       SPDLOG_DEBUG("Verbose mode enabled");
+    } else if(c == 'a') {
+      archive = true;
+    } else if(c == 's') {
+      searching = true;
+      query = optarg;
+    } else if(c == 'l') {
+      limit = strtoul(optarg, NULL, 10);
     } else {
       SPDLOG_ERROR("Unrecognised argument: {}",  argv[optind-1]);
       printHelp(argv[0], false);
@@ -73,25 +215,34 @@ int main(int argc, char** argv) {
     return 1;
   }
 
-  SPDLOG_INFO("Starting Telegram Recorder...");
-  TelegramRecorder recorder;
-  recorder.start();
-
-  // Block SIGINT and SIGTERM from executing the default disposition (terminate)
+  // Block SIGINT, SIGTERM and SIGHUP from executing the default disposition
+  // (terminate), before starting any thread so they all inherit the mask
   sigset_t sigset;
   sigemptyset(&sigset);
   sigaddset(&sigset, SIGINT);
   sigaddset(&sigset, SIGTERM);
+  sigaddset(&sigset, SIGHUP);
   sigprocmask(SIG_BLOCK, &sigset, NULL);
 
-  // Wait until one of the signals is pending (generated but not delivered)
-  int sig;
-  if(sigwait(&sigset, &sig)) {
-    SPDLOG_ERROR("Error calling sigwait: {}",  strerror(errno));
+  ConfigParams config;
+  if(!loadConfig(DEFAULT_CONFIG_FILE, config)) {
+    SPDLOG_ERROR("Unable to load configuration file");
+    return 1;
+  }
+  if(searching) {
+    int status = search(config, query, limit);
+    spdlog::shutdown();
+    return status;
+  }
+  if(config.accounts.size()) {
+    RecorderHost host(nullptr, config);
+    record(host, archive, sigset);
+  } else {
+    TelegramRecorder recorder;
+    record(recorder, archive, sigset);
   }
-
-  SPDLOG_INFO("Stopping Telegram Recorder...");
-  recorder.stop();
 
   SPDLOG_INFO("Terminating...");
+  // Flushes anything still queued if logging is asynchronous
+  spdlog::shutdown();
 }
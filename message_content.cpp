@@ -0,0 +1,247 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#include <array>
+#include <cstdint>
+#include <initializer_list>
+
+#include <td/telegram/td_api.hpp>
+
+#include "message_content.hpp"
+
+// Slots of the dispatch table, a power of two at least twice the number of
+// content types handled, so lookups rarely probe more than one slot
+#define CONTENT_TABLE_BITS 7
+#define CONTENT_TABLE_SIZE (1 << CONTENT_TABLE_BITS)
+
+typedef void (*ContentExtractor)(td_api::MessageContent& content, MessageContentInfo& info);
+
+typedef struct ContentHandler {
+  std::int32_t contentType;
+  ContentExtractor extract;
+} ContentHandler;
+
+static const std::string& captionText(td_api::object_ptr<td_api::formattedText>& caption) {
+  static const std::string empty;
+  return caption ? caption->text_ : empty;
+}
+
+static td_api::file* largestPhoto(td_api::array<td_api::object_ptr<td_api::photoSize>>& photoSizes) {
+  td_api::file* largest = nullptr;
+  std::int64_t largestSize = -1;
+  for(td_api::object_ptr<td_api::photoSize>& photoSize : photoSizes) {
+    std::int64_t picSize = static_cast<std::int64_t>(photoSize->height_) * photoSize->width_;
+    if(picSize > largestSize) {
+      largestSize = picSize;
+      largest = photoSize->photo_.get();
+    }
+  }
+  return largest;
+}
+
+// Text put together from several fields
+static void setComposedText(MessageContentInfo& info) {
+  info.text = info.composedText;
+}
+
+static void readAsMedia(MessageContentInfo& info, td_api::int32 duration) {
+  info.readAs = CONTENT_READ_MEDIA;
+  info.durationSec = duration;
+}
+
+// One overload per content type handled, picked by contentHandler<T>()
+static void extractContent(td_api::messageText& content, MessageContentInfo& info) {
+  info.text = captionText(content.text_);
+  info.readAs = CONTENT_READ_WORDS;
+}
+
+static void extractContent(td_api::messagePhoto& content, MessageContentInfo& info) {
+  info.text = captionText(content.caption_);
+  info.file = largestPhoto(content.photo_->sizes_);
+  info.readAs = CONTENT_READ_PHOTO;
+}
+
+static void extractContent(td_api::messageVideo& content, MessageContentInfo& info) {
+  info.text = captionText(content.caption_);
+  info.file = content.video_->video_.get();
+  readAsMedia(info, content.video_->duration_);
+}
+
+static void extractContent(td_api::messageDocument& content, MessageContentInfo& info) {
+  info.text = captionText(content.caption_);
+  info.file = content.document_->document_.get();
+}
+
+static void extractContent(td_api::messageVoiceNote& content, MessageContentInfo& info) {
+  info.text = captionText(content.caption_);
+  info.file = content.voice_note_->voice_.get();
+  readAsMedia(info, content.voice_note_->duration_);
+}
+
+static void extractContent(td_api::messageVideoNote& content, MessageContentInfo& info) {
+  info.file = content.video_note_->video_.get();
+  readAsMedia(info, content.video_note_->duration_);
+}
+
+static void extractContent(td_api::messageAnimation& content, MessageContentInfo& info) {
+  info.text = captionText(content.caption_);
+  info.file = content.animation_->animation_.get();
+  readAsMedia(info, content.animation_->duration_);
+}
+
+// Without a caption, the track is what the message says
+static void extractContent(td_api::messageAudio& content, MessageContentInfo& info) {
+  info.text = captionText(content.caption_);
+  if(info.text == "" && (content.audio_->performer_ != "" || content.audio_->title_ != "")) {
+    info.composedText = content.audio_->performer_ + " - " + content.audio_->title_;
+    setComposedText(info);
+  }
+  info.file = content.audio_->audio_.get();
+  readAsMedia(info, content.audio_->duration_);
+}
+
+static void extractContent(td_api::messageSticker& content, MessageContentInfo& info) {
+  info.text = content.sticker_->emoji_;
+  info.file = content.sticker_->sticker_.get();
+  info.readAs = CONTENT_READ_PHOTO;
+}
+
+static void extractContent(td_api::messageAnimatedEmoji& content, MessageContentInfo& info) {
+  info.text = content.emoji_;
+}
+
+static void extractContent(td_api::messageDice& content, MessageContentInfo& info) {
+  info.composedText = content.emoji_ + " " + std::to_string(content.value_);
+  setComposedText(info);
+}
+
+static void extractContent(td_api::messageLocation& content, MessageContentInfo& info) {
+  info.composedText = std::to_string(content.location_->latitude_) + "," + std::to_string(content.location_->longitude_);
+  setComposedText(info);
+}
+
+static void extractContent(td_api::messageVenue& content, MessageContentInfo& info) {
+  td_api::venue& venue = *content.venue_;
+  info.composedText = venue.title_ + "\n" + venue.address_;
+  if(venue.location_) {
+    info.composedText += "\n" + std::to_string(venue.location_->latitude_) + "," + std::to_string(venue.location_->longitude_);
+  }
+  setComposedText(info);
+  info.readAs = CONTENT_READ_WORDS;
+}
+
+static void extractContent(td_api::messageContact& content, MessageContentInfo& info) {
+  td_api::contact& contact = *content.contact_;
+  info.composedText = (contact.last_name_ == "" ? contact.first_name_ : contact.first_name_ + " " + contact.last_name_) + "\n" + contact.phone_number_;
+  setComposedText(info);
+  info.readAs = CONTENT_READ_WORDS;
+}
+
+// The question, then each option on its own line
+static void extractContent(td_api::messagePoll& content, MessageContentInfo& info) {
+  info.composedText = content.poll_->question_;
+  for(td_api::object_ptr<td_api::pollOption>& option : content.poll_->options_) {
+    info.composedText += "\n" + option->text_;
+  }
+  setComposedText(info);
+  info.readAs = CONTENT_READ_WORDS;
+}
+
+static void extractContent(td_api::messageGame& content, MessageContentInfo& info) {
+  const std::string& text = captionText(content.game_->text_);
+  if(text != "") {
+    info.composedText = content.game_->title_ + "\n" + text;
+    setComposedText(info);
+  } else {
+    info.text = content.game_->title_;
+  }
+  info.readAs = CONTENT_READ_WORDS;
+}
+
+static void extractContent(td_api::messageChatChangeTitle& content, MessageContentInfo& info) {
+  info.text = content.title_;
+}
+
+static void extractContent(td_api::messageChatChangePhoto& content, MessageContentInfo& info) {
+  info.file = largestPhoto(content.photo_->sizes_);
+  info.readAs = CONTENT_READ_PHOTO;
+}
+
+static void extractContent(td_api::messageBasicGroupChatCreate& content, MessageContentInfo& info) {
+  info.text = content.title_;
+}
+
+static void extractContent(td_api::messageSupergroupChatCreate& content, MessageContentInfo& info) {
+  info.text = content.title_;
+}
+
+static void extractContent(td_api::messageCustomServiceAction& content, MessageContentInfo& info) {
+  info.text = content.text_;
+}
+
+template<class T>
+constexpr ContentHandler contentHandler() {
+  return ContentHandler{T::ID, [](td_api::MessageContent& content, MessageContentInfo& info) {
+    extractContent(static_cast<T&>(content), info);
+  }};
+}
+
+// Content type IDs are arbitrary 32-bit constants, spread over the table by
+// Fibonacci hashing
+constexpr std::size_t contentSlot(std::int32_t contentType) {
+  return (static_cast<std::uint32_t>(contentType) * 2654435769u) >> (32 - CONTENT_TABLE_BITS);
+}
+
+// An open addressing hash table, with linear probing
+template<class... Contents>
+constexpr std::array<ContentHandler, CONTENT_TABLE_SIZE> makeContentTable() {
+  static_assert(sizeof...(Contents) * 2 <= CONTENT_TABLE_SIZE, "CONTENT_TABLE_BITS is too small for the content types handled");
+  std::array<ContentHandler, CONTENT_TABLE_SIZE> table{};
+  for(const ContentHandler& handler : {contentHandler<Contents>()...}) {
+    std::size_t slot = contentSlot(handler.contentType);
+    while(table[slot].extract) {
+      slot = (slot + 1) % CONTENT_TABLE_SIZE;
+    }
+    table[slot] = handler;
+  }
+  return table;
+}
+
+// The remaining content types, mostly service messages like members joining
+// or a screenshot being taken, carry nothing to record besides their type
+static constexpr std::array<ContentHandler, CONTENT_TABLE_SIZE> contentTable = makeContentTable<
+  td_api::messageText,
+  td_api::messagePhoto,
+  td_api::messageVideo,
+  td_api::messageDocument,
+  td_api::messageVoiceNote,
+  td_api::messageVideoNote,
+  td_api::messageAnimation,
+  td_api::messageAudio,
+  td_api::messageSticker,
+  td_api::messageAnimatedEmoji,
+  td_api::messageDice,
+  td_api::messageLocation,
+  td_api::messageVenue,
+  td_api::messageContact,
+  td_api::messagePoll,
+  td_api::messageGame,
+  td_api::messageChatChangeTitle,
+  td_api::messageChatChangePhoto,
+  td_api::messageBasicGroupChatCreate,
+  td_api::messageSupergroupChatCreate,
+  td_api::messageCustomServiceAction
+>();
+
+void getMessageContentInfo(td_api::MessageContent& content, MessageContentInfo& info) {
+  std::int32_t contentType = content.get_id();
+  for(std::size_t slot = contentSlot(contentType); contentTable[slot].extract; slot = (slot + 1) % CONTENT_TABLE_SIZE) {
+    if(contentTable[slot].contentType == contentType) {
+      contentTable[slot].extract(content, info);
+      break;
+    }
+  }
+}
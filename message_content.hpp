@@ -0,0 +1,50 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#ifndef MESSAGE_CONTENT_HPP
+#define MESSAGE_CONTENT_HPP
+
+#include <string>
+#include <string_view>
+
+#include <td/telegram/td_api.h>
+
+namespace td_api = td::td_api;
+
+// How long the reader takes to read a message
+// A fixed second
+#define CONTENT_READ_DEFAULT 0
+// Depends on the number of words of its text
+#define CONTENT_READ_WORDS 1
+// Its duration
+#define CONTENT_READ_MEDIA 2
+// photo_read_speed_sec
+#define CONTENT_READ_PHOTO 3
+
+// Everything the recorder takes from the content of a message. It points into
+// the message, so it's only valid as long as the message is, and it can't be
+// copied since text may point into composedText.
+typedef struct MessageContentInfo {
+  MessageContentInfo() = default;
+  MessageContentInfo(const MessageContentInfo&) = delete;
+  MessageContentInfo& operator=(const MessageContentInfo&) = delete;
+  // The text or caption, or a description of content that has neither, like
+  // the question and options of a poll or the coordinates of a location
+  std::string_view text;
+  // Holds the description when it has to be put together from several fields
+  std::string composedText;
+  // The file to download, if there's any
+  td_api::file* file{nullptr};
+  int readAs{CONTENT_READ_DEFAULT};
+  double durationSec{0};
+} MessageContentInfo;
+
+// Looks the content type up in a table generated at compile time, and
+// extracts it all at once. Content types the recorder knows nothing about
+// leave info empty.
+void getMessageContentInfo(td_api::MessageContent& content, MessageContentInfo& info);
+
+#endif
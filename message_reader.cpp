@@ -4,45 +4,35 @@
 // 
 // Distributed under BSD 3-Clause License. See LICENSE.
 
+#include <algorithm>
 #include <chrono>
 #include <random>
 #include <thread>
 #include <vector>
 
 #include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
 
 #define SPDLOG_ACTIVE_LEVEL SPDLOG_LEVEL_TRACE
 #include <spdlog/spdlog.h>
 
+#include "read_scheduler.hpp"
 #include "telegram_data.hpp"
 #include "telegram_recorder.hpp"
-
-unsigned int getNumberOfWordsInString(std::string& text) {
-  unsigned int numWords = 0;
-  std::size_t found = text.find(' ');
-  while (found!=std::string::npos) {
-    numWords++;
-    found = text.find(' ', found+1);
-  }
-  return numWords;
-}
+#include "text_kernel.hpp"
+#include "text_utils.hpp"
 
 double getMessageReadTime(std::shared_ptr<td_api::message>& message, ConfigParams& config) {
-  if(message->content_->get_id() == td_api::messageText::ID) {
-    td_api::messageText& msgText = static_cast<td_api::messageText&>(*message->content_);
-    return getNumberOfWordsInString(msgText.text_->text_) * 60 / config.humanParams.textReadSpeedWPM;
-  } else if(message->content_->get_id() == td_api::messageVideo::ID) {
-    td_api::messageVideo& msgVideo = static_cast<td_api::messageVideo&>(*message->content_);
-    return static_cast<double>(msgVideo.video_->duration_);
-  } else if(message->content_->get_id() == td_api::messagePhoto::ID) {
-    return config.humanParams.photoReadSpeedSec;
-  } else if(message->content_->get_id() == td_api::messageVoiceNote::ID) {
-    td_api::messageVoiceNote& voice = static_cast<td_api::messageVoiceNote&>(*message->content_);
-    return voice.voice_note_->duration_;
-  } else if(message->content_->get_id() == td_api::messageVideoNote::ID) {
-    td_api::messageVideoNote& video = static_cast<td_api::messageVideoNote&>(*message->content_);
-    return video.video_note_->duration_;
+  MessageContentInfo info;
+  getMessageContentInfo(*message->content_, info);
+  switch(info.readAs) {
+    case CONTENT_READ_WORDS:
+      return scanText(info.text).words * 60 / config.humanParams.textReadSpeedWPM;
+    case CONTENT_READ_MEDIA:
+      return info.durationSec;
+    case CONTENT_READ_PHOTO:
+      return config.humanParams.photoReadSpeedSec;
   }
   return 1.0;
 }
@@ -55,42 +45,118 @@ void TelegramRecorder::runMessageReader() {
     this->config.humanParams.readMsgFrequencyMean,
     this->config.humanParams.readMsgFrequencyStdDev
   );
+  // An Active Period shouldn't take longer than the Inactive Period that
+  // follows, otherwise the backlog never clears under sustained load. Each
+  // pass is paced to fit in this budget, and no new pass starts once it's
+  // spent: under steady traffic there's always something new to read.
+  double activePeriodBudget = std::max(this->config.humanParams.readMsgFrequencyMean, this->config.humanParams.readMsgMinWaitSec);
   while(!this->exitFlag.load()) {
     double nextActivityPeriod = distribution(generator);
     if(nextActivityPeriod < this->config.humanParams.readMsgMinWaitSec) {
       nextActivityPeriod = this->config.humanParams.readMsgMinWaitSec;
     }
     SPDLOG_DEBUG("Waiting {:0.3f} seconds until reading messages...", nextActivityPeriod);
-    std::this_thread::sleep_for(std::chrono::milliseconds(static_cast<int>(nextActivityPeriod * 1000)));
+    if(this->sleepUntilExit(std::chrono::steady_clock::now() + std::chrono::milliseconds(static_cast<int>(nextActivityPeriod * 1000)))) {
+      break;
+    }
     SPDLOG_INFO("Reading messages...");
-    while(this->toReadMessageQueue.size()) {
+    auto activePeriodStart = std::chrono::steady_clock::now();
+    std::uint64_t readThisPeriod = 0;
+    auto activePeriodEnd = activePeriodStart + std::chrono::milliseconds(static_cast<long>(activePeriodBudget * 1000));
+    while(!this->exitFlag.load() && (activePeriodBudget <= 0 || std::chrono::steady_clock::now() < activePeriodEnd)) {
+      // Take the current backlog out of the queue, anything arriving while
+      // reading is picked up on the next pass, or the next Active Period
+      std::map<td_api::int53, std::vector<std::shared_ptr<td_api::message>>> backlog;
       this->toReadQueueMutex.lock();
-      std::vector<td_api::int53> chats;
-      for(auto it = this->toReadMessageQueue.begin(); it != this->toReadMessageQueue.end(); ++it) {
-        std::cerr << it->first << " ";
-        chats.push_back(it->first);
+      backlog.swap(this->toReadMessageQueue);
+      this->recorderMetrics.readQueueMessages->set(0);
+      // Still pending as far as getReaderStats() is concerned
+      for(auto it = backlog.begin(); it != backlog.end(); ++it) {
+        this->readerPassUnread += it->second.size();
+        for(auto& message : it->second) {
+          if(!this->readerPassOldestDate || message->date_ < this->readerPassOldestDate) {
+            this->readerPassOldestDate = message->date_;
+          }
+        }
       }
-      std::cerr << std::endl;
       this->toReadQueueMutex.unlock();
-      for(td_api::int53& chat : chats) {
-        this->toReadQueueMutex.lock();
-        td_api::object_ptr<td::td_api::openChat> openChat = td_api::make_object<td_api::openChat>();
-        openChat->chat_id_ = chat;
-        this->sendQuery(std::move(openChat), checkAPICallSuccess("openChat"));
-        for(auto& message : this->toReadMessageQueue[chat]) {
-          double timeToRead = getMessageReadTime(message, this->config);
-          this->markMessageAsRead(message);
-          std::this_thread::sleep_for(std::chrono::milliseconds(static_cast<int>(timeToRead * 1000)));
+      if(!backlog.size()) {
+        break;
+      }
+
+      ReadScheduler scheduler(this->config.humanParams.readMaxOpenChats, activePeriodBudget);
+      for(auto it = backlog.begin(); it != backlog.end(); ++it) {
+        std::vector<double> readTimes;
+        for(auto& message : it->second) {
+          readTimes.push_back(getMessageReadTime(message, this->config));
+        }
+        scheduler.addChat(it->first, std::move(readTimes));
+      }
+      std::vector<ReadEvent> events = scheduler.plan();
+      SPDLOG_DEBUG("Reading {} chats, {} at a time, pacing factor {:0.3f}", backlog.size(), this->config.humanParams.readMaxOpenChats, scheduler.getPacingFactor());
+
+      auto passStart = std::chrono::steady_clock::now();
+      for(ReadEvent& event : events) {
+        if(this->sleepUntilExit(passStart + std::chrono::milliseconds(static_cast<long>(event.offsetSec * 1000)))) {
+          break;
+        }
+        // Opening and closing a chat again is harmless too, and they would
+        // fail on a client that's restarting and isn't authorized yet
+        if(event.type == READ_EVENT_OPEN_CHAT) {
+          this->sendIdempotentQuery([chatID = event.chatID]() {
+            td_api::object_ptr<td::td_api::openChat> openChat = td_api::make_object<td_api::openChat>();
+            openChat->chat_id_ = chatID;
+            return openChat;
+          }, checkAPICallSuccess("openChat"));
+        } else if(event.type == READ_EVENT_READ_MESSAGE) {
+          this->markMessageAsRead(backlog[event.chatID][event.messageIndex]);
+          this->toReadQueueMutex.lock();
+          --this->readerPassUnread;
+          this->toReadQueueMutex.unlock();
+          ++readThisPeriod;
+          ++this->readerMessagesRead;
+          this->recorderMetrics.messagesRead->inc();
+        } else {
+          this->sendIdempotentQuery([chatID = event.chatID]() {
+            td_api::object_ptr<td::td_api::closeChat> closeChat = td_api::make_object<td_api::closeChat>();
+            closeChat->chat_id_ = chatID;
+            return closeChat;
+          }, checkAPICallSuccess("closeChat"));
         }
-        td_api::object_ptr<td::td_api::closeChat> closeChat = td_api::make_object<td_api::closeChat>();
-        closeChat->chat_id_ = chat;
-        this->sendQuery(std::move(closeChat), checkAPICallSuccess("closeChat"));
-        this->toReadMessageQueue.erase(chat);
-        this->toReadQueueMutex.unlock();
       }
+      // Messages left unread on exit are dropped along with the pass
+      this->toReadQueueMutex.lock();
+      this->readerPassUnread = 0;
+      this->readerPassOldestDate = 0;
+      this->toReadQueueMutex.unlock();
+    }
+    double activePeriodSec = std::chrono::duration<double>(std::chrono::steady_clock::now() - activePeriodStart).count();
+    if(activePeriodSec > 0) {
+      this->readerDrainRate = readThisPeriod / activePeriodSec;
     }
-    SPDLOG_INFO("Finished reading messages!");
+    SPDLOG_INFO("Finished reading messages! Read {} messages in {:0.1f} seconds", readThisPeriod, activePeriodSec);
+  }
+}
+
+ReaderStats TelegramRecorder::getReaderStats() {
+  ReaderStats stats = {this->readerMessagesRead.load(), this->readerDrainRate.load(), 0, 0.0};
+  this->toReadQueueMutex.lock();
+  // The oldest message of a pass is only known to be read once it's over
+  td_api::int32 oldestDate = this->readerPassUnread ? this->readerPassOldestDate : 0;
+  stats.pendingMessages = this->readerPassUnread;
+  for(auto it = this->toReadMessageQueue.begin(); it != this->toReadMessageQueue.end(); ++it) {
+    stats.pendingMessages += it->second.size();
+    for(auto& message : it->second) {
+      if(!oldestDate || message->date_ < oldestDate) {
+        oldestDate = message->date_;
+      }
+    }
+  }
+  this->toReadQueueMutex.unlock();
+  if(oldestDate) {
+    stats.backlogAgeSec = std::max(0.0, difftime(time(0), oldestDate));
   }
+  return stats;
 }
 
 void TelegramRecorder::enqueueMessageToRead(std::shared_ptr<td_api::message>& message) {
@@ -100,14 +166,20 @@ void TelegramRecorder::enqueueMessageToRead(std::shared_ptr<td_api::message>& me
     this->toReadMessageQueue[message->chat_id_] = std::vector<std::shared_ptr<td_api::message>>();
   }
   this->toReadMessageQueue[message->chat_id_].push_back(message);
+  this->recorderMetrics.readQueueMessages->add(1);
   this->toReadQueueMutex.unlock();
 }
 
 void TelegramRecorder::markMessageAsRead(std::shared_ptr<td_api::message>& message) {
   SPDLOG_DEBUG("Marking message {} from chat {} as read", message->id_, message->chat_id_);
-  td_api::object_ptr<td::td_api::viewMessages> viewMessages = td_api::make_object<td_api::viewMessages>();
-  viewMessages->chat_id_ = message->chat_id_;
-  std::vector<td_api::int53> messages = {message->id_};
-  viewMessages->message_ids_ = std::move(messages);
-  this->sendQuery(std::move(viewMessages), checkAPICallSuccess("viewMessages"));
+  // Viewing a message twice is harmless, so a message read while the client
+  // restarts is still marked as read once it's back
+  this->sendIdempotentQuery([chatID = message->chat_id_, messageID = message->id_]() {
+    td_api::object_ptr<td::td_api::viewMessages> viewMessages = td_api::make_object<td_api::viewMessages>();
+    viewMessages->chat_id_ = chatID;
+    std::vector<td_api::int53> messages = {messageID};
+    viewMessages->message_ids_ = std::move(messages);
+    return viewMessages;
+  }, checkAPICallSuccess("viewMessages"));
+  this->tracer.stamp(getCompoundMessageID(message->chat_id_, message->id_), TRACE_READ);
 }
\ No newline at end of file
@@ -0,0 +1,204 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+// 
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#include <algorithm>
+#include <vector>
+
+#include <fmt/format.h>
+
+#define SPDLOG_ACTIVE_LEVEL SPDLOG_LEVEL_TRACE
+#include <spdlog/spdlog.h>
+
+#include "message_tracer.hpp"
+
+static const char* stageNames[TRACE_NUM_STAGES] = {"received", "enqueued", "committed", "downloaded", "read"};
+
+MessageTracer::MessageTracer(MetricsRegistry& registry, std::chrono::seconds maxAge) :
+  registry(registry),
+  droppedTraces(registry.counter("tgrec_message_traces_dropped_total", "Messages not traced because too many traces were in flight")),
+  abandonedTraces(registry.counter("tgrec_message_traces_abandoned_total", "Traces dropped before the message went through the whole pipeline")),
+  durableLatency(registry.histogram("tgrec_message_durable_seconds", "Latency from receiving a message until it's committed to the DB", "", 1e-6)),
+  epoch(std::chrono::steady_clock::now()),
+  maxAgeMicros(std::chrono::duration_cast<std::chrono::microseconds>(maxAge).count()) {}
+
+MessageTracer::~MessageTracer() {
+  this->closeTraceLog();
+}
+
+std::int64_t MessageTracer::now() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - this->epoch).count();
+}
+
+Histogram& MessageTracer::stageLatency(std::int32_t contentType, TraceStage from, TraceStage to) {
+  auto key = std::make_pair(contentType, static_cast<int>(from * TRACE_NUM_STAGES + to));
+  auto it = this->histograms.find(key);
+  if(it == this->histograms.end()) {
+    Histogram* h = &this->registry.histogram(
+      "tgrec_message_stage_seconds",
+      "Latency between consecutive pipeline stages of a message",
+      fmt::format("from=\"{}\",to=\"{}\",content_type_id=\"{}\"", stageNames[from], stageNames[to], contentType),
+      1e-6
+    );
+    it = this->histograms.emplace(key, h).first;
+  }
+  return *it->second;
+}
+
+Histogram& MessageTracer::endToEndLatency(std::int32_t contentType) {
+  auto key = std::make_pair(contentType, -1);
+  auto it = this->histograms.find(key);
+  if(it == this->histograms.end()) {
+    Histogram* h = &this->registry.histogram(
+      "tgrec_message_end_to_end_seconds",
+      "Latency from receiving a message until it's durable, downloaded and read",
+      fmt::format("content_type_id=\"{}\"", contentType),
+      1e-6
+    );
+    it = this->histograms.emplace(key, h).first;
+  }
+  return *it->second;
+}
+
+// Must be called with tracerMutex held
+void MessageTracer::evictStale(std::int64_t t) {
+  for(auto it = this->inFlight.begin(); it != this->inFlight.end();) {
+    if(t - it->second.stamps[TRACE_RECEIVED] >= this->maxAgeMicros) {
+      it = this->inFlight.erase(it);
+      this->abandonedTraces.inc();
+    } else {
+      ++it;
+    }
+  }
+  this->lastEviction = t;
+}
+
+void MessageTracer::begin(const std::string& messageID, std::int32_t contentType, bool hasFile) {
+  std::lock_guard<std::mutex> lk(this->tracerMutex);
+  std::int64_t t = this->now();
+  if(this->inFlight.size() >= MAX_TRACES_IN_FLIGHT || t - this->lastEviction >= std::min<std::int64_t>(this->maxAgeMicros, TRACE_EVICTION_INTERVAL_SEC * 1000000LL)) {
+    this->evictStale(t);
+  }
+  if(this->inFlight.size() >= MAX_TRACES_IN_FLIGHT) {
+    this->droppedTraces.inc();
+    return;
+  }
+  MessageTrace trace = {contentType, hasFile, 0, {}};
+  for(int i = 0; i < TRACE_NUM_STAGES; ++i) {
+    trace.stamps[i] = -1;
+  }
+  trace.stamps[TRACE_RECEIVED] = t;
+  ++this->tracesBegun;
+  if(this->sampleEvery && this->tracesBegun % this->sampleEvery == 0) {
+    trace.sampleID = this->tracesBegun;
+  }
+  this->inFlight[messageID] = trace;
+}
+
+void MessageTracer::stamp(const std::string& messageID, TraceStage stage) {
+  std::lock_guard<std::mutex> lk(this->tracerMutex);
+  auto it = this->inFlight.find(messageID);
+  if(it == this->inFlight.end()) {
+    // Not traced (e.g. a profile picture download, or a dropped trace)
+    return;
+  }
+  MessageTrace& trace = it->second;
+  if(trace.stamps[stage] != -1) {
+    return;
+  }
+  std::int64_t t = this->now();
+  int previous = TRACE_RECEIVED;
+  for(int i = 0; i < TRACE_NUM_STAGES; ++i) {
+    if(trace.stamps[i] > trace.stamps[previous]) {
+      previous = i;
+    }
+  }
+  trace.stamps[stage] = t;
+  this->stageLatency(trace.contentType, static_cast<TraceStage>(previous), stage).record(t - trace.stamps[previous]);
+  if(stage == TRACE_COMMITTED) {
+    this->durableLatency.record(t - trace.stamps[TRACE_RECEIVED]);
+  }
+  this->finishIfComplete(it, t);
+}
+
+void MessageTracer::skipDownload(const std::string& messageID) {
+  std::lock_guard<std::mutex> lk(this->tracerMutex);
+  auto it = this->inFlight.find(messageID);
+  if(it == this->inFlight.end() || !it->second.hasFile) {
+    return;
+  }
+  it->second.hasFile = false;
+  this->finishIfComplete(it, this->now());
+}
+
+void MessageTracer::abandon(const std::string& messageID) {
+  std::lock_guard<std::mutex> lk(this->tracerMutex);
+  if(this->inFlight.erase(messageID)) {
+    this->abandonedTraces.inc();
+  }
+}
+
+// Must be called with tracerMutex held
+void MessageTracer::finishIfComplete(std::unordered_map<std::string, MessageTrace>::iterator it, std::int64_t t) {
+  MessageTrace& trace = it->second;
+  bool complete = trace.stamps[TRACE_COMMITTED] != -1 && trace.stamps[TRACE_READ] != -1 && (!trace.hasFile || trace.stamps[TRACE_DOWNLOADED] != -1);
+  if(!complete) {
+    return;
+  }
+  this->endToEndLatency(trace.contentType).record(t - trace.stamps[TRACE_RECEIVED]);
+  if(trace.sampleID && this->traceLog.is_open()) {
+    this->writeTrace(it->first, trace);
+  }
+  this->inFlight.erase(it);
+}
+
+void MessageTracer::writeTrace(const std::string& messageID, MessageTrace& trace) {
+  // One row per message, one complete ("X") event per stage, lasting from
+  // the previous stamp until this one
+  std::vector<std::pair<std::int64_t, int>> stamps;
+  for(int stage = TRACE_ENQUEUED; stage < TRACE_NUM_STAGES; ++stage) {
+    if(trace.stamps[stage] != -1) {
+      stamps.push_back(std::make_pair(trace.stamps[stage], stage));
+    }
+  }
+  std::sort(stamps.begin(), stamps.end());
+  std::int64_t previous = trace.stamps[TRACE_RECEIVED];
+  for(auto& stamp : stamps) {
+    this->traceLog << (this->firstTraceEvent ? "" : ",\n") << fmt::format(
+      "{{\"name\":\"{}\",\"cat\":\"{}\",\"ph\":\"X\",\"ts\":{},\"dur\":{},\"pid\":1,\"tid\":{},\"args\":{{\"message\":\"{}\"}}}}",
+      stageNames[stamp.second], trace.contentType, previous, stamp.first - previous, trace.sampleID, messageID
+    );
+    this->firstTraceEvent = false;
+    previous = stamp.first;
+  }
+}
+
+bool MessageTracer::openTraceLog(const std::string& path, unsigned int sampleEvery) {
+  std::lock_guard<std::mutex> lk(this->tracerMutex);
+  this->traceLog.open(path, std::ios::out | std::ios::trunc);
+  if(!this->traceLog.is_open()) {
+    SPDLOG_ERROR("Unable to open trace log {}", path);
+    return false;
+  }
+  this->traceLog << "[\n";
+  this->sampleEvery = sampleEvery ? sampleEvery : 1;
+  this->firstTraceEvent = true;
+  SPDLOG_INFO("Writing 1 in {} message traces to {}", this->sampleEvery, path);
+  return true;
+}
+
+void MessageTracer::closeTraceLog() {
+  std::lock_guard<std::mutex> lk(this->tracerMutex);
+  if(this->traceLog.is_open()) {
+    this->traceLog << "\n]\n";
+    this->traceLog.close();
+  }
+  this->sampleEvery = 0;
+}
+
+std::size_t MessageTracer::tracesInFlight() {
+  std::lock_guard<std::mutex> lk(this->tracerMutex);
+  return this->inFlight.size();
+}
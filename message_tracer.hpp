@@ -0,0 +1,88 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+// 
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#ifndef MESSAGE_TRACER_HPP
+#define MESSAGE_TRACER_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include "metrics.hpp"
+
+#define MAX_TRACES_IN_FLIGHT 100000
+// Traces still in flight this long after the message was received are
+// dropped, as some stage they wait for is never going to happen
+#define MAX_TRACE_AGE_SEC 3600
+#define TRACE_EVICTION_INTERVAL_SEC 60
+
+typedef enum TraceStage {
+  TRACE_RECEIVED,
+  TRACE_ENQUEUED,
+  TRACE_COMMITTED,
+  TRACE_DOWNLOADED,
+  TRACE_READ,
+  TRACE_NUM_STAGES
+} TraceStage;
+
+// Follows every ingested message through the pipeline. Each stamp records the
+// latency since the previous stamp of the same message, per content type, the
+// latency until the message is durable, and the end to end latency once the
+// message is durable, downloaded and read.
+// A sample of the traces can be written in Chrome trace-event format.
+class MessageTracer {
+  public:
+    MessageTracer(MetricsRegistry& registry, std::chrono::seconds maxAge = std::chrono::seconds(MAX_TRACE_AGE_SEC));
+    ~MessageTracer();
+    void begin(const std::string& messageID, std::int32_t contentType, bool hasFile);
+    void stamp(const std::string& messageID, TraceStage stage);
+    // The message's file won't be downloaded, e.g. it's stored already, so
+    // the trace completes without it
+    void skipDownload(const std::string& messageID);
+    // Drops the trace of a message that won't go through the rest of the
+    // pipeline, e.g. its download or its commit failed
+    void abandon(const std::string& messageID);
+    bool openTraceLog(const std::string& path, unsigned int sampleEvery);
+    void closeTraceLog();
+    std::size_t tracesInFlight();
+
+  private:
+    typedef struct MessageTrace {
+      std::int32_t contentType;
+      bool hasFile;
+      std::uint64_t sampleID;
+      std::int64_t stamps[TRACE_NUM_STAGES];
+    } MessageTrace;
+
+    std::int64_t now();
+    void finishIfComplete(std::unordered_map<std::string, MessageTrace>::iterator it, std::int64_t t);
+    void evictStale(std::int64_t t);
+    Histogram& stageLatency(std::int32_t contentType, TraceStage from, TraceStage to);
+    Histogram& endToEndLatency(std::int32_t contentType);
+    void writeTrace(const std::string& messageID, MessageTrace& trace);
+
+    MetricsRegistry& registry;
+    Counter& droppedTraces;
+    Counter& abandonedTraces;
+    Histogram& durableLatency;
+    std::chrono::steady_clock::time_point epoch;
+    std::int64_t maxAgeMicros;
+    std::int64_t lastEviction{0};
+    std::mutex tracerMutex;
+    std::unordered_map<std::string, MessageTrace> inFlight;
+    std::map<std::pair<std::int32_t, int>, Histogram*> histograms;
+    std::ofstream traceLog;
+    unsigned int sampleEvery{0};
+    std::uint64_t tracesBegun{0};
+    bool firstTraceEvent{true};
+};
+
+#endif
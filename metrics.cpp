@@ -0,0 +1,177 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+// 
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#include <fstream>
+
+#include <fmt/format.h>
+
+#include "metrics.hpp"
+
+std::string joinLabels(const std::string& labels, const std::string& extra) {
+  if(labels == "") {
+    return "{" + extra + "}";
+  }
+  return "{" + labels + "," + extra + "}";
+}
+
+std::string wrapLabels(const std::string& labels) {
+  return labels == "" ? "" : "{" + labels + "}";
+}
+
+void Counter::render(std::string& out, const std::string& name, const std::string& labels) {
+  out += fmt::format("{}{} {}\n", name, wrapLabels(labels), this->get());
+}
+
+void Gauge::render(std::string& out, const std::string& name, const std::string& labels) {
+  out += fmt::format("{}{} {}\n", name, wrapLabels(labels), this->get());
+}
+
+unsigned int Histogram::bucketIndex(std::uint64_t value) {
+  if(value < HISTOGRAM_SUB_BUCKETS) {
+    return value;
+  }
+  if(value >> HISTOGRAM_MAX_VALUE_BITS) {
+    return HISTOGRAM_NUM_BUCKETS - 1;
+  }
+  unsigned int exponent = 63 - __builtin_clzll(value);
+  unsigned int subBucket = (value >> (exponent - HISTOGRAM_SUB_BUCKET_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1);
+  return (exponent - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKETS + subBucket;
+}
+
+std::uint64_t Histogram::bucketUpperBound(unsigned int index) {
+  if(index < HISTOGRAM_SUB_BUCKETS) {
+    return index;
+  }
+  unsigned int exponent = index / HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKET_BITS - 1;
+  std::uint64_t subBucket = index % HISTOGRAM_SUB_BUCKETS;
+  std::uint64_t width = std::uint64_t(1) << (exponent - HISTOGRAM_SUB_BUCKET_BITS);
+  return ((HISTOGRAM_SUB_BUCKETS + subBucket) << (exponent - HISTOGRAM_SUB_BUCKET_BITS)) + width - 1;
+}
+
+void Histogram::record(std::uint64_t value) {
+  this->buckets[bucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+  this->accumulated.fetch_add(value, std::memory_order_relaxed);
+}
+
+std::uint64_t Histogram::count() {
+  // Not kept as a separate atomic to save one read-modify-write per record()
+  std::uint64_t total = 0;
+  for(unsigned int i = 0; i < HISTOGRAM_NUM_BUCKETS; ++i) {
+    total += this->buckets[i].load(std::memory_order_relaxed);
+  }
+  return total;
+}
+
+std::uint64_t Histogram::sum() {
+  return this->accumulated.load(std::memory_order_relaxed);
+}
+
+std::uint64_t Histogram::percentile(double q) {
+  std::uint64_t target = static_cast<std::uint64_t>(q * this->count());
+  std::uint64_t seen = 0;
+  unsigned int last = 0;
+  for(unsigned int i = 0; i < HISTOGRAM_NUM_BUCKETS; ++i) {
+    std::uint64_t inBucket = this->buckets[i].load(std::memory_order_relaxed);
+    if(!inBucket) {
+      continue;
+    }
+    last = i;
+    seen += inBucket;
+    if(seen > target) {
+      return bucketUpperBound(i);
+    }
+  }
+  return bucketUpperBound(last);
+}
+
+void Histogram::render(std::string& out, const std::string& name, const std::string& labels) {
+  for(const char* q : {"0.5", "0.9", "0.99", "0.999"}) {
+    out += fmt::format("{}{} {}\n", name, joinLabels(labels, fmt::format("quantile=\"{}\"", q)), this->percentile(std::stod(q)) * this->scale);
+  }
+  out += fmt::format("{}_sum{} {}\n", name, wrapLabels(labels), this->sum() * this->scale);
+  out += fmt::format("{}_count{} {}\n", name, wrapLabels(labels), this->count());
+}
+
+Metric* MetricsRegistry::find(const std::string& name, const std::string& labels) {
+  auto family = this->families.find(name);
+  if(family == this->families.end()) {
+    return NULL;
+  }
+  auto series = family->second.series.find(labels);
+  if(series == family->second.series.end()) {
+    return NULL;
+  }
+  return series->second.get();
+}
+
+void MetricsRegistry::add(const std::string& name, const std::string& help, const std::string& type, const std::string& labels, Metric* metric) {
+  MetricFamily& family = this->families[name];
+  family.help = help;
+  family.type = type;
+  family.series[labels] = std::unique_ptr<Metric>(metric);
+}
+
+Counter& MetricsRegistry::counter(const std::string& name, const std::string& help, const std::string& labels) {
+  std::lock_guard<std::mutex> lk(this->registryMutex);
+  Metric* metric = this->find(name, labels);
+  if(!metric) {
+    metric = new Counter;
+    this->add(name, help, "counter", labels, metric);
+  }
+  return *static_cast<Counter*>(metric);
+}
+
+Gauge& MetricsRegistry::gauge(const std::string& name, const std::string& help, const std::string& labels) {
+  std::lock_guard<std::mutex> lk(this->registryMutex);
+  Metric* metric = this->find(name, labels);
+  if(!metric) {
+    metric = new Gauge;
+    this->add(name, help, "gauge", labels, metric);
+  }
+  return *static_cast<Gauge*>(metric);
+}
+
+Histogram& MetricsRegistry::histogram(const std::string& name, const std::string& help, const std::string& labels, double scale) {
+  std::lock_guard<std::mutex> lk(this->registryMutex);
+  Metric* metric = this->find(name, labels);
+  if(!metric) {
+    metric = new Histogram(scale);
+    this->add(name, help, "summary", labels, metric);
+  }
+  return *static_cast<Histogram*>(metric);
+}
+
+std::string MetricsRegistry::render() {
+  std::lock_guard<std::mutex> lk(this->registryMutex);
+  std::string out;
+  for(auto& family : this->families) {
+    out += fmt::format("# HELP {} {}\n", family.first, family.second.help);
+    out += fmt::format("# TYPE {} {}\n", family.first, family.second.type);
+    for(auto& series : family.second.series) {
+      series.second->render(out, family.first, series.first);
+    }
+  }
+  return out;
+}
+
+MetricsRegistry& metrics() {
+  static MetricsRegistry registry;
+  return registry;
+}
+
+ProcessStats processStats() {
+  ProcessStats stats = {0, 0};
+  std::ifstream status("/proc/self/status");
+  std::string line;
+  while(std::getline(status, line)) {
+    if(line.rfind("VmRSS:", 0) == 0) {
+      stats.residentBytes = std::stoull(line.substr(6)) * 1024;
+    } else if(line.rfind("Threads:", 0) == 0) {
+      stats.threads = std::stoul(line.substr(8));
+    }
+  }
+  return stats;
+}
@@ -0,0 +1,115 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+// 
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+// Histogram buckets are log-linear (HDR style): values below
+// HISTOGRAM_SUB_BUCKETS are exact, after that every power of two is split in
+// HISTOGRAM_SUB_BUCKETS linear buckets, which keeps the relative error of any
+// percentile under 1/HISTOGRAM_SUB_BUCKETS
+#define HISTOGRAM_SUB_BUCKET_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_MAX_VALUE_BITS 48
+#define HISTOGRAM_NUM_BUCKETS ((HISTOGRAM_MAX_VALUE_BITS - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+class Metric {
+  public:
+    virtual ~Metric() = default;
+    virtual void render(std::string& out, const std::string& name, const std::string& labels) = 0;
+};
+
+class Counter : public Metric {
+  public:
+    void inc(std::uint64_t n = 1) { this->value.fetch_add(n, std::memory_order_relaxed); }
+    std::uint64_t get() { return this->value.load(std::memory_order_relaxed); }
+    void render(std::string& out, const std::string& name, const std::string& labels) override;
+
+  private:
+    std::atomic<std::uint64_t> value{0};
+};
+
+class Gauge : public Metric {
+  public:
+    void set(double v) { this->value.store(v, std::memory_order_relaxed); }
+    void add(double n) {
+      double current = this->value.load(std::memory_order_relaxed);
+      while(!this->value.compare_exchange_weak(current, current + n, std::memory_order_relaxed));
+    }
+    double get() { return this->value.load(std::memory_order_relaxed); }
+    void render(std::string& out, const std::string& name, const std::string& labels) override;
+
+  private:
+    std::atomic<double> value{0.0};
+};
+
+class Histogram : public Metric {
+  public:
+    // scale converts recorded integer units to the exported unit, e.g. 1e-6
+    // to export microsecond recordings as seconds
+    Histogram(double scale) : scale(scale) {};
+    void record(std::uint64_t value);
+    std::uint64_t count();
+    std::uint64_t sum();
+    std::uint64_t percentile(double q);
+    void render(std::string& out, const std::string& name, const std::string& labels) override;
+
+    static unsigned int bucketIndex(std::uint64_t value);
+    static std::uint64_t bucketUpperBound(unsigned int index);
+
+  private:
+    std::atomic<std::uint64_t> buckets[HISTOGRAM_NUM_BUCKETS] = {};
+    std::atomic<std::uint64_t> accumulated{0};
+    double scale;
+};
+
+// Registering a metric takes a lock and must be done out of the hot path,
+// keep the returned reference around. Updating a metric is lock-free.
+class MetricsRegistry {
+  public:
+    Counter& counter(const std::string& name, const std::string& help, const std::string& labels = "");
+    Gauge& gauge(const std::string& name, const std::string& help, const std::string& labels = "");
+    Histogram& histogram(const std::string& name, const std::string& help, const std::string& labels = "", double scale = 1.0);
+    // Prometheus text exposition format
+    std::string render();
+
+  private:
+    typedef struct MetricFamily {
+      std::string help;
+      std::string type;
+      std::map<std::string, std::unique_ptr<Metric>> series;
+    } MetricFamily;
+
+    Metric* find(const std::string& name, const std::string& labels);
+    void add(const std::string& name, const std::string& help, const std::string& type, const std::string& labels, Metric* metric);
+
+    std::mutex registryMutex;
+    std::map<std::string, MetricFamily> families;
+};
+
+MetricsRegistry& metrics();
+
+typedef struct ProcessStats {
+  std::uint64_t residentBytes;
+  unsigned int threads;
+} ProcessStats;
+
+// Read from /proc/self/status, left at 0 where it's not available
+ProcessStats processStats();
+
+inline std::uint64_t elapsedMicros(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+#endif
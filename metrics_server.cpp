@@ -0,0 +1,139 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+// 
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define SPDLOG_ACTIVE_LEVEL SPDLOG_LEVEL_TRACE
+#include <spdlog/spdlog.h>
+
+#include "metrics_server.hpp"
+
+#define METRICS_POLL_TIMEOUT_MS 500
+
+MetricsServer::~MetricsServer() {
+  this->stop();
+}
+
+bool MetricsServer::listenTCP(int port) {
+  this->listenFD = socket(AF_INET, SOCK_STREAM, 0);
+  if(this->listenFD == -1) {
+    SPDLOG_ERROR("Unable to create metrics socket: {}", strerror(errno));
+    return false;
+  }
+  int reuse = 1;
+  setsockopt(this->listenFD, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if(bind(this->listenFD, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) || listen(this->listenFD, 8)) {
+    SPDLOG_ERROR("Unable to listen for metrics on 127.0.0.1:{}: {}", port, strerror(errno));
+    close(this->listenFD);
+    this->listenFD = -1;
+    return false;
+  }
+  SPDLOG_INFO("Serving metrics on 127.0.0.1:{}", port);
+  this->serverThread = std::thread(&MetricsServer::run, this);
+  return true;
+}
+
+bool MetricsServer::listenUnix(const std::string& path) {
+  struct sockaddr_un addr;
+  if(path.size() >= sizeof(addr.sun_path)) {
+    SPDLOG_ERROR("Metrics socket path is too long: {}", path);
+    return false;
+  }
+  this->listenFD = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(this->listenFD == -1) {
+    SPDLOG_ERROR("Unable to create metrics socket: {}", strerror(errno));
+    return false;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  unlink(path.c_str());
+  if(bind(this->listenFD, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) || listen(this->listenFD, 8)) {
+    SPDLOG_ERROR("Unable to listen for metrics on {}: {}", path, strerror(errno));
+    close(this->listenFD);
+    this->listenFD = -1;
+    return false;
+  }
+  this->socketPath = path;
+  SPDLOG_INFO("Serving metrics on {}", path);
+  this->serverThread = std::thread(&MetricsServer::run, this);
+  return true;
+}
+
+void MetricsServer::stop() {
+  this->exitFlag = true;
+  if(this->serverThread.joinable()) {
+    this->serverThread.join();
+  }
+  if(this->listenFD != -1) {
+    close(this->listenFD);
+    this->listenFD = -1;
+  }
+  if(this->socketPath != "") {
+    unlink(this->socketPath.c_str());
+    this->socketPath = "";
+  }
+}
+
+void MetricsServer::run() {
+  SPDLOG_DEBUG("Metrics server thread started");
+  struct pollfd pfd = {this->listenFD, POLLIN, 0};
+  while(!this->exitFlag.load()) {
+    int rc = poll(&pfd, 1, METRICS_POLL_TIMEOUT_MS);
+    if(rc <= 0) {
+      if(rc == -1 && errno != EINTR) {
+        SPDLOG_ERROR("Error polling metrics socket: {}", strerror(errno));
+        return;
+      }
+      continue;
+    }
+    int clientFD = accept(this->listenFD, NULL, NULL);
+    if(clientFD == -1) {
+      SPDLOG_WARN("Unable to accept metrics connection: {}", strerror(errno));
+      continue;
+    }
+    this->serveClient(clientFD);
+    close(clientFD);
+  }
+  SPDLOG_DEBUG("Metrics server stopped");
+}
+
+void MetricsServer::serveClient(int clientFD) {
+  // The request itself is irrelevant, every path returns the metrics. Just
+  // wait until the client has sent something so it's ready to read the reply
+  char request[1024];
+  struct pollfd pfd = {clientFD, POLLIN, 0};
+  if(poll(&pfd, 1, METRICS_POLL_TIMEOUT_MS) > 0) {
+    recv(clientFD, request, sizeof(request), 0);
+  }
+
+  std::string body = this->render();
+  std::string response = "HTTP/1.0 200 OK\r\n"
+                         "Content-Type: text/plain; version=0.0.4\r\n"
+                         "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                         "\r\n" + body;
+  std::size_t sent = 0;
+  while(sent < response.size()) {
+    ssize_t n = send(clientFD, response.c_str() + sent, response.size() - sent, MSG_NOSIGNAL);
+    if(n <= 0) {
+      SPDLOG_WARN("Unable to send metrics: {}", strerror(errno));
+      return;
+    }
+    sent += n;
+  }
+}
@@ -0,0 +1,36 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+// 
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#ifndef METRICS_SERVER_HPP
+#define METRICS_SERVER_HPP
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+
+// Minimal HTTP/1.0 endpoint answering every request with the rendered
+// metrics. Listens either on 127.0.0.1:port or on a Unix socket.
+class MetricsServer {
+  public:
+    MetricsServer(std::function<std::string()> render) : render(render) {};
+    ~MetricsServer();
+    bool listenTCP(int port);
+    bool listenUnix(const std::string& path);
+    void stop();
+
+  private:
+    void run();
+    void serveClient(int clientFD);
+
+    std::function<std::string()> render;
+    std::atomic<bool> exitFlag{false};
+    std::thread serverThread;
+    std::string socketPath;
+    int listenFD{-1};
+};
+
+#endif
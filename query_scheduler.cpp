@@ -0,0 +1,165 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#include <algorithm>
+#include <cstdlib>
+
+#include "query_scheduler.hpp"
+
+int parseRetryAfter(std::int32_t code, const std::string& message) {
+  std::size_t pos = message.find("retry after ");
+  if(pos != std::string::npos) {
+    return std::atoi(message.c_str() + pos + 12);
+  }
+  pos = message.find("FLOOD_WAIT_");
+  if(pos != std::string::npos) {
+    return std::atoi(message.c_str() + pos + 11);
+  }
+  if(code == 429) {
+    return QUERY_DEFAULT_FLOOD_WAIT_SEC;
+  }
+  return -1;
+}
+
+QueryScheduler::QueryScheduler(double bulkPerSec) : bulk(makeBucket(bulkPerSec)) {}
+
+// Starts full, and holds up to a second's worth of tokens
+QueryScheduler::TokenBucket QueryScheduler::makeBucket(double perSec) {
+  return TokenBucket{perSec, std::max(1.0, perSec), Clock::time_point()};
+}
+
+bool QueryScheduler::hasToken(TokenBucket& bucket, Clock::time_point now) {
+  if(bucket.perSec <= 0) {
+    return true;
+  }
+  double elapsedSec = std::chrono::duration<double>(now - bucket.refilled).count();
+  if(elapsedSec > 0) {
+    bucket.tokens = std::min(std::max(1.0, bucket.perSec), bucket.tokens + elapsedSec * bucket.perSec);
+    bucket.refilled = now;
+  }
+  return bucket.tokens >= 1;
+}
+
+QueryScheduler::Clock::time_point QueryScheduler::tokenAt(TokenBucket& bucket, Clock::time_point now) {
+  if(hasToken(bucket, now)) {
+    return now;
+  }
+  return bucket.refilled + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>((1 - bucket.tokens) / bucket.perSec));
+}
+
+void QueryScheduler::setMethodLimit(std::int32_t method, double perSec, bool sharedLimit) {
+  MethodState& state = this->method(method, QUERY_PRIORITY_BULK);
+  state.bucket = makeBucket(perSec);
+  state.sharedLimit = sharedLimit;
+}
+
+QueryScheduler::MethodState& QueryScheduler::method(std::int32_t method, int priority) {
+  auto it = this->methods.find(method);
+  if(it == this->methods.end()) {
+    it = this->methods.emplace(method, MethodState{priority, true, makeBucket(0), Clock::time_point(), {}}).first;
+  }
+  it->second.priority = priority;
+  return it->second;
+}
+
+bool QueryScheduler::sharesBulk(MethodState& state) {
+  return state.priority == QUERY_PRIORITY_BULK && state.sharedLimit;
+}
+
+bool QueryScheduler::available(MethodState& state, Clock::time_point now) {
+  if(now < state.pausedUntil || !hasToken(state.bucket, now)) {
+    return false;
+  }
+  return !this->sharesBulk(state) || hasToken(this->bulk, now);
+}
+
+void QueryScheduler::take(MethodState& state) {
+  if(state.bucket.perSec > 0) {
+    state.bucket.tokens -= 1;
+  }
+  if(this->sharesBulk(state) && this->bulk.perSec > 0) {
+    this->bulk.tokens -= 1;
+  }
+}
+
+bool QueryScheduler::admit(std::uint64_t id, std::int32_t method, int priority, Clock::time_point now) {
+  if(priority == QUERY_PRIORITY_CONTROL) {
+    return true;
+  }
+  MethodState& state = this->method(method, priority);
+  // Queries of the method that are waiting go first
+  if(!state.queue.empty() || !this->available(state, now)) {
+    state.queue.push_back(id);
+    ++this->queuedQueries;
+    return false;
+  }
+  this->take(state);
+  return true;
+}
+
+void QueryScheduler::retryAfter(std::uint64_t id, std::int32_t method, int priority, double seconds, Clock::time_point now) {
+  MethodState& state = this->method(method, priority);
+  state.pausedUntil = std::max(state.pausedUntil, now + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds)));
+  state.queue.push_front(id);
+  ++this->queuedQueries;
+}
+
+std::vector<std::uint64_t> QueryScheduler::due(Clock::time_point now) {
+  std::vector<std::uint64_t> ready;
+  if(!this->queuedQueries) {
+    return ready;
+  }
+  for(int priority = QUERY_PRIORITY_CONTROL; priority <= QUERY_PRIORITY_BULK; ++priority) {
+    // One query of each method at a time, so none of them starves the rest
+    // of the shared bucket
+    bool progress = true;
+    while(progress) {
+      progress = false;
+      for(auto& entry : this->methods) {
+        MethodState& state = entry.second;
+        if(state.priority != priority || state.queue.empty() || !this->available(state, now)) {
+          continue;
+        }
+        this->take(state);
+        ready.push_back(state.queue.front());
+        state.queue.pop_front();
+        --this->queuedQueries;
+        progress = true;
+      }
+    }
+  }
+  return ready;
+}
+
+QueryScheduler::Clock::time_point QueryScheduler::nextDue(Clock::time_point now) {
+  Clock::time_point next = Clock::time_point::max();
+  if(!this->queuedQueries) {
+    return next;
+  }
+  for(auto& entry : this->methods) {
+    MethodState& state = entry.second;
+    if(state.queue.empty()) {
+      continue;
+    }
+    Clock::time_point at = std::max(state.pausedUntil, tokenAt(state.bucket, now));
+    if(this->sharesBulk(state)) {
+      at = std::max(at, tokenAt(this->bulk, now));
+    }
+    next = std::min(next, at);
+  }
+  return next;
+}
+
+std::size_t QueryScheduler::queued() {
+  return this->queuedQueries;
+}
+
+void QueryScheduler::clear() {
+  for(auto& entry : this->methods) {
+    entry.second.queue.clear();
+  }
+  this->queuedQueries = 0;
+}
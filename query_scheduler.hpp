@@ -0,0 +1,90 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#ifndef QUERY_SCHEDULER_HPP
+#define QUERY_SCHEDULER_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+// Never held back, besides being the first ones sent once the method is
+// allowed again after a flood wait
+#define QUERY_PRIORITY_CONTROL 0
+// Only held back by flood waits, and sent ahead of bulk queries
+#define QUERY_PRIORITY_INTERACTIVE 1
+// Paced by token buckets, per method and all together
+#define QUERY_PRIORITY_BULK 2
+// Used when Telegram asks to slow down without saying for how long
+#define QUERY_DEFAULT_FLOOD_WAIT_SEC 1
+
+// Seconds Telegram asked to wait before sending the query again, from a
+// "Too Many Requests: retry after N" (429) or "FLOOD_WAIT_N" error, or -1 if
+// the error isn't one of those
+int parseRetryAfter(std::int32_t code, const std::string& message);
+
+// Decides when each query is sent to TDLib. Queries are identified by their
+// request ID and grouped by method (the TDLib function ID). Bulk queries
+// take a token from their method's bucket, if it has one, and unless their
+// method is kept out of it, from the bucket shared by all bulk methods.
+// Queries that can't get their tokens wait in a queue per method, in order.
+// A flood wait holds a whole method back until it's over. Not thread safe,
+// the caller must serialize access.
+class QueryScheduler {
+  public:
+    typedef std::chrono::steady_clock Clock;
+
+    // Bulk queries per second across all methods, 0 doesn't limit them
+    QueryScheduler(double bulkPerSec = 0);
+    // Paces a bulk method on its own, and unless it's kept out of it, with
+    // the rest of them too
+    void setMethodLimit(std::int32_t method, double perSec, bool sharedLimit = true);
+    // True if the query can be sent now, otherwise it's queued
+    bool admit(std::uint64_t id, std::int32_t method, int priority, Clock::time_point now);
+    // Queues a query Telegram turned down, ahead of the rest of its method,
+    // and holds the method back for the given seconds
+    void retryAfter(std::uint64_t id, std::int32_t method, int priority, double seconds, Clock::time_point now);
+    // Queries that can be sent now, highest priority first
+    std::vector<std::uint64_t> due(Clock::time_point now);
+    // When the next queued query can be sent, Clock::time_point::max() if
+    // there's none
+    Clock::time_point nextDue(Clock::time_point now);
+    std::size_t queued();
+    // Drops every queued query, keeping the buckets and flood waits
+    void clear();
+
+  private:
+    typedef struct TokenBucket {
+      double perSec;
+      double tokens;
+      Clock::time_point refilled;
+    } TokenBucket;
+
+    typedef struct MethodState {
+      int priority;
+      bool sharedLimit;
+      TokenBucket bucket;
+      Clock::time_point pausedUntil;
+      std::deque<std::uint64_t> queue;
+    } MethodState;
+
+    static TokenBucket makeBucket(double perSec);
+    static bool hasToken(TokenBucket& bucket, Clock::time_point now);
+    static Clock::time_point tokenAt(TokenBucket& bucket, Clock::time_point now);
+    MethodState& method(std::int32_t method, int priority);
+    bool sharesBulk(MethodState& state);
+    bool available(MethodState& state, Clock::time_point now);
+    void take(MethodState& state);
+
+    TokenBucket bulk;
+    std::map<std::int32_t, MethodState> methods;
+    std::size_t queuedQueries{0};
+};
+
+#endif
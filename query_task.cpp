@@ -0,0 +1,83 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#include <mutex>
+#include <new>
+#include <vector>
+
+#include "query_task.hpp"
+
+typedef struct FramePoolState {
+  std::mutex mutex;
+  std::vector<void*> freeFrames[FRAME_POOL_MAX_FRAME_SIZE / FRAME_POOL_GRANULARITY];
+  std::size_t cached{0};
+} FramePoolState;
+
+// Never destroyed, frames can still be released while the process exits
+static FramePoolState& poolState() {
+  static FramePoolState* state = new FramePoolState;
+  return *state;
+}
+
+void* FramePool::allocate(std::size_t size) {
+  if(size > FRAME_POOL_MAX_FRAME_SIZE) {
+    return ::operator new(size);
+  }
+  std::size_t sizeClass = (size + FRAME_POOL_GRANULARITY - 1) / FRAME_POOL_GRANULARITY - 1;
+  FramePoolState& state = poolState();
+  {
+    std::lock_guard<std::mutex> lk(state.mutex);
+    std::vector<void*>& frames = state.freeFrames[sizeClass];
+    if(!frames.empty()) {
+      void* frame = frames.back();
+      frames.pop_back();
+      --state.cached;
+      return frame;
+    }
+  }
+  return ::operator new((sizeClass + 1) * FRAME_POOL_GRANULARITY);
+}
+
+void FramePool::release(void* frame, std::size_t size) {
+  if(size > FRAME_POOL_MAX_FRAME_SIZE) {
+    ::operator delete(frame);
+    return;
+  }
+  std::size_t sizeClass = (size + FRAME_POOL_GRANULARITY - 1) / FRAME_POOL_GRANULARITY - 1;
+  FramePoolState& state = poolState();
+  {
+    std::lock_guard<std::mutex> lk(state.mutex);
+    std::vector<void*>& frames = state.freeFrames[sizeClass];
+    if(frames.size() < FRAME_POOL_MAX_FREE_FRAMES) {
+      frames.push_back(frame);
+      ++state.cached;
+      return;
+    }
+  }
+  ::operator delete(frame);
+}
+
+std::size_t FramePool::cached() {
+  FramePoolState& state = poolState();
+  std::lock_guard<std::mutex> lk(state.mutex);
+  return state.cached;
+}
+
+void answerQuery(QueryJoin* join) {
+  if(join->pending.fetch_sub(1) != 1) {
+    return;
+  }
+  if(join->abandoned.load()) {
+    join->waiter.destroy();
+  } else {
+    join->waiter.resume();
+  }
+}
+
+void abandonQuery(QueryJoin* join) {
+  join->abandoned = true;
+  answerQuery(join);
+}
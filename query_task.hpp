@@ -0,0 +1,76 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#ifndef QUERY_TASK_HPP
+#define QUERY_TASK_HPP
+
+#include <atomic>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+
+// Frames are kept for reuse in size classes of this many bytes
+#define FRAME_POOL_GRANULARITY 64
+// Bigger frames are allocated and freed as usual
+#define FRAME_POOL_MAX_FRAME_SIZE 2048
+// Free frames kept per size class, the rest are freed
+#define FRAME_POOL_MAX_FREE_FRAMES 256
+
+// Recycles coroutine frames. Lookups run as coroutines, one per user or chat
+// looked up, and their frames are allocated on the thread that starts them
+// and freed on the one that receives the last response, so the pool is
+// shared by all threads.
+class FramePool {
+  public:
+    static void* allocate(std::size_t size);
+    static void release(void* frame, std::size_t size);
+    // Free frames held by the pool
+    static std::size_t cached();
+};
+
+// Return type of the coroutines that send queries. They start running
+// straight away, up to the first query they wait on, and free themselves
+// once they return. Nothing waits on them, like on a query handler.
+class QueryTask {
+  public:
+    struct promise_type {
+      QueryTask get_return_object() {
+        return QueryTask();
+      }
+      std::suspend_never initial_suspend() noexcept {
+        return {};
+      }
+      std::suspend_never final_suspend() noexcept {
+        return {};
+      }
+      void return_void() {}
+      void unhandled_exception() {
+        std::terminate();
+      }
+      static void* operator new(std::size_t size) {
+        return FramePool::allocate(size);
+      }
+      static void operator delete(void* frame, std::size_t size) {
+        FramePool::release(frame, size);
+      }
+    };
+};
+
+// Lives in the frame of a coroutine waiting on one or more queries sent
+// together. The last one to be answered resumes it.
+typedef struct QueryJoin {
+  std::coroutine_handle<> waiter;
+  std::atomic<unsigned int> pending{0};
+  std::atomic<bool> abandoned{false};
+} QueryJoin;
+
+// Resumes the coroutine if it was the last query it was waiting on
+void answerQuery(QueryJoin* join);
+// For a query that will never be answered, e.g. because TDLib was closed.
+// Once none of them are left, the coroutine is destroyed instead of resumed.
+void abandonQuery(QueryJoin* join);
+
+#endif
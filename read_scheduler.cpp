@@ -0,0 +1,76 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+// 
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#include <algorithm>
+#include <functional>
+#include <queue>
+#include <utility>
+
+#include "read_scheduler.hpp"
+
+ReadScheduler::ReadScheduler(unsigned int maxOpenChats, double budgetSec) : maxOpenChats(maxOpenChats ? maxOpenChats : 1), budgetSec(budgetSec) {}
+
+void ReadScheduler::addChat(std::int64_t chatID, std::vector<double> readTimes) {
+  this->chatOrder.push_back(chatID);
+  this->chatReadTimes.push_back(std::move(readTimes));
+}
+
+double ReadScheduler::simulate(double factor, std::vector<ReadEvent>* events) {
+  // Every lane is an open chat. Chats are handed to whichever lane frees up
+  // first, keeping the order in which they were added.
+  typedef std::pair<double, unsigned int> Lane;
+  std::priority_queue<Lane, std::vector<Lane>, std::greater<Lane>> lanes;
+  unsigned int numLanes = std::min<std::size_t>(this->maxOpenChats, this->chatOrder.size());
+  for(unsigned int i = 0; i < numLanes; ++i) {
+    lanes.push(Lane(0.0, i));
+  }
+
+  double end = 0.0;
+  for(std::size_t chat = 0; chat < this->chatOrder.size(); ++chat) {
+    Lane lane = lanes.top();
+    lanes.pop();
+    double t = lane.first;
+    if(events) {
+      events->push_back({t, this->chatOrder[chat], 0, READ_EVENT_OPEN_CHAT});
+    }
+    for(std::size_t i = 0; i < this->chatReadTimes[chat].size(); ++i) {
+      if(events) {
+        events->push_back({t, this->chatOrder[chat], i, READ_EVENT_READ_MESSAGE});
+      }
+      t += std::max(this->chatReadTimes[chat][i], 0.0) * factor;
+    }
+    if(events) {
+      events->push_back({t, this->chatOrder[chat], 0, READ_EVENT_CLOSE_CHAT});
+    }
+    end = std::max(end, t);
+    lanes.push(Lane(t, lane.second));
+  }
+  return end;
+}
+
+std::vector<ReadEvent> ReadScheduler::plan() {
+  std::vector<ReadEvent> events;
+  // Lanes are filled greedily in a fixed order, so scaling every read time by
+  // the same factor scales the whole schedule linearly
+  double unpacedDuration = this->simulate(1.0, NULL);
+  this->pacingFactor = 1.0;
+  if(this->budgetSec > 0 && unpacedDuration > this->budgetSec) {
+    this->pacingFactor = this->budgetSec / unpacedDuration;
+  }
+  this->plannedDuration = this->simulate(this->pacingFactor, &events);
+  std::stable_sort(events.begin(), events.end(), [](const ReadEvent& a, const ReadEvent& b) {
+    return a.offsetSec < b.offsetSec;
+  });
+  return events;
+}
+
+double ReadScheduler::getPacingFactor() {
+  return this->pacingFactor;
+}
+
+double ReadScheduler::getPlannedDuration() {
+  return this->plannedDuration;
+}
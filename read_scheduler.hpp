@@ -0,0 +1,51 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+// 
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#ifndef READ_SCHEDULER_HPP
+#define READ_SCHEDULER_HPP
+
+#include <cstdint>
+#include <vector>
+
+typedef enum ReadEventType {
+  READ_EVENT_OPEN_CHAT,
+  READ_EVENT_READ_MESSAGE,
+  READ_EVENT_CLOSE_CHAT
+} ReadEventType;
+
+typedef struct ReadEvent {
+  double offsetSec;
+  std::int64_t chatID;
+  std::size_t messageIndex;
+  ReadEventType type;
+} ReadEvent;
+
+// Plans an Active Period in which up to maxOpenChats chats are read at the
+// same time. Every open chat is read message by message, waiting each
+// message's read time before the next one, same as a single reader would do.
+// If the whole backlog wouldn't fit in budgetSec, every read time is shrunk by
+// the same factor (the human "skims" the backlog) so the Active Period never
+// runs longer than the budget.
+class ReadScheduler {
+  public:
+    ReadScheduler(unsigned int maxOpenChats, double budgetSec);
+    void addChat(std::int64_t chatID, std::vector<double> readTimes);
+    std::vector<ReadEvent> plan();
+    double getPacingFactor();
+    double getPlannedDuration();
+
+  private:
+    double simulate(double factor, std::vector<ReadEvent>* events);
+
+    unsigned int maxOpenChats;
+    double budgetSec;
+    double pacingFactor{1.0};
+    double plannedDuration{0.0};
+    std::vector<std::int64_t> chatOrder;
+    std::vector<std::vector<double>> chatReadTimes;
+};
+
+#endif
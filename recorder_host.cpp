@@ -0,0 +1,273 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#include <algorithm>
+#include <filesystem>
+
+#define SPDLOG_ACTIVE_LEVEL SPDLOG_LEVEL_TRACE
+#include <spdlog/spdlog.h>
+
+#include "logging.hpp"
+#include "recorder_host.hpp"
+#include "telegram_data.hpp"
+
+RecorderHost::RecorderHost(std::unique_ptr<ClientBackend> backend, ConfigParams config, std::string configFile) : config(config), configFile(configFile), downloads(config.downloadMaxInFlight) {
+  if(backend) {
+    this->backend = std::move(backend);
+  } else {
+    td::ClientManager::execute(td_api::make_object<td_api::setLogVerbosityLevel>(2));
+    this->backend = std::make_unique<TDClientBackend>();
+  }
+  this->clientManager = this->backend.get();
+  MetricsRegistry& registry = metrics();
+  this->accountsGauge = &registry.gauge("tgrec_accounts", "Accounts recorded by the process");
+  this->downloadsQueued = &registry.gauge("tgrec_downloads_queued", "Downloads waiting for a free slot to be requested");
+  this->processResidentBytes = &registry.gauge("tgrec_process_resident_bytes", "Resident memory of the process");
+  this->processThreads = &registry.gauge("tgrec_process_threads", "Threads of the process, TDLib's included");
+}
+
+std::string RecorderHost::renderMetrics() {
+  for(auto& account : this->accounts) {
+    account->updateMetrics();
+  }
+  ProcessStats process = processStats();
+  this->processResidentBytes->set(process.residentBytes);
+  this->processThreads->set(process.threads);
+  this->downloadsQueued->set(this->downloads.queued());
+  return metrics().render();
+}
+
+void RecorderHost::start() {
+  if(this->config.logAsync) {
+    enableAsyncLogging(this->config.logQueueSize);
+  }
+  LogRateLimiter::configure(this->config.logMessageRateLimit, this->config.logMessageSampleEvery);
+
+  if(this->config.metricsPort || this->config.metricsSocket != "") {
+    this->metricsServer = std::make_unique<MetricsServer>([this]() {
+      return this->renderMetrics();
+    });
+    if(this->config.metricsSocket != "") {
+      this->metricsServer->listenUnix(this->config.metricsSocket);
+    } else {
+      this->metricsServer->listenTCP(this->config.metricsPort);
+    }
+  }
+  if(this->config.captureFile != "") {
+    // Every account's traffic goes through the same capture
+    std::unique_ptr<RecordingClientBackend> recording = std::make_unique<RecordingClientBackend>(std::move(this->backend));
+    if(recording->open(this->config.captureFile)) {
+      this->capture = recording.get();
+    }
+    this->backend = std::move(recording);
+    this->clientManager = this->backend.get();
+  }
+
+  for(AccountParams& params : this->config.accounts) {
+    ConfigParams accountConfig = this->config;
+    accountConfig.accounts.clear();
+    accountConfig.accountName = params.name;
+    accountConfig.dbFile = params.dbFile;
+    accountConfig.tdlibDirectory = params.tdlibDirectory;
+    // Next to each account's DB
+    accountConfig.dedupFilterFile = "";
+    if(accountConfig.traceLogFile != "") {
+      std::filesystem::path trace(accountConfig.traceLogFile);
+      accountConfig.traceLogFile = (trace.parent_path() / (trace.stem().string() + "." + params.name + trace.extension().string())).string();
+    }
+    std::unique_ptr<TelegramRecorder> account = std::make_unique<TelegramRecorder>(this, this->clientManager, &this->downloads, accountConfig);
+    SPDLOG_INFO("Starting account {}", params.name);
+    if(!account->startAccount()) {
+      SPDLOG_ERROR("Unable to start account {}", params.name);
+      account->stopWorkers();
+      account->closeAccount();
+      continue;
+    }
+    this->accounts.push_back(std::move(account));
+  }
+  this->accountsGauge->set(this->accounts.size());
+  this->receiverThread = std::thread(&RecorderHost::runReceiver, this);
+  this->writerThread = std::thread(&RecorderHost::runWriter, this);
+}
+
+void RecorderHost::startArchive() {
+  for(auto& account : this->accounts) {
+    account->startArchive();
+  }
+}
+
+bool RecorderHost::archiveFinished() {
+  for(auto& account : this->accounts) {
+    if(!account->archiveFinished()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void RecorderHost::reloadChatFilters() {
+  ConfigParams config;
+  if(!loadConfig(this->configFile, config)) {
+    SPDLOG_ERROR("Unable to reload chat filters, keeping the current ones");
+    return;
+  }
+  for(auto& account : this->accounts) {
+    account->chatFilter.load(config.chatFilters, account->metricLabels());
+  }
+}
+
+void RecorderHost::runReceiver() {
+  SPDLOG_DEBUG("Receiver thread started");
+  for(auto& account : this->accounts) {
+    account->sendQuery(td_api::make_object<td_api::getOption>("version"), checkAPICallSuccess("version"));
+  }
+  // Keeps running after the accounts stop, downloads still in flight need
+  // their responses processed
+  while(!this->closeFlag.load()) {
+    double timeout = SHUTDOWN_POLL_INTERVAL_MS / 1000.0;
+    for(auto& account : this->accounts) {
+      if(account->needRestart) {
+        account->restart();
+      }
+      account->releaseQueries();
+      timeout = account->receiveTimeout(timeout);
+    }
+    this->dispatch(this->clientManager->receive(timeout));
+  }
+  SPDLOG_DEBUG("Receiver stopped");
+  this->closeAccounts();
+}
+
+void RecorderHost::dispatch(td::ClientManager::Response response) {
+  if(!response.object) {
+    return;
+  }
+  for(auto& account : this->accounts) {
+    if(account->clientID == response.client_id) {
+      account->processResponse(std::move(response));
+      return;
+    }
+  }
+  // Leftovers from a client closed before a restart
+  SPDLOG_DEBUG("Ignoring response for client ID {}", response.client_id);
+}
+
+void RecorderHost::closeAccounts() {
+  for(auto& account : this->accounts) {
+    account->sendQuery(td_api::make_object<td_api::close>(), checkAPICallSuccess("close"));
+  }
+  // TDLib flushes each account's state before reporting it's closed
+  auto closed = [](std::unique_ptr<TelegramRecorder>& account) {
+    return account->authState && account->authState->get_id() == td_api::authorizationStateClosed::ID;
+  };
+  while(!std::all_of(this->accounts.begin(), this->accounts.end(), closed)) {
+    if(std::chrono::steady_clock::now() >= this->shutdownDeadline) {
+      SPDLOG_WARN("TDLib didn't close every account before the shutdown deadline");
+      return;
+    }
+    this->dispatch(this->clientManager->receive(SHUTDOWN_POLL_INTERVAL_MS / 1000.0));
+  }
+  SPDLOG_INFO("TDLib is closed");
+}
+
+void RecorderHost::wakeWriter(TelegramRecorder* account) {
+  {
+    std::lock_guard<std::mutex> lk(this->writerMutex);
+    if(std::find(this->writerTurns.begin(), this->writerTurns.end(), account) != this->writerTurns.end()) {
+      return;
+    }
+    this->writerTurns.push_back(account);
+  }
+  this->writerWakeUp.notify_one();
+}
+
+void RecorderHost::runWriter() {
+  SPDLOG_DEBUG("DB Writer thread started");
+  std::unique_lock<std::mutex> lk(this->writerMutex);
+  while(true) {
+    this->writerWakeUp.wait(lk, [this]{return !this->writerTurns.empty() || this->writerExit;});
+    // Only set once no account can enqueue anything else
+    if(this->writerTurns.empty()) {
+      break;
+    }
+    TelegramRecorder* account = this->writerTurns.front();
+    this->writerTurns.pop_front();
+    lk.unlock();
+    // A busy account can only hold the writer for one batch before the
+    // others get their turn
+    bool pending = account->writeQueued(this->config.accountWriteBatch);
+    lk.lock();
+    if(pending && std::find(this->writerTurns.begin(), this->writerTurns.end(), account) == this->writerTurns.end()) {
+      this->writerTurns.push_back(account);
+    }
+  }
+  SPDLOG_DEBUG("DB Writer thread stopped");
+}
+
+void RecorderHost::stop() {
+  auto start = std::chrono::steady_clock::now();
+  this->shutdownDeadline = start + std::chrono::seconds(this->config.shutdownTimeoutSec);
+  std::uint64_t downloadsBefore = 0;
+  for(auto& account : this->accounts) {
+    downloadsBefore += account->recorderMetrics.downloadsCompleted->get() + account->recorderMetrics.downloadsFailed->get();
+  }
+
+  std::size_t toFlush = 0;
+  for(auto& account : this->accounts) {
+    toFlush += account->stopWorkers();
+    account->shutdownDeadline = this->shutdownDeadline;
+    // Whatever is left is flushed before the writer exits
+    this->wakeWriter(account.get());
+  }
+  {
+    std::lock_guard<std::mutex> lk(this->writerMutex);
+    this->writerExit = true;
+  }
+  this->writerWakeUp.notify_all();
+  if(this->writerThread.joinable()) {
+    this->writerThread.join();
+  }
+
+  // Every download has been requested by now, as the writer requests them
+  auto downloadsInFlight = [this]() {
+    double inFlight = 0;
+    for(auto& account : this->accounts) {
+      inFlight += account->recorderMetrics.downloadsInFlight->get();
+    }
+    return inFlight;
+  };
+  while(downloadsInFlight() > 0 && std::chrono::steady_clock::now() < this->shutdownDeadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(SHUTDOWN_POLL_INTERVAL_MS));
+  }
+  std::uint64_t downloadsFinished = 0;
+  std::uint64_t messagesIgnored = 0;
+  for(auto& account : this->accounts) {
+    downloadsFinished += account->recorderMetrics.downloadsCompleted->get() + account->recorderMetrics.downloadsFailed->get();
+  }
+  downloadsFinished -= downloadsBefore;
+  double downloadsAbandoned = downloadsInFlight();
+
+  this->closeFlag = true;
+  if(this->receiverThread.joinable()) {
+    this->receiverThread.join();
+  }
+  for(auto& account : this->accounts) {
+    account->closeAccount();
+    messagesIgnored += account->messagesIgnoredOnExit;
+  }
+
+  if(this->metricsServer) {
+    this->metricsServer->stop();
+  }
+  if(this->capture) {
+    this->capture->close();
+  }
+  double elapsedSec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  SPDLOG_INFO(
+    "Shutdown of {} accounts finished in {:0.3f} seconds: flushed {} queued messages, finished {} downloads, abandoned {}, ignored {} messages received while stopping",
+    this->accounts.size(), elapsedSec, toFlush, downloadsFinished, downloadsAbandoned, messagesIgnored
+  );
+}
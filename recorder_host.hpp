@@ -0,0 +1,77 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#ifndef RECORDER_HOST_HPP
+#define RECORDER_HOST_HPP
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "capture_backend.hpp"
+#include "client_backend.hpp"
+#include "config.hpp"
+#include "download_scheduler.hpp"
+#include "metrics.hpp"
+#include "metrics_server.hpp"
+#include "telegram_recorder.hpp"
+
+// Records every account in the accounts list from a single process. TDLib
+// serves all of them from one ClientManager, so a single thread receives for
+// every account and hands each response to the one it belongs to, and a
+// single writer takes turns committing to each account's DB. Downloads are
+// requested through one scheduler, so the accounts share the limit on
+// downloads in flight. Each account still has its own DB, caches, reader and
+// backfill workers.
+class RecorderHost {
+  public:
+    RecorderHost(std::unique_ptr<ClientBackend> backend, ConfigParams config, std::string configFile = DEFAULT_CONFIG_FILE);
+    void start();
+    void startArchive();
+    // True once every account has finished archiving
+    bool archiveFinished();
+    void stop();
+    // Reads chat_filters from the config file again, for every account
+    void reloadChatFilters();
+    // Gives the account a turn of the writer
+    void wakeWriter(TelegramRecorder* account);
+
+  private:
+    void runReceiver();
+    void dispatch(td::ClientManager::Response response);
+    void closeAccounts();
+    void runWriter();
+    std::string renderMetrics();
+
+    ConfigParams config;
+    std::string configFile;
+    std::unique_ptr<ClientBackend> backend;
+    ClientBackend* clientManager{nullptr};
+    RecordingClientBackend* capture{nullptr};
+    std::vector<std::unique_ptr<TelegramRecorder>> accounts;
+    DownloadScheduler downloads;
+    std::thread receiverThread;
+    std::thread writerThread;
+    std::mutex writerMutex;
+    std::condition_variable writerWakeUp;
+    // Accounts with messages to write, in the order they get their turn
+    std::deque<TelegramRecorder*> writerTurns;
+    bool writerExit{false};
+    std::atomic<bool> closeFlag{false};
+    std::chrono::steady_clock::time_point shutdownDeadline;
+    std::unique_ptr<MetricsServer> metricsServer;
+    Gauge* accountsGauge;
+    Gauge* downloadsQueued;
+    Gauge* processResidentBytes;
+    Gauge* processThreads;
+};
+
+#endif
@@ -0,0 +1,292 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#include <initializer_list>
+
+#define SPDLOG_ACTIVE_LEVEL SPDLOG_LEVEL_TRACE
+#include <spdlog/spdlog.h>
+
+#include "db_schema.hpp"
+#include "search_index.hpp"
+
+// The index has the messages up to build_cursor, which buildSearchIndex()
+// advances, and the ones after build_until, the last message recorded when it
+// was created, up to live_cursor, which indexNewMessages() advances. The
+// triggers only touch the messages in it: removing one that isn't from an
+// FTS5 external content table corrupts it.
+#define SEARCH_INDEXED(row) \
+  "(" row " <= (SELECT build_cursor FROM search_index_state) OR " \
+  "(" row " > (SELECT build_until FROM search_index_state) AND " row " <= (SELECT live_cursor FROM search_index_state)))"
+
+// Not part of the versioned schema, as it's optional and can be rebuilt from
+// the messages at any time.
+// There's no trigger indexing each message inserted: FTS5 writes what it has
+// indexed to the DB on every savepoint, and every INSERT running a trigger
+// takes one, so each message would end up in a segment of its own. Only
+// messages inserted with a rowid SQLite already handed out, if the last ones
+// were deleted, are indexed right away.
+static const char* createStatement =
+  "CREATE VIRTUAL TABLE messages_fts USING fts5(message, content='messages', content_rowid='rowid', tokenize=%Q);"
+  "CREATE TABLE search_index_state(tokenizer TEXT, build_cursor INTEGER, build_until INTEGER, live_cursor INTEGER);"
+  "INSERT INTO search_index_state SELECT %Q, 0, IFNULL(MAX(rowid), 0), IFNULL(MAX(rowid), 0) FROM messages;"
+  "CREATE TRIGGER messages_fts_insert AFTER INSERT ON messages WHEN " SEARCH_INDEXED("new.rowid") " BEGIN "
+    "INSERT INTO messages_fts (rowid, message) VALUES (new.rowid, new.message);"
+  "END;"
+  "CREATE TRIGGER messages_fts_delete AFTER DELETE ON messages WHEN " SEARCH_INDEXED("old.rowid") " BEGIN "
+    "INSERT INTO messages_fts (messages_fts, rowid, message) VALUES ('delete', old.rowid, old.message);"
+  "END;"
+  "CREATE TRIGGER messages_fts_update AFTER UPDATE OF message ON messages WHEN " SEARCH_INDEXED("old.rowid") " BEGIN "
+    "INSERT INTO messages_fts (messages_fts, rowid, message) VALUES ('delete', old.rowid, old.message);"
+    "INSERT INTO messages_fts (rowid, message) VALUES (new.rowid, new.message);"
+  "END;";
+
+static const char* dropStatement =
+  "DROP TRIGGER messages_fts_insert;"
+  "DROP TRIGGER messages_fts_delete;"
+  "DROP TRIGGER messages_fts_update;"
+  "DROP TABLE search_index_state;"
+  "DROP TABLE messages_fts;";
+
+// Ranked in the FTS5 table on its own, which only makes snippets of the
+// best matches. Ranking the join would make one for every match.
+static const char* searchStatement =
+  "SELECT m.id, m.timestamp, m.chat_id, c.name, m.sender_id, IFNULL(u.fullname, s.name), f.snippet, f.rank "
+  "FROM ("
+    "SELECT rowid, rank, snippet(messages_fts, 0, '[', ']', '...', 16) AS snippet FROM messages_fts "
+    "WHERE messages_fts MATCH ? ORDER BY rank LIMIT ?"
+  ") f "
+  "JOIN messages m ON m.rowid = f.rowid "
+  "LEFT JOIN chats c ON c.chat_id = m.chat_id "
+  "LEFT JOIN users u ON u.user_id = m.sender_id "
+  "LEFT JOIN chats s ON s.chat_id = m.sender_id "
+  "ORDER BY f.rank;";
+
+typedef struct SearchIndexState {
+  bool exists{false};
+  std::string tokenizer;
+  std::int64_t buildCursor{0};
+  std::int64_t buildUntil{0};
+  std::int64_t liveCursor{0};
+} SearchIndexState;
+
+static std::string columnText(sqlite3_stmt* stmt, int column) {
+  const unsigned char* text = sqlite3_column_text(stmt, column);
+  return text ? reinterpret_cast<const char*>(text) : "";
+}
+
+// Runs a statement taking integer parameters, reading the integers in the
+// first row it returns, if any, into columns
+static bool runStatement(sqlite3* db, const char* statement, std::initializer_list<std::int64_t> params, std::vector<std::int64_t>* columns = nullptr) {
+  sqlite3_stmt* stmt;
+  int rc = sqlite3_prepare_v2(db, statement, -1, &stmt, NULL);
+  if(rc != SQLITE_OK) {
+    SPDLOG_ERROR("Error preparing statement: {}", sqlite3_errmsg(db));
+    return false;
+  }
+  int index = 1;
+  for(std::int64_t param : params) {
+    sqlite3_bind_int64(stmt, index++, param);
+  }
+  SPDLOG_DEBUG("Executing SQL: {}", statement);
+  rc = sqlite3_step(stmt);
+  if(rc == SQLITE_ROW && columns) {
+    for(int i = 0; i < sqlite3_column_count(stmt); ++i) {
+      columns->push_back(sqlite3_column_int64(stmt, i));
+    }
+  }
+  sqlite3_finalize(stmt);
+  if(rc != SQLITE_ROW && rc != SQLITE_DONE) {
+    SPDLOG_ERROR("Error executing SQL: {}", sqlite3_errmsg(db));
+    return false;
+  }
+  return true;
+}
+
+// state.exists is false if there's no index
+static bool readSearchIndexState(sqlite3* db, SearchIndexState& state) {
+  std::vector<std::int64_t> tables;
+  // Looked up like the table itself, which may be in an attached DB
+  if(!runStatement(db, "SELECT COUNT(*) FROM pragma_table_info('search_index_state');", {}, &tables)) {
+    return false;
+  }
+  state.exists = tables.size() && tables[0];
+  if(!state.exists) {
+    return true;
+  }
+  sqlite3_stmt* stmt;
+  int rc = sqlite3_prepare_v2(db, "SELECT tokenizer, build_cursor, build_until, live_cursor FROM search_index_state;", -1, &stmt, NULL);
+  if(rc != SQLITE_OK) {
+    SPDLOG_ERROR("Error preparing statement: {}", sqlite3_errmsg(db));
+    return false;
+  }
+  rc = sqlite3_step(stmt);
+  if(rc == SQLITE_ROW) {
+    state.tokenizer = columnText(stmt, 0);
+    state.buildCursor = sqlite3_column_int64(stmt, 1);
+    state.buildUntil = sqlite3_column_int64(stmt, 2);
+    state.liveCursor = sqlite3_column_int64(stmt, 3);
+  }
+  sqlite3_finalize(stmt);
+  if(rc != SQLITE_ROW) {
+    SPDLOG_ERROR("Unable to read the search index state: {}", sqlite3_errmsg(db));
+    return false;
+  }
+  return true;
+}
+
+// Indexes the messages with rowids in (from, to] with a single statement and
+// sets cursorUpdate's parameter to "to", in a savepoint, so it can be called
+// inside or outside of a transaction. Returns the messages indexed, or -1.
+static std::int64_t indexMessages(sqlite3* db, const char* cursorUpdate, std::int64_t from, std::int64_t to) {
+  if(!execSchemaSQL(db, "SAVEPOINT search_index;")) {
+    return -1;
+  }
+  std::int64_t indexed = -1;
+  if(runStatement(db, "INSERT INTO messages_fts (rowid, message) SELECT rowid, message FROM messages WHERE rowid > ? AND rowid <= ?;", {from, to})) {
+    indexed = sqlite3_changes64(db);
+  }
+  if(indexed < 0 || !runStatement(db, cursorUpdate, {to})) {
+    execSchemaSQL(db, "ROLLBACK TO search_index;");
+    execSchemaSQL(db, "RELEASE search_index;");
+    return -1;
+  }
+  return execSchemaSQL(db, "RELEASE search_index;") ? indexed : -1;
+}
+
+bool configureSearchIndex(sqlite3* db, bool enabled, const std::string& tokenizer) {
+  if(!execSchemaSQL(db, "BEGIN IMMEDIATE;")) {
+    return false;
+  }
+  SearchIndexState state;
+  if(!readSearchIndexState(db, state)) {
+    execSchemaSQL(db, "ROLLBACK;");
+    return false;
+  }
+  bool ok = true;
+  if(state.exists && !enabled) {
+    SPDLOG_INFO("Search index disabled, dropping it");
+    ok = execSchemaSQL(db, dropStatement);
+  } else if(state.exists && state.tokenizer != tokenizer) {
+    SPDLOG_INFO("Search index tokenizer changed from \"{}\" to \"{}\", rebuilding it", state.tokenizer, tokenizer);
+    ok = execSchemaSQL(db, dropStatement);
+  }
+  if(ok && enabled && (!state.exists || state.tokenizer != tokenizer)) {
+    char* statement = sqlite3_mprintf(createStatement, tokenizer.c_str(), tokenizer.c_str());
+    ok = execSchemaSQL(db, statement);
+    sqlite3_free(statement);
+    if(ok) {
+      SPDLOG_INFO("Created search index with tokenizer \"{}\"", tokenizer);
+    }
+  }
+  if(!ok) {
+    SPDLOG_ERROR("Unable to set up the search index, rolling back");
+    execSchemaSQL(db, "ROLLBACK;");
+    return false;
+  }
+  return execSchemaSQL(db, "COMMIT;");
+}
+
+std::int64_t indexNewMessages(sqlite3* db) {
+  SearchIndexState state;
+  std::vector<std::int64_t> last;
+  if(!readSearchIndexState(db, state) || !runStatement(db, "SELECT IFNULL(MAX(rowid), 0) FROM messages;", {}, &last)) {
+    return -1;
+  }
+  if(!state.exists || last[0] <= state.liveCursor) {
+    return 0;
+  }
+  return indexMessages(db, "UPDATE search_index_state SET live_cursor = ?;", state.liveCursor, last[0]);
+}
+
+std::int64_t searchIndexPendingRows(sqlite3* db) {
+  SearchIndexState state;
+  if(!readSearchIndexState(db, state)) {
+    return -1;
+  }
+  if(!state.exists || state.buildCursor >= state.buildUntil) {
+    return 0;
+  }
+  std::vector<std::int64_t> pending;
+  if(!runStatement(db, "SELECT COUNT(*) FROM messages WHERE rowid > ? AND rowid <= ?;", {state.buildCursor, state.buildUntil}, &pending)) {
+    return -1;
+  }
+  return pending[0];
+}
+
+std::int64_t buildSearchIndex(sqlite3* db, unsigned int maxRows) {
+  SearchIndexState state;
+  if(!readSearchIndexState(db, state)) {
+    return -1;
+  }
+  if(!state.exists || state.buildCursor >= state.buildUntil) {
+    return 0;
+  }
+  std::vector<std::int64_t> batch;
+  if(!runStatement(
+    db, "SELECT COUNT(*), MAX(rowid) FROM (SELECT rowid FROM messages WHERE rowid > ? AND rowid <= ? ORDER BY rowid LIMIT ?);",
+    {state.buildCursor, state.buildUntil, maxRows}, &batch
+  )) {
+    return -1;
+  }
+  // Whatever is left may be gone, if the last messages were deleted
+  std::int64_t end = batch[0] ? batch[1] : state.buildUntil;
+  return indexMessages(db, "UPDATE search_index_state SET build_cursor = ?;", state.buildCursor, end);
+}
+
+bool searchIndexExists(sqlite3* db) {
+  SearchIndexState state;
+  return readSearchIndexState(db, state) && state.exists;
+}
+
+bool optimizeSearchIndex(sqlite3* db) {
+  SearchIndexState state;
+  if(!readSearchIndexState(db, state)) {
+    return false;
+  }
+  return !state.exists || execSchemaSQL(db, "INSERT INTO messages_fts (messages_fts) VALUES ('optimize');");
+}
+
+bool searchMessages(sqlite3* db, const std::string& query, unsigned int limit, std::vector<SearchResult>& results) {
+  SearchIndexState state;
+  if(!readSearchIndexState(db, state)) {
+    return false;
+  }
+  if(!state.exists) {
+    SPDLOG_ERROR("The DB has no search index, set search_index = true to build it");
+    return false;
+  }
+  if(state.buildCursor < state.buildUntil) {
+    SPDLOG_WARN("The search index is still being built, older messages may be missing from the results");
+  }
+  sqlite3_stmt* stmt;
+  int rc = sqlite3_prepare_v2(db, searchStatement, -1, &stmt, NULL);
+  if(rc != SQLITE_OK) {
+    SPDLOG_ERROR("Error preparing statement: {}", sqlite3_errmsg(db));
+    return false;
+  }
+  sqlite3_bind_text64(stmt, 1, query.c_str(), query.length(), SQLITE_STATIC, SQLITE_UTF8);
+  sqlite3_bind_int(stmt, 2, limit);
+  SPDLOG_DEBUG("Executing SQL: {}", searchStatement);
+  while((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    results.push_back({
+      columnText(stmt, 0),
+      sqlite3_column_int64(stmt, 1),
+      sqlite3_column_int64(stmt, 2),
+      columnText(stmt, 3),
+      sqlite3_column_int64(stmt, 4),
+      columnText(stmt, 5),
+      columnText(stmt, 6),
+      sqlite3_column_double(stmt, 7)
+    });
+  }
+  sqlite3_finalize(stmt);
+  // Malformed queries fail here
+  if(rc != SQLITE_DONE) {
+    SPDLOG_ERROR("Error searching messages: {}", sqlite3_errmsg(db));
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,61 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#ifndef SEARCH_INDEX_HPP
+#define SEARCH_INDEX_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <sqlite3.h>
+
+// Rows indexed in each transaction while building the index
+#define SEARCH_INDEX_BUILD_BATCH 5000
+#define DEFAULT_SEARCH_LIMIT 20
+
+typedef struct SearchResult {
+  std::string messageID;
+  std::int64_t timestamp;
+  std::int64_t chatID;
+  std::string chatName;
+  std::int64_t senderID;
+  // The user's full name, or the chat's name if a chat sent it
+  std::string senderName;
+  // The text around the matches, which are in square brackets
+  std::string snippet;
+  // BM25, lower is better. Only roughly comparable between indexes.
+  double rank;
+} SearchResult;
+
+// The index is an FTS5 table over the text of the messages, which it doesn't
+// store a copy of. New messages are added to it by indexNewMessages(), which
+// the writer calls before committing them, and edits by triggers. Messages
+// recorded before the index existed are added to it by buildSearchIndex(), a
+// batch at a time.
+//
+// Creates the index if it's enabled and missing, recreating it if the
+// tokenizer changed, and drops it if it's disabled.
+bool configureSearchIndex(sqlite3* db, bool enabled, const std::string& tokenizer);
+// Indexes the messages inserted since the last call, in a savepoint, so it
+// can be called inside or outside of a transaction. Returns the messages
+// indexed, or -1 on errors.
+std::int64_t indexNewMessages(sqlite3* db);
+// Messages left for buildSearchIndex(), 0 if there's no index. -1 on errors.
+std::int64_t searchIndexPendingRows(sqlite3* db);
+// Indexes the next batch of messages recorded before the index existed, like
+// indexNewMessages()
+std::int64_t buildSearchIndex(sqlite3* db, unsigned int maxRows = SEARCH_INDEX_BUILD_BATCH);
+// False if there's no index, or it can't be read
+bool searchIndexExists(sqlite3* db);
+// Merges the index into a single segment, which is faster to search. Slow,
+// meant for DBs that won't be written to anymore.
+bool optimizeSearchIndex(sqlite3* db);
+// Best matches first. The query uses the FTS5 syntax: words, "phrases",
+// prefix*, AND, OR, NOT and NEAR().
+bool searchMessages(sqlite3* db, const std::string& query, unsigned int limit, std::vector<SearchResult>& results);
+
+#endif
@@ -7,6 +7,7 @@
 #include <filesystem>
 
 #include "hash.hpp"
+#include "logging.hpp"
 #include "telegram_data.hpp"
 
 std::function<void(TDAPIObjectPtr)> checkAPICallSuccess(std::string callName) {
@@ -23,6 +24,23 @@ std::function<void(TDAPIObjectPtr)> checkAPICallSuccess(std::string callName) {
   };
 }
 
+// One of the CHAT_TYPE_* flags, secret chats count as private
+unsigned int getChatType(td_api::object_ptr<td_api::ChatType>& type) {
+  if(!type) {
+    return 0;
+  }
+  switch(type->get_id()) {
+    case td_api::chatTypePrivate::ID:
+    case td_api::chatTypeSecret::ID:
+      return CHAT_TYPE_PRIVATE;
+    case td_api::chatTypeBasicGroup::ID:
+      return CHAT_TYPE_BASIC_GROUP;
+    case td_api::chatTypeSupergroup::ID:
+      return static_cast<td_api::chatTypeSupergroup&>(*type).is_channel_ ? CHAT_TYPE_CHANNEL : CHAT_TYPE_SUPERGROUP;
+  }
+  return 0;
+}
+
 td_api::int53 getMessageSenderID(std::shared_ptr<td_api::message>& message) {
   td_api::int53 senderID;
   td_api::downcast_call(*message->sender_id_,
@@ -39,114 +57,170 @@ td_api::int53 getMessageSenderID(std::shared_ptr<td_api::message>& message) {
 }
 
 std::string getMessageText(std::shared_ptr<td_api::message>& message) {
-  if (message->content_->get_id() == td_api::messageText::ID) {
-    return static_cast<td_api::messageText&>(
-      *message->content_
-    ).text_->text_;
-  } else if(message->content_->get_id() == td_api::messageVideo::ID) {
-    td_api::messageVideo& msgVideo = static_cast<td_api::messageVideo&>(*message->content_);
-    return msgVideo.caption_->text_;
-  } else if(message->content_->get_id() == td_api::messagePhoto::ID) {
-    td_api::messagePhoto& msgPhoto = static_cast<td_api::messagePhoto&>(*message->content_);
-    return msgPhoto.caption_->text_;
-  } else if(message->content_->get_id() == td_api::messageDocument::ID) {
-    td_api::messageDocument& msgDoc = static_cast<td_api::messageDocument&>(*message->content_);
-    return msgDoc.caption_->text_;
-  }
-  return "";
+  MessageContentInfo info;
+  getMessageContentInfo(*message->content_, info);
+  return std::string(info.text);
 }
 
-std::string getMessageOrigin(std::shared_ptr<td_api::message>& message) {
+std::string_view getMessageOrigin(std::shared_ptr<td_api::message>& message, IDBuffer& buffer) {
   if(message->forward_info_) {
     if (message->forward_info_->origin_->get_id() == td_api::messageOriginChannel::ID) {
-      td_api::object_ptr<td_api::messageOriginChannel> orig = td::move_tl_object_as<td_api::messageOriginChannel>(message->forward_info_->origin_);
-      return std::to_string(orig->chat_id_) + ":" + std::to_string(orig->message_id_);
+      td_api::messageOriginChannel& orig = static_cast<td_api::messageOriginChannel&>(*message->forward_info_->origin_);
+      return formatCompoundID(buffer, {orig.chat_id_, orig.message_id_});
     } else if(message->forward_info_->origin_->get_id() == td_api::messageOriginChat::ID) {
-      td_api::object_ptr<td_api::messageOriginChat> orig = td::move_tl_object_as<td_api::messageOriginChat>(message->forward_info_->origin_);
-      return std::to_string(orig->sender_chat_id_);
+      td_api::messageOriginChat& orig = static_cast<td_api::messageOriginChat&>(*message->forward_info_->origin_);
+      return formatCompoundID(buffer, {orig.sender_chat_id_});
     } else if(message->forward_info_->origin_->get_id() == td_api::messageOriginHiddenUser::ID) {
-      td_api::object_ptr<td_api::messageOriginHiddenUser> orig = td::move_tl_object_as<td_api::messageOriginHiddenUser>(message->forward_info_->origin_);
-      return orig->sender_name_;
+      td_api::messageOriginHiddenUser& orig = static_cast<td_api::messageOriginHiddenUser&>(*message->forward_info_->origin_);
+      return orig.sender_name_;
     } else if(message->forward_info_->origin_->get_id() == td_api::messageOriginUser::ID) {
-      td_api::object_ptr<td_api::messageOriginUser> orig = td::move_tl_object_as<td_api::messageOriginUser>(message->forward_info_->origin_);
-      return std::to_string(orig->sender_user_id_);
+      td_api::messageOriginUser& orig = static_cast<td_api::messageOriginUser&>(*message->forward_info_->origin_);
+      return formatCompoundID(buffer, {orig.sender_user_id_});
     }
   }
   return "";
 }
 
-unsigned int getLargestPhotoIndex(td_api::array<td_api::object_ptr<td_api::photoSize>>& photoSizes) {
-  unsigned int largestSize = 0;
-  unsigned int largestIndex = 0;
-  for(unsigned int i = 0; i < photoSizes.size(); ++i) {
-    unsigned int picSize = photoSizes[i]->height_ * photoSizes[i]->width_;
-    if(picSize > largestSize) {
-      largestSize = picSize;
-      largestIndex = i;
-    }
-  }
-  return largestIndex;
+td::td_api::file* getMessageContentFileReference(td_api::object_ptr<td_api::MessageContent>& content) {
+  MessageContentInfo info;
+  getMessageContentInfo(*content, info);
+  return info.file;
 }
 
-td::td_api::file* getMessageContentFileReference(td_api::object_ptr<td_api::MessageContent>& content) {
-  if (content->get_id() == td_api::messageText::ID) {
-    // no data
-  } else if(content->get_id() == td_api::messageVideo::ID) {
-    td_api::messageVideo& msgVideo = static_cast<td_api::messageVideo&>(*content);
-    return msgVideo.video_->video_.get();
-  } else if(content->get_id() == td_api::messagePhoto::ID) {
-    td_api::messagePhoto& msgPhoto = static_cast<td_api::messagePhoto&>(*content);
-    unsigned int largestIndex = getLargestPhotoIndex(msgPhoto.photo_->sizes_);
-    return msgPhoto.photo_->sizes_[largestIndex]->photo_.get();
-  } else if(content->get_id() == td_api::messageDocument::ID) {
-    td_api::messageDocument& msgDoc = static_cast<td_api::messageDocument&>(*content);
-    return msgDoc.document_->document_.get();
-  } else if (content->get_id() == td_api::messageVoiceNote::ID) {
-    td_api::messageVoiceNote& voice = static_cast<td_api::messageVoiceNote&>(*content);
-    return voice.voice_note_->voice_.get();
-  } else if (content->get_id() == td_api::messageVideoNote::ID) {
-    td_api::messageVideoNote& video = static_cast<td_api::messageVideoNote&>(*content);
-    return video.video_note_->video_.get();
+// fileID is the hash of <file ID>:<origin ID> the caller stores the file as
+void TelegramRecorder::downloadFile(td_api::file& file, std::string_view originID, std::string_view fileID) {
+  // Stored already, or requested and not failed yet
+  this->knownFilesMutex.lock();
+  bool known = !this->knownFiles.emplace(fileID).second;
+  this->knownFilesMutex.unlock();
+  if(known) {
+    TGREC_LOG_LIMITED(DEBUG, "File ID {} from {} is already downloaded", file.id_, originID);
+    this->recorderMetrics.downloadsSkipped->inc();
+    this->tracer.skipDownload(std::string(originID));
+    return;
   }
-  return NULL;
+  TGREC_LOG_LIMITED(INFO, "Enqueuing download for file ID {}", file.id_);
+  this->recorderMetrics.downloadsInFlight->add(1);
+  this->downloads->submit(this->config.accountName, [this, id = file.id_, originID = std::string(originID), fileID = std::string(fileID)]() {
+    this->requestDownload(id, originID, fileID);
+  });
 }
 
-void TelegramRecorder::downloadFile(td_api::file& file, std::string& originID) {
-  SPDLOG_INFO("Enqueuing download for file ID {}", file.id_);
-  td_api::object_ptr<td_api::downloadFile> downloadFile = td_api::make_object<td_api::downloadFile>();
-  downloadFile->file_id_ = file.id_;
-  downloadFile->priority_ = 1;
-  downloadFile->offset_ = 0;
-  downloadFile->limit_ = 0;
-  downloadFile->synchronous_ = true;
-  this->sendQuery(std::move(downloadFile), [this, id = file.id_, originID](TDAPIObjectPtr object) {
+void TelegramRecorder::requestDownload(td_api::int32 id, const std::string& originID, const std::string& fileID) {
+  // TDLib resumes partial downloads, so it's fine to send it again
+  this->sendIdempotentQuery([id]() {
+    td_api::object_ptr<td_api::downloadFile> downloadFile = td_api::make_object<td_api::downloadFile>();
+    downloadFile->file_id_ = id;
+    downloadFile->priority_ = 1;
+    downloadFile->offset_ = 0;
+    downloadFile->limit_ = 0;
+    downloadFile->synchronous_ = true;
+    return downloadFile;
+  }, [this, id, originID, fileID](TDAPIObjectPtr object) {
+    this->recorderMetrics.downloadsInFlight->add(-1);
+    this->downloads->finished();
     if(!object) {
       SPDLOG_ERROR("NULL response received when downloading file for file ID {}", id);
+      this->recorderMetrics.downloadsFailed->inc();
+      this->forgetFile(fileID);
+      this->tracer.abandon(originID);
       return;
     }
     if(object->get_id() == td_api::error::ID) {
       td_api::object_ptr<td_api::error> err = td::move_tl_object_as<td_api::error>(object);
       SPDLOG_ERROR("Download for file ID {} failed: {}", id, err->message_);
+      this->recorderMetrics.downloadsFailed->inc();
+      this->forgetFile(fileID);
+      this->tracer.abandon(originID);
       return;
     }
-    SPDLOG_INFO("Download for file ID {} completed", id);
+    TGREC_LOG_LIMITED(INFO, "Download for file ID {} completed", id);
     td_api::object_ptr<td_api::file> f = td::move_tl_object_as<td_api::file>(object);
     if(!f->local_->is_downloading_completed_) {
       SPDLOG_ERROR("Download for file ID {} didn't complete successfully", id);
+      this->recorderMetrics.downloadsFailed->inc();
+      this->forgetFile(fileID);
+      this->tracer.abandon(originID);
       return;
     }
+    // Completed once it's stored, but the bytes were downloaded regardless
+    this->recorderMetrics.downloadedBytes->inc(f->local_->downloaded_size_);
     if(f->local_->path_ == "") {
       SPDLOG_ERROR("File ID {} isn't locally available", id);
+      this->recorderMetrics.downloadsFailed->inc();
+      this->forgetFile(fileID);
+      this->tracer.abandon(originID);
       return;
     }
-    std::string downloadPath = std::filesystem::path(this->config.downloadFolder) / std::filesystem::path(f->local_->path_).filename();
+    std::string downloadPath;
+    if(this->config.downloadLayout == DOWNLOAD_LAYOUT_SHARDED) {
+      if(!storeSharded(f->local_->path_, this->config.downloadFolder, downloadPath)) {
+        this->recorderMetrics.downloadsFailed->inc();
+        this->forgetFile(fileID);
+        this->tracer.abandon(originID);
+        return;
+      }
+      this->writeFileToDB(fileID, downloadPath, originID);
+      this->recorderMetrics.downloadsCompleted->inc();
+      this->tracer.stamp(originID, TRACE_DOWNLOADED);
+      return;
+    }
+    downloadPath = std::filesystem::path(this->config.downloadFolder) / std::filesystem::path(f->local_->path_).filename();
     try {
       std::filesystem::copy_file(f->local_->path_, downloadPath, std::filesystem::copy_options::skip_existing);
-      std::string fileIDStr = std::to_string(f->id_) + ":" + originID;
-      std::string fileID = SHA256(fileIDStr.c_str(), fileIDStr.size());
       this->writeFileToDB(fileID, downloadPath, originID);
+      this->recorderMetrics.downloadsCompleted->inc();
+      this->tracer.stamp(originID, TRACE_DOWNLOADED);
     } catch(std::filesystem::filesystem_error& e) {
       SPDLOG_ERROR("Unable to copy file {}: {}", downloadPath, e.what());
+      this->recorderMetrics.downloadsFailed->inc();
+      this->forgetFile(fileID);
+      this->tracer.abandon(originID);
     }
   });
-}
\ No newline at end of file
+}
+
+// So the next time it's seen it's downloaded again
+void TelegramRecorder::forgetFile(const std::string& fileID) {
+  this->knownFilesMutex.lock();
+  this->knownFiles.erase(fileID);
+  this->knownFilesMutex.unlock();
+}
+
+// Files downloaded before the sharded layout was in use are moved to it in
+// the background, a batch at a time. Only the DB statements take the lock,
+// files are hashed and linked without it. The old file is removed once the
+// DB points to the new one, so it's never left pointing to a missing file.
+void TelegramRecorder::runDownloadMigrator() {
+  SPDLOG_DEBUG("Download migrator started");
+  std::int64_t lastRowID = 0;
+  std::uint64_t migrated = 0;
+  while(!this->exitFlag.load()) {
+    std::vector<std::pair<std::int64_t, std::string>> files;
+    if(!this->readDownloadedFiles(lastRowID, files) || files.empty()) {
+      break;
+    }
+    for(auto& [rowID, downloadedAs] : files) {
+      if(this->exitFlag.load()) {
+        break;
+      }
+      lastRowID = rowID;
+      std::error_code ec;
+      // Moved already if another file shared the path
+      if(downloadedAs == "" || isShardedPath(this->config.downloadFolder, downloadedAs) || !std::filesystem::exists(downloadedAs, ec)) {
+        continue;
+      }
+      std::string storedAs;
+      if(!linkToSharded(downloadedAs, this->config.downloadFolder, storedAs) || !this->updateDownloadedAs(downloadedAs, storedAs)) {
+        continue;
+      }
+      std::filesystem::remove(downloadedAs, ec);
+      this->recorderMetrics.downloadsMigrated->inc();
+      ++migrated;
+    }
+  }
+  if(migrated) {
+    SPDLOG_INFO("Moved {} downloaded files to the sharded layout", migrated);
+  }
+  SPDLOG_DEBUG("Download migrator stopped");
+}
@@ -7,12 +7,17 @@
 #ifndef TELEGRAM_DATA_HPP
 #define TELEGRAM_DATA_HPP
 
+#include "message_content.hpp"
 #include "telegram_recorder.hpp"
+#include "text_utils.hpp"
 
 std::function<void(TDAPIObjectPtr)> checkAPICallSuccess(std::string callName);
+unsigned int getChatType(td_api::object_ptr<td_api::ChatType>& type);
 td_api::int53 getMessageSenderID(std::shared_ptr<td_api::message>& message);
 std::string getMessageText(std::shared_ptr<td_api::message>& message);
-std::string getMessageOrigin(std::shared_ptr<td_api::message>& message);
+// Empty if it's not forwarded. The view returned may point into the buffer or
+// into the message.
+std::string_view getMessageOrigin(std::shared_ptr<td_api::message>& message, IDBuffer& buffer);
 td::td_api::file* getMessageContentFileReference(td_api::object_ptr<td_api::MessageContent>& message);
 
 #endif
\ No newline at end of file
@@ -6,6 +6,7 @@
 
 // TODO: Video and voice chats
 
+#include <algorithm>
 #include <filesystem>
 #include <thread>
 
@@ -15,25 +16,107 @@
 #define SPDLOG_ACTIVE_LEVEL SPDLOG_LEVEL_TRACE
 #include <spdlog/spdlog.h>
 
+#include "db_partition.hpp"
 #include "hash.hpp"
+#include "logging.hpp"
 #include "telegram_data.hpp"
 #include "telegram_recorder.hpp"
+#include "text_utils.hpp"
 
-std::string join(std::vector<std::string>& vec, char separator = '.') {
-    std::ostringstream o;
-    auto cur = vec.begin();
-    if (cur != vec.end()) {
-        o << *cur++;
-        for (; cur != vec.end(); ++cur)
-            o << separator << *cur;
+TelegramRecorder::TelegramRecorder() : TelegramRecorder(nullptr, DEFAULT_CONFIG_FILE) {}
+
+TelegramRecorder::TelegramRecorder(std::unique_ptr<ClientBackend> backend, std::string configFile) : configFile(configFile) {
+    if(backend) {
+      this->ownedBackend = std::move(backend);
+    } else {
+      td::ClientManager::execute(td_api::make_object<td_api::setLogVerbosityLevel>(2));
+      this->ownedBackend = std::make_unique<TDClientBackend>();
     }
-    return o.str();
+    this->clientManager = this->ownedBackend.get();
+    this->clientID = this->clientManager->create_client_id();
+    this->initMetrics();
 }
 
-TelegramRecorder::TelegramRecorder() {
-    td::ClientManager::execute(td_api::make_object<td_api::setLogVerbosityLevel>(2));
-    this->clientManager = std::make_unique<td::ClientManager>();
-    this->clientID = this->clientManager->create_client_id();
+TelegramRecorder::TelegramRecorder(RecorderHost* host, ClientBackend* backend, DownloadScheduler* downloads, ConfigParams config) {
+  this->host = host;
+  this->clientManager = backend;
+  this->downloads = downloads;
+  this->config = config;
+  this->clientID = this->clientManager->create_client_id();
+  this->initMetrics();
+}
+
+void TelegramRecorder::initMetrics() {
+  MetricsRegistry& registry = metrics();
+  this->recorderMetrics.pendingQueries = &registry.gauge("tgrec_pending_queries", "TDLib queries waiting for a response", this->metricLabels());
+  this->recorderMetrics.readQueueMessages = &registry.gauge("tgrec_read_queue_messages", "Messages waiting to be marked as read", this->metricLabels());
+  this->recorderMetrics.writeQueueMessages = &registry.gauge("tgrec_write_queue_messages", "Messages waiting to be written to DB", this->metricLabels());
+  this->recorderMetrics.userCacheHits = &registry.counter("tgrec_cache_lookups_total", "Lookups in the user and chat caches", this->metricLabels("cache=\"user\",result=\"hit\""));
+  this->recorderMetrics.userCacheMisses = &registry.counter("tgrec_cache_lookups_total", "Lookups in the user and chat caches", this->metricLabels("cache=\"user\",result=\"miss\""));
+  this->recorderMetrics.chatCacheHits = &registry.counter("tgrec_cache_lookups_total", "Lookups in the user and chat caches", this->metricLabels("cache=\"chat\",result=\"hit\""));
+  this->recorderMetrics.chatCacheMisses = &registry.counter("tgrec_cache_lookups_total", "Lookups in the user and chat caches", this->metricLabels("cache=\"chat\",result=\"miss\""));
+  this->recorderMetrics.messagesWritten = &registry.counter("tgrec_messages_written_total", "Messages inserted in the DB", this->metricLabels());
+  this->recorderMetrics.messagesWriteFailed = &registry.counter("tgrec_messages_write_failed_total", "Messages dropped because their DB writer pass couldn't be committed", this->metricLabels());
+  this->recorderMetrics.textsRepaired = &registry.counter("tgrec_texts_utf8_repaired_total", "Texts with invalid UTF-8, stored with U+FFFD in its place", this->metricLabels());
+  this->recorderMetrics.commitLatency = &registry.histogram("tgrec_sqlite_commit_seconds", "Latency of committing a DB writer pass", this->metricLabels(), 1e-6);
+  this->recorderMetrics.downloadsInFlight = &registry.gauge("tgrec_downloads_in_flight", "Downloads requested to TDLib and not finished yet", this->metricLabels());
+  this->recorderMetrics.downloadsCompleted = &registry.counter("tgrec_downloads_total", "Finished downloads", this->metricLabels("result=\"completed\""));
+  this->recorderMetrics.downloadsFailed = &registry.counter("tgrec_downloads_total", "Finished downloads", this->metricLabels("result=\"failed\""));
+  this->recorderMetrics.downloadsSkipped = &registry.counter("tgrec_downloads_skipped_total", "Downloads not requested because the file is stored already", this->metricLabels());
+  this->recorderMetrics.downloadsMigrated = &registry.counter("tgrec_download_files_migrated_total", "Files moved from the flat download layout to the sharded one", this->metricLabels());
+  this->recorderMetrics.searchIndexBuilt = &registry.counter("tgrec_search_index_built_messages_total", "Messages recorded before the search index existed and added to it since", this->metricLabels());
+  this->recorderMetrics.searchIndexPending = &registry.gauge("tgrec_search_index_pending_messages", "Messages recorded before the search index existed and not added to it yet", this->metricLabels());
+  this->recorderMetrics.partitionRotations = &registry.counter("tgrec_db_partition_rotations_total", "Times the DB writer moved on to a new time partition", this->metricLabels());
+  this->recorderMetrics.partitionsSealed = &registry.counter("tgrec_db_partitions_sealed_total", "Time partitions optimized and made read-only", this->metricLabels());
+  this->recorderMetrics.downloadedBytes = &registry.counter("tgrec_downloaded_bytes_total", "Bytes of completed downloads", this->metricLabels());
+  this->recorderMetrics.messagesRead = &registry.counter("tgrec_messages_read_total", "Messages marked as read", this->metricLabels());
+  this->recorderMetrics.readerDrainRate = &registry.gauge("tgrec_reader_drain_rate", "Messages per second read during the last Active Period", this->metricLabels());
+  this->recorderMetrics.readerBacklogAge = &registry.gauge("tgrec_reader_backlog_age_seconds", "Age of the oldest message waiting to be read", this->metricLabels());
+  this->recorderMetrics.restarts = &registry.counter("tgrec_restarts_total", "TDLib client restarts", this->metricLabels());
+  this->recorderMetrics.queriesReissued = &registry.counter("tgrec_queries_reissued_total", "Queries sent again to a new TDLib client after a restart", this->metricLabels());
+  this->recorderMetrics.restartRecovery = &registry.histogram("tgrec_restart_recovery_seconds", "Time from a TDLib client restart until it's authorized again", this->metricLabels(), 1e-6);
+  this->recorderMetrics.backfilledMessages = &registry.counter("tgrec_backfilled_messages_total", "Messages missed while offline and recovered from the chat history", this->metricLabels());
+  this->recorderMetrics.backfillChatsPending = &registry.gauge("tgrec_backfill_chats_pending", "Chats whose history gap hasn't been backfilled yet", this->metricLabels());
+  this->recorderMetrics.archivedMessages = &registry.counter("tgrec_archived_messages_total", "Messages recorded from the history of archived chats", this->metricLabels());
+  this->recorderMetrics.archiveChatsPending = &registry.gauge("tgrec_archive_chats_pending", "Chats whose history hasn't been archived yet", this->metricLabels());
+  this->recorderMetrics.dedupNew = &registry.counter("tgrec_dedup_lookups_total", "Messages received checked against the ones already recorded", this->metricLabels("result=\"new\""));
+  this->recorderMetrics.dedupDuplicates = &registry.counter("tgrec_dedup_lookups_total", "Messages received checked against the ones already recorded", this->metricLabels("result=\"duplicate\""));
+  this->recorderMetrics.dedupFalsePositives = &registry.counter("tgrec_dedup_lookups_total", "Messages received checked against the ones already recorded", this->metricLabels("result=\"false_positive\""));
+  this->recorderMetrics.dedupFilterBytes = &registry.gauge("tgrec_dedup_filter_bytes", "Memory used by the filter of recorded messages", this->metricLabels());
+  this->recorderMetrics.dedupFilterFalsePositiveRate = &registry.gauge("tgrec_dedup_filter_false_positive_rate", "Estimated false positive rate of the filter of recorded messages", this->metricLabels());
+  this->recorderMetrics.threads = &registry.gauge("tgrec_account_threads", "Threads of the account, besides the ones shared with other accounts", this->metricLabels());
+  this->recorderMetrics.queriesThrottled = &registry.counter("tgrec_queries_throttled_total", "Queries held back to stay under the query rate limits", this->metricLabels());
+  this->recorderMetrics.queriesQueued = &registry.gauge("tgrec_queries_queued", "Queries waiting for the rate limits or a flood wait to be sent", this->metricLabels());
+  this->recorderMetrics.floodWaits = &registry.counter("tgrec_query_flood_waits_total", "Queries Telegram asked to send again later", this->metricLabels());
+  // Shared by every account in the process
+  this->recorderMetrics.downloadsQueued = &registry.gauge("tgrec_downloads_queued", "Downloads waiting for a free slot to be requested");
+  this->recorderMetrics.processResidentBytes = &registry.gauge("tgrec_process_resident_bytes", "Resident memory of the process");
+  this->recorderMetrics.processThreads = &registry.gauge("tgrec_process_threads", "Threads of the process, TDLib's included");
+}
+
+// Every metric of an account is labelled with its name when the process
+// records several
+std::string TelegramRecorder::metricLabels(const std::string& labels) {
+  if(this->config.accountName == "") {
+    return labels;
+  }
+  std::string account = "account=\"" + this->config.accountName + "\"";
+  return labels == "" ? account : account + "," + labels;
+}
+
+void TelegramRecorder::updateMetrics() {
+  ReaderStats stats = this->getReaderStats();
+  this->recorderMetrics.readerDrainRate->set(stats.drainRateMsgsPerSec);
+  this->recorderMetrics.readerBacklogAge->set(stats.backlogAgeSec);
+}
+
+std::string TelegramRecorder::renderMetrics() {
+  this->updateMetrics();
+  ProcessStats process = processStats();
+  this->recorderMetrics.processResidentBytes->set(process.residentBytes);
+  this->recorderMetrics.processThreads->set(process.threads);
+  this->recorderMetrics.downloadsQueued->set(this->downloads->queued());
+  return metrics().render();
 }
 
 void TelegramRecorder::start() {
@@ -42,24 +125,101 @@ void TelegramRecorder::start() {
     return;
   }
 
+  if(this->config.logAsync) {
+    enableAsyncLogging(this->config.logQueueSize);
+  }
+  LogRateLimiter::configure(this->config.logMessageRateLimit, this->config.logMessageSampleEvery);
+
+  if(this->config.metricsPort || this->config.metricsSocket != "") {
+    this->metricsServer = std::make_unique<MetricsServer>([this]() {
+      return this->renderMetrics();
+    });
+    if(this->config.metricsSocket != "") {
+      this->metricsServer->listenUnix(this->config.metricsSocket);
+    } else {
+      this->metricsServer->listenTCP(this->config.metricsPort);
+    }
+  }
+  if(this->config.captureFile != "") {
+    // Everything TDLib sends and receives from now on goes through the capture
+    std::unique_ptr<RecordingClientBackend> recording = std::make_unique<RecordingClientBackend>(std::move(this->ownedBackend));
+    if(recording->open(this->config.captureFile)) {
+      this->capture = recording.get();
+    }
+    this->ownedBackend = std::move(recording);
+    this->clientManager = this->ownedBackend.get();
+  }
+  this->ownedDownloads = std::make_unique<DownloadScheduler>(this->config.downloadMaxInFlight);
+  this->downloads = this->ownedDownloads.get();
+
+  if(!this->startAccount()) {
+    return;
+  }
+  this->recorderThread = std::thread(&TelegramRecorder::runRecorder, this);
+  this->writerThread = std::thread(&TelegramRecorder::runDBWriter, this);
+  this->recorderMetrics.threads->add(2);
+}
+
+// Everything but receiving from TDLib and writing to the DB, which a host
+// does for all its accounts
+bool TelegramRecorder::startAccount() {
+  if(!this->chatFilter.load(this->config.chatFilters, this->metricLabels())) {
+    SPDLOG_ERROR("Unable to load chat filters");
+    return false;
+  }
+  this->queryScheduler = QueryScheduler(this->config.queryBulkPerSec);
+  for(std::int32_t method : {td_api::getUser::ID, td_api::getUserFullInfo::ID, td_api::getChat::ID, td_api::getSupergroupFullInfo::ID, td_api::getBasicGroupFullInfo::ID}) {
+    this->queryScheduler.setMethodLimit(method, this->config.queryMetadataPerSec);
+  }
+  // History pages are backfilled and archived in bulk, out of the shared
+  // bucket so they can't hold back the lookups live messages wait on
+  this->queryScheduler.setMethodLimit(td_api::getChatHistory::ID, this->config.queryHistoryPerSec, false);
+  // Already capped by the downloads in flight, so they don't wait behind the
+  // metadata lookups
+  this->queryScheduler.setMethodLimit(td_api::downloadFile::ID, this->config.queryDownloadPerSec, false);
+  if(this->config.traceLogFile != "") {
+    this->tracer.openTraceLog(this->config.traceLogFile, this->config.traceSampleEvery);
+  }
   create_directory(std::filesystem::current_path() / this->config.downloadFolder);
+  // Open the DB before any thread can look up users and chats in it
+  if(!this->initDB()) {
+    SPDLOG_ERROR("Unable to initialise DB");
+    return false;
+  }
 
-  std::thread recorderThread(&TelegramRecorder::runRecorder, this);
-  recorderThread.detach();
-  std::thread readerThread(&TelegramRecorder::runMessageReader, this);
-  readerThread.detach();
-  std::thread writerThread(&TelegramRecorder::runDBWriter, this);
-  writerThread.detach();
+  this->readerThread = std::thread(&TelegramRecorder::runMessageReader, this);
+  // Their queries wait until the client is authorized
+  this->beginBackfill();
+  for(unsigned int i = 0; i < this->config.backfillParallelChats; ++i) {
+    this->backfillThreads.emplace_back(&TelegramRecorder::runBackfillWorker, this, false);
+  }
+  this->recorderMetrics.threads->add(1 + this->config.backfillParallelChats);
+  if(this->config.downloadLayout == DOWNLOAD_LAYOUT_SHARDED) {
+    this->migratorThread = std::thread(&TelegramRecorder::runDownloadMigrator, this);
+    this->recorderMetrics.threads->add(1);
+  }
+  if(this->config.searchIndex) {
+    this->indexerThread = std::thread(&TelegramRecorder::runSearchIndexer, this);
+    this->recorderMetrics.threads->add(1);
+  }
+  if(this->config.dbPartition != DB_PARTITION_NONE) {
+    this->sealerThread = std::thread(&TelegramRecorder::runPartitionSealer, this);
+    this->recorderMetrics.threads->add(1);
+  }
+  return true;
 }
 
 void TelegramRecorder::runRecorder() {
   SPDLOG_DEBUG("Recorder thread started");
   this->sendQuery(td_api::make_object<td_api::getOption>("version"), checkAPICallSuccess("version"));
-  while(!this->exitFlag.load()) {
+  // Keeps running after exitFlag is set, downloads still in flight need
+  // their responses processed
+  while(!this->closeFlag.load()) {
+    this->releaseQueries();
     if (this->needRestart) {
       this->restart();
     } else if (!this->authorized) {
-      this->processResponse(this->clientManager->receive(10));
+      this->processResponse(this->clientManager->receive(this->receiveTimeout(10)));
     } else {
       bool updatesAvailable = false;
       do {
@@ -70,66 +230,404 @@ void TelegramRecorder::runRecorder() {
           this->processResponse(std::move(response));
         }
       }while(updatesAvailable);
-      sleep(1);
+      // Wait for the next one, but not for so long that stopping or sending
+      // the queued queries is delayed
+      this->processResponse(this->clientManager->receive(this->receiveTimeout(SHUTDOWN_POLL_INTERVAL_MS / 1000.0)));
     }
   }
   SPDLOG_DEBUG("Recorder stopped");
-  this->sendQuery(td_api::make_object<td_api::logOut>(), checkAPICallSuccess("logOut"));
+  this->closeTDLib();
+}
+
+void TelegramRecorder::closeTDLib() {
   this->sendQuery(td_api::make_object<td_api::close>(), checkAPICallSuccess("close"));
+  // TDLib flushes its own state before reporting it's closed
+  while(!(this->authState && this->authState->get_id() == td_api::authorizationStateClosed::ID)) {
+    if(std::chrono::steady_clock::now() >= this->shutdownDeadline) {
+      SPDLOG_WARN("TDLib didn't close before the shutdown deadline");
+      return;
+    }
+    this->processResponse(this->clientManager->receive(SHUTDOWN_POLL_INTERVAL_MS / 1000.0));
+  }
+  SPDLOG_INFO("TDLib is closed");
+}
+
+bool TelegramRecorder::sleepUntilExit(std::chrono::steady_clock::time_point wakeUp) {
+  std::unique_lock<std::mutex> lk(this->exitMutex);
+  return this->exitRequested.wait_until(lk, wakeUp, [this]{return this->exitFlag.load();});
 }
 
 void TelegramRecorder::stop() {
-  this->exitFlag = true;
+  auto start = std::chrono::steady_clock::now();
+  this->shutdownDeadline = start + std::chrono::seconds(this->config.shutdownTimeoutSec);
+  std::uint64_t downloadsBefore = this->recorderMetrics.downloadsCompleted->get() + this->recorderMetrics.downloadsFailed->get();
+
+  std::size_t toFlush = this->stopWorkers();
   this->messagesAvailableToWrite.notify_all();
+  if(this->writerThread.joinable()) {
+    this->writerThread.join();
+  }
+
+  // Every download has been requested by now, as the writer requests them
+  while(this->recorderMetrics.downloadsInFlight->get() > 0 && std::chrono::steady_clock::now() < this->shutdownDeadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(SHUTDOWN_POLL_INTERVAL_MS));
+  }
+  std::uint64_t downloadsFinished = this->recorderMetrics.downloadsCompleted->get() + this->recorderMetrics.downloadsFailed->get() - downloadsBefore;
+  double downloadsAbandoned = this->recorderMetrics.downloadsInFlight->get();
+
+  this->closeFlag = true;
+  if(this->recorderThread.joinable()) {
+    this->recorderThread.join();
+  }
+  this->closeAccount();
+
+  if(this->metricsServer) {
+    this->metricsServer->stop();
+  }
+  if(this->capture) {
+    this->capture->close();
+  }
+  double elapsedSec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  SPDLOG_INFO(
+    "Shutdown finished in {:0.3f} seconds: flushed {} queued messages, finished {} downloads, abandoned {}, ignored {} messages received while stopping",
+    elapsedSec, toFlush, downloadsFinished, downloadsAbandoned, this->messagesIgnoredOnExit
+  );
+}
+
+void TelegramRecorder::reloadChatFilters() {
+  ConfigParams config;
+  if(!::loadConfig(this->configFile, config)) {
+    SPDLOG_ERROR("Unable to reload chat filters, keeping the current ones");
+    return;
+  }
+  this->chatFilter.load(config.chatFilters, this->metricLabels());
+}
+
+// Stops intake and joins every thread of the account but the writer.
+// Returns the messages left for the writer to flush.
+std::size_t TelegramRecorder::stopWorkers() {
+  // New messages aren't enqueued anymore and the reader stops before the
+  // next message
+  {
+    std::lock_guard<std::mutex> lk(this->exitMutex);
+    this->exitFlag = true;
+  }
+  this->exitRequested.notify_all();
+  if(this->readerThread.joinable()) {
+    this->readerThread.join();
+  }
+  // Backfill and archive workers stop after the current page, which is
+  // dropped
+  this->backfillMutex.lock();
+  this->backfillMutex.unlock();
+  this->backfillJobsAvailable.notify_all();
+  for(std::thread& worker : this->backfillThreads) {
+    worker.join();
+  }
+  this->backfillThreads.clear();
+  if(this->archiveThread.joinable()) {
+    this->archiveThread.join();
+  }
+  for(std::thread& worker : this->archiveThreads) {
+    worker.join();
+  }
+  this->archiveThreads.clear();
+  // Stops after the file it's moving
+  if(this->migratorThread.joinable()) {
+    this->migratorThread.join();
+  }
+  // Stops after the batch it's indexing
+  if(this->indexerThread.joinable()) {
+    this->indexerThread.join();
+  }
+  // Stops after the partition it's sealing
+  if(this->sealerThread.joinable()) {
+    this->sealerThread.join();
+  }
+
+  // The writer drains the queue in one last group commit before exiting
+  std::size_t toFlush = 0;
+  this->toWriteQueueMutex.lock();
+  for(auto it = this->toWriteMessageQueue.begin(); it != this->toWriteMessageQueue.end(); ++it) {
+    toFlush += it->second.size();
+  }
+  this->toWriteQueueMutex.unlock();
+  return toFlush;
+}
+
+// Response handlers write users, chats and files too, so the DB is closed
+// once nothing receives from TDLib anymore
+void TelegramRecorder::closeAccount() {
+  this->abandonQueries();
+  this->closeDB();
+  this->tracer.closeTraceLog();
+  this->recorderMetrics.threads->set(0);
 }
 
 void TelegramRecorder::restart() {
   SPDLOG_INFO("Restarting recorder");
-  this->clientManager.reset();
-  this->clientManager = std::make_unique<td::ClientManager>();
+  this->recorderMetrics.restarts->inc();
+  // The queues and caches are kept, only the work in flight on the old
+  // client has to be carried over. Request IDs keep growing, so late
+  // responses to the old client can't be mistaken for new ones.
+  this->tdapiQueryMutex.lock();
+  this->restartStart = std::chrono::steady_clock::now();
+  this->reconnecting = true;
+  this->restarted = true;
+  std::size_t dropped = 0;
+  for(auto it = this->handlers.begin(); it != this->handlers.end(); ++it) {
+    if(it->second.makeQuery) {
+      this->deferredQueries.push_back(std::move(it->second));
+    } else {
+      ++dropped;
+    }
+  }
+  this->handlers.clear();
+  this->recorderMetrics.pendingQueries->set(0);
+  // The ones that can be sent again were among the handlers
+  this->queuedQueries.clear();
+  this->queryScheduler.clear();
+  this->recorderMetrics.queriesQueued->set(0);
   this->clientID = this->clientManager->create_client_id();
   this->authorized = false;
   this->needRestart = false;
-  this->currentQueryID = 0;
   this->authQueryID = 0;
-  this->handlers.clear();
-  this->toReadMessageQueue.clear();
+  this->tdapiQueryMutex.unlock();
+  SPDLOG_INFO("{} queries will be sent again once authorized, {} dropped", this->deferredQueries.size(), dropped);
   this->sendQuery(td_api::make_object<td_api::getOption>("version"), checkAPICallSuccess("version"));
 }
 
+void TelegramRecorder::onAuthorized() {
+  this->tdapiQueryMutex.lock();
+  if(!this->reconnecting) {
+    this->tdapiQueryMutex.unlock();
+    return;
+  }
+  this->reconnecting = false;
+  bool restarted = this->restarted;
+  this->restarted = false;
+  std::vector<PendingQuery> deferred;
+  deferred.swap(this->deferredQueries);
+  for(PendingQuery& query : deferred) {
+    td_api::object_ptr<td_api::Function> func = query.makeQuery();
+    this->sendPendingQuery(std::move(func), std::move(query));
+  }
+  this->tdapiQueryMutex.unlock();
+  if(!restarted) {
+    return;
+  }
+  std::uint64_t recoveryMicros = elapsedMicros(this->restartStart);
+  this->recorderMetrics.queriesReissued->inc(deferred.size());
+  this->recorderMetrics.restartRecovery->record(recoveryMicros);
+  SPDLOG_INFO("Recovered from restart in {:0.3f} seconds, sent {} queries again", recoveryMicros / 1e6, deferred.size());
+  // Whatever arrived while the client was down is only in the history now
+  this->beginBackfill();
+}
+
 void TelegramRecorder::sendQuery(
   td_api::object_ptr<td_api::Function> func,
   std::function<void(TDAPIObjectPtr)> handler
 ) {
   this->tdapiQueryMutex.lock();
+  this->sendPendingQuery(std::move(func), PendingQuery{std::move(handler), nullptr});
+  this->tdapiQueryMutex.unlock();
+}
+
+void TelegramRecorder::sendIdempotentQuery(
+  std::function<td_api::object_ptr<td_api::Function>()> makeQuery,
+  std::function<void(TDAPIObjectPtr)> handler
+) {
+  this->sendIdempotentQuery(PendingQuery{std::move(handler), std::move(makeQuery)});
+}
+
+void TelegramRecorder::sendIdempotentQuery(PendingQuery query) {
+  this->tdapiQueryMutex.lock();
+  if(this->reconnecting) {
+    // It would fail on a client that isn't authorized yet
+    this->deferredQueries.push_back(std::move(query));
+  } else {
+    td_api::object_ptr<td_api::Function> func = query.makeQuery();
+    this->sendPendingQuery(std::move(func), std::move(query));
+  }
+  this->tdapiQueryMutex.unlock();
+}
+
+QueryAwaiter<1> TelegramRecorder::query(std::function<td_api::object_ptr<td_api::Function>()> makeQuery) {
+  return QueryAwaiter<1>(this, {std::move(makeQuery)});
+}
+
+QueryAwaiter<2> TelegramRecorder::queries(
+  std::function<td_api::object_ptr<td_api::Function>()> makeFirst,
+  std::function<td_api::object_ptr<td_api::Function>()> makeSecond
+) {
+  return QueryAwaiter<2>(this, {std::move(makeFirst), std::move(makeSecond)});
+}
+
+// Once nothing receives from TDLib anymore, frees the coroutines still
+// waiting on a query
+void TelegramRecorder::abandonQueries() {
+  std::vector<QueryJoin*> joins;
+  this->tdapiQueryMutex.lock();
+  for(auto it = this->handlers.begin(); it != this->handlers.end();) {
+    if(it->second.join) {
+      joins.push_back(it->second.join);
+      it = this->handlers.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  for(PendingQuery& query : this->deferredQueries) {
+    if(query.join) {
+      joins.push_back(query.join);
+    }
+  }
+  this->deferredQueries.clear();
+  this->tdapiQueryMutex.unlock();
+  for(QueryJoin* join : joins) {
+    abandonQuery(join);
+  }
+}
+
+// Queries the user could be waiting on go ahead of the ones fetching
+// metadata and files in bulk. Anything else, authorization and the like, is
+// never held back.
+static int queryPriority(std::int32_t method) {
+  switch(method) {
+    case td_api::viewMessages::ID:
+    case td_api::openChat::ID:
+    case td_api::closeChat::ID:
+      return QUERY_PRIORITY_INTERACTIVE;
+    case td_api::getUser::ID:
+    case td_api::getUserFullInfo::ID:
+    case td_api::getChat::ID:
+    case td_api::getSupergroupFullInfo::ID:
+    case td_api::getBasicGroupFullInfo::ID:
+    case td_api::getMessage::ID:
+    case td_api::getChatHistory::ID:
+    case td_api::downloadFile::ID:
+      return QUERY_PRIORITY_BULK;
+    default:
+      return QUERY_PRIORITY_CONTROL;
+  }
+}
+
+// Must be called with tdapiQueryMutex held
+void TelegramRecorder::sendPendingQuery(td_api::object_ptr<td_api::Function> func, PendingQuery query) {
   ++this->currentQueryID;
   SPDLOG_DEBUG("Sending query type {} with ID {}", func->get_id(), this->currentQueryID);
-  if(handler) {
-    this->handlers.emplace(this->currentQueryID, std::move(handler));
+  if(query.handler || query.join) {
+    this->handlers.emplace(this->currentQueryID, std::move(query));
+    this->recorderMetrics.pendingQueries->set(this->handlers.size());
+  }
+  std::int32_t method = func->get_id();
+  if(!this->queryScheduler.admit(this->currentQueryID, method, queryPriority(method), std::chrono::steady_clock::now())) {
+    // Sent by releaseQueries() once the rate limits allow it
+    this->queuedQueries.emplace(this->currentQueryID, std::move(func));
+    this->recorderMetrics.queriesThrottled->inc();
+    this->recorderMetrics.queriesQueued->set(this->queryScheduler.queued());
+    return;
   }
   this->clientManager->send(this->clientID, this->currentQueryID, std::move(func));
+}
+
+// Must be called with tdapiQueryMutex held. Telegram turned the query down
+// for being sent too often, so it's built again and queued until the wait is
+// over, under a new request ID.
+void TelegramRecorder::retryQuery(PendingQuery query, int retryAfterSec) {
+  td_api::object_ptr<td_api::Function> func = query.makeQuery();
+  std::int32_t method = func->get_id();
+  ++query.floodRetries;
+  ++this->currentQueryID;
+  SPDLOG_WARN("Flood wait of {} seconds for query type {}, retrying it with ID {}", retryAfterSec, method, this->currentQueryID);
+  this->recorderMetrics.floodWaits->inc();
+  this->handlers.emplace(this->currentQueryID, std::move(query));
+  this->queuedQueries.emplace(this->currentQueryID, std::move(func));
+  this->queryScheduler.retryAfter(this->currentQueryID, method, queryPriority(method), retryAfterSec, std::chrono::steady_clock::now());
+  this->recorderMetrics.queriesQueued->set(this->queryScheduler.queued());
+}
+
+// Sends the queued queries the rate limits allow by now
+void TelegramRecorder::releaseQueries() {
+  this->tdapiQueryMutex.lock();
+  std::vector<std::uint64_t> due = this->queryScheduler.due(std::chrono::steady_clock::now());
+  for(std::uint64_t id : due) {
+    auto it = this->queuedQueries.find(id);
+    if(it == this->queuedQueries.end()) {
+      continue;
+    }
+    this->clientManager->send(this->clientID, id, std::move(it->second));
+    this->queuedQueries.erase(it);
+  }
+  if(!due.empty()) {
+    this->recorderMetrics.queriesQueued->set(this->queryScheduler.queued());
+  }
   this->tdapiQueryMutex.unlock();
 }
 
+// How long to wait for responses without delaying the next queued query
+double TelegramRecorder::receiveTimeout(double maxSec) {
+  auto now = std::chrono::steady_clock::now();
+  this->tdapiQueryMutex.lock();
+  auto next = this->queryScheduler.nextDue(now);
+  this->tdapiQueryMutex.unlock();
+  if(next == QueryScheduler::Clock::time_point::max()) {
+    return maxSec;
+  }
+  return std::max(0.0, std::min(maxSec, std::chrono::duration<double>(next - now).count()));
+}
+
 void TelegramRecorder::processResponse(td::ClientManager::Response response) {
   if(response.object) {
+    if(response.client_id != this->clientID) {
+      // Leftovers from a client closed before a restart
+      SPDLOG_DEBUG("Ignoring response for client ID {}", response.client_id);
+      return;
+    }
     if(!response.request_id) {
       // request_id value of 0 indicates an update from TDLib
       this->processUpdate(std::move(response.object));
       return;
     }
     SPDLOG_DEBUG("Processing response for request ID {}", response.request_id);
+    // Queries are sent from other threads too, so take the handler out with
+    // the lock held, but call it without, since it might send more queries
+    PendingQuery answered;
+    this->tdapiQueryMutex.lock();
     auto it = this->handlers.find(response.request_id);
     if(it != this->handlers.end()) {
-      // if a handler is found for the request ID, call it!
-      it->second(std::move(response.object));
+      PendingQuery query = std::move(it->second);
       this->handlers.erase(it);
+      int retryAfterSec = -1;
+      if(response.object->get_id() == td_api::error::ID && query.makeQuery && !this->exitFlag.load() && query.floodRetries < QUERY_MAX_FLOOD_RETRIES) {
+        const td_api::error& error = static_cast<const td_api::error&>(*response.object);
+        retryAfterSec = parseRetryAfter(error.code_, error.message_);
+      }
+      if(retryAfterSec >= 0) {
+        this->retryQuery(std::move(query), retryAfterSec);
+      } else {
+        answered = std::move(query);
+      }
+      this->recorderMetrics.pendingQueries->set(this->handlers.size());
+    }
+    this->tdapiQueryMutex.unlock();
+    if(answered.join) {
+      *answered.result = std::move(response.object);
+      answerQuery(answered.join);
+    } else if(answered.handler) {
+      // if a handler is found for the request ID, call it!
+      answered.handler(std::move(response.object));
     }
   } 
 }
 
 void TelegramRecorder::processUpdate(TDAPIObjectPtr update) {
   SPDLOG_DEBUG("Processing Telegram update type {}", update->get_id());
+  auto counter = this->updateCounters.find(update->get_id());
+  if(counter == this->updateCounters.end()) {
+    Counter* c = &metrics().counter("tgrec_tdlib_updates_total", "Updates received from TDLib by type ID", "type_id=\"" + std::to_string(update->get_id()) + "\"");
+    counter = this->updateCounters.emplace(update->get_id(), c).first;
+  }
+  counter->second->inc();
   td_api::downcast_call(
     *update,
     overload {
@@ -144,11 +642,19 @@ void TelegramRecorder::processUpdate(TDAPIObjectPtr update) {
       [this](td_api::updateNewChat& updateNewChat) {
         // A new chat has been loaded/created
         SPDLOG_DEBUG("Received update: updateNewChat");
+        this->chatFilter.learnChat(updateNewChat.chat_->id_, getChatType(updateNewChat.chat_->type_), updateNewChat.chat_->title_);
+        if(!this->chatFilter.allows(updateNewChat.chat_->id_)) {
+          return;
+        }
         this->retrieveAndWriteChatFromTelegram(updateNewChat.chat_->id_);
       },
       [this](td_api::updateChatTitle& updateChatTitle) {
         // The title of a chat was changed
         SPDLOG_DEBUG("Received update: updateChatTitle");
+        this->chatFilter.learnTitle(updateChatTitle.chat_id_, updateChatTitle.title_);
+        if(!this->chatFilter.allows(updateChatTitle.chat_id_)) {
+          return;
+        }
         this->retrieveAndWriteChatFromTelegram(updateChatTitle.chat_id_);
       },
       [this](td_api::updateUser& updateUser) {
@@ -159,17 +665,26 @@ void TelegramRecorder::processUpdate(TDAPIObjectPtr update) {
       [this](td_api::updateChatPhoto& updateChatPhoto) {
         // Chat photo was changed
         SPDLOG_DEBUG("Received update: updateChatPhoto");
+        if(!this->chatFilter.allows(updateChatPhoto.chat_id_)) {
+          return;
+        }
         this->retrieveAndWriteChatFromTelegram(updateChatPhoto.chat_id_);
       },
       [this](td_api::updateMessageContent& updateMessageContent) {
         // Message content changed
         SPDLOG_DEBUG("Received update: updateMessageContent");
+        if(!this->chatFilter.allows(updateMessageContent.chat_id_)) {
+          return;
+        }
         std::string compoundMessageID = std::to_string(updateMessageContent.chat_id_) + ":" + std::to_string(updateMessageContent.message_id_);
         this->updateMessageContent(compoundMessageID, updateMessageContent.new_content_, td_api::int32(time(0)));
       },
       [this](td_api::updateMessageEdited& updateMessageEdited) {
         // Message was edited
         SPDLOG_DEBUG("Received update: updateMessageEdited");
+        if(!this->chatFilter.allows(updateMessageEdited.chat_id_)) {
+          return;
+        }
         this->updateMessageText(updateMessageEdited.chat_id_, updateMessageEdited.message_id_, updateMessageEdited.edit_date_);
       },
       [this](td_api::updateUserFullInfo& updateUserFullInfo) {
@@ -193,10 +708,25 @@ void TelegramRecorder::processUpdate(TDAPIObjectPtr update) {
       [this](td_api::updateNewMessage& updateNewMessage) {
         // A new message was received
         SPDLOG_DEBUG("Received update: updateNewMessage");
+        if(!this->chatFilter.allows(updateNewMessage.message_->chat_id_)) {
+          return;
+        }
         std::shared_ptr<td_api::message> message = std::shared_ptr<td_api::message>(updateNewMessage.message_.release());
+        if(this->isKnownMessage(message->chat_id_, message->id_)) {
+          SPDLOG_DEBUG("Message {} from chat {} is already recorded", message->id_, message->chat_id_);
+          return;
+        }
+        this->tracer.begin(
+          getCompoundMessageID(message->chat_id_, message->id_),
+          message->content_->get_id(),
+          getMessageContentFileReference(message->content_) != NULL
+        );
 
         std::unique_ptr<TelegramUser>* senderPtr = this->userCache.get(getMessageSenderID(message));
-        if(!senderPtr) {
+        if(senderPtr) {
+          this->recorderMetrics.userCacheHits->inc();
+        } else {
+          this->recorderMetrics.userCacheMisses->inc();
           std::unique_ptr<TelegramUser> sender = this->retrieveUserFromDB(getMessageSenderID(message));
           if(sender) {
             this->userCache.put(getMessageSenderID(message), std::move(sender));
@@ -206,7 +736,10 @@ void TelegramRecorder::processUpdate(TDAPIObjectPtr update) {
         }
 
         std::unique_ptr<TelegramChat>* chatPtr = this->chatCache.get(message->chat_id_);
-        if(!chatPtr) {
+        if(chatPtr) {
+          this->recorderMetrics.chatCacheHits->inc();
+        } else {
+          this->recorderMetrics.chatCacheMisses->inc();
           std::unique_ptr<TelegramChat> chat = this->retrieveChatFromDB(message->chat_id_);
           if(chat) {
             this->chatCache.put(message->chat_id_, std::move(chat));
@@ -222,146 +755,160 @@ void TelegramRecorder::processUpdate(TDAPIObjectPtr update) {
   );
 }
 
-void TelegramRecorder::retrieveAndWriteChatFromTelegram(td_api::int53 chatID) {
-  td_api::object_ptr<td::td_api::getChat> getChat = td_api::make_object<td_api::getChat>();
-  getChat->chat_id_ = chatID;
-  this->sendQuery(std::move(getChat), [this, chatID](TDAPIObjectPtr object) {
+bool TelegramRecorder::startLookup(std::unordered_set<td_api::int53>& inFlight, td_api::int53 id) {
+  std::lock_guard<std::mutex> lk(this->lookupsMutex);
+  return inFlight.insert(id).second;
+}
+
+void TelegramRecorder::finishLookup(std::unordered_set<td_api::int53>& inFlight, td_api::int53 id) {
+  std::lock_guard<std::mutex> lk(this->lookupsMutex);
+  inFlight.erase(id);
+}
+
+QueryTask TelegramRecorder::retrieveAndWriteChatFromTelegram(td_api::int53 chatID) {
+  if(!this->startLookup(this->chatsInFlight, chatID)) {
+    co_return;
+  }
+  TDAPIObjectPtr object = co_await this->query([chatID]() {
+    td_api::object_ptr<td::td_api::getChat> getChat = td_api::make_object<td_api::getChat>();
+    getChat->chat_id_ = chatID;
+    return getChat;
+  });
+  this->finishLookup(this->chatsInFlight, chatID);
+  if(!object) {
+    SPDLOG_ERROR("NULL response received when calling getChat for chat ID {}", chatID);
+    co_return;
+  }
+  if(object->get_id() == td_api::error::ID) {
+    td_api::object_ptr<td_api::error> err = td::move_tl_object_as<td_api::error>(object);
+    SPDLOG_ERROR("Retrieve chat info for chat ID {} failed: {}", chatID, err->message_);
+    co_return;
+  }
+  td_api::object_ptr<td_api::chat> c = td::move_tl_object_as<td_api::chat>(object);
+  std::string fileOrigin;
+  std::string fileOriginID;
+  if(c->photo_) {
+    fileOrigin = std::to_string(c->id_);
+    std::string fileIDStr = std::to_string(c->photo_->big_->id_) + ":" + fileOrigin;
+    fileOriginID = SHA256(fileIDStr.c_str(), fileIDStr.size());
+    this->downloadFile(*c->photo_->big_, fileOrigin, fileOriginID);
+  }
+
+  TelegramChat* chat = new TelegramChat;
+  chat->chatID = c->id_;
+  chat->name = c->title_;
+  chat->about = "";
+  chat->profilePicFileID = fileOriginID;
+  std::unique_ptr<TelegramChat> chatPtr = std::unique_ptr<TelegramChat>(chat);
+
+  if(c->type_->get_id() == td_api::chatTypeSupergroup::ID) {
+    td_api::int53 groupID = static_cast<td_api::chatTypeSupergroup&>(*c->type_).supergroup_id_;
+    chatPtr->groupID = groupID;
+    this->writeChatToDB(chatPtr);
+    this->chatCache.put(chat->chatID, std::move(chatPtr));
+
+    object = co_await this->query([groupID]() {
+      td_api::object_ptr<td::td_api::getSupergroupFullInfo> getSupergroupFullInfo = td_api::make_object<td_api::getSupergroupFullInfo>();
+      getSupergroupFullInfo->supergroup_id_ = groupID;
+      return getSupergroupFullInfo;
+    });
     if(!object) {
-      SPDLOG_ERROR("NULL response received when calling getChat for chat ID {}", chatID);
-      return;
+      SPDLOG_ERROR("NULL response received when calling getSupergroupFullInfo for group ID {}", groupID);
+      co_return;
     }
     if(object->get_id() == td_api::error::ID) {
       td_api::object_ptr<td_api::error> err = td::move_tl_object_as<td_api::error>(object);
-      SPDLOG_ERROR("Retrieve chat info for chat ID {} failed: {}", chatID, err->message_);
-      return;
+      SPDLOG_ERROR("Retrieve group info for group ID {} failed: {}", groupID, err->message_);
+      co_return;
     }
-    std::shared_ptr<td_api::chat> c = std::shared_ptr<td_api::chat>(td::move_tl_object_as<td_api::chat>(object).release());
-    std::string fileOrigin;
-    std::string fileOriginID;
-    if(c->photo_) {
-      fileOrigin = std::to_string(c->id_);
-      std::string fileIDStr = std::to_string(c->photo_->big_->id_) + ":" + fileOrigin;
-      fileOriginID = SHA256(fileIDStr.c_str(), fileIDStr.size());
-      this->downloadFile(*c->photo_->big_, fileOrigin);
-    }
-    
-    TelegramChat* chat = new TelegramChat;
-    chat->chatID = c->id_;
-    chat->name = c->title_;
-    chat->about = "";
-    chat->profilePicFileID = fileOriginID;
-    std::unique_ptr<TelegramChat> chatPtr = std::unique_ptr<TelegramChat>(chat);
-
-    if(c->type_->get_id() == td_api::chatTypeSupergroup::ID) {
-      td_api::object_ptr<td::td_api::chatTypeSupergroup> chatTypeSupergroup = td::move_tl_object_as<td_api::chatTypeSupergroup>(c->type_);
-      td_api::object_ptr<td::td_api::getSupergroupFullInfo> getSupergroupFullInfo = td_api::make_object<td_api::getSupergroupFullInfo>();
-      getSupergroupFullInfo->supergroup_id_ = chatTypeSupergroup->supergroup_id_;
-      
-      chatPtr->groupID = chatTypeSupergroup->supergroup_id_;
-      this->writeChatToDB(chatPtr);
-      this->chatCache.put(chat->chatID, std::move(chatPtr));
-    
-      this->sendQuery(std::move(getSupergroupFullInfo), [this, groupID = chatTypeSupergroup->supergroup_id_](TDAPIObjectPtr object) {
-        if(!object) {
-          SPDLOG_ERROR("NULL response received when calling getSupergroupFullInfo for group ID {}", groupID);
-          return;
-        }
-        if(object->get_id() == td_api::error::ID) {
-          td_api::object_ptr<td_api::error> err = td::move_tl_object_as<td_api::error>(object);
-          SPDLOG_ERROR("Retrieve group info for group ID {} failed: {}", groupID, err->message_);
-          return;
-        }
-        td_api::object_ptr<td::td_api::supergroupFullInfo> sgfi = td::move_tl_object_as<td_api::supergroupFullInfo>(object);
-        this->updateGroupData(td::move_tl_object_as<td_api::Object>(sgfi), groupID);
-      });
-    } else if(c->type_->get_id() == td_api::chatTypeBasicGroup::ID) {
-      td_api::object_ptr<td::td_api::chatTypeBasicGroup> chatTypeBasicGroup = td::move_tl_object_as<td_api::chatTypeBasicGroup>(c->type_);
-      td_api::object_ptr<td::td_api::getBasicGroupFullInfo> getBasicGroupFullInfo = td_api::make_object<td_api::getBasicGroupFullInfo>();
-      getBasicGroupFullInfo->basic_group_id_ = chatTypeBasicGroup->basic_group_id_;
+    this->updateGroupData(std::move(object), groupID);
+  } else if(c->type_->get_id() == td_api::chatTypeBasicGroup::ID) {
+    td_api::int53 groupID = static_cast<td_api::chatTypeBasicGroup&>(*c->type_).basic_group_id_;
+    chatPtr->groupID = groupID;
+    this->writeChatToDB(chatPtr);
+    this->chatCache.put(chat->chatID, std::move(chatPtr));
 
-      chatPtr->groupID = chatTypeBasicGroup->basic_group_id_;
-      this->writeChatToDB(chatPtr);
-      this->chatCache.put(chat->chatID, std::move(chatPtr));
-
-      this->sendQuery(std::move(getBasicGroupFullInfo), [this, groupID = chatTypeBasicGroup->basic_group_id_](TDAPIObjectPtr object) {
-        if(!object) {
-          SPDLOG_ERROR("NULL response received when calling getBasicGroupFullInfo for group ID {}", groupID);
-          return;
-        }
-        if(object->get_id() == td_api::error::ID) {
-          td_api::object_ptr<td_api::error> err = td::move_tl_object_as<td_api::error>(object);
-          SPDLOG_ERROR("Retrieve group info for group ID {} failed: {}", groupID, err->message_);
-          return;
-        }
-        td_api::object_ptr<td::td_api::basicGroupFullInfo> bgfi = td::move_tl_object_as<td_api::basicGroupFullInfo>(object);
-        this->updateGroupData(td::move_tl_object_as<td_api::Object>(bgfi), groupID);
-      });
-    } else {
-      this->writeChatToDB(chatPtr);
-      this->chatCache.put(chat->chatID, std::move(chatPtr));
-    }
-  });
-}
-
-void TelegramRecorder::retrieveAndWriteUserFromTelegram(td_api::int53 userID) {
-  td_api::object_ptr<td_api::getUser> getUser = td_api::make_object<td_api::getUser>();
-  getUser->user_id_ = userID;
-  this->sendQuery(std::move(getUser), [this, userID](TDAPIObjectPtr object) {
+    object = co_await this->query([groupID]() {
+      td_api::object_ptr<td::td_api::getBasicGroupFullInfo> getBasicGroupFullInfo = td_api::make_object<td_api::getBasicGroupFullInfo>();
+      getBasicGroupFullInfo->basic_group_id_ = groupID;
+      return getBasicGroupFullInfo;
+    });
     if(!object) {
-      SPDLOG_ERROR("NULL response received when calling getUser for user ID {}", userID);
-      return;
+      SPDLOG_ERROR("NULL response received when calling getBasicGroupFullInfo for group ID {}", groupID);
+      co_return;
     }
     if(object->get_id() == td_api::error::ID) {
       td_api::object_ptr<td_api::error> err = td::move_tl_object_as<td_api::error>(object);
-      SPDLOG_ERROR("Retrieve user info for user ID {} failed: {}", userID, err->message_);
-      return;
+      SPDLOG_ERROR("Retrieve group info for group ID {} failed: {}", groupID, err->message_);
+      co_return;
     }
-    std::shared_ptr<td_api::user> u = std::shared_ptr<td_api::user>(td::move_tl_object_as<td_api::user>(object).release());
-    // To get the bio...
+    this->updateGroupData(std::move(object), groupID);
+  } else {
+    this->writeChatToDB(chatPtr);
+    this->chatCache.put(chat->chatID, std::move(chatPtr));
+  }
+}
+
+QueryTask TelegramRecorder::retrieveAndWriteUserFromTelegram(td_api::int53 userID) {
+  if(!this->startLookup(this->usersInFlight, userID)) {
+    co_return;
+  }
+  // The full info has the bio. Neither query needs the other's response, so
+  // they're sent together.
+  auto [object, fullInfo] = co_await this->queries([userID]() {
+    td_api::object_ptr<td_api::getUser> getUser = td_api::make_object<td_api::getUser>();
+    getUser->user_id_ = userID;
+    return getUser;
+  }, [userID]() {
     td_api::object_ptr<td_api::getUserFullInfo> getUserFullInfo = td_api::make_object<td_api::getUserFullInfo>();
-    getUserFullInfo->user_id_ = u->id_;
-    this->sendQuery(std::move(getUserFullInfo), [this, u](TDAPIObjectPtr object) {
-      if(!object) {
-        SPDLOG_ERROR("NULL response received when calling getUserFullInfo for user ID {}", u->id_);
-        return;
-      }
-      if(object->get_id() == td_api::error::ID) {
-      td_api::object_ptr<td_api::error> err = td::move_tl_object_as<td_api::error>(object);
-      SPDLOG_ERROR("Retrieve user full info for user ID {} failed: {}", u->id_, err->message_);
-      return;
-    }
-      std::string fileOriginID;
-      std::string bio;
-      if(object->get_id() == td_api::error::ID) {
-        td_api::object_ptr<td_api::error> err = td::move_tl_object_as<td_api::error>(object);
-        SPDLOG_ERROR("Retrieve full user info for user ID {} failed: {}", u->id_, err->message_);
-      } else {
-        td::tl::unique_ptr<td_api::userFullInfo> ufi = td::move_tl_object_as<td_api::userFullInfo>(object);
-        std::string fileOrigin;
-        if (ufi->bio_) {
-            bio = ufi->bio_->text_;
-        }
-        if(u->profile_photo_ && u->profile_photo_->id_) {
-          fileOrigin = std::to_string(u->id_);
-          std::string fileIDStr = std::to_string(u->profile_photo_->big_->id_)  + ":" + fileOrigin;
-          fileOriginID = SHA256(fileIDStr.c_str(), fileIDStr.size());
-          this->downloadFile(*u->profile_photo_->big_, fileOrigin);
-        }
-      }
-      TelegramUser* user = new TelegramUser;
-      user->userID = u->id_;
-      user->fullName = (u->last_name_ == "" ? u->first_name_ : (u->first_name_ + " " + u->last_name_));
-      if (u->usernames_) {
-        // First username is the active username
-        user->activeUserName = u->usernames_->active_usernames_[0];
-        user->userNames = join(u->usernames_->active_usernames_);
-        user->disabledUserNames = join(u->usernames_->disabled_usernames_);
-      }
-      user->profilePicFileID = fileOriginID;
-      user->bio = bio;
-      std::unique_ptr<TelegramUser> userPtr = std::unique_ptr<TelegramUser>(user);
-      this->writeUserToDB(userPtr);
-      this->userCache.put(user->userID, std::move(userPtr));
-    });
+    getUserFullInfo->user_id_ = userID;
+    return getUserFullInfo;
   });
+  // Cached right after, or looked up again by its next message if this failed
+  this->finishLookup(this->usersInFlight, userID);
+  if(!object) {
+    SPDLOG_ERROR("NULL response received when calling getUser for user ID {}", userID);
+    co_return;
+  }
+  if(object->get_id() == td_api::error::ID) {
+    td_api::object_ptr<td_api::error> err = td::move_tl_object_as<td_api::error>(object);
+    SPDLOG_ERROR("Retrieve user info for user ID {} failed: {}", userID, err->message_);
+    co_return;
+  }
+  if(!fullInfo) {
+    SPDLOG_ERROR("NULL response received when calling getUserFullInfo for user ID {}", userID);
+    co_return;
+  }
+  if(fullInfo->get_id() == td_api::error::ID) {
+    td_api::object_ptr<td_api::error> err = td::move_tl_object_as<td_api::error>(fullInfo);
+    SPDLOG_ERROR("Retrieve user full info for user ID {} failed: {}", userID, err->message_);
+    co_return;
+  }
+  td_api::object_ptr<td_api::user> u = td::move_tl_object_as<td_api::user>(object);
+  td_api::object_ptr<td_api::userFullInfo> ufi = td::move_tl_object_as<td_api::userFullInfo>(fullInfo);
+  std::string fileOriginID;
+  std::string bio;
+  if (ufi->bio_) {
+    bio = ufi->bio_->text_;
+  }
+  if(u->profile_photo_ && u->profile_photo_->id_) {
+    std::string fileOrigin = std::to_string(u->id_);
+    std::string fileIDStr = std::to_string(u->profile_photo_->big_->id_)  + ":" + fileOrigin;
+    fileOriginID = SHA256(fileIDStr.c_str(), fileIDStr.size());
+    this->downloadFile(*u->profile_photo_->big_, fileOrigin, fileOriginID);
+  }
+  TelegramUser* user = new TelegramUser;
+  user->userID = u->id_;
+  user->fullName = (u->last_name_ == "" ? u->first_name_ : (u->first_name_ + " " + u->last_name_));
+  if (u->usernames_) {
+    // First username is the active username
+    user->activeUserName = u->usernames_->active_usernames_[0];
+    user->userNames = join(u->usernames_->active_usernames_);
+    user->disabledUserNames = join(u->usernames_->disabled_usernames_);
+  }
+  user->profilePicFileID = fileOriginID;
+  user->bio = bio;
+  std::unique_ptr<TelegramUser> userPtr = std::unique_ptr<TelegramUser>(user);
+  this->writeUserToDB(userPtr);
+  this->userCache.put(user->userID, std::move(userPtr));
 }
\ No newline at end of file
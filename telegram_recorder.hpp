@@ -7,23 +7,52 @@
 #ifndef TELEGRAM_RECORDER_HPP
 #define TELEGRAM_RECORDER_HPP
 
+#include <array>
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <deque>
 #include <functional>
 #include <iostream>
 #include <map>
 #include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 
 #include <sqlite3.h>
 #include <td/telegram/td_api.hpp>
 #include <td/telegram/Client.h>
 #include <td/telegram/td_api.h>
 
+#include "bloom_filter.hpp"
+#include "capture_backend.hpp"
+#include "chat_filter.hpp"
+#include "client_backend.hpp"
 #include "config.hpp"
+#include "download_layout.hpp"
+#include "download_scheduler.hpp"
 #include "lru.hpp"
+#include "message_tracer.hpp"
+#include "metrics.hpp"
+#include "metrics_server.hpp"
+#include "query_scheduler.hpp"
+#include "query_task.hpp"
 
 #define USER_CACHE_SIZE 32
 #define CHAT_CACHE_SIZE 32
+#define SHUTDOWN_POLL_INTERVAL_MS 100
+#define BACKFILL_PAGE_SIZE 100
+// Backfilling pauses while more live messages than this wait to be written
+#define BACKFILL_MAX_WRITE_QUEUE 1000
+#define ARCHIVE_LOAD_CHATS_LIMIT 100
+#define ARCHIVE_MAX_CHATS 100000
+#define DOWNLOAD_MIGRATION_BATCH_SIZE 100
+// Building the search index pauses while more live messages than this wait
+// to be written
+#define SEARCH_INDEX_MAX_WRITE_QUEUE 1000
+// Flood waits a query is retried after before its handler gets the error
+#define QUERY_MAX_FLOOD_RETRIES 5
 
 namespace td_api = td::td_api;
 
@@ -43,6 +72,103 @@ typedef struct TelegramUser {
   std::string profilePicFileID;
 } TelegramUser;
 
+typedef struct ReaderStats {
+  std::uint64_t messagesRead;
+  double drainRateMsgsPerSec;
+  std::size_t pendingMessages;
+  double backlogAgeSec;
+} ReaderStats;
+
+typedef struct RecorderMetrics {
+  Gauge* pendingQueries;
+  Gauge* readQueueMessages;
+  Gauge* writeQueueMessages;
+  Counter* userCacheHits;
+  Counter* userCacheMisses;
+  Counter* chatCacheHits;
+  Counter* chatCacheMisses;
+  Counter* messagesWritten;
+  Counter* messagesWriteFailed;
+  Counter* textsRepaired;
+  Histogram* commitLatency;
+  Gauge* downloadsInFlight;
+  Counter* downloadsCompleted;
+  Counter* downloadsFailed;
+  Counter* downloadsSkipped;
+  Counter* downloadsMigrated;
+  Counter* searchIndexBuilt;
+  Gauge* searchIndexPending;
+  Counter* partitionRotations;
+  Counter* partitionsSealed;
+  Counter* downloadedBytes;
+  Counter* messagesRead;
+  Gauge* readerDrainRate;
+  Gauge* readerBacklogAge;
+  Counter* restarts;
+  Counter* queriesReissued;
+  Histogram* restartRecovery;
+  Counter* backfilledMessages;
+  Gauge* backfillChatsPending;
+  Counter* archivedMessages;
+  Gauge* archiveChatsPending;
+  Counter* dedupNew;
+  Counter* dedupDuplicates;
+  Counter* dedupFalsePositives;
+  Gauge* dedupFilterBytes;
+  Gauge* dedupFilterFalsePositiveRate;
+  Gauge* threads;
+  Gauge* downloadsQueued;
+  Gauge* processResidentBytes;
+  Gauge* processThreads;
+  Counter* queriesThrottled;
+  Gauge* queriesQueued;
+  Counter* floodWaits;
+} RecorderMetrics;
+
+typedef struct PendingQuery {
+  std::function<void(TDAPIObjectPtr)> handler;
+  // Only set for idempotent queries, builds the query again so it can be
+  // sent to a new client after a restart
+  std::function<td_api::object_ptr<td_api::Function>()> makeQuery;
+  unsigned int floodRetries{0};
+  // Set instead of a handler for queries a coroutine waits on. The response
+  // is stored in result, in the coroutine's frame.
+  QueryJoin* join{nullptr};
+  TDAPIObjectPtr* result{nullptr};
+} PendingQuery;
+
+// Messages newer than until and older than cursor (or any, while cursor is
+// 0) are still missing from a chat. An until of 0 means there's no gap.
+typedef struct BackfillCheckpoint {
+  td_api::int53 until;
+  td_api::int53 cursor;
+} BackfillCheckpoint;
+
+// Progress archiving a chat's whole history, newest first
+typedef struct ArchiveCheckpoint {
+  td_api::int53 cursor;
+  std::uint64_t messages;
+  bool finished;
+} ArchiveCheckpoint;
+
+typedef struct BackfillJob {
+  td_api::int53 chatID{0};
+  td_api::int53 until{0};
+  td_api::int53 cursor{0};
+  // The gap left by an interrupted backfill pass, paged once this one is
+  // covered
+  td_api::int53 resumeUntil{0};
+  td_api::int53 resumeCursor{0};
+  std::uint64_t generation{0};
+  // Archival jobs go back to the start of the chat, or as far as the depth
+  // limit allows, and aren't part of any backfill pass
+  bool archive{false};
+  bool finished{false};
+  std::uint64_t messages{0};
+  std::uint64_t resumedAt{0};
+  std::chrono::steady_clock::time_point started;
+} BackfillJob;
+
 typedef struct TelegramChat {
   td_api::int53 chatID;
   td_api::int53 groupID;
@@ -51,20 +177,89 @@ typedef struct TelegramChat {
   std::string profilePicFileID;
 } TelegramChat;
 
+class RecorderHost;
+class TelegramRecorder;
+
+// What a coroutine co_awaits to send idempotent queries, all at once, and
+// get their responses once every one of them is answered. A response is
+// nullptr if the query couldn't be sent.
+template<std::size_t N>
+class QueryAwaiter {
+  public:
+    QueryAwaiter(TelegramRecorder* recorder, std::array<std::function<td_api::object_ptr<td_api::Function>()>, N> makeQueries) : recorder(recorder), makeQueries(std::move(makeQueries)) {}
+    bool await_ready() {
+      return false;
+    }
+    void await_suspend(std::coroutine_handle<> waiter);
+    // A single response, or an array with one per query
+    auto await_resume() {
+      if constexpr(N == 1) {
+        return std::move(this->results[0]);
+      } else {
+        return std::move(this->results);
+      }
+    }
+
+  private:
+    TelegramRecorder* recorder;
+    std::array<std::function<td_api::object_ptr<td_api::Function>()>, N> makeQueries;
+    std::array<TDAPIObjectPtr, N> results;
+    QueryJoin join;
+};
+
 class TelegramRecorder {
+  // Reaches into the DB writer for the microbenchmarks
+  friend class TelegramRecorderBenchAccess;
+  // Drives the accounts it hosts from its own threads
+  friend class RecorderHost;
+  template<std::size_t N> friend class QueryAwaiter;
+
   public:
     TelegramRecorder();
+    TelegramRecorder(std::unique_ptr<ClientBackend> backend, std::string configFile);
+    // One of the accounts of a host, which receives TDLib responses and
+    // writes to the DB for it
+    TelegramRecorder(RecorderHost* host, ClientBackend* backend, DownloadScheduler* downloads, ConfigParams config);
     void start();
+    // Records the whole history of every chat, besides what arrives live
+    void startArchive();
+    bool archiveFinished();
     void stop();
+    ReaderStats getReaderStats();
+    // Reads chat_filters from the config file again
+    void reloadChatFilters();
 
   private:
     void runRecorder();
     bool loadConfig();
+    void initMetrics();
+    std::string metricLabels(const std::string& labels = "");
+    void updateMetrics();
+    std::string renderMetrics();
+    bool startAccount();
+    std::size_t stopWorkers();
+    void closeAccount();
     void restart();
     void sendQuery(
       td_api::object_ptr<td_api::Function> func,
       std::function<void(TDAPIObjectPtr)> handler
     );
+    void sendIdempotentQuery(
+      std::function<td_api::object_ptr<td_api::Function>()> makeQuery,
+      std::function<void(TDAPIObjectPtr)> handler
+    );
+    void sendIdempotentQuery(PendingQuery query);
+    void sendPendingQuery(td_api::object_ptr<td_api::Function> func, PendingQuery query);
+    QueryAwaiter<1> query(std::function<td_api::object_ptr<td_api::Function>()> makeQuery);
+    QueryAwaiter<2> queries(
+      std::function<td_api::object_ptr<td_api::Function>()> makeFirst,
+      std::function<td_api::object_ptr<td_api::Function>()> makeSecond
+    );
+    void abandonQueries();
+    void retryQuery(PendingQuery query, int retryAfterSec);
+    void releaseQueries();
+    double receiveTimeout(double maxSec);
+    void onAuthorized();
     void processResponse(td::ClientManager::Response response);
     void processUpdate(TDAPIObjectPtr update);
     auto createAuthQueryHandler();
@@ -77,37 +272,178 @@ class TelegramRecorder {
     bool writeMessageToDB(std::shared_ptr<td_api::message>& message);
     std::unique_ptr<TelegramChat> retrieveChatFromDB(td_api::int53 chatID);
     std::unique_ptr<TelegramUser> retrieveUserFromDB(td_api::int53 userID);
-    void retrieveAndWriteChatFromTelegram(td_api::int53 chatID);
+    QueryTask retrieveAndWriteChatFromTelegram(td_api::int53 chatID);
     bool updateGroupData(TDAPIObjectPtr groupData, td_api::int53 groupID);
-    void retrieveAndWriteUserFromTelegram(td_api::int53 userID);
+    QueryTask retrieveAndWriteUserFromTelegram(td_api::int53 userID);
+    bool startLookup(std::unordered_set<td_api::int53>& inFlight, td_api::int53 id);
+    void finishLookup(std::unordered_set<td_api::int53>& inFlight, td_api::int53 id);
+    int bindText(sqlite3_stmt* stmt, int index, std::string_view text, std::string& repaired);
     bool writeUserToDB(std::unique_ptr<TelegramUser>& user);
     bool writeChatToDB(std::unique_ptr<TelegramChat>& chat);
-    bool writeFileToDB(std::string& fileID, std::string& downloadedAs, const std::string& originID);
+    bool writeFileToDB(const std::string& fileID, std::string& downloadedAs, const std::string& originID);
     void updateMessageText(td_api::int53 chatID, td_api::int53 messageID, td_api::int32 editDate);
     bool updateMessageContent(std::string compoundMessageID, td_api::object_ptr<td_api::MessageContent>& newContent, td_api::int32 editDate);
-    void downloadFile(td_api::file& file, std::string& originID);
+    void downloadFile(td_api::file& file, std::string_view originID, std::string_view fileID);
+    void requestDownload(td_api::int32 id, const std::string& originID, const std::string& fileID);
+    void forgetFile(const std::string& fileID);
+    bool loadKnownFiles();
+    void runDownloadMigrator();
+    bool readDownloadedFiles(std::int64_t afterRowID, std::vector<std::pair<std::int64_t, std::string>>& files);
+    bool updateDownloadedAs(const std::string& from, const std::string& to);
+    void runSearchIndexer();
     void runDBWriter();
+    bool writesPending();
+    void writePass(std::size_t maxMessages);
+    bool writeQueued(std::size_t maxMessages);
+    void notifyWriter();
+    bool updateChatSyncState(td_api::int53 chatID, td_api::int53 lastMessageID);
+    bool writeBackfillCheckpoint(td_api::int53 chatID, BackfillCheckpoint& checkpoint);
+    bool messageInDB(const std::string& compoundMessageID);
+    std::vector<std::pair<sqlite3*, std::string>> messageTables();
+    int updateMessage(const char* assignments, const std::string& compoundMessageID, std::function<int(sqlite3_stmt*)> bind, Histogram& latency);
+    bool loadKnownMessages();
+    bool rebuildKnownMessages();
+    void saveKnownMessages();
+    bool isKnownMessage(td_api::int53 chatID, td_api::int53 messageID);
+    std::int64_t lastMessageRowID();
+    void beginBackfill();
+    void runBackfillWorker(bool archive);
+    bool backfillChatPage(BackfillJob& job);
+    bool enqueueBackfillPage(BackfillJob& job, std::vector<std::shared_ptr<td_api::message>>& messages, bool finished);
+    void runArchiveLister();
+    bool listChats(bool archivedList, std::vector<td_api::int53>& chats);
+    void finishArchiveJob(BackfillJob& job);
+    std::map<td_api::int53, ArchiveCheckpoint> readArchiveState();
+    bool writeArchiveCheckpoint(td_api::int53 chatID, ArchiveCheckpoint& checkpoint);
+    TDAPIObjectPtr waitForQuery(std::function<td_api::object_ptr<td_api::Function>()> makeQuery);
+    bool sleepUntilExit(std::chrono::steady_clock::time_point wakeUp);
+    void closeTDLib();
+    void closeDB();
+    bool execSQL(const std::string& statement);
     bool initDB();
+    bool openPartitions();
+    bool attachPartitions(const std::string& current, const std::string& previous);
+    bool rotatePartition(const std::string& period);
+    bool openSealedPartition(const std::string& path);
+    void runPartitionSealer();
 
-    std::unique_ptr<td::ClientManager> clientManager;
+    std::string configFile;
+    RecorderHost* host{nullptr};
+    std::unique_ptr<ClientBackend> ownedBackend;
+    ClientBackend* clientManager{nullptr};
+    std::unique_ptr<DownloadScheduler> ownedDownloads;
+    DownloadScheduler* downloads{nullptr};
+    RecordingClientBackend* capture{nullptr};
     std::int32_t clientID{0};
     td_api::object_ptr<td_api::AuthorizationState> authState;
     bool authorized{false};
     bool needRestart{false};
     std::uint64_t currentQueryID{0};
     std::uint64_t authQueryID{0};
-    std::map<std::uint64_t, std::function<void(TDAPIObjectPtr)>> handlers;
+    std::map<std::uint64_t, PendingQuery> handlers;
+    // Paces queries to Telegram, under tdapiQueryMutex like the handlers
+    QueryScheduler queryScheduler;
+    std::unordered_map<std::uint64_t, td_api::object_ptr<td_api::Function>> queuedQueries;
+    // Users and chats being looked up, so the ones still queued aren't asked
+    // for again by every message that comes in meanwhile
+    std::unordered_set<td_api::int53> usersInFlight;
+    std::unordered_set<td_api::int53> chatsInFlight;
+    std::mutex lookupsMutex;
+    // Idempotent queries waiting for the client to be authorized, which it
+    // isn't at first either
+    bool reconnecting{true};
+    bool restarted{false};
+    std::vector<PendingQuery> deferredQueries;
+    std::chrono::steady_clock::time_point restartStart;
     std::atomic<bool> exitFlag{false};
+    // Set once everything else is stopped, lets the recorder thread close TDLib
+    std::atomic<bool> closeFlag{false};
+    std::chrono::steady_clock::time_point shutdownDeadline;
+    std::mutex exitMutex;
+    std::condition_variable exitRequested;
+    std::uint64_t messagesIgnoredOnExit{0};
+    std::thread recorderThread;
+    std::thread readerThread;
+    std::thread writerThread;
+    std::vector<std::thread> backfillThreads;
+    std::mutex backfillMutex;
+    std::condition_variable backfillJobsAvailable;
+    std::deque<BackfillJob> backfillJobs;
+    // Bumped by every pass, under toWriteQueueMutex
+    std::atomic<std::uint64_t> backfillGeneration{0};
+    std::chrono::steady_clock::time_point backfillNextPage;
+    std::thread archiveThread;
+    std::vector<std::thread> archiveThreads;
+    std::deque<BackfillJob> archiveJobs;
+    std::atomic<std::size_t> archiveChatsLeft{0};
+    std::atomic<bool> archiveDone{false};
+    // Moves files downloaded into the flat layout to the sharded one
+    std::thread migratorThread;
+    // Adds the messages recorded before the search index existed to it
+    std::thread indexerThread;
+    // Seals the partitions that aren't written to anymore
+    std::thread sealerThread;
     std::map<td_api::int53, std::vector<std::shared_ptr<td_api::message>>> toReadMessageQueue;
     std::map<td_api::int53, std::vector<std::shared_ptr<td_api::message>>> toWriteMessageQueue;
+    // Committed along with the messages enqueued before them
+    std::map<td_api::int53, BackfillCheckpoint> toWriteCheckpoints;
+    std::map<td_api::int53, ArchiveCheckpoint> toWriteArchiveCheckpoints;
+    // Every message committed to the DB, checked before doing any work on
+    // the ones received again
+    BloomFilter knownMessages;
+    std::mutex knownMessagesMutex;
+    std::string knownMessagesFile;
+    // IDs in the files table, plus the downloads in flight
+    std::unordered_set<std::string> knownFiles;
+    std::mutex knownFilesMutex;
     std::mutex toReadQueueMutex;
     std::mutex toWriteQueueMutex;
     std::mutex tdapiQueryMutex;
     std::condition_variable messagesAvailableToWrite;
+    // Where the next capped writer pass starts, so every chat gets its turn
+    td_api::int53 writerNextChat{0};
+    // Messages inserted by the current writer pass, not committed yet
+    std::uint64_t passMessagesWritten{0};
+    std::atomic<std::uint64_t> readerMessagesRead{0};
+    // Messages taken out of the read queue by the current pass and not read
+    // yet, and the date of the oldest one. Under toReadQueueMutex.
+    std::size_t readerPassUnread{0};
+    td_api::int32 readerPassOldestDate{0};
+    std::atomic<double> readerDrainRate{0.0};
     ConfigParams config;
-    sqlite3 *db;
+    sqlite3 *db{nullptr};
+    // Prepared once, the messages INSERT runs for every message written
+    sqlite3_stmt *insertMessageStmt{nullptr};
+    // Only set with db_partition, under toWriteQueueMutex. The current and
+    // previous partitions are attached to db, sealed ones are opened
+    // read-only to look for messages received again.
+    std::string currentPeriod;
+    std::string currentPartition;
+    std::string previousPartition;
+    std::vector<sqlite3*> sealedPartitions;
     LRU<td_api::int53, std::unique_ptr<TelegramUser>> userCache{USER_CACHE_SIZE};
     LRU<td_api::int53, std::unique_ptr<TelegramChat>> chatCache{CHAT_CACHE_SIZE};
+    RecorderMetrics recorderMetrics;
+    MessageTracer tracer{metrics()};
+    std::unordered_map<std::int32_t, Counter*> updateCounters;
+    // Checked before doing any work for an update
+    ChatFilter chatFilter;
+    std::unique_ptr<MetricsServer> metricsServer;
 };
 
+// The coroutine can be resumed by the response to the last query before
+// this returns, so nothing is touched after sending it
+template<std::size_t N>
+void QueryAwaiter<N>::await_suspend(std::coroutine_handle<> waiter) {
+  this->join.waiter = waiter;
+  this->join.pending = N;
+  TelegramRecorder* recorder = this->recorder;
+  for(std::size_t i = 0; i < N; ++i) {
+    PendingQuery query{nullptr, std::move(this->makeQueries[i])};
+    query.join = &this->join;
+    query.result = &this->results[i];
+    recorder->sendIdempotentQuery(std::move(query));
+  }
+}
+
 #endif
@@ -0,0 +1,17 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#ifndef ALLOC_COUNTER_HPP
+#define ALLOC_COUNTER_HPP
+
+#include <cstdint>
+
+// Number of times operator new has been called in the binary linking
+// alloc_counter.cpp, which replaces it. Only meant for tests and benchmarks
+// checking a code path stays within an allocation budget.
+std::uint64_t allocationCount();
+
+#endif
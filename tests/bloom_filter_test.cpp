@@ -0,0 +1,94 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#include <cstdio>
+#include <fstream>
+
+#include <gtest/gtest.h>
+
+#include "bloom_filter.hpp"
+
+TEST(BloomFilterTest, NoFalseNegatives) {
+  BloomFilter filter(10000, 0.01);
+  for(std::int64_t i = 1; i <= 10000; ++i) {
+    filter.add(-100 - i % 7, i << 20);
+  }
+  EXPECT_EQ(10000, filter.items());
+  for(std::int64_t i = 1; i <= 10000; ++i) {
+    EXPECT_TRUE(filter.mightContain(-100 - i % 7, i << 20));
+  }
+}
+
+TEST(BloomFilterTest, FalsePositiveRate) {
+  BloomFilter filter(10000, 0.01);
+  EXPECT_FALSE(filter.mightContain(1, 1));
+  for(std::int64_t i = 1; i <= 10000; ++i) {
+    filter.add(1, i);
+  }
+  // Same message IDs in another chat, and new ones in the same chat
+  int falsePositives = 0;
+  for(std::int64_t i = 1; i <= 10000; ++i) {
+    falsePositives += filter.mightContain(2, i);
+    falsePositives += filter.mightContain(1, 10000 + i);
+  }
+  EXPECT_LT(falsePositives / 20000.0, 0.02);
+  EXPECT_NEAR(0.01, filter.estimatedFalsePositiveRate(), 0.005);
+  // About 9.6 bits per item
+  EXPECT_LT(filter.sizeBytes(), 10000 * 10 / 8 + 8);
+
+  filter.clear();
+  EXPECT_EQ(0, filter.items());
+  EXPECT_FALSE(filter.mightContain(1, 1));
+}
+
+TEST(BloomFilterTest, SaveAndLoad) {
+  std::string path = testing::TempDir() + "tgrec_bloom_test.bloom";
+  BloomFilter filter(1000, 0.001);
+  for(std::int64_t i = 1; i <= 500; ++i) {
+    filter.add(42, i);
+  }
+  ASSERT_TRUE(filter.save(path, 1234));
+
+  BloomFilter loaded;
+  std::int64_t tag = 0;
+  ASSERT_TRUE(loaded.load(path, tag));
+  EXPECT_EQ(1234, tag);
+  EXPECT_EQ(500, loaded.items());
+  EXPECT_EQ(filter.sizeBytes(), loaded.sizeBytes());
+  for(std::int64_t i = 1; i <= 500; ++i) {
+    EXPECT_TRUE(loaded.mightContain(42, i));
+  }
+  std::remove(path.c_str());
+}
+
+TEST(BloomFilterTest, RejectsBadFiles) {
+  std::string path = testing::TempDir() + "tgrec_bloom_test.bloom";
+  BloomFilter filter(1000, 0.01);
+  filter.add(1, 1);
+  std::int64_t tag = 0;
+  std::remove(path.c_str());
+  EXPECT_FALSE(filter.load(path, tag));
+
+  std::ofstream(path, std::ios::binary) << "not a filter";
+  EXPECT_FALSE(filter.load(path, tag));
+
+  // Truncated
+  ASSERT_TRUE(filter.save(path, 1));
+  std::ifstream in(path, std::ios::binary);
+  std::string contents((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+  in.close();
+  std::ofstream(path, std::ios::binary | std::ios::trunc) << contents.substr(0, contents.size() - 1);
+  EXPECT_FALSE(filter.load(path, tag));
+
+  // Claiming more bits than there are
+  std::uint64_t hugeBits = 1ULL << 62;
+  contents.replace(BLOOM_FILTER_MAGIC_SIZE, sizeof(hugeBits), reinterpret_cast<const char*>(&hugeBits), sizeof(hugeBits));
+  std::ofstream(path, std::ios::binary | std::ios::trunc) << contents;
+  EXPECT_FALSE(filter.load(path, tag));
+  // Left as it was
+  EXPECT_TRUE(filter.mightContain(1, 1));
+  std::remove(path.c_str());
+}
@@ -0,0 +1,72 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+
+#include <gtest/gtest.h>
+
+#include "capture_log.hpp"
+
+TEST(CaptureLogTest, RoundTrip) {
+  std::string path = testing::TempDir() + "tgrec_capture_test.bin";
+  CaptureWriter writer;
+  ASSERT_TRUE(writer.open(path));
+  writer.write(CAPTURE_SENT, 1, "{\"@type\":\"getOption\"}");
+  writer.write(CAPTURE_RECEIVED, 1, "{\"@type\":\"optionValueString\"}");
+  writer.write(CAPTURE_RECEIVED, 0, std::string(300, 'x'));
+  writer.write(CAPTURE_RECEIVED, 1ULL << 40, "");
+  EXPECT_EQ(4, writer.recordsWritten());
+  writer.close();
+
+  CaptureReader reader;
+  ASSERT_TRUE(reader.open(path));
+  CaptureRecord record;
+  ASSERT_TRUE(reader.next(record));
+  EXPECT_EQ(CAPTURE_SENT, record.type);
+  EXPECT_EQ(1, record.requestID);
+  EXPECT_EQ("{\"@type\":\"getOption\"}", record.payload);
+  std::uint64_t previous = record.timestampMicros;
+  ASSERT_TRUE(reader.next(record));
+  EXPECT_EQ(CAPTURE_RECEIVED, record.type);
+  EXPECT_GE(record.timestampMicros, previous);
+  ASSERT_TRUE(reader.next(record));
+  EXPECT_EQ(0, record.requestID);
+  EXPECT_EQ(std::string(300, 'x'), record.payload);
+  ASSERT_TRUE(reader.next(record));
+  EXPECT_EQ(1ULL << 40, record.requestID);
+  EXPECT_EQ("", record.payload);
+  EXPECT_FALSE(reader.next(record));
+  std::remove(path.c_str());
+}
+
+TEST(CaptureLogTest, SkipsTruncatedRecord) {
+  std::string path = testing::TempDir() + "tgrec_capture_truncated_test.bin";
+  CaptureWriter writer;
+  ASSERT_TRUE(writer.open(path));
+  writer.write(CAPTURE_RECEIVED, 0, "first");
+  writer.write(CAPTURE_RECEIVED, 0, "second");
+  writer.close();
+  std::filesystem::resize_file(path, std::filesystem::file_size(path) - 2);
+
+  CaptureReader reader;
+  ASSERT_TRUE(reader.open(path));
+  CaptureRecord record;
+  ASSERT_TRUE(reader.next(record));
+  EXPECT_EQ("first", record.payload);
+  EXPECT_FALSE(reader.next(record));
+  std::remove(path.c_str());
+}
+
+TEST(CaptureLogTest, RejectsOtherFiles) {
+  std::string path = testing::TempDir() + "tgrec_capture_bad_test.bin";
+  std::ofstream(path) << "not a capture";
+  CaptureReader reader;
+  EXPECT_FALSE(reader.open(path));
+  EXPECT_FALSE(CaptureReader().open(path + ".missing"));
+  std::remove(path.c_str());
+}
@@ -0,0 +1,94 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#include <gtest/gtest.h>
+
+#include "chat_filter.hpp"
+
+TEST(ChatFilterTest, NoRulesAllowsEverything) {
+  ChatFilter filter;
+  ASSERT_TRUE(filter.load({}));
+  EXPECT_EQ(0, filter.rules());
+  EXPECT_TRUE(filter.allows(1));
+  EXPECT_TRUE(filter.allows(-1001234));
+}
+
+TEST(ChatFilterTest, FirstMatchingRuleDecides) {
+  ChatFilter filter;
+  ASSERT_TRUE(filter.load({
+    {"keep", true, {10}, {}, ""},
+    {"no_channels", false, {}, {"channel"}, ""},
+    {"spam", false, {}, {}, "giveaway"},
+  }, "test=\"first_match\""));
+  filter.learnChat(10, CHAT_TYPE_CHANNEL, "Crypto Giveaway");
+  filter.learnChat(11, CHAT_TYPE_CHANNEL, "News");
+  filter.learnChat(12, CHAT_TYPE_SUPERGROUP, "Weekly GIVEAWAY");
+  filter.learnChat(13, CHAT_TYPE_PRIVATE, "Alice");
+  // Included by ID, before the other rules are tried
+  EXPECT_TRUE(filter.allows(10));
+  EXPECT_FALSE(filter.allows(11));
+  // Titles are matched ignoring case
+  EXPECT_FALSE(filter.allows(12));
+  // No rule matches, and there's an include rule
+  EXPECT_FALSE(filter.allows(13));
+
+  Counter& channels = metrics().counter("tgrec_chat_filter_dropped_total", "", "test=\"first_match\",rule=\"no_channels\"");
+  Counter& spam = metrics().counter("tgrec_chat_filter_dropped_total", "", "test=\"first_match\",rule=\"spam\"");
+  EXPECT_FALSE(filter.allows(11));
+  EXPECT_EQ(2, channels.get());
+  EXPECT_EQ(1, spam.get());
+}
+
+TEST(ChatFilterTest, IncludeRulesDropTheRest) {
+  ChatFilter filter;
+  ASSERT_TRUE(filter.load({
+    {"groups", true, {}, {"basic_group", "supergroup"}, ""},
+  }, "test=\"include_only\""));
+  filter.learnChat(1, CHAT_TYPE_BASIC_GROUP, "Family");
+  filter.learnChat(2, CHAT_TYPE_SUPERGROUP, "Work");
+  filter.learnChat(3, CHAT_TYPE_PRIVATE, "Bob");
+  EXPECT_TRUE(filter.allows(1));
+  EXPECT_TRUE(filter.allows(2));
+  EXPECT_FALSE(filter.allows(3));
+  // Type rules can't match a chat whose type isn't known
+  EXPECT_FALSE(filter.allows(4));
+  EXPECT_EQ(2, metrics().counter("tgrec_chat_filter_dropped_total", "", "test=\"include_only\",rule=\"default\"").get());
+}
+
+TEST(ChatFilterTest, TitleChangesAreEvaluatedAgain) {
+  ChatFilter filter;
+  ASSERT_TRUE(filter.load({
+    {"archived", false, {}, {}, "^\\[old\\]"},
+  }));
+  filter.learnChat(5, CHAT_TYPE_SUPERGROUP, "Project");
+  EXPECT_TRUE(filter.allows(5));
+  filter.learnTitle(5, "[old] Project");
+  EXPECT_FALSE(filter.allows(5));
+  filter.learnTitle(5, "Project 2");
+  EXPECT_TRUE(filter.allows(5));
+}
+
+TEST(ChatFilterTest, ReloadReplacesRules) {
+  ChatFilter filter;
+  ASSERT_TRUE(filter.load({
+    {"drop", false, {7}, {}, ""},
+  }));
+  filter.learnChat(7, CHAT_TYPE_PRIVATE, "Carol");
+  EXPECT_FALSE(filter.allows(7));
+
+  // Invalid rules keep the current ones
+  EXPECT_FALSE(filter.load({
+    {"bad_type", false, {}, {"forum"}, ""},
+  }));
+  EXPECT_FALSE(filter.load({
+    {"bad_title", false, {}, {}, "(unclosed"},
+  }));
+  EXPECT_EQ(1, filter.rules());
+  EXPECT_FALSE(filter.allows(7));
+
+  ASSERT_TRUE(filter.load({}));
+  EXPECT_TRUE(filter.allows(7));
+}
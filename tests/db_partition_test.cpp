@@ -0,0 +1,173 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#include <sys/stat.h>
+
+#include <gtest/gtest.h>
+
+#include "db_partition.hpp"
+#include "db_schema.hpp"
+#include "search_index.hpp"
+
+static void insertMessage(sqlite3* db, const std::string& table, int messageID, std::int64_t timestamp) {
+  sqlite3_stmt* stmt;
+  std::string statement = "INSERT INTO " + table + " (id, timestamp, message, chat_id, sender_id) VALUES (?, ?, 'hello there', 1, 2);";
+  sqlite3_prepare_v2(db, statement.c_str(), -1, &stmt, NULL);
+  std::string id = "1:" + std::to_string(messageID);
+  sqlite3_bind_text(stmt, 1, id.c_str(), -1, SQLITE_TRANSIENT);
+  sqlite3_bind_int64(stmt, 2, timestamp);
+  sqlite3_step(stmt);
+  sqlite3_finalize(stmt);
+}
+
+static std::vector<std::string> partitionFiles(sqlite3* catalog, std::int64_t since, std::int64_t until) {
+  std::vector<Partition> partitions;
+  EXPECT_TRUE(listPartitions(catalog, since, until, partitions));
+  std::vector<std::string> files;
+  for(Partition& partition : partitions) {
+    files.push_back(partition.file);
+  }
+  return files;
+}
+
+class DBPartitionTest : public ::testing::Test {
+  protected:
+    void SetUp() override {
+      this->catalogFile = testing::TempDir() + "tgrec_partition_test.db";
+      this->removeFiles();
+      ASSERT_EQ(SQLITE_OK, sqlite3_open(this->catalogFile.c_str(), &this->catalog));
+      ASSERT_TRUE(migrateSchema(this->catalog));
+    }
+
+    void TearDown() override {
+      sqlite3_close(this->catalog);
+      this->removeFiles();
+    }
+
+    void removeFiles() {
+      for(std::string period : {"", "2026-09", "2026-10"}) {
+        std::string path = period != "" ? partitionPath(this->catalogFile, partitionFileName(this->catalogFile, period)) : this->catalogFile;
+        for(std::string suffix : {"", "-wal", "-shm", "-journal"}) {
+          std::remove((path + suffix).c_str());
+        }
+      }
+    }
+
+    std::string catalogFile;
+    sqlite3* catalog;
+};
+
+TEST(DBPartitionNamesTest, NamesPeriodsInUTC) {
+  // 2026-10-18T23:30:00Z
+  std::time_t time = 1792366200;
+  EXPECT_EQ("2026-10-18", partitionPeriod(DB_PARTITION_DAY, time));
+  EXPECT_EQ("2026-10", partitionPeriod(DB_PARTITION_MONTH, time));
+  EXPECT_EQ("2026", partitionPeriod(DB_PARTITION_YEAR, time));
+  EXPECT_EQ("", partitionPeriod(DB_PARTITION_NONE, time));
+  EXPECT_TRUE(validPartitioning(DB_PARTITION_NONE));
+  EXPECT_TRUE(validPartitioning(DB_PARTITION_MONTH));
+  EXPECT_FALSE(validPartitioning("week"));
+}
+
+TEST(DBPartitionNamesTest, PlacesPartitionsNextToTheCatalog) {
+  EXPECT_EQ("tgrec-2026-10.db", partitionFileName("data/tgrec.db", "2026-10"));
+  EXPECT_EQ("alice-2026.sqlite", partitionFileName("/var/lib/alice.sqlite", "2026"));
+  EXPECT_EQ("data/tgrec-2026-10.db", partitionPath("data/tgrec.db", "tgrec-2026-10.db"));
+  EXPECT_EQ("tgrec-2026-10.db", partitionPath("tgrec.db", "tgrec-2026-10.db"));
+}
+
+TEST_F(DBPartitionTest, AttachesPreparedPartitions) {
+  std::string file = partitionFileName(this->catalogFile, "2026-10");
+  std::string path = partitionPath(this->catalogFile, file);
+  ASSERT_TRUE(preparePartition(path, DBTuningParams(), true, DEFAULT_SEARCH_TOKENIZER));
+  // Preparing it again leaves it as it was
+  ASSERT_TRUE(preparePartition(path, DBTuningParams(), true, DEFAULT_SEARCH_TOKENIZER));
+  ASSERT_TRUE(attachDB(this->catalog, path, "current"));
+  insertMessage(this->catalog, "current.messages", 1, 1000);
+  sqlite3_stmt* stmt;
+  ASSERT_EQ(SQLITE_OK, sqlite3_prepare_v2(this->catalog, "SELECT COUNT(*), (SELECT COUNT(*) FROM main.messages) FROM current.messages_fts;", -1, &stmt, NULL));
+  ASSERT_EQ(SQLITE_ROW, sqlite3_step(stmt));
+  EXPECT_EQ(1, sqlite3_column_int(stmt, 0));
+  EXPECT_EQ(0, sqlite3_column_int(stmt, 1));
+  sqlite3_finalize(stmt);
+  EXPECT_FALSE(attachDB(this->catalog, path, "current"));
+}
+
+TEST_F(DBPartitionTest, ListsPartitionsOverlappingATimeRange) {
+  ASSERT_TRUE(registerPartition(this->catalog, "old.db", "2026-09"));
+  ASSERT_TRUE(registerPartition(this->catalog, "empty.db", "2026-09"));
+  ASSERT_TRUE(registerPartition(this->catalog, "new.db", "2026-10"));
+  ASSERT_TRUE(registerPartition(this->catalog, "old.db", "2026-09"));
+  Partition old{"old.db", "2026-09", 1000, 2000, 5, true};
+  ASSERT_TRUE(markPartitionSealed(this->catalog, old));
+  Partition empty{"empty.db", "2026-09", 0, 0, 0, true};
+  ASSERT_TRUE(markPartitionSealed(this->catalog, empty));
+  EXPECT_EQ(std::vector<std::string>({"old.db", "new.db"}), partitionFiles(this->catalog, 0, 0));
+  EXPECT_EQ(std::vector<std::string>({"old.db", "new.db"}), partitionFiles(this->catalog, 2000, 0));
+  EXPECT_EQ(std::vector<std::string>({"old.db", "new.db"}), partitionFiles(this->catalog, 0, 1001));
+  // Unsealed partitions may have anything
+  EXPECT_EQ(std::vector<std::string>({"new.db"}), partitionFiles(this->catalog, 2001, 0));
+  EXPECT_EQ(std::vector<std::string>({"new.db"}), partitionFiles(this->catalog, 0, 1000));
+}
+
+TEST_F(DBPartitionTest, RegistersLegacyMessagesOnce) {
+  ASSERT_TRUE(registerLegacyPartition(this->catalog, this->catalogFile));
+  // Nothing to keep
+  EXPECT_TRUE(partitionFiles(this->catalog, 0, 0).empty());
+  insertMessage(this->catalog, "messages", 1, 1000);
+  insertMessage(this->catalog, "messages", 2, 3000);
+  ASSERT_TRUE(registerLegacyPartition(this->catalog, this->catalogFile));
+  std::vector<Partition> partitions;
+  ASSERT_TRUE(listPartitions(this->catalog, 0, 0, partitions));
+  ASSERT_EQ(1, partitions.size());
+  EXPECT_EQ("tgrec_partition_test.db", partitions[0].file);
+  EXPECT_EQ(DB_PARTITION_LEGACY_PERIOD, partitions[0].period);
+  EXPECT_EQ(1000, partitions[0].firstTimestamp);
+  EXPECT_EQ(3000, partitions[0].lastTimestamp);
+  EXPECT_EQ(2, partitions[0].messages);
+  EXPECT_TRUE(partitions[0].sealed);
+  // Partitions exist already, so these aren't legacy
+  insertMessage(this->catalog, "messages", 3, 5000);
+  ASSERT_TRUE(registerLegacyPartition(this->catalog, this->catalogFile));
+  partitions.clear();
+  ASSERT_TRUE(listPartitions(this->catalog, 0, 0, partitions));
+  ASSERT_EQ(1, partitions.size());
+  EXPECT_EQ(2, partitions[0].messages);
+}
+
+TEST_F(DBPartitionTest, SealsPartitionsReadOnly) {
+  std::string file = partitionFileName(this->catalogFile, "2026-09");
+  std::string path = partitionPath(this->catalogFile, file);
+  ASSERT_TRUE(preparePartition(path, DBTuningParams(), true, DEFAULT_SEARCH_TOKENIZER));
+  sqlite3* db;
+  ASSERT_EQ(SQLITE_OK, sqlite3_open(path.c_str(), &db));
+  for(int i = 1; i <= 10; ++i) {
+    insertMessage(db, "messages", i, 1000 * i);
+  }
+  sqlite3_close(db);
+  ASSERT_TRUE(registerPartition(this->catalog, file, "2026-09"));
+  Partition partition{file, "2026-09"};
+  ASSERT_TRUE(sealPartition(path, partition));
+  ASSERT_TRUE(markPartitionSealed(this->catalog, partition));
+  EXPECT_EQ(1000, partition.firstTimestamp);
+  EXPECT_EQ(10000, partition.lastTimestamp);
+  EXPECT_EQ(10, partition.messages);
+  EXPECT_EQ(std::vector<std::string>({file}), partitionFiles(this->catalog, 9000, 0));
+  EXPECT_TRUE(partitionFiles(this->catalog, 10001, 0).empty());
+  struct stat info;
+  ASSERT_EQ(0, stat(path.c_str(), &info));
+  EXPECT_EQ(0444, info.st_mode & 0777);
+  // Out of WAL, so it can be read without write access
+  struct stat wal;
+  EXPECT_NE(0, stat((path + "-wal").c_str(), &wal));
+  ASSERT_EQ(SQLITE_OK, sqlite3_open_v2(path.c_str(), &db, SQLITE_OPEN_READONLY, NULL));
+  ASSERT_TRUE(attachDB(db, this->catalogFile, "catalog"));
+  std::vector<SearchResult> results;
+  EXPECT_TRUE(searchMessages(db, "hello", DEFAULT_SEARCH_LIMIT, results));
+  EXPECT_EQ(10, results.size());
+  sqlite3_close(db);
+  chmod(path.c_str(), 0644);
+}
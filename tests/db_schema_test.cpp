@@ -0,0 +1,118 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#include <cstdio>
+
+#include <gtest/gtest.h>
+
+#include "db_schema.hpp"
+
+bool tableExists(sqlite3* db, const std::string& name) {
+  sqlite3_stmt* stmt;
+  sqlite3_prepare_v2(db, "SELECT COUNT(*) FROM sqlite_master WHERE type='table' AND name = ?;", -1, &stmt, NULL);
+  sqlite3_bind_text(stmt, 1, name.c_str(), -1, SQLITE_TRANSIENT);
+  bool exists = sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_int(stmt, 0);
+  sqlite3_finalize(stmt);
+  return exists;
+}
+
+TEST(DBSchemaTest, MigratesNewDB) {
+  sqlite3* db;
+  ASSERT_EQ(SQLITE_OK, sqlite3_open(":memory:", &db));
+  EXPECT_EQ(0, getSchemaVersion(db));
+  ASSERT_TRUE(migrateSchema(db));
+  EXPECT_EQ(latestSchemaVersion(), getSchemaVersion(db));
+  EXPECT_TRUE(tableExists(db, "messages"));
+  EXPECT_TRUE(tableExists(db, "users"));
+  EXPECT_TRUE(tableExists(db, "chats"));
+  EXPECT_TRUE(tableExists(db, "files"));
+  EXPECT_TRUE(tableExists(db, "chat_sync_state"));
+  EXPECT_TRUE(tableExists(db, "chat_archive_state"));
+  // Nothing left to do the second time
+  EXPECT_TRUE(migrateSchema(db));
+  EXPECT_EQ(latestSchemaVersion(), getSchemaVersion(db));
+  sqlite3_close(db);
+}
+
+TEST(DBSchemaTest, AdoptsUnversionedDB) {
+  sqlite3* db;
+  ASSERT_EQ(SQLITE_OK, sqlite3_open(":memory:", &db));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "CREATE TABLE users(user_id INTEGER PRIMARY KEY, fullname TEXT, username TEXT, usernames TEXT, disabled_usernames TEXT, bio TEXT, profile_pic_file_id TEXT);"
+                                        "INSERT INTO users (user_id, fullname) VALUES (1, 'Somebody');", 0, 0, NULL));
+  ASSERT_TRUE(migrateSchema(db));
+  EXPECT_EQ(latestSchemaVersion(), getSchemaVersion(db));
+  EXPECT_TRUE(tableExists(db, "messages"));
+  sqlite3_stmt* stmt;
+  sqlite3_prepare_v2(db, "SELECT fullname FROM users WHERE user_id = 1;", -1, &stmt, NULL);
+  ASSERT_EQ(SQLITE_ROW, sqlite3_step(stmt));
+  EXPECT_STREQ("Somebody", reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0)));
+  sqlite3_finalize(stmt);
+  sqlite3_close(db);
+}
+
+TEST(DBSchemaTest, SeedsChatSyncState) {
+  sqlite3* db;
+  ASSERT_EQ(SQLITE_OK, sqlite3_open(":memory:", &db));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "CREATE TABLE messages(id TEXT PRIMARY KEY, timestamp INTEGER, message TEXT, message_type INTEGER, content_file_id TEXT, chat_id INTEGER, sender_id INTEGER, in_reply_of TEXT, forwarded_from TEXT);"
+                                        "CREATE TABLE files(file_id TEXT PRIMARY KEY, downloaded_as TEXT, origin_id TEXT);"
+                                        "INSERT INTO messages (id, chat_id) VALUES ('-100:9', -100), ('-100:10', -100), ('7:3', 7);"
+                                        "PRAGMA user_version = 1;", 0, 0, NULL));
+  ASSERT_TRUE(migrateSchema(db));
+  sqlite3_stmt* stmt;
+  sqlite3_prepare_v2(db, "SELECT chat_id, last_message_id, backfill_until FROM chat_sync_state ORDER BY chat_id;", -1, &stmt, NULL);
+  ASSERT_EQ(SQLITE_ROW, sqlite3_step(stmt));
+  EXPECT_EQ(-100, sqlite3_column_int64(stmt, 0));
+  // Compared as numbers, not as text
+  EXPECT_EQ(10, sqlite3_column_int64(stmt, 1));
+  EXPECT_EQ(SQLITE_NULL, sqlite3_column_type(stmt, 2));
+  ASSERT_EQ(SQLITE_ROW, sqlite3_step(stmt));
+  EXPECT_EQ(7, sqlite3_column_int64(stmt, 0));
+  EXPECT_EQ(3, sqlite3_column_int64(stmt, 1));
+  EXPECT_EQ(SQLITE_DONE, sqlite3_step(stmt));
+  sqlite3_finalize(stmt);
+  sqlite3_close(db);
+}
+
+TEST(DBSchemaTest, RejectsNewerDB) {
+  sqlite3* db;
+  ASSERT_EQ(SQLITE_OK, sqlite3_open(":memory:", &db));
+  std::string statement = "PRAGMA user_version = " + std::to_string(latestSchemaVersion() + 1) + ";";
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, statement.c_str(), 0, 0, NULL));
+  EXPECT_FALSE(migrateSchema(db));
+  EXPECT_FALSE(tableExists(db, "messages"));
+  // The transaction was rolled back, so the DB is usable
+  EXPECT_EQ(SQLITE_OK, sqlite3_exec(db, "BEGIN; COMMIT;", 0, 0, NULL));
+  sqlite3_close(db);
+}
+
+TEST(DBSchemaTest, StartupPragmas) {
+  std::string path = testing::TempDir() + "tgrec_schema_test.db";
+  std::remove(path.c_str());
+  sqlite3* db;
+  ASSERT_EQ(SQLITE_OK, sqlite3_open(path.c_str(), &db));
+  DBTuningParams params;
+  params.journalMode = "wal";
+  params.pageSize = 8192;
+  ASSERT_TRUE(applyStartupPragmas(db, params));
+  ASSERT_TRUE(migrateSchema(db));
+
+  sqlite3_stmt* stmt;
+  sqlite3_prepare_v2(db, "PRAGMA journal_mode;", -1, &stmt, NULL);
+  ASSERT_EQ(SQLITE_ROW, sqlite3_step(stmt));
+  EXPECT_STREQ("wal", reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0)));
+  sqlite3_finalize(stmt);
+  sqlite3_prepare_v2(db, "PRAGMA page_size;", -1, &stmt, NULL);
+  ASSERT_EQ(SQLITE_ROW, sqlite3_step(stmt));
+  EXPECT_EQ(8192, sqlite3_column_int(stmt, 0));
+  sqlite3_finalize(stmt);
+
+  params.journalMode = "bogus";
+  EXPECT_FALSE(applyStartupPragmas(db, params));
+  sqlite3_close(db);
+  std::remove(path.c_str());
+  std::remove((path + "-wal").c_str());
+  std::remove((path + "-shm").c_str());
+}
@@ -0,0 +1,96 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#include <filesystem>
+#include <fstream>
+
+#include <gtest/gtest.h>
+#include <unistd.h>
+
+#include "download_layout.hpp"
+#include "hash.hpp"
+
+class DownloadLayoutTest : public ::testing::Test {
+  protected:
+    void SetUp() override {
+      this->folder = (std::filesystem::temp_directory_path() / ("tgrec_download_layout_test_" + std::to_string(getpid()))).string();
+      std::filesystem::remove_all(this->folder);
+      std::filesystem::create_directories(this->folder);
+    }
+
+    void TearDown() override {
+      std::filesystem::remove_all(this->folder);
+    }
+
+    std::string writeFile(const std::string& name, const std::string& contents) {
+      std::string path = (std::filesystem::path(this->folder) / name).string();
+      std::ofstream file(path, std::ios::binary);
+      file << contents;
+      return path;
+    }
+
+    std::string folder;
+};
+
+TEST_F(DownloadLayoutTest, ShardedPath) {
+  std::string hash = SHA256("photo", 5);
+  std::string path = shardedPath("downloads", hash, ".jpg");
+  EXPECT_EQ("downloads/" + hash.substr(0, 2) + "/" + hash.substr(2, 2) + "/" + hash + ".jpg", path);
+  EXPECT_TRUE(isShardedPath("downloads", path));
+  EXPECT_FALSE(isShardedPath("downloads", "downloads/photo_1.jpg"));
+  EXPECT_FALSE(isShardedPath("downloads", "downloads/zz/zz/zzzz.jpg"));
+  EXPECT_FALSE(isShardedPath("downloads", "downloads/ab/cd/1234.jpg"));
+  EXPECT_FALSE(isShardedPath("other", path));
+}
+
+TEST_F(DownloadLayoutTest, StoresByContents) {
+  // Same name, different contents, as TDLib reuses names across chats
+  std::string source = this->writeFile("source.jpg", std::string(200000, 'a'));
+  std::string first;
+  ASSERT_TRUE(storeSharded(source, this->folder, first));
+  EXPECT_EQ(shardedPath(this->folder, SHA256(std::string(200000, 'a').c_str(), 200000), ".jpg"), first);
+  this->writeFile("source.jpg", "b");
+  std::string second;
+  ASSERT_TRUE(storeSharded(source, this->folder, second));
+  EXPECT_NE(first, second);
+  EXPECT_EQ(200000, std::filesystem::file_size(first));
+  EXPECT_EQ(1, std::filesystem::file_size(second));
+  // The source is left alone, and nothing else is left behind
+  EXPECT_TRUE(std::filesystem::exists(source));
+  std::size_t files = 0;
+  for(auto& entry : std::filesystem::recursive_directory_iterator(this->folder)) {
+    files += entry.is_regular_file();
+  }
+  EXPECT_EQ(3, files);
+}
+
+TEST_F(DownloadLayoutTest, StoresDuplicatesOnce) {
+  std::string first;
+  std::string second;
+  ASSERT_TRUE(storeSharded(this->writeFile("a.mp4", "same"), this->folder, first));
+  ASSERT_TRUE(storeSharded(this->writeFile("b.mp4", "same"), this->folder, second));
+  EXPECT_EQ(first, second);
+  // Only the extension differs
+  ASSERT_TRUE(storeSharded(this->writeFile("c.jpg", "same"), this->folder, second));
+  EXPECT_NE(first, second);
+}
+
+TEST_F(DownloadLayoutTest, LinksFlatFiles) {
+  std::string flat = this->writeFile("photo_1.jpg", "contents");
+  std::string storedAs;
+  ASSERT_TRUE(linkToSharded(flat, this->folder, storedAs));
+  EXPECT_TRUE(isShardedPath(this->folder, storedAs));
+  EXPECT_TRUE(std::filesystem::exists(flat));
+  std::ifstream file(storedAs);
+  std::string contents;
+  file >> contents;
+  EXPECT_EQ("contents", contents);
+  // Linking it again finds it in place
+  std::string again;
+  ASSERT_TRUE(linkToSharded(flat, this->folder, again));
+  EXPECT_EQ(storedAs, again);
+  EXPECT_FALSE(linkToSharded(this->folder + "/missing.jpg", this->folder, again));
+}
@@ -0,0 +1,73 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "download_scheduler.hpp"
+
+TEST(DownloadSchedulerTest, Unlimited) {
+  DownloadScheduler scheduler;
+  int started = 0;
+  for(int i = 0; i < 100; ++i) {
+    scheduler.submit("a", [&started]() { ++started; });
+  }
+  EXPECT_EQ(100, started);
+  EXPECT_EQ(100, scheduler.inFlight());
+  EXPECT_EQ(0, scheduler.queued());
+}
+
+TEST(DownloadSchedulerTest, CapsInFlight) {
+  DownloadScheduler scheduler(2);
+  std::vector<int> started;
+  for(int i = 0; i < 5; ++i) {
+    scheduler.submit("a", [&started, i]() { started.push_back(i); });
+  }
+  EXPECT_EQ(std::vector<int>({0, 1}), started);
+  EXPECT_EQ(2, scheduler.inFlight());
+  EXPECT_EQ(3, scheduler.queued());
+  scheduler.finished();
+  EXPECT_EQ(std::vector<int>({0, 1, 2}), started);
+  EXPECT_EQ(2, scheduler.inFlight());
+  for(int i = 0; i < 4; ++i) {
+    scheduler.finished();
+  }
+  EXPECT_EQ(std::vector<int>({0, 1, 2, 3, 4}), started);
+  EXPECT_EQ(0, scheduler.inFlight());
+  EXPECT_EQ(0, scheduler.queued());
+}
+
+TEST(DownloadSchedulerTest, AccountsTakeTurns) {
+  DownloadScheduler scheduler(1);
+  std::string started;
+  scheduler.submit("busy", [&started]() { started += "B"; });
+  // The busy account queues a backlog before the quiet one asks for anything
+  for(int i = 0; i < 4; ++i) {
+    scheduler.submit("busy", [&started]() { started += "b"; });
+  }
+  scheduler.submit("quiet", [&started]() { started += "q"; });
+  scheduler.submit("quiet", [&started]() { started += "q"; });
+  for(int i = 0; i < 6; ++i) {
+    scheduler.finished();
+  }
+  EXPECT_EQ("Bbqbqbb", started);
+}
+
+TEST(DownloadSchedulerTest, StartCanSubmit) {
+  DownloadScheduler scheduler(1);
+  int started = 0;
+  scheduler.submit("a", [&]() {
+    ++started;
+    // Queued, as the only slot is taken
+    scheduler.submit("a", [&started]() { ++started; });
+  });
+  EXPECT_EQ(1, started);
+  EXPECT_EQ(1, scheduler.queued());
+  scheduler.finished();
+  EXPECT_EQ(2, started);
+}
@@ -6,6 +6,7 @@
 
 #include <gtest/gtest.h>
 
+#include "alloc_counter.hpp"
 #include "hash.hpp"
 
 TEST(HashTest, SHA256Test) {
@@ -13,4 +14,12 @@ TEST(HashTest, SHA256Test) {
   EXPECT_EQ("e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855", res1);
   std::string res2 = SHA256(res1.c_str(), res1.size());
   EXPECT_EQ("cd372fb85148700fa88095e3492d3f9f5beb43e555e5ff26d95f5a6adc36f8e6", res2);
-}
\ No newline at end of file
+}
+
+TEST(HashTest, SHA256IntoBufferDoesNotAllocate) {
+  SHA256Buffer buffer;
+  std::uint64_t before = allocationCount();
+  std::string_view res = SHA256("", 0, buffer);
+  EXPECT_EQ(before, allocationCount());
+  EXPECT_EQ("e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855", res);
+}
@@ -0,0 +1,286 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <sstream>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "db_partition.hpp"
+#include "db_schema.hpp"
+#include "history_export.hpp"
+
+static void insertMessage(sqlite3* db, std::int64_t chatID, int messageID, std::int64_t senderID, const std::string& text,
+                          std::int64_t timestamp = 1700000000) {
+  sqlite3_stmt* stmt;
+  sqlite3_prepare_v2(db, "INSERT INTO messages (id, timestamp, message, message_type, chat_id, sender_id) VALUES (?, ?, ?, 1, ?, ?);", -1, &stmt, NULL);
+  std::string id = std::to_string(chatID) + ":" + std::to_string(messageID);
+  sqlite3_bind_text(stmt, 1, id.c_str(), -1, SQLITE_TRANSIENT);
+  sqlite3_bind_int64(stmt, 2, timestamp);
+  sqlite3_bind_text(stmt, 3, text.c_str(), text.size(), SQLITE_TRANSIENT);
+  sqlite3_bind_int64(stmt, 4, chatID);
+  sqlite3_bind_int64(stmt, 5, senderID);
+  sqlite3_step(stmt);
+  sqlite3_finalize(stmt);
+}
+
+static std::vector<std::string> splitLines(const std::string& text) {
+  std::vector<std::string> lines;
+  std::istringstream stream(text);
+  for(std::string line; std::getline(stream, line);) {
+    lines.push_back(line);
+  }
+  return lines;
+}
+
+// The ID is the first field in both formats
+static std::string lineID(const std::string& line) {
+  if(line[0] == '{') {
+    return line.substr(7, line.find('"', 7) - 7);
+  }
+  return line.substr(0, line.find(','));
+}
+
+class HistoryExportTest : public ::testing::Test {
+  protected:
+    void SetUp() override {
+      this->params.dbFile = testing::TempDir() + "tgrec_export_test.db";
+      this->outputFile = testing::TempDir() + "tgrec_export_test.out";
+      std::remove(this->params.dbFile.c_str());
+      ASSERT_EQ(SQLITE_OK, sqlite3_open(this->params.dbFile.c_str(), &this->db));
+      ASSERT_TRUE(migrateSchema(this->db));
+    }
+
+    void TearDown() override {
+      sqlite3_close(this->db);
+      std::remove(this->params.dbFile.c_str());
+      std::remove(this->outputFile.c_str());
+    }
+
+    std::string runExport() {
+      int fd = open(this->outputFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      EXPECT_TRUE(exportHistory(this->params, fd, this->stats));
+      close(fd);
+      std::ifstream file(this->outputFile, std::ios::binary);
+      std::stringstream contents;
+      contents << file.rdbuf();
+      EXPECT_EQ(contents.str().size(), this->stats.bytes);
+      return contents.str();
+    }
+
+    sqlite3* db;
+    ExportParams params;
+    ExportStats stats;
+    std::string outputFile;
+};
+
+TEST(HistoryExportEncodingTest, EscapesJSONStrings) {
+  std::string out;
+  appendJSONString(out, "plain text, привет");
+  EXPECT_EQ("\"plain text, привет\"", out);
+  out.clear();
+  appendJSONString(out, "say \"hi\"\\\n\r\t\x01\x1f");
+  EXPECT_EQ("\"say \\\"hi\\\"\\\\\\n\\r\\t\\u0001\\u001f\"", out);
+  out.clear();
+  appendJSONString(out, "");
+  EXPECT_EQ("\"\"", out);
+}
+
+TEST(HistoryExportEncodingTest, QuotesCSVFields) {
+  std::string out;
+  appendCSVField(out, "plain text");
+  EXPECT_EQ("plain text", out);
+  out.clear();
+  appendCSVField(out, "a, b");
+  EXPECT_EQ("\"a, b\"", out);
+  out.clear();
+  appendCSVField(out, "say \"hi\"\nbye");
+  EXPECT_EQ("\"say \"\"hi\"\"\nbye\"", out);
+}
+
+TEST(HistoryExportEncodingTest, ParsesTimes) {
+  std::int64_t timestamp;
+  ASSERT_TRUE(parseExportTime("1700000000", timestamp));
+  EXPECT_EQ(1700000000, timestamp);
+  ASSERT_TRUE(parseExportTime("2023-11-14", timestamp));
+  EXPECT_EQ(1699920000, timestamp);
+  ASSERT_TRUE(parseExportTime("2023-11-14T22:13:20", timestamp));
+  EXPECT_EQ(1700000000, timestamp);
+  EXPECT_FALSE(parseExportTime("yesterday", timestamp));
+  EXPECT_FALSE(parseExportTime("2023-11-14 and more", timestamp));
+}
+
+TEST_F(HistoryExportTest, JoinsChatSenderAndFile) {
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(this->db, "INSERT INTO chats (chat_id, name) VALUES (1, 'Friends'), (-100, 'News');"
+                                              "INSERT INTO users (user_id, fullname, username) VALUES (2, 'Ann Smith', 'ann');"
+                                              "INSERT INTO files (file_id, downloaded_as, origin_id) VALUES ('remote', 'ab/cd/abcd.jpg', 'origin');", 0, 0, NULL));
+  insertMessage(this->db, 1, 1, 2, "look at \"this\"\n");
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(this->db, "UPDATE messages SET content_file_id = 'origin', in_reply_of = '1:0';", 0, 0, NULL));
+  // Channel posts are sent by the channel itself
+  insertMessage(this->db, -100, 1, -100, "news");
+  std::vector<std::string> lines = splitLines(this->runExport());
+  ASSERT_EQ(2, lines.size());
+  std::sort(lines.begin(), lines.end());
+  EXPECT_EQ("{\"id\":\"-100:1\",\"timestamp\":1700000000,\"chat_id\":-100,\"chat\":\"News\",\"sender_id\":-100,\"sender\":\"News\","
+            "\"sender_username\":null,\"message_type\":1,\"text\":\"news\",\"in_reply_of\":null,\"forwarded_from\":null,"
+            "\"file_id\":null,\"file\":null}", lines[0]);
+  EXPECT_EQ("{\"id\":\"1:1\",\"timestamp\":1700000000,\"chat_id\":1,\"chat\":\"Friends\",\"sender_id\":2,\"sender\":\"Ann Smith\","
+            "\"sender_username\":\"ann\",\"message_type\":1,\"text\":\"look at \\\"this\\\"\\n\",\"in_reply_of\":\"1:0\",\"forwarded_from\":null,"
+            "\"file_id\":\"origin\",\"file\":\"ab/cd/abcd.jpg\"}", lines[1]);
+  EXPECT_EQ(2, this->stats.messages);
+  EXPECT_EQ(2, this->stats.chats);
+}
+
+TEST_F(HistoryExportTest, WritesCSVWithHeader) {
+  insertMessage(this->db, 1, 1, 2, "one, two");
+  this->params.format = EXPORT_CSV;
+  std::string output = this->runExport();
+  EXPECT_EQ("id,timestamp,chat_id,chat,sender_id,sender,sender_username,message_type,text,in_reply_of,forwarded_from,file_id,file\n"
+            "1:1,1700000000,1,,2,,,1,\"one, two\",,,,\n", output);
+}
+
+TEST_F(HistoryExportTest, KeepsEachChatInOrderAcrossPages) {
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(this->db, "BEGIN;", 0, 0, NULL));
+  // Interleaved like they are recorded
+  std::map<std::int64_t, std::vector<std::string>> expected;
+  for(int i = 1; i <= 300; ++i) {
+    std::int64_t chatID = i % 7;
+    insertMessage(this->db, chatID, 1000 - i, 2, "message");
+    expected[chatID].push_back(std::to_string(chatID) + ":" + std::to_string(1000 - i));
+  }
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(this->db, "COMMIT;", 0, 0, NULL));
+  this->params.threads = 3;
+  this->params.pageRows = 4;
+  std::map<std::int64_t, std::vector<std::string>> exported;
+  for(std::string& line : splitLines(this->runExport())) {
+    std::string id = lineID(line);
+    exported[std::stoll(id.substr(0, id.find(':')))].push_back(id);
+  }
+  EXPECT_EQ(expected, exported);
+  EXPECT_EQ(300, this->stats.messages);
+  EXPECT_EQ(7, this->stats.chats);
+}
+
+TEST_F(HistoryExportTest, FiltersByChatSenderAndTime) {
+  insertMessage(this->db, 1, 1, 10, "a", 1000);
+  insertMessage(this->db, 1, 2, 11, "b", 2000);
+  insertMessage(this->db, 1, 3, 10, "c", 3000);
+  insertMessage(this->db, 2, 1, 10, "d", 2000);
+  insertMessage(this->db, 3, 1, 11, "e", 2000);
+  auto exportedIDs = [&]() {
+    std::vector<std::string> ids;
+    for(std::string& line : splitLines(this->runExport())) {
+      ids.push_back(lineID(line));
+    }
+    // Chats are exported at the same time
+    std::sort(ids.begin(), ids.end());
+    return ids;
+  };
+  this->params.chatIDs = {2, 1, 2};
+  EXPECT_EQ(std::vector<std::string>({"1:1", "1:2", "1:3", "2:1"}), exportedIDs());
+  this->params.senderIDs = {10};
+  EXPECT_EQ(std::vector<std::string>({"1:1", "1:3", "2:1"}), exportedIDs());
+  this->params.chatIDs.clear();
+  this->params.since = 2000;
+  this->params.until = 3000;
+  EXPECT_EQ(std::vector<std::string>({"2:1"}), exportedIDs());
+  EXPECT_EQ(1, this->stats.chats);
+  this->params.senderIDs.clear();
+  EXPECT_EQ(std::vector<std::string>({"1:2", "2:1", "3:1"}), exportedIDs());
+}
+
+TEST_F(HistoryExportTest, RepairsInvalidUTF8) {
+  insertMessage(this->db, 1, 1, 2, std::string("bad \xff byte", 10));
+  std::vector<std::string> lines = splitLines(this->runExport());
+  ASSERT_EQ(1, lines.size());
+  EXPECT_NE(std::string::npos, lines[0].find("\"text\":\"bad \xef\xbf\xbd byte\""));
+}
+
+TEST_F(HistoryExportTest, ExportsEmptyDB) {
+  EXPECT_EQ("", this->runExport());
+  EXPECT_EQ(0, this->stats.messages);
+}
+
+TEST_F(HistoryExportTest, ExportsPartitionsInOrder) {
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(this->db, "INSERT INTO chats (chat_id, name) VALUES (1, 'Friends');", 0, 0, NULL));
+  // Recorded before partitioning
+  insertMessage(this->db, 1, 1, 2, "legacy", 1000);
+  ASSERT_TRUE(registerLegacyPartition(this->db, this->params.dbFile));
+  std::vector<std::string> paths;
+  for(std::string period : {"2026-09", "2026-10"}) {
+    std::string file = partitionFileName(this->params.dbFile, period);
+    paths.push_back(partitionPath(this->params.dbFile, file));
+    ASSERT_TRUE(preparePartition(paths.back(), DBTuningParams(), false, DEFAULT_SEARCH_TOKENIZER));
+    ASSERT_TRUE(registerPartition(this->db, file, period));
+  }
+  sqlite3* partition;
+  ASSERT_EQ(SQLITE_OK, sqlite3_open(paths[0].c_str(), &partition));
+  insertMessage(partition, 1, 2, 2, "september", 2000);
+  insertMessage(partition, 2, 1, 2, "september", 2000);
+  sqlite3_close(partition);
+  Partition sealed{partitionFileName(this->params.dbFile, "2026-09"), "2026-09"};
+  ASSERT_TRUE(sealPartition(paths[0], sealed));
+  ASSERT_TRUE(markPartitionSealed(this->db, sealed));
+  ASSERT_EQ(SQLITE_OK, sqlite3_open(paths[1].c_str(), &partition));
+  insertMessage(partition, 1, 3, 2, "october", 3000);
+  sqlite3_close(partition);
+  this->params.threads = 2;
+  std::vector<std::string> lines = splitLines(this->runExport());
+  std::vector<std::string> chat;
+  for(std::string& line : lines) {
+    if(lineID(line).substr(0, 2) == "1:") {
+      chat.push_back(lineID(line));
+      EXPECT_NE(std::string::npos, line.find("\"chat\":\"Friends\""));
+    }
+  }
+  EXPECT_EQ(std::vector<std::string>({"1:1", "1:2", "1:3"}), chat);
+  EXPECT_EQ(4, this->stats.messages);
+  EXPECT_EQ(2, this->stats.chats);
+  // Sealed partitions outside the range aren't read
+  this->params.since = 2500;
+  lines = splitLines(this->runExport());
+  ASSERT_EQ(1, lines.size());
+  EXPECT_EQ("1:3", lineID(lines[0]));
+  for(std::string& path : paths) {
+    chmod(path.c_str(), 0644);
+    std::remove(path.c_str());
+    std::remove((path + "-wal").c_str());
+    std::remove((path + "-shm").c_str());
+  }
+}
+
+#ifdef HAVE_ZSTD
+TEST_F(HistoryExportTest, CompressesWithZstd) {
+  for(int i = 1; i <= 100; ++i) {
+    insertMessage(this->db, i % 5, i, 2, "the same text over and over");
+  }
+  this->params.threads = 2;
+  this->params.pageRows = 3;
+  std::string plain = this->runExport();
+  this->params.zstdLevel = DEFAULT_EXPORT_ZSTD_LEVEL;
+  std::string compressed = this->runExport();
+  EXPECT_LT(compressed.size(), plain.size());
+  // A frame per write, decompressed as a single stream
+  std::string decompressed(plain.size() * 2, '\0');
+  std::size_t size = ZSTD_decompress(decompressed.data(), decompressed.size(), compressed.data(), compressed.size());
+  ASSERT_FALSE(ZSTD_isError(size));
+  decompressed.resize(size);
+  std::vector<std::string> plainLines = splitLines(plain);
+  std::vector<std::string> decompressedLines = splitLines(decompressed);
+  std::sort(plainLines.begin(), plainLines.end());
+  std::sort(decompressedLines.begin(), decompressedLines.end());
+  EXPECT_EQ(plainLines, decompressedLines);
+}
+#endif
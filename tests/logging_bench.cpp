@@ -0,0 +1,60 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+// 
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#include <cstdio>
+#include <string>
+
+#include <benchmark/benchmark.h>
+#define SPDLOG_ACTIVE_LEVEL SPDLOG_LEVEL_TRACE
+#include <spdlog/spdlog.h>
+#include <spdlog/async.h>
+#include <spdlog/sinks/basic_file_sink.h>
+
+#include "logging.hpp"
+
+static const std::string messageBody(280, 'x');
+
+static std::shared_ptr<spdlog::sinks::basic_file_sink_mt> benchSink() {
+  static std::shared_ptr<spdlog::sinks::basic_file_sink_mt> sink = std::make_shared<spdlog::sinks::basic_file_sink_mt>("tgrec_logging_bench.log", true);
+  sink->set_pattern("%l - %Y-%m-%d %H:%M:%S %z [%s:%# %!() TID:%t] %^%v%$");
+  return sink;
+}
+
+static void logMessages(benchmark::State& state, spdlog::logger* logger) {
+  std::int64_t chatID = -1001234567890;
+  for (auto _ : state) {
+    SPDLOG_LOGGER_INFO(logger, "Got message: [chat_id: {}] [from: {}]: {}", chatID, 123456789, messageBody);
+  }
+  logger->flush();
+}
+
+static void BM_SyncFileLogging(benchmark::State& state) {
+  spdlog::logger logger("sync", benchSink());
+  logMessages(state, &logger);
+}
+BENCHMARK(BM_SyncFileLogging);
+
+static void BM_AsyncFileLogging(benchmark::State& state) {
+  static std::shared_ptr<spdlog::details::thread_pool> pool = std::make_shared<spdlog::details::thread_pool>(8192, 1);
+  // async_logger needs to be owned by a shared_ptr
+  std::shared_ptr<spdlog::async_logger> logger = std::make_shared<spdlog::async_logger>("async", benchSink(), pool, spdlog::async_overflow_policy::overrun_oldest);
+  logMessages(state, logger.get());
+}
+BENCHMARK(BM_AsyncFileLogging);
+
+static void BM_RateLimitedLogging(benchmark::State& state) {
+  spdlog::logger logger("limited", benchSink());
+  std::shared_ptr<spdlog::logger> previousLogger = spdlog::default_logger();
+  spdlog::set_default_logger(std::shared_ptr<spdlog::logger>(&logger, [](spdlog::logger*) {}));
+  LogRateLimiter::configure(100, 1);
+  std::int64_t chatID = -1001234567890;
+  for (auto _ : state) {
+    TGREC_LOG_LIMITED(INFO, "Got message: [chat_id: {}] [from: {}]: {}", chatID, 123456789, messageBody);
+  }
+  LogRateLimiter::configure(0, 1);
+  spdlog::set_default_logger(previousLogger);
+}
+BENCHMARK(BM_RateLimitedLogging);
@@ -0,0 +1,44 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+// 
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#include <gtest/gtest.h>
+
+#include "logging.hpp"
+
+TEST(LoggingTest, UnlimitedByDefault) {
+  LogRateLimiter limiter;
+  for(int i = 0; i < 1000; ++i) {
+    EXPECT_TRUE(limiter.allow());
+  }
+}
+
+TEST(LoggingTest, Sampling) {
+  LogRateLimiter::configure(0, 3);
+  LogRateLimiter limiter;
+  int allowed = 0;
+  for(int i = 0; i < 30; ++i) {
+    allowed += limiter.allow();
+  }
+  EXPECT_EQ(10, allowed);
+  LogRateLimiter::configure(0, 1);
+}
+
+TEST(LoggingTest, RateLimit) {
+  LogRateLimiter::configure(5, 1);
+  LogRateLimiter limiter;
+  LogRateLimiter otherCallSite;
+  std::uint64_t suppressedBefore = LogRateLimiter::suppressed().get();
+  int allowed = 0;
+  for(int i = 0; i < 100; ++i) {
+    allowed += limiter.allow();
+  }
+  // The loop could straddle a second boundary
+  EXPECT_GE(allowed, 5);
+  EXPECT_LE(allowed, 10);
+  EXPECT_EQ(100 - allowed, LogRateLimiter::suppressed().get() - suppressedBefore);
+  EXPECT_TRUE(otherCallSite.allow());
+  LogRateLimiter::configure(0, 1);
+}
@@ -0,0 +1,121 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+// 
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+#include <gtest/gtest.h>
+
+#include "message_tracer.hpp"
+
+TEST(MessageTracerTest, CompletesWithoutFile) {
+  MetricsRegistry registry;
+  MessageTracer tracer(registry);
+  tracer.begin("1:2", 42, false);
+  EXPECT_EQ(1, tracer.tracesInFlight());
+  tracer.stamp("1:2", TRACE_ENQUEUED);
+  tracer.stamp("1:2", TRACE_COMMITTED);
+  EXPECT_EQ(1, tracer.tracesInFlight());
+  tracer.stamp("1:2", TRACE_READ);
+  EXPECT_EQ(0, tracer.tracesInFlight());
+
+  EXPECT_EQ(1, registry.histogram("tgrec_message_stage_seconds", "", "from=\"received\",to=\"enqueued\",content_type_id=\"42\"").count());
+  EXPECT_EQ(1, registry.histogram("tgrec_message_stage_seconds", "", "from=\"enqueued\",to=\"committed\",content_type_id=\"42\"").count());
+  EXPECT_EQ(1, registry.histogram("tgrec_message_stage_seconds", "", "from=\"committed\",to=\"read\",content_type_id=\"42\"").count());
+  EXPECT_EQ(1, registry.histogram("tgrec_message_end_to_end_seconds", "", "content_type_id=\"42\"").count());
+  EXPECT_EQ(1, registry.histogram("tgrec_message_durable_seconds", "").count());
+}
+
+TEST(MessageTracerTest, WaitsForDownload) {
+  MetricsRegistry registry;
+  MessageTracer tracer(registry);
+  tracer.begin("1:3", 7, true);
+  tracer.stamp("1:3", TRACE_ENQUEUED);
+  tracer.stamp("1:3", TRACE_COMMITTED);
+  tracer.stamp("1:3", TRACE_READ);
+  EXPECT_EQ(1, tracer.tracesInFlight());
+  tracer.stamp("1:3", TRACE_DOWNLOADED);
+  EXPECT_EQ(0, tracer.tracesInFlight());
+  EXPECT_EQ(1, registry.histogram("tgrec_message_stage_seconds", "", "from=\"read\",to=\"downloaded\",content_type_id=\"7\"").count());
+}
+
+TEST(MessageTracerTest, AbandonsFailedDownload) {
+  MetricsRegistry registry;
+  MessageTracer tracer(registry);
+  tracer.begin("1:5", 7, true);
+  tracer.stamp("1:5", TRACE_ENQUEUED);
+  tracer.stamp("1:5", TRACE_COMMITTED);
+  tracer.abandon("1:5");
+  EXPECT_EQ(0, tracer.tracesInFlight());
+  // Stamps after it's abandoned don't bring it back
+  tracer.stamp("1:5", TRACE_READ);
+  EXPECT_EQ(0, tracer.tracesInFlight());
+  EXPECT_EQ(0, registry.histogram("tgrec_message_end_to_end_seconds", "", "content_type_id=\"7\"").count());
+  EXPECT_EQ(1, registry.counter("tgrec_message_traces_abandoned_total", "").get());
+}
+
+TEST(MessageTracerTest, CompletesWithSkippedDownload) {
+  MetricsRegistry registry;
+  MessageTracer tracer(registry);
+  tracer.begin("1:6", 7, true);
+  tracer.stamp("1:6", TRACE_ENQUEUED);
+  tracer.skipDownload("1:6");
+  tracer.stamp("1:6", TRACE_COMMITTED);
+  tracer.stamp("1:6", TRACE_READ);
+  EXPECT_EQ(0, tracer.tracesInFlight());
+  EXPECT_EQ(1, registry.histogram("tgrec_message_end_to_end_seconds", "", "content_type_id=\"7\"").count());
+}
+
+TEST(MessageTracerTest, EvictsStaleTraces) {
+  MetricsRegistry registry;
+  MessageTracer tracer(registry, std::chrono::seconds(0));
+  tracer.begin("1:7", 7, true);
+  tracer.begin("1:8", 7, false);
+  EXPECT_EQ(1, tracer.tracesInFlight());
+  EXPECT_EQ(1, registry.counter("tgrec_message_traces_abandoned_total", "").get());
+}
+
+TEST(MessageTracerTest, IgnoresUnknownAndRepeatedStamps) {
+  MetricsRegistry registry;
+  MessageTracer tracer(registry);
+  tracer.stamp("5", TRACE_DOWNLOADED);
+  EXPECT_EQ(0, tracer.tracesInFlight());
+  tracer.begin("1:4", 7, false);
+  tracer.stamp("1:4", TRACE_ENQUEUED);
+  tracer.stamp("1:4", TRACE_ENQUEUED);
+  EXPECT_EQ(1, registry.histogram("tgrec_message_stage_seconds", "", "from=\"received\",to=\"enqueued\",content_type_id=\"7\"").count());
+}
+
+TEST(MessageTracerTest, WritesChromeTrace) {
+  std::string path = testing::TempDir() + "tgrec_trace_test.json";
+  MetricsRegistry registry;
+  MessageTracer tracer(registry);
+  ASSERT_TRUE(tracer.openTraceLog(path, 2));
+  for(int i = 0; i < 4; ++i) {
+    std::string id = "1:" + std::to_string(i);
+    tracer.begin(id, 7, false);
+    tracer.stamp(id, TRACE_ENQUEUED);
+    tracer.stamp(id, TRACE_COMMITTED);
+    tracer.stamp(id, TRACE_READ);
+  }
+  tracer.closeTraceLog();
+
+  std::ifstream in(path);
+  std::stringstream contents;
+  contents << in.rdbuf();
+  std::string trace = contents.str();
+  EXPECT_EQ('[', trace.front());
+  EXPECT_EQ("]\n", trace.substr(trace.size() - 2));
+  // 2 sampled messages, 3 events each
+  std::size_t events = 0;
+  for(std::size_t pos = trace.find("\"ph\":\"X\""); pos != std::string::npos; pos = trace.find("\"ph\":\"X\"", pos + 1)) {
+    ++events;
+  }
+  EXPECT_EQ(6, events);
+  EXPECT_NE(std::string::npos, trace.find("\"args\":{\"message\":\"1:1\"}"));
+  std::remove(path.c_str());
+}
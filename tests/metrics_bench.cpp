@@ -0,0 +1,35 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+// 
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#include <benchmark/benchmark.h>
+
+#include "metrics.hpp"
+
+static void BM_CounterInc(benchmark::State& state) {
+  static Counter& counter = metrics().counter("bench_total", "Benchmark counter");
+  for (auto _ : state) {
+    counter.inc();
+  }
+}
+BENCHMARK(BM_CounterInc)->ThreadRange(1, 4);
+
+static void BM_GaugeAdd(benchmark::State& state) {
+  static Gauge& gauge = metrics().gauge("bench_gauge", "Benchmark gauge");
+  for (auto _ : state) {
+    gauge.add(1);
+  }
+}
+BENCHMARK(BM_GaugeAdd)->ThreadRange(1, 4);
+
+static void BM_HistogramRecord(benchmark::State& state) {
+  static Histogram& histogram = metrics().histogram("bench_seconds", "Benchmark histogram", "", 1e-6);
+  std::uint64_t value = 1;
+  for (auto _ : state) {
+    histogram.record(value);
+    value = (value * 7 + 13) & 0xFFFFF;
+  }
+}
+BENCHMARK(BM_HistogramRecord)->ThreadRange(1, 4);
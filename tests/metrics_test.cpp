@@ -0,0 +1,94 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+// 
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "metrics.hpp"
+
+TEST(MetricsTest, Counter) {
+  MetricsRegistry registry;
+  Counter& counter = registry.counter("test_total", "Test counter");
+  counter.inc();
+  counter.inc(2);
+  EXPECT_EQ(3, counter.get());
+  EXPECT_EQ(&counter, &registry.counter("test_total", "Test counter"));
+  EXPECT_NE(&counter, &registry.counter("test_total", "Test counter", "a=\"b\""));
+}
+
+TEST(MetricsTest, CounterConcurrentIncrements) {
+  MetricsRegistry registry;
+  Counter& counter = registry.counter("test_total", "Test counter");
+  std::vector<std::thread> threads;
+  for(int i = 0; i < 4; ++i) {
+    threads.emplace_back([&counter]() {
+      for(int j = 0; j < 10000; ++j) {
+        counter.inc();
+      }
+    });
+  }
+  for(std::thread& t : threads) {
+    t.join();
+  }
+  EXPECT_EQ(40000, counter.get());
+}
+
+TEST(MetricsTest, Gauge) {
+  MetricsRegistry registry;
+  Gauge& gauge = registry.gauge("test_gauge", "Test gauge");
+  gauge.set(5);
+  gauge.add(-2);
+  EXPECT_DOUBLE_EQ(3, gauge.get());
+}
+
+TEST(MetricsTest, HistogramBuckets) {
+  for(std::uint64_t v : {0ull, 1ull, 15ull, 16ull, 17ull, 31ull, 32ull, 1000ull, 123456789ull}) {
+    unsigned int index = Histogram::bucketIndex(v);
+    EXPECT_GE(Histogram::bucketUpperBound(index), v);
+    if(index) {
+      EXPECT_LT(Histogram::bucketUpperBound(index - 1), v);
+    }
+  }
+  EXPECT_EQ(HISTOGRAM_NUM_BUCKETS - 1, Histogram::bucketIndex(~0ull));
+}
+
+TEST(MetricsTest, HistogramPercentiles) {
+  Histogram histogram(1.0);
+  for(std::uint64_t v = 1; v <= 1000; ++v) {
+    histogram.record(v);
+  }
+  EXPECT_EQ(1000, histogram.count());
+  EXPECT_EQ(500500, histogram.sum());
+  EXPECT_NEAR(500, histogram.percentile(0.5), 500 / HISTOGRAM_SUB_BUCKETS);
+  EXPECT_NEAR(990, histogram.percentile(0.99), 990 / HISTOGRAM_SUB_BUCKETS);
+  EXPECT_GE(histogram.percentile(1.0), 1000);
+}
+
+TEST(MetricsTest, Render) {
+  MetricsRegistry registry;
+  registry.counter("test_total", "Test counter", "type=\"a\"").inc(2);
+  registry.gauge("test_gauge", "Test gauge").set(7);
+  registry.histogram("test_seconds", "Test histogram", "", 1e-6).record(2000000);
+  std::string out = registry.render();
+  EXPECT_NE(std::string::npos, out.find("# TYPE test_total counter\ntest_total{type=\"a\"} 2\n"));
+  EXPECT_NE(std::string::npos, out.find("# HELP test_gauge Test gauge\n# TYPE test_gauge gauge\ntest_gauge 7\n"));
+  EXPECT_NE(std::string::npos, out.find("# TYPE test_seconds summary\n"));
+  EXPECT_NE(std::string::npos, out.find("test_seconds{quantile=\"0.5\"} 2."));
+  EXPECT_NE(std::string::npos, out.find("test_seconds_sum 2\n"));
+  EXPECT_NE(std::string::npos, out.find("test_seconds_count 1\n"));
+}
+
+TEST(MetricsTest, ProcessStats) {
+  ProcessStats before = processStats();
+  EXPECT_GT(before.residentBytes, 0);
+  EXPECT_GE(before.threads, 1);
+  std::thread thread([before]() {
+    EXPECT_EQ(before.threads + 1, processStats().threads);
+  });
+  thread.join();
+}
@@ -0,0 +1,165 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#include <memory>
+
+#include <benchmark/benchmark.h>
+
+#include "hash.hpp"
+#include "lru.hpp"
+#include "text_kernel.hpp"
+#include "text_utils.hpp"
+
+typedef struct BenchUser {
+  std::int64_t userID;
+  std::string fullName;
+} BenchUser;
+
+static void BM_LRUGetHit(benchmark::State& state) {
+  unsigned int size = state.range(0);
+  LRU<std::int64_t, std::unique_ptr<BenchUser>> cache(size);
+  for(unsigned int i = 0; i < size; ++i) {
+    cache.put(i, std::make_unique<BenchUser>(BenchUser{i, "User"}));
+  }
+  std::int64_t key = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(cache.get(key));
+    key = (key + 7) % size;
+  }
+}
+BENCHMARK(BM_LRUGetHit)->Arg(32)->Arg(1024)->Arg(65536);
+
+static void BM_LRUGetMiss(benchmark::State& state) {
+  unsigned int size = state.range(0);
+  LRU<std::int64_t, std::unique_ptr<BenchUser>> cache(size);
+  for(unsigned int i = 0; i < size; ++i) {
+    cache.put(i, std::make_unique<BenchUser>(BenchUser{i, "User"}));
+  }
+  std::int64_t key = size;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(cache.get(key++));
+  }
+}
+BENCHMARK(BM_LRUGetMiss)->Arg(32)->Arg(1024)->Arg(65536);
+
+// Every put is a new key, so the oldest one is evicted
+static void BM_LRUPutEvict(benchmark::State& state) {
+  unsigned int size = state.range(0);
+  LRU<std::int64_t, std::unique_ptr<BenchUser>> cache(size);
+  std::int64_t key = 0;
+  for(unsigned int i = 0; i < size; ++i) {
+    cache.put(key++, std::make_unique<BenchUser>(BenchUser{i, "User"}));
+  }
+  for (auto _ : state) {
+    cache.put(key, std::make_unique<BenchUser>(BenchUser{key, "User"}));
+    ++key;
+  }
+}
+BENCHMARK(BM_LRUPutEvict)->Arg(32)->Arg(1024)->Arg(65536);
+
+// Putting a key that is already cached moves it to the front
+static void BM_LRUPutExisting(benchmark::State& state) {
+  unsigned int size = state.range(0);
+  LRU<std::int64_t, std::unique_ptr<BenchUser>> cache(size);
+  for(unsigned int i = 0; i < size; ++i) {
+    cache.put(i, std::make_unique<BenchUser>(BenchUser{i, "User"}));
+  }
+  std::int64_t key = 0;
+  for (auto _ : state) {
+    cache.put(key, std::make_unique<BenchUser>(BenchUser{key, "User"}));
+    key = (key + 7) % size;
+  }
+}
+BENCHMARK(BM_LRUPutExisting)->Arg(32)->Arg(1024)->Arg(65536);
+
+// SHA256 and hex encoding of a file origin, as done for every file
+static void BM_SHA256FileOrigin(benchmark::State& state) {
+  std::string fileIDStr = "1234:-1001234567890:1048576";
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(SHA256(fileIDStr.c_str(), fileIDStr.size()));
+  }
+}
+BENCHMARK(BM_SHA256FileOrigin);
+
+static void BM_SHA256(benchmark::State& state) {
+  std::string data(state.range(0), 'x');
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(SHA256(data.c_str(), data.size()));
+  }
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_SHA256)->Arg(64)->Arg(4096)->Arg(1 << 20);
+
+static void BM_CompoundMessageID(benchmark::State& state) {
+  std::int64_t messageID = 1048576;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(getCompoundMessageID(-1001234567890, messageID++));
+  }
+}
+BENCHMARK(BM_CompoundMessageID);
+
+static void BM_Join(benchmark::State& state) {
+  std::vector<std::string> userNames;
+  for(int i = 0; i < state.range(0); ++i) {
+    userNames.push_back("username" + std::to_string(i));
+  }
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(join(userNames));
+  }
+}
+BENCHMARK(BM_Join)->Arg(1)->Arg(4)->Arg(32);
+
+static void BM_NumberOfWords(benchmark::State& state) {
+  std::string text;
+  while(text.size() < static_cast<std::size_t>(state.range(0))) {
+    text += "lorem ipsum dolor sit amet ";
+  }
+  text.resize(state.range(0));
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(getNumberOfWordsInString(text));
+  }
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_NumberOfWords)->Arg(64)->Arg(1024)->Arg(4096);
+
+// Channel posts of a few KB: English with typographic punctuation, Russian,
+// and Chinese with emoji
+static std::string channelPost(int language, std::size_t size) {
+  const char* paragraphs[] = {
+    "Breaking: the city council has approved the new budget \xE2\x80\x94 \xE2\x80\x9C" "a historic day\xE2\x80\x9D, said the mayor. More details in the thread below.\n\n",
+    "\xD0\x93\xD0\xBB\xD0\xB0\xD0\xB2\xD0\xBD\xD0\xBE\xD0\xB5 \xD0\xB7\xD0\xB0 \xD0\xB4\xD0\xB5\xD0\xBD\xD1\x8C: \xD0\xB3\xD0\xBE\xD1\x80\xD0\xBE\xD0\xB4\xD1\x81\xD0\xBA\xD0\xBE\xD0\xB9 \xD1\x81\xD0\xBE\xD0\xB2\xD0\xB5\xD1\x82 \xD1\x83\xD1\x82\xD0\xB2\xD0\xB5\xD1\x80\xD0\xB4\xD0\xB8\xD0\xBB \xD0\xB1\xD1\x8E\xD0\xB4\xD0\xB6\xD0\xB5\xD1\x82 \xD0\xBD\xD0\xB0 \xD1\x81\xD0\xBB\xD0\xB5\xD0\xB4\xD1\x83\xD1\x8E\xD1\x89\xD0\xB8\xD0\xB9 \xD0\xB3\xD0\xBE\xD0\xB4.\n\n",
+    "\xE5\xB8\x82\xE8\xAE\xAE\xE4\xBC\x9A\xE6\x89\xB9\xE5\x87\x86\xE4\xBA\x86\xE6\x96\xB0\xE9\xA2\x84\xE7\xAE\x97 \xF0\x9F\x8E\x89 \xE8\xAF\xA6\xE6\x83\x85\xE8\xA7\x81\xE4\xB8\x8B\xE6\x96\x87\xE3\x80\x82\n\n"
+  };
+  std::string text;
+  while(text.size() < size) {
+    text += paragraphs[language];
+  }
+  return text;
+}
+
+static void BM_ScanText(benchmark::State& state) {
+  std::string text = channelPost(state.range(1), state.range(0));
+  int kernel = state.range(2);
+  if(kernel > bestTextKernel()) {
+    state.SkipWithError("Kernel not supported by this CPU");
+    return;
+  }
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(scanText(text, kernel));
+  }
+  state.SetBytesProcessed(state.iterations() * text.size());
+}
+BENCHMARK(BM_ScanText)->ArgsProduct({{4096}, {0, 1, 2}, {TEXT_KERNEL_SCALAR, TEXT_KERNEL_SSE2, TEXT_KERNEL_AVX2}});
+
+static void BM_RepairUTF8(benchmark::State& state) {
+  std::string text = channelPost(1, 4096);
+  text[text.size() / 2] = '\xFF';
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(repairUTF8(text));
+  }
+  state.SetBytesProcessed(state.iterations() * text.size());
+}
+BENCHMARK(BM_RepairUTF8);
@@ -0,0 +1,104 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#include <gtest/gtest.h>
+
+#include "query_scheduler.hpp"
+
+using namespace std::chrono_literals;
+
+TEST(QuerySchedulerTest, ParseRetryAfter) {
+  EXPECT_EQ(7, parseRetryAfter(429, "Too Many Requests: retry after 7"));
+  EXPECT_EQ(35, parseRetryAfter(420, "FLOOD_WAIT_35"));
+  EXPECT_EQ(QUERY_DEFAULT_FLOOD_WAIT_SEC, parseRetryAfter(429, "Too Many Requests"));
+  EXPECT_EQ(-1, parseRetryAfter(400, "CHAT_ID_INVALID"));
+  EXPECT_EQ(-1, parseRetryAfter(404, "Not Found"));
+}
+
+TEST(QuerySchedulerTest, ControlQueriesAreNeverHeldBack) {
+  QueryScheduler scheduler(1);
+  auto now = QueryScheduler::Clock::now();
+  for(std::uint64_t id = 1; id <= 10; ++id) {
+    EXPECT_TRUE(scheduler.admit(id, 1, QUERY_PRIORITY_CONTROL, now));
+  }
+  EXPECT_EQ(0, scheduler.queued());
+  EXPECT_EQ(QueryScheduler::Clock::time_point::max(), scheduler.nextDue(now));
+}
+
+TEST(QuerySchedulerTest, MethodBucketPacesBulkQueries) {
+  QueryScheduler scheduler;
+  scheduler.setMethodLimit(1, 2);
+  auto now = QueryScheduler::Clock::now();
+  // A second's worth goes straight away
+  EXPECT_TRUE(scheduler.admit(1, 1, QUERY_PRIORITY_BULK, now));
+  EXPECT_TRUE(scheduler.admit(2, 1, QUERY_PRIORITY_BULK, now));
+  EXPECT_FALSE(scheduler.admit(3, 1, QUERY_PRIORITY_BULK, now));
+  EXPECT_FALSE(scheduler.admit(4, 1, QUERY_PRIORITY_BULK, now));
+  // Other methods aren't limited
+  EXPECT_TRUE(scheduler.admit(5, 2, QUERY_PRIORITY_BULK, now));
+  EXPECT_EQ(2, scheduler.queued());
+  EXPECT_TRUE(scheduler.due(now).empty());
+
+  EXPECT_EQ(now + 500ms, scheduler.nextDue(now));
+  EXPECT_EQ(std::vector<std::uint64_t>({3}), scheduler.due(now + 500ms));
+  // Queued ones keep their place ahead of new ones
+  EXPECT_FALSE(scheduler.admit(6, 1, QUERY_PRIORITY_BULK, now + 1s));
+  EXPECT_EQ(std::vector<std::uint64_t>({4}), scheduler.due(now + 1s));
+  EXPECT_EQ(std::vector<std::uint64_t>({6}), scheduler.due(now + 1500ms));
+  EXPECT_EQ(0, scheduler.queued());
+}
+
+TEST(QuerySchedulerTest, BulkMethodsShareALimit) {
+  QueryScheduler scheduler(1);
+  scheduler.setMethodLimit(3, 0, false);
+  auto now = QueryScheduler::Clock::now();
+  EXPECT_TRUE(scheduler.admit(1, 1, QUERY_PRIORITY_BULK, now));
+  EXPECT_FALSE(scheduler.admit(2, 2, QUERY_PRIORITY_BULK, now));
+  EXPECT_FALSE(scheduler.admit(3, 1, QUERY_PRIORITY_BULK, now));
+  // Kept out of the shared limit
+  EXPECT_TRUE(scheduler.admit(4, 3, QUERY_PRIORITY_BULK, now));
+  // Interactive queries don't take from it
+  EXPECT_TRUE(scheduler.admit(5, 4, QUERY_PRIORITY_INTERACTIVE, now));
+
+  // Methods take turns
+  EXPECT_EQ(std::vector<std::uint64_t>({3}), scheduler.due(now + 1s));
+  EXPECT_EQ(std::vector<std::uint64_t>({2}), scheduler.due(now + 2s));
+}
+
+TEST(QuerySchedulerTest, FloodWaitHoldsTheMethodBack) {
+  QueryScheduler scheduler;
+  auto now = QueryScheduler::Clock::now();
+  EXPECT_TRUE(scheduler.admit(1, 1, QUERY_PRIORITY_INTERACTIVE, now));
+  scheduler.retryAfter(2, 1, QUERY_PRIORITY_INTERACTIVE, 3, now);
+  EXPECT_FALSE(scheduler.admit(3, 1, QUERY_PRIORITY_INTERACTIVE, now + 1s));
+  EXPECT_TRUE(scheduler.admit(4, 2, QUERY_PRIORITY_INTERACTIVE, now + 1s));
+  EXPECT_TRUE(scheduler.due(now + 2s).empty());
+  EXPECT_EQ(now + 3s, scheduler.nextDue(now + 2s));
+  // The query turned down goes first
+  EXPECT_EQ(std::vector<std::uint64_t>({2, 3}), scheduler.due(now + 3s));
+}
+
+TEST(QuerySchedulerTest, InteractiveQueriesGoAheadOfBulk) {
+  QueryScheduler scheduler;
+  auto now = QueryScheduler::Clock::now();
+  scheduler.retryAfter(1, 1, QUERY_PRIORITY_BULK, 1, now);
+  scheduler.retryAfter(2, 2, QUERY_PRIORITY_INTERACTIVE, 1, now);
+  scheduler.retryAfter(3, 3, QUERY_PRIORITY_CONTROL, 1, now);
+  EXPECT_EQ(std::vector<std::uint64_t>({3, 2, 1}), scheduler.due(now + 1s));
+}
+
+TEST(QuerySchedulerTest, ClearKeepsFloodWaits) {
+  QueryScheduler scheduler;
+  auto now = QueryScheduler::Clock::now();
+  scheduler.retryAfter(1, 1, QUERY_PRIORITY_BULK, 5, now);
+  EXPECT_FALSE(scheduler.admit(2, 1, QUERY_PRIORITY_BULK, now));
+  EXPECT_EQ(2, scheduler.queued());
+  scheduler.clear();
+  EXPECT_EQ(0, scheduler.queued());
+  EXPECT_TRUE(scheduler.due(now + 5s).empty());
+  EXPECT_FALSE(scheduler.admit(3, 1, QUERY_PRIORITY_BULK, now + 1s));
+  EXPECT_EQ(std::vector<std::uint64_t>({3}), scheduler.due(now + 5s));
+}
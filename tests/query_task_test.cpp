@@ -0,0 +1,104 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#include <gtest/gtest.h>
+
+#include "query_task.hpp"
+
+// Stands in for the queries, answered by the test
+typedef struct FakeQueries {
+  QueryJoin join;
+  unsigned int count;
+  bool await_ready() {
+    return false;
+  }
+  void await_suspend(std::coroutine_handle<> waiter) {
+    this->join.waiter = waiter;
+    this->join.pending = this->count;
+  }
+  void await_resume() {}
+} FakeQueries;
+
+typedef struct FrameGuard {
+  bool* destroyed;
+  ~FrameGuard() {
+    *this->destroyed = true;
+  }
+} FrameGuard;
+
+QueryTask waitOn(FakeQueries& queries, int& stage, bool& destroyed) {
+  FrameGuard guard{&destroyed};
+  stage = 1;
+  co_await queries;
+  stage = 2;
+}
+
+TEST(QueryTaskTest, RunsUntilTheFirstQuery) {
+  FakeQueries queries{{}, 1};
+  int stage = 0;
+  bool destroyed = false;
+  waitOn(queries, stage, destroyed);
+  EXPECT_EQ(1, stage);
+  EXPECT_FALSE(destroyed);
+  answerQuery(&queries.join);
+  EXPECT_EQ(2, stage);
+  EXPECT_TRUE(destroyed);
+}
+
+TEST(QueryTaskTest, ResumedByTheLastQueryAnswered) {
+  FakeQueries queries{{}, 2};
+  int stage = 0;
+  bool destroyed = false;
+  waitOn(queries, stage, destroyed);
+  answerQuery(&queries.join);
+  EXPECT_EQ(1, stage);
+  answerQuery(&queries.join);
+  EXPECT_EQ(2, stage);
+  EXPECT_TRUE(destroyed);
+}
+
+TEST(QueryTaskTest, AbandonedQueriesDestroyTheCoroutine) {
+  FakeQueries queries{{}, 2};
+  int stage = 0;
+  bool destroyed = false;
+  waitOn(queries, stage, destroyed);
+  abandonQuery(&queries.join);
+  EXPECT_FALSE(destroyed);
+  // Not resumed, even if the other one is answered
+  answerQuery(&queries.join);
+  EXPECT_EQ(1, stage);
+  EXPECT_TRUE(destroyed);
+}
+
+TEST(QueryTaskTest, FramesAreReused) {
+  FakeQueries queries{{}, 1};
+  int stage = 0;
+  bool destroyed = false;
+  waitOn(queries, stage, destroyed);
+  answerQuery(&queries.join);
+  std::size_t cached = FramePool::cached();
+  ASSERT_GT(cached, 0);
+  waitOn(queries, stage, destroyed);
+  EXPECT_EQ(cached - 1, FramePool::cached());
+  answerQuery(&queries.join);
+  EXPECT_EQ(cached, FramePool::cached());
+}
+
+TEST(QueryTaskTest, FramePoolSizeClasses) {
+  void* small = FramePool::allocate(10);
+  FramePool::release(small, 10);
+  // Same size class
+  EXPECT_EQ(small, FramePool::allocate(FRAME_POOL_GRANULARITY));
+  FramePool::release(small, FRAME_POOL_GRANULARITY);
+  void* other = FramePool::allocate(FRAME_POOL_GRANULARITY + 1);
+  EXPECT_NE(small, other);
+  FramePool::release(other, FRAME_POOL_GRANULARITY + 1);
+
+  std::size_t cached = FramePool::cached();
+  void* big = FramePool::allocate(FRAME_POOL_MAX_FRAME_SIZE + 1);
+  FramePool::release(big, FRAME_POOL_MAX_FRAME_SIZE + 1);
+  EXPECT_EQ(cached, FramePool::cached());
+}
@@ -0,0 +1,80 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+// 
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#include <map>
+
+#include <gtest/gtest.h>
+
+#include "read_scheduler.hpp"
+
+TEST(ReadSchedulerTest, SingleChatIsSequential) {
+  ReadScheduler scheduler(4, 100.0);
+  scheduler.addChat(1, {1.0, 2.0, 3.0});
+  std::vector<ReadEvent> events = scheduler.plan();
+  ASSERT_EQ(5, events.size());
+  EXPECT_EQ(READ_EVENT_OPEN_CHAT, events[0].type);
+  EXPECT_DOUBLE_EQ(0.0, events[1].offsetSec);
+  EXPECT_DOUBLE_EQ(1.0, events[2].offsetSec);
+  EXPECT_DOUBLE_EQ(3.0, events[3].offsetSec);
+  EXPECT_EQ(READ_EVENT_CLOSE_CHAT, events[4].type);
+  EXPECT_DOUBLE_EQ(6.0, events[4].offsetSec);
+  EXPECT_DOUBLE_EQ(1.0, scheduler.getPacingFactor());
+}
+
+TEST(ReadSchedulerTest, RespectsMaxOpenChats) {
+  ReadScheduler scheduler(2, 1000.0);
+  for(std::int64_t chat = 1; chat <= 5; ++chat) {
+    scheduler.addChat(chat, {1.0, 1.0});
+  }
+  std::vector<ReadEvent> events = scheduler.plan();
+  int open = 0;
+  int maxOpen = 0;
+  for(ReadEvent& event : events) {
+    if(event.type == READ_EVENT_OPEN_CHAT) {
+      maxOpen = std::max(maxOpen, ++open);
+    } else if(event.type == READ_EVENT_CLOSE_CHAT) {
+      --open;
+    }
+  }
+  EXPECT_EQ(2, maxOpen);
+  EXPECT_EQ(0, open);
+  // 5 chats of 2 seconds each over 2 lanes
+  EXPECT_DOUBLE_EQ(6.0, scheduler.getPlannedDuration());
+}
+
+TEST(ReadSchedulerTest, KeepsMessageOrderWithinChat) {
+  ReadScheduler scheduler(3, 1000.0);
+  scheduler.addChat(1, {5.0, 1.0, 1.0});
+  scheduler.addChat(2, {1.0, 1.0, 1.0, 1.0});
+  scheduler.addChat(3, {2.0});
+  std::map<std::int64_t, std::size_t> nextIndex;
+  for(ReadEvent& event : scheduler.plan()) {
+    if(event.type == READ_EVENT_READ_MESSAGE) {
+      EXPECT_EQ(nextIndex[event.chatID]++, event.messageIndex);
+    }
+  }
+  EXPECT_EQ(3, nextIndex[1]);
+  EXPECT_EQ(4, nextIndex[2]);
+  EXPECT_EQ(1, nextIndex[3]);
+}
+
+TEST(ReadSchedulerTest, PacesBacklogIntoBudget) {
+  ReadScheduler scheduler(2, 10.0);
+  scheduler.addChat(1, {30.0});
+  scheduler.addChat(2, {10.0, 10.0});
+  std::vector<ReadEvent> events = scheduler.plan();
+  EXPECT_DOUBLE_EQ(10.0 / 30.0, scheduler.getPacingFactor());
+  EXPECT_DOUBLE_EQ(10.0, scheduler.getPlannedDuration());
+  for(ReadEvent& event : events) {
+    EXPECT_LE(event.offsetSec, 10.0);
+  }
+}
+
+TEST(ReadSchedulerTest, EmptyBacklog) {
+  ReadScheduler scheduler(2, 10.0);
+  EXPECT_EQ(0, scheduler.plan().size());
+  EXPECT_DOUBLE_EQ(0.0, scheduler.getPlannedDuration());
+}
@@ -0,0 +1,165 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#include <random>
+
+#include <benchmark/benchmark.h>
+#include <spdlog/spdlog.h>
+
+#include "db_schema.hpp"
+#include "search_index.hpp"
+
+#define SEARCH_BENCH_VOCABULARY 20000
+#define SEARCH_BENCH_MESSAGES 100000
+
+// Made up words from a few syllables, the first ones much more frequent than
+// the rest, as in real text
+class MessageGenerator {
+  public:
+    MessageGenerator() : rng(1) {
+      const char* syllables[] = {"ka", "lo", "mi", "ne", "ru", "sa", "to", "vi", "zu", "pe", "da", "gro", "fen", "tar", "wil"};
+      for(unsigned int i = 0; i < SEARCH_BENCH_VOCABULARY; ++i) {
+        std::string word;
+        for(unsigned int n = i; ; n /= 15) {
+          word += syllables[n % 15];
+          if(n < 15) {
+            break;
+          }
+        }
+        this->vocabulary.push_back(word);
+      }
+    }
+
+    const std::string& word() {
+      double u = std::uniform_real_distribution<double>(0, 1)(this->rng);
+      return this->vocabulary[static_cast<std::size_t>(u * u * u * SEARCH_BENCH_VOCABULARY)];
+    }
+
+    std::string message() {
+      std::string text;
+      unsigned int words = 3 + this->rng() % 40;
+      for(unsigned int i = 0; i < words; ++i) {
+        text += this->word();
+        text += ' ';
+      }
+      return text;
+    }
+
+    std::mt19937 rng;
+    std::vector<std::string> vocabulary;
+};
+
+static sqlite3* openBenchDB() {
+  spdlog::set_level(spdlog::level::warn);
+  sqlite3* db;
+  sqlite3_open(":memory:", &db);
+  migrateSchema(db);
+  return db;
+}
+
+// One transaction per batch, like the DB writer, which also indexes them if
+// the index is enabled
+static void insertMessages(sqlite3* db, MessageGenerator& generator, unsigned int count, bool index = false) {
+  unsigned int batch = 1000;
+  sqlite3_stmt* stmt;
+  sqlite3_prepare_v2(db, "INSERT INTO messages (id, timestamp, message, chat_id, sender_id) VALUES (?, ?, ?, ?, ?);", -1, &stmt, NULL);
+  sqlite3_int64 first = 0;
+  sqlite3_stmt* last;
+  sqlite3_prepare_v2(db, "SELECT IFNULL(MAX(rowid), 0) FROM messages;", -1, &last, NULL);
+  if(sqlite3_step(last) == SQLITE_ROW) {
+    first = sqlite3_column_int64(last, 0);
+  }
+  sqlite3_finalize(last);
+  for(unsigned int i = 0; i < count; ++i) {
+    if(i % batch == 0) {
+      sqlite3_exec(db, "BEGIN;", 0, 0, NULL);
+    }
+    std::string id = "1:" + std::to_string(first + i);
+    std::string text = generator.message();
+    sqlite3_bind_text(stmt, 1, id.c_str(), id.length(), SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, 1700000000 + i);
+    sqlite3_bind_text(stmt, 3, text.c_str(), text.length(), SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 4, i % 50);
+    sqlite3_bind_int64(stmt, 5, i % 500);
+    sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    if(i % batch == batch - 1 || i == count - 1) {
+      if(index) {
+        indexNewMessages(db);
+      }
+      sqlite3_exec(db, "COMMIT;", 0, 0, NULL);
+    }
+  }
+  sqlite3_finalize(stmt);
+}
+
+// Indexing messages recorded before the index existed, in batches
+static void BM_SearchIndexBuild(benchmark::State& state) {
+  unsigned int messages = state.range(0);
+  for (auto _ : state) {
+    state.PauseTiming();
+    MessageGenerator generator;
+    sqlite3* db = openBenchDB();
+    insertMessages(db, generator, messages);
+    configureSearchIndex(db, true, DEFAULT_SEARCH_TOKENIZER);
+    state.ResumeTiming();
+    while(buildSearchIndex(db) > 0);
+    state.PauseTiming();
+    sqlite3_close(db);
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * messages);
+}
+BENCHMARK(BM_SearchIndexBuild)->Arg(SEARCH_BENCH_MESSAGES)->Unit(benchmark::kMillisecond);
+
+// What the index costs the writer: 0 has no index, 1 keeps it up to date
+static void BM_InsertMessages(benchmark::State& state) {
+  MessageGenerator generator;
+  sqlite3* db = openBenchDB();
+  configureSearchIndex(db, state.range(0), DEFAULT_SEARCH_TOKENIZER);
+  for (auto _ : state) {
+    insertMessages(db, generator, 1000, state.range(0));
+  }
+  state.SetItemsProcessed(state.iterations() * 1000);
+  sqlite3_close(db);
+}
+BENCHMARK(BM_InsertMessages)->Arg(0)->Arg(1);
+
+static sqlite3* searchBenchDB() {
+  static sqlite3* db = nullptr;
+  if(!db) {
+    MessageGenerator generator;
+    db = openBenchDB();
+    configureSearchIndex(db, true, DEFAULT_SEARCH_TOKENIZER);
+    insertMessages(db, generator, SEARCH_BENCH_MESSAGES, true);
+    sqlite3_exec(db, "INSERT INTO chats (chat_id, name) SELECT DISTINCT chat_id, 'Chat ' || chat_id FROM messages;"
+                     "INSERT INTO users (user_id, fullname) SELECT DISTINCT sender_id, 'User ' || sender_id FROM messages;", 0, 0, NULL);
+  }
+  return db;
+}
+
+// A common word, a rare one, a phrase, a prefix and two words
+static void BM_Search(benchmark::State& state) {
+  sqlite3* db = searchBenchDB();
+  MessageGenerator generator;
+  std::string queries[] = {
+    generator.vocabulary[1],
+    generator.vocabulary[SEARCH_BENCH_VOCABULARY / 2],
+    "\"" + generator.vocabulary[1] + " " + generator.vocabulary[2] + "\"",
+    generator.vocabulary[5] + "*",
+    generator.vocabulary[10] + " AND " + generator.vocabulary[200]
+  };
+  std::string& query = queries[state.range(0)];
+  std::size_t found = 0;
+  for (auto _ : state) {
+    std::vector<SearchResult> results;
+    searchMessages(db, query, DEFAULT_SEARCH_LIMIT, results);
+    found = results.size();
+    benchmark::DoNotOptimize(results);
+  }
+  state.counters["results"] = found;
+}
+BENCHMARK(BM_Search)->DenseRange(0, 4)->Unit(benchmark::kMicrosecond);
@@ -0,0 +1,192 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#include <algorithm>
+
+#include <gtest/gtest.h>
+
+#include "db_schema.hpp"
+#include "search_index.hpp"
+
+static void insertMessage(sqlite3* db, int messageID, const std::string& text, std::int64_t chatID = 1, std::int64_t senderID = 2) {
+  sqlite3_stmt* stmt;
+  sqlite3_prepare_v2(db, "INSERT INTO messages (id, timestamp, message, chat_id, sender_id) VALUES (?, ?, ?, ?, ?);", -1, &stmt, NULL);
+  std::string id = std::to_string(chatID) + ":" + std::to_string(messageID);
+  sqlite3_bind_text(stmt, 1, id.c_str(), -1, SQLITE_TRANSIENT);
+  sqlite3_bind_int(stmt, 2, 1700000000 + messageID);
+  sqlite3_bind_text(stmt, 3, text.c_str(), -1, SQLITE_TRANSIENT);
+  sqlite3_bind_int64(stmt, 4, chatID);
+  sqlite3_bind_int64(stmt, 5, senderID);
+  sqlite3_step(stmt);
+  sqlite3_finalize(stmt);
+}
+
+static std::vector<std::string> searchIDs(sqlite3* db, const std::string& query) {
+  std::vector<SearchResult> results;
+  EXPECT_TRUE(searchMessages(db, query, DEFAULT_SEARCH_LIMIT, results));
+  std::vector<std::string> ids;
+  for(SearchResult& result : results) {
+    ids.push_back(result.messageID);
+  }
+  std::sort(ids.begin(), ids.end());
+  return ids;
+}
+
+// Also compares the index with the messages table
+static bool indexIntact(sqlite3* db) {
+  return sqlite3_exec(db, "INSERT INTO messages_fts (messages_fts, rank) VALUES ('integrity-check', 1);", 0, 0, NULL) == SQLITE_OK;
+}
+
+class SearchIndexTest : public ::testing::Test {
+  protected:
+    void SetUp() override {
+      ASSERT_EQ(SQLITE_OK, sqlite3_open(":memory:", &this->db));
+      ASSERT_TRUE(migrateSchema(this->db));
+    }
+
+    void TearDown() override {
+      sqlite3_close(this->db);
+    }
+
+    sqlite3* db;
+};
+
+TEST_F(SearchIndexTest, IndexesNewAndEditedMessages) {
+  ASSERT_TRUE(configureSearchIndex(this->db, true, DEFAULT_SEARCH_TOKENIZER));
+  EXPECT_EQ(0, searchIndexPendingRows(this->db));
+  insertMessage(this->db, 1, "Meet me at the station");
+  insertMessage(this->db, 2, "The train is late");
+  EXPECT_TRUE(searchIDs(this->db, "station").empty());
+  EXPECT_EQ(2, indexNewMessages(this->db));
+  EXPECT_EQ(0, indexNewMessages(this->db));
+  EXPECT_EQ(std::vector<std::string>({"1:1"}), searchIDs(this->db, "station"));
+  EXPECT_EQ(std::vector<std::string>({"1:2"}), searchIDs(this->db, "train"));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(this->db, "UPDATE messages SET message = 'Meet me at the airport' WHERE id = '1:1';", 0, 0, NULL));
+  EXPECT_TRUE(searchIDs(this->db, "station").empty());
+  EXPECT_EQ(std::vector<std::string>({"1:1"}), searchIDs(this->db, "airport"));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(this->db, "DELETE FROM messages WHERE id = '1:2';", 0, 0, NULL));
+  EXPECT_TRUE(searchIDs(this->db, "train").empty());
+  // Gets the rowid of the one deleted, which is indexed already
+  insertMessage(this->db, 3, "The bus is late");
+  EXPECT_EQ(std::vector<std::string>({"1:3"}), searchIDs(this->db, "bus"));
+  EXPECT_EQ(0, indexNewMessages(this->db));
+  EXPECT_TRUE(indexIntact(this->db));
+}
+
+TEST_F(SearchIndexTest, BuildsExistingMessagesInBatches) {
+  for(int i = 1; i <= 10; ++i) {
+    insertMessage(this->db, i, "old message " + std::to_string(i));
+  }
+  ASSERT_TRUE(configureSearchIndex(this->db, true, DEFAULT_SEARCH_TOKENIZER));
+  EXPECT_EQ(10, searchIndexPendingRows(this->db));
+  EXPECT_TRUE(searchIDs(this->db, "old").empty());
+  // Edits and new messages while it's being built only touch what's indexed
+  ASSERT_EQ(3, buildSearchIndex(this->db, 3));
+  insertMessage(this->db, 11, "new message");
+  ASSERT_EQ(1, indexNewMessages(this->db));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(this->db, "UPDATE messages SET message = 'edited message' WHERE id IN ('1:2', '1:5');", 0, 0, NULL));
+  EXPECT_EQ(std::vector<std::string>({"1:2"}), searchIDs(this->db, "edited"));
+  ASSERT_EQ(3, buildSearchIndex(this->db, 3));
+  ASSERT_EQ(3, buildSearchIndex(this->db, 3));
+  EXPECT_EQ(1, searchIndexPendingRows(this->db));
+  ASSERT_EQ(1, buildSearchIndex(this->db, 3));
+  EXPECT_EQ(0, buildSearchIndex(this->db, 3));
+  EXPECT_EQ(0, searchIndexPendingRows(this->db));
+  EXPECT_EQ(std::vector<std::string>({"1:2", "1:5"}), searchIDs(this->db, "edited"));
+  EXPECT_EQ(8, searchIDs(this->db, "old").size());
+  EXPECT_EQ(std::vector<std::string>({"1:11"}), searchIDs(this->db, "new"));
+  EXPECT_TRUE(indexIntact(this->db));
+}
+
+TEST_F(SearchIndexTest, BuildsInsideATransaction) {
+  insertMessage(this->db, 1, "old message");
+  ASSERT_TRUE(configureSearchIndex(this->db, true, DEFAULT_SEARCH_TOKENIZER));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(this->db, "BEGIN;", 0, 0, NULL));
+  insertMessage(this->db, 2, "new message");
+  ASSERT_EQ(1, buildSearchIndex(this->db));
+  ASSERT_EQ(1, indexNewMessages(this->db));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(this->db, "COMMIT;", 0, 0, NULL));
+  EXPECT_EQ(std::vector<std::string>({"1:1", "1:2"}), searchIDs(this->db, "message"));
+  EXPECT_TRUE(indexIntact(this->db));
+}
+
+TEST_F(SearchIndexTest, JoinsChatAndSenderNames) {
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(this->db, "INSERT INTO chats (chat_id, name) VALUES (1, 'Friends'), (-100, 'News');"
+                                              "INSERT INTO users (user_id, fullname) VALUES (2, 'Ann Smith');", 0, 0, NULL));
+  ASSERT_TRUE(configureSearchIndex(this->db, true, DEFAULT_SEARCH_TOKENIZER));
+  insertMessage(this->db, 1, "lunch tomorrow?", 1, 2);
+  // Channel posts are sent by the channel itself
+  insertMessage(this->db, 2, "lunch prices are up", -100, -100);
+  indexNewMessages(this->db);
+  std::vector<SearchResult> results;
+  ASSERT_TRUE(searchMessages(this->db, "lunch", DEFAULT_SEARCH_LIMIT, results));
+  ASSERT_EQ(2, results.size());
+  std::sort(results.begin(), results.end(), [](const SearchResult& a, const SearchResult& b) { return a.chatID > b.chatID; });
+  EXPECT_EQ("Friends", results[0].chatName);
+  EXPECT_EQ("Ann Smith", results[0].senderName);
+  EXPECT_EQ(1700000001, results[0].timestamp);
+  EXPECT_EQ("[lunch] tomorrow?", results[0].snippet);
+  EXPECT_EQ("News", results[1].chatName);
+  EXPECT_EQ("News", results[1].senderName);
+}
+
+TEST_F(SearchIndexTest, RanksAndLimitsResults) {
+  ASSERT_TRUE(configureSearchIndex(this->db, true, DEFAULT_SEARCH_TOKENIZER));
+  insertMessage(this->db, 1, "coffee and a long story about many other unrelated things");
+  insertMessage(this->db, 2, "coffee coffee");
+  indexNewMessages(this->db);
+  std::vector<SearchResult> results;
+  ASSERT_TRUE(searchMessages(this->db, "coffee", 1, results));
+  ASSERT_EQ(1, results.size());
+  EXPECT_EQ("1:2", results[0].messageID);
+}
+
+TEST_F(SearchIndexTest, IgnoresDiacritics) {
+  ASSERT_TRUE(configureSearchIndex(this->db, true, DEFAULT_SEARCH_TOKENIZER));
+  insertMessage(this->db, 1, "Un café crème à Zürich");
+  insertMessage(this->db, 2, "Привет, мир");
+  indexNewMessages(this->db);
+  EXPECT_EQ(std::vector<std::string>({"1:1"}), searchIDs(this->db, "cafe"));
+  EXPECT_EQ(std::vector<std::string>({"1:1"}), searchIDs(this->db, "ZURICH"));
+  EXPECT_EQ(std::vector<std::string>({"1:2"}), searchIDs(this->db, "привет"));
+}
+
+TEST_F(SearchIndexTest, TokenizerChangeRebuildsIndex) {
+  ASSERT_TRUE(configureSearchIndex(this->db, true, DEFAULT_SEARCH_TOKENIZER));
+  insertMessage(this->db, 1, "Un café crème");
+  ASSERT_TRUE(configureSearchIndex(this->db, true, "unicode61 remove_diacritics 0"));
+  EXPECT_EQ(1, searchIndexPendingRows(this->db));
+  ASSERT_EQ(1, buildSearchIndex(this->db));
+  EXPECT_TRUE(searchIDs(this->db, "cafe").empty());
+  EXPECT_EQ(std::vector<std::string>({"1:1"}), searchIDs(this->db, "café"));
+  // Nothing to do if it's the same
+  ASSERT_TRUE(configureSearchIndex(this->db, true, "unicode61 remove_diacritics 0"));
+  EXPECT_EQ(0, searchIndexPendingRows(this->db));
+  EXPECT_FALSE(configureSearchIndex(this->db, true, "no_such_tokenizer"));
+  EXPECT_EQ(std::vector<std::string>({"1:1"}), searchIDs(this->db, "café"));
+}
+
+TEST_F(SearchIndexTest, DisablingDropsIndex) {
+  ASSERT_TRUE(configureSearchIndex(this->db, true, DEFAULT_SEARCH_TOKENIZER));
+  insertMessage(this->db, 1, "some text");
+  ASSERT_TRUE(configureSearchIndex(this->db, false, DEFAULT_SEARCH_TOKENIZER));
+  insertMessage(this->db, 2, "more text");
+  EXPECT_EQ(0, indexNewMessages(this->db));
+  std::vector<SearchResult> results;
+  EXPECT_FALSE(searchMessages(this->db, "text", DEFAULT_SEARCH_LIMIT, results));
+  EXPECT_EQ(0, searchIndexPendingRows(this->db));
+  EXPECT_EQ(0, buildSearchIndex(this->db));
+  ASSERT_TRUE(configureSearchIndex(this->db, false, DEFAULT_SEARCH_TOKENIZER));
+}
+
+TEST_F(SearchIndexTest, MalformedQueryFails) {
+  ASSERT_TRUE(configureSearchIndex(this->db, true, DEFAULT_SEARCH_TOKENIZER));
+  insertMessage(this->db, 1, "some text");
+  indexNewMessages(this->db);
+  std::vector<SearchResult> results;
+  EXPECT_FALSE(searchMessages(this->db, "\"unterminated", DEFAULT_SEARCH_LIMIT, results));
+  EXPECT_TRUE(results.empty());
+}
@@ -0,0 +1,77 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#include <random>
+
+#include <gtest/gtest.h>
+
+#include "text_kernel.hpp"
+
+static void expectSameStats(const TextStats& expected, const TextStats& actual, int kernel) {
+  EXPECT_EQ(expected.codepoints, actual.codepoints) << "kernel " << kernel;
+  EXPECT_EQ(expected.words, actual.words) << "kernel " << kernel;
+  EXPECT_EQ(expected.lines, actual.lines) << "kernel " << kernel;
+  EXPECT_EQ(expected.validUTF8, actual.validUTF8) << "kernel " << kernel;
+}
+
+TEST(TextKernelTest, Stats) {
+  TextStats empty = scanText("");
+  EXPECT_EQ(0, empty.codepoints);
+  EXPECT_EQ(0, empty.words);
+  EXPECT_EQ(0, empty.lines);
+  EXPECT_TRUE(empty.validUTF8);
+
+  // Cyrillic, an emoji, a no-break space and an ideographic space
+  TextStats stats = scanText("Привет 👋\nsee\xC2\xA0you\xE3\x80\x80明天\n");
+  EXPECT_EQ(20, stats.codepoints);
+  EXPECT_EQ(5, stats.words);
+  EXPECT_EQ(3, stats.lines);
+  EXPECT_TRUE(stats.validUTF8);
+}
+
+TEST(TextKernelTest, InvalidUTF8) {
+  // Stray continuation, overlong, surrogate, past U+10FFFF and truncated
+  for(std::string text : {"a\x80", "\xC0\xAF", "\xED\xA0\x80", "\xF4\x90\x80\x80", "abc\xE2\x82"}) {
+    for(int kernel = TEXT_KERNEL_SCALAR; kernel <= bestTextKernel(); ++kernel) {
+      EXPECT_FALSE(scanText(text, kernel).validUTF8) << "kernel " << kernel;
+    }
+  }
+}
+
+TEST(TextKernelTest, RepairReplacesMaximalSubparts) {
+  EXPECT_EQ("abc", repairUTF8("abc"));
+  // Truncated three byte sequence, then a stray continuation
+  EXPECT_EQ("a\xEF\xBF\xBD" "b\xEF\xBF\xBD", repairUTF8("a\xE2\x82" "b\x80"));
+  // Each byte of an overlong sequence is invalid on its own
+  EXPECT_EQ("\xEF\xBF\xBD\xEF\xBF\xBD", repairUTF8("\xC0\xAF"));
+  std::string repaired = repairUTF8("Привет\xFF");
+  EXPECT_TRUE(scanText(repaired).validUTF8);
+  EXPECT_EQ(7, scanText(repaired).codepoints);
+}
+
+// Long enough for the vector kernels, with sequences and whitespace crossing
+// chunk boundaries at every offset
+TEST(TextKernelTest, KernelsMatchScalar) {
+  const char* pieces[] = {
+    "a", "word", " ", "\n", "\t", "\xC2\xA0", "\xC2\x85", "\xE2\x80\x83", "\xE2\x80\xA8", "\xE2\x81\x9F",
+    "\xE1\x9A\x80", "\xE3\x80\x80", "Ж", "你", "😀", "“", "\x80", "\xC0\xAF", "\xED\xA0\x80", "\xF0\x9F", "\xFF"
+  };
+  // The invalid ones are at the end
+  const std::size_t validPieces = 16;
+  std::mt19937 rng(1);
+  for(int i = 0; i < 20000; ++i) {
+    bool valid = i % 2;
+    std::string text;
+    std::size_t length = rng() % 200;
+    while(text.size() < length) {
+      text += pieces[rng() % (valid ? validPieces : sizeof(pieces) / sizeof(*pieces))];
+    }
+    TextStats expected = scanText(text, TEXT_KERNEL_SCALAR);
+    for(int kernel = TEXT_KERNEL_SSE2; kernel <= bestTextKernel(); ++kernel) {
+      expectSameStats(expected, scanText(text, kernel), kernel);
+    }
+  }
+}
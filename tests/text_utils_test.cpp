@@ -0,0 +1,50 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#include <gtest/gtest.h>
+
+#include "alloc_counter.hpp"
+#include "text_utils.hpp"
+
+TEST(TextUtilsTest, Join) {
+  std::vector<std::string> empty;
+  EXPECT_EQ("", join(empty));
+  std::vector<std::string> one = {"alice"};
+  EXPECT_EQ("alice", join(one));
+  std::vector<std::string> several = {"alice", "bob", "carol"};
+  EXPECT_EQ("alice.bob.carol", join(several));
+  EXPECT_EQ("alice,bob,carol", join(several, ','));
+}
+
+TEST(TextUtilsTest, NumberOfWords) {
+  std::string empty = "";
+  EXPECT_EQ(0, getNumberOfWordsInString(empty));
+  std::string text = "see you at the office";
+  EXPECT_EQ(5, getNumberOfWordsInString(text));
+  std::string lines = "  see you\ttomorrow\n\nat the\xC2\xA0office ";
+  EXPECT_EQ(6, getNumberOfWordsInString(lines));
+}
+
+TEST(TextUtilsTest, CompoundMessageID) {
+  EXPECT_EQ("123:456", getCompoundMessageID(123, 456));
+  EXPECT_EQ("-1001234567890:1048576", getCompoundMessageID(-1001234567890, 1048576));
+}
+
+TEST(TextUtilsTest, FormatCompoundID) {
+  IDBuffer buffer;
+  EXPECT_EQ("123", formatCompoundID(buffer, {123}));
+  EXPECT_EQ("-1001234567890:1048576", formatCompoundID(buffer, {-1001234567890, 1048576}));
+  // The longest there is
+  EXPECT_EQ("-9223372036854775808:-9223372036854775808:-9223372036854775808", formatCompoundID(buffer, {INT64_MIN, INT64_MIN, INT64_MIN}));
+}
+
+TEST(TextUtilsTest, FormatCompoundIDDoesNotAllocate) {
+  IDBuffer buffer;
+  std::uint64_t before = allocationCount();
+  std::string_view id = formatCompoundID(buffer, {42, -1001234567890, 1048576});
+  EXPECT_EQ(before, allocationCount());
+  EXPECT_EQ("42:-1001234567890:1048576", id);
+}
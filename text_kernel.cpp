@@ -0,0 +1,475 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#include <bit>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TEXT_KERNEL_X86
+#endif
+
+#include "text_kernel.hpp"
+
+#define INVALID_CODEPOINT 0xFFFFFFFF
+
+typedef struct ScanState {
+  TextStats stats;
+  // Whether the last character was whitespace, or there's none yet, so the
+  // next one that isn't starts a word
+  bool afterSpace{true};
+  std::size_t newlines{0};
+} ScanState;
+
+// Length of the sequence at s, or of its maximal invalid subpart, in which
+// case cp is INVALID_CODEPOINT
+static inline std::size_t decodeUTF8(const unsigned char* s, std::size_t n, std::uint32_t& cp) {
+  unsigned char b = s[0];
+  if(b < 0x80) {
+    cp = b;
+    return 1;
+  }
+  std::size_t len;
+  // Allowed range of the second byte, the rest are always 80..BF
+  unsigned char lo = 0x80;
+  unsigned char hi = 0xBF;
+  if(b >= 0xC2 && b <= 0xDF) {
+    len = 2;
+    cp = b & 0x1F;
+  } else if(b >= 0xE0 && b <= 0xEF) {
+    len = 3;
+    cp = b & 0x0F;
+    if(b == 0xE0) {
+      // Overlong
+      lo = 0xA0;
+    } else if(b == 0xED) {
+      // Surrogates
+      hi = 0x9F;
+    }
+  } else if(b >= 0xF0 && b <= 0xF4) {
+    len = 4;
+    cp = b & 0x07;
+    if(b == 0xF0) {
+      // Overlong
+      lo = 0x90;
+    } else if(b == 0xF4) {
+      // Past U+10FFFF
+      hi = 0x8F;
+    }
+  } else {
+    cp = INVALID_CODEPOINT;
+    return 1;
+  }
+  for(std::size_t i = 1; i < len; ++i) {
+    if(i >= n || s[i] < lo || s[i] > hi) {
+      cp = INVALID_CODEPOINT;
+      return i;
+    }
+    cp = (cp << 6) | (s[i] & 0x3F);
+    lo = 0x80;
+    hi = 0xBF;
+  }
+  return len;
+}
+
+// The White_Space property
+static inline bool isSpace(std::uint32_t cp) {
+  switch(cp) {
+    case 0x09: case 0x0A: case 0x0B: case 0x0C: case 0x0D: case 0x20:
+    case 0x85: case 0xA0: case 0x1680:
+    case 0x2028: case 0x2029: case 0x202F: case 0x205F: case 0x3000:
+      return true;
+  }
+  return cp >= 0x2000 && cp <= 0x200A;
+}
+
+static inline std::size_t scanCodepoint(const unsigned char* s, std::size_t n, ScanState& state) {
+  std::uint32_t cp;
+  std::size_t len = decodeUTF8(s, n, cp);
+  if(cp == INVALID_CODEPOINT) {
+    state.stats.validUTF8 = false;
+  }
+  bool space = isSpace(cp);
+  if(!space && state.afterSpace) {
+    ++state.stats.words;
+  }
+  state.afterSpace = space;
+  ++state.stats.codepoints;
+  if(cp == '\n') {
+    ++state.newlines;
+  }
+  return len;
+}
+
+// Character by character, from pos until at least end
+static inline std::size_t scanScalar(const unsigned char* s, std::size_t pos, std::size_t end, std::size_t n, ScanState& state) {
+  while(pos < end) {
+    pos += scanCodepoint(s + pos, n - pos, state);
+  }
+  return pos;
+}
+
+// Adds up a chunk from bitmasks with one bit per byte, the first byte being the
+// lowest bit. spaces has every byte of whitespace characters, starts the first
+// byte of every character.
+static inline void countChunk(std::uint64_t spaces, std::uint64_t starts, std::uint64_t newlines, unsigned int width, ScanState& state) {
+  std::uint64_t all = width == 64 ? ~0ULL : (1ULL << width) - 1;
+  spaces &= all;
+  starts &= all;
+  std::uint64_t wordStarts = starts & ~spaces & ((spaces << 1) | (state.afterSpace ? 1 : 0));
+  state.stats.words += std::popcount(wordStarts);
+  state.stats.codepoints += std::popcount(starts);
+  state.newlines += std::popcount(newlines & all);
+  state.afterSpace = (spaces >> (width - 1)) & 1;
+}
+
+static TextStats finish(ScanState& state, std::size_t n) {
+  state.stats.lines = n ? state.newlines + 1 : 0;
+  return state.stats;
+}
+
+static TextStats scanTextScalar(std::string_view text) {
+  const unsigned char* s = reinterpret_cast<const unsigned char*>(text.data());
+  ScanState state;
+  scanScalar(s, 0, text.size(), text.size(), state);
+  return finish(state, text.size());
+}
+
+#ifdef TEXT_KERNEL_X86
+
+// Part of the x86-64 baseline, so no need to check for it
+static TextStats scanTextSSE2(std::string_view text) {
+  const unsigned char* s = reinterpret_cast<const unsigned char*>(text.data());
+  std::size_t n = text.size();
+  ScanState state;
+  std::size_t pos = 0;
+  const __m128i tab = _mm_set1_epi8(0x08);
+  const __m128i carriageReturn = _mm_set1_epi8(0x0E);
+  const __m128i space = _mm_set1_epi8(' ');
+  const __m128i newline = _mm_set1_epi8('\n');
+  while(n - pos >= 16) {
+    __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + pos));
+    if(_mm_movemask_epi8(chunk)) {
+      pos = scanScalar(s, pos, pos + 16, n, state);
+      continue;
+    }
+    // All ASCII, so the signed comparisons work
+    __m128i spaces = _mm_or_si128(
+      _mm_cmpeq_epi8(chunk, space),
+      _mm_and_si128(_mm_cmpgt_epi8(chunk, tab), _mm_cmplt_epi8(chunk, carriageReturn))
+    );
+    countChunk(
+      static_cast<std::uint32_t>(_mm_movemask_epi8(spaces)),
+      0xFFFF,
+      static_cast<std::uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline))),
+      16,
+      state
+    );
+    pos += 16;
+  }
+  scanScalar(s, pos, n, n, state);
+  return finish(state, n);
+}
+
+#define TOO_SHORT (1 << 0)
+#define TOO_LONG (1 << 1)
+#define OVERLONG_3 (1 << 2)
+#define TOO_LARGE (1 << 3)
+#define SURROGATE (1 << 4)
+#define OVERLONG_2 (1 << 5)
+#define TOO_LARGE_1000 (1 << 6)
+#define OVERLONG_4 (1 << 6)
+#define TWO_CONTS (1 << 7)
+#define CARRY (TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+__attribute__((target("avx2,popcnt")))
+static inline __m256i lookup16(__m256i index, __m256i table) {
+  return _mm256_shuffle_epi8(table, index);
+}
+
+// The input shifted N bytes towards the end, with the last ones of the
+// previous chunk coming in
+template<int N>
+__attribute__((target("avx2,popcnt")))
+static inline __m256i previous(__m256i input, __m256i prevInput) {
+  return _mm256_alignr_epi8(input, _mm256_permute2x128_si256(prevInput, input, 0x21), 16 - N);
+}
+
+__attribute__((target("avx2,popcnt")))
+static inline __m256i inRange(__m256i input, unsigned char lo, unsigned char hi) {
+  return _mm256_and_si256(
+    _mm256_cmpeq_epi8(_mm256_max_epu8(input, _mm256_set1_epi8(lo)), input),
+    _mm256_cmpeq_epi8(_mm256_min_epu8(input, _mm256_set1_epi8(hi)), input)
+  );
+}
+
+__attribute__((target("avx2,popcnt")))
+static inline __m256i equals(__m256i input, unsigned char c) {
+  return _mm256_cmpeq_epi8(input, _mm256_set1_epi8(c));
+}
+
+__attribute__((target("avx2,popcnt")))
+static inline std::uint32_t bits(__m256i mask) {
+  return static_cast<std::uint32_t>(_mm256_movemask_epi8(mask));
+}
+
+// Bytes where an invalid sequence is detected, nonzero
+__attribute__((target("avx2,popcnt")))
+static inline __m256i utf8Errors(__m256i input, __m256i prevInput) {
+  const __m256i byte1High = _mm256_setr_epi8(
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+    TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+    TOO_SHORT | OVERLONG_2,
+    TOO_SHORT,
+    TOO_SHORT | OVERLONG_3 | SURROGATE,
+    TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4,
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+    TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+    TOO_SHORT | OVERLONG_2,
+    TOO_SHORT,
+    TOO_SHORT | OVERLONG_3 | SURROGATE,
+    TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4
+  );
+  const __m256i byte1Low = _mm256_setr_epi8(
+    CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+    CARRY | OVERLONG_2,
+    CARRY,
+    CARRY,
+    CARRY | TOO_LARGE,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+    CARRY | OVERLONG_2,
+    CARRY,
+    CARRY,
+    CARRY | TOO_LARGE,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000
+  );
+  const __m256i byte2High = _mm256_setr_epi8(
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT
+  );
+  const __m256i lowNibble = _mm256_set1_epi8(0x0F);
+  __m256i prev1 = previous<1>(input, prevInput);
+  __m256i prev1High = _mm256_and_si256(_mm256_srli_epi16(prev1, 4), lowNibble);
+  __m256i prev1Low = _mm256_and_si256(prev1, lowNibble);
+  __m256i inputHigh = _mm256_and_si256(_mm256_srli_epi16(input, 4), lowNibble);
+  __m256i special = _mm256_and_si256(
+    _mm256_and_si256(lookup16(prev1High, byte1High), lookup16(prev1Low, byte1Low)),
+    lookup16(inputHigh, byte2High)
+  );
+  // Third and fourth bytes of a sequence, which must be continuations
+  __m256i prev2 = previous<2>(input, prevInput);
+  __m256i prev3 = previous<3>(input, prevInput);
+  __m256i must23 = _mm256_or_si256(
+    _mm256_subs_epu8(prev2, _mm256_set1_epi8(static_cast<char>(0xE0 - 0x80))),
+    _mm256_subs_epu8(prev3, _mm256_set1_epi8(static_cast<char>(0xF0 - 0x80)))
+  );
+  __m256i must23High = _mm256_and_si256(must23, _mm256_set1_epi8(static_cast<char>(0x80)));
+  return _mm256_xor_si256(must23High, special);
+}
+
+// Whitespace outside of ASCII, marked on the first byte of each character.
+// next1 and next2 are the input one and two bytes further into the text.
+__attribute__((target("avx2,popcnt")))
+static inline void multibyteSpaces(__m256i input, __m256i next1, __m256i next2, std::uint32_t& twoByte, std::uint32_t& threeByte) {
+  // U+0085, U+00A0
+  twoByte = bits(_mm256_and_si256(equals(input, 0xC2), _mm256_or_si256(equals(next1, 0x85), equals(next1, 0xA0))));
+  __m256i e2 = equals(input, 0xE2);
+  // U+2000..U+200A, U+2028, U+2029, U+202F
+  __m256i generalPunctuation = _mm256_and_si256(_mm256_and_si256(e2, equals(next1, 0x80)), _mm256_or_si256(
+    _mm256_or_si256(inRange(next2, 0x80, 0x8A), inRange(next2, 0xA8, 0xA9)),
+    equals(next2, 0xAF)
+  ));
+  // U+205F
+  __m256i mathematicalSpace = _mm256_and_si256(_mm256_and_si256(e2, equals(next1, 0x81)), equals(next2, 0x9F));
+  // U+1680
+  __m256i ogham = _mm256_and_si256(_mm256_and_si256(equals(input, 0xE1), equals(next1, 0x9A)), equals(next2, 0x80));
+  // U+3000
+  __m256i ideographic = _mm256_and_si256(_mm256_and_si256(equals(input, 0xE3), equals(next1, 0x80)), equals(next2, 0x80));
+  threeByte = bits(_mm256_or_si256(
+    _mm256_or_si256(generalPunctuation, mathematicalSpace),
+    _mm256_or_si256(ogham, ideographic)
+  ));
+}
+
+// Nonzero if the chunk ends with an unfinished sequence
+__attribute__((target("avx2,popcnt")))
+static inline __m256i unfinished(__m256i input) {
+  const __m256i maxLast = _mm256_setr_epi8(
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    static_cast<char>(0xEF), static_cast<char>(0xDF), static_cast<char>(0xBF)
+  );
+  return _mm256_subs_epu8(input, maxLast);
+}
+
+typedef struct AVX2State {
+  __m256i prevInput;
+  __m256i errors;
+  // Whitespace bytes of a character started in the previous chunk
+  std::uint64_t spacesCarry;
+} AVX2State;
+
+// Validates and counts the 32 bytes at s, reading 2 more past them. Characters
+// can span chunks: they count in the chunk where they start.
+__attribute__((target("avx2,popcnt"), always_inline))
+static inline void scanChunkAVX2(const unsigned char* s, unsigned int width, ScanState& state, AVX2State& vector) {
+  __m256i input = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s));
+  // Only ASCII is positive, so the signed comparisons work
+  __m256i asciiSpaces = _mm256_or_si256(
+    equals(input, ' '),
+    _mm256_and_si256(_mm256_cmpgt_epi8(input, _mm256_set1_epi8(0x08)), _mm256_cmpgt_epi8(_mm256_set1_epi8(0x0E), input))
+  );
+  std::uint64_t spaces = bits(asciiSpaces) | vector.spacesCarry;
+  std::uint32_t newlines = bits(equals(input, '\n'));
+  if(!bits(input)) {
+    vector.errors = _mm256_or_si256(vector.errors, unfinished(vector.prevInput));
+    vector.prevInput = input;
+    vector.spacesCarry = 0;
+    countChunk(spaces, 0xFFFFFFFF, newlines, width, state);
+    return;
+  }
+  vector.errors = _mm256_or_si256(vector.errors, utf8Errors(input, vector.prevInput));
+  vector.prevInput = input;
+  std::uint64_t twoByte;
+  std::uint64_t threeByte;
+  {
+    std::uint32_t two;
+    std::uint32_t three;
+    multibyteSpaces(
+      input,
+      _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + 1)),
+      _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + 2)),
+      two,
+      three
+    );
+    twoByte = two;
+    threeByte = three;
+  }
+  spaces |= twoByte | (twoByte << 1) | threeByte | (threeByte << 1) | (threeByte << 2);
+  vector.spacesCarry = spaces >> 32;
+  // Every byte but continuations, signed above 0xBF
+  std::uint32_t starts = bits(_mm256_cmpgt_epi8(input, _mm256_set1_epi8(static_cast<char>(0xBF))));
+  countChunk(spaces & 0xFFFFFFFF, starts, newlines, width, state);
+}
+
+// Invalid UTF-8 is rare enough to just scan it all again with the scalar code,
+// which knows where each invalid sequence ends
+__attribute__((target("avx2,popcnt")))
+static TextStats scanTextAVX2(std::string_view text) {
+  const unsigned char* s = reinterpret_cast<const unsigned char*>(text.data());
+  std::size_t n = text.size();
+  ScanState state;
+  AVX2State vector{_mm256_setzero_si256(), _mm256_setzero_si256(), 0};
+  std::size_t pos = 0;
+  // Room to read 2 bytes past the chunk
+  while(n - pos >= 34) {
+    scanChunkAVX2(s + pos, 32, state, vector);
+    pos += 32;
+  }
+  // The rest, padded with zeros, which also catches a sequence left unfinished
+  if(pos < n) {
+    unsigned char tail[66] = {0};
+    std::size_t rest = n - pos;
+    for(std::size_t i = 0; i < rest; ++i) {
+      tail[i] = s[pos + i];
+    }
+    scanChunkAVX2(tail, rest < 32 ? rest : 32, state, vector);
+    if(rest > 32) {
+      scanChunkAVX2(tail + 32, rest - 32, state, vector);
+    }
+  }
+  // Unless the last chunk was padded, a sequence could still be unfinished
+  vector.errors = _mm256_or_si256(vector.errors, unfinished(vector.prevInput));
+  if(!_mm256_testz_si256(vector.errors, vector.errors)) {
+    return scanTextScalar(text);
+  }
+  return finish(state, n);
+}
+
+#endif
+
+static int detectTextKernel() {
+#ifdef TEXT_KERNEL_X86
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+    return TEXT_KERNEL_AVX2;
+  }
+  return TEXT_KERNEL_SSE2;
+#else
+  return TEXT_KERNEL_SCALAR;
+#endif
+}
+
+int bestTextKernel() {
+  static const int best = detectTextKernel();
+  return best;
+}
+
+TextStats scanText(std::string_view text) {
+  return scanText(text, bestTextKernel());
+}
+
+TextStats scanText(std::string_view text, int kernel) {
+  switch(kernel) {
+#ifdef TEXT_KERNEL_X86
+    case TEXT_KERNEL_AVX2:
+      return scanTextAVX2(text);
+    case TEXT_KERNEL_SSE2:
+      return scanTextSSE2(text);
+#endif
+    default:
+      return scanTextScalar(text);
+  }
+}
+
+std::string repairUTF8(std::string_view text) {
+  const unsigned char* s = reinterpret_cast<const unsigned char*>(text.data());
+  std::string repaired;
+  repaired.reserve(text.size() + 2);
+  std::size_t pos = 0;
+  while(pos < text.size()) {
+    std::uint32_t cp;
+    std::size_t len = decodeUTF8(s + pos, text.size() - pos, cp);
+    if(cp == INVALID_CODEPOINT) {
+      repaired += "\xEF\xBF\xBD";
+    } else {
+      repaired.append(text.data() + pos, len);
+    }
+    pos += len;
+  }
+  return repaired;
+}
@@ -0,0 +1,42 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#ifndef TEXT_KERNEL_HPP
+#define TEXT_KERNEL_HPP
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+// Implementations of scanText(), from slowest to fastest
+#define TEXT_KERNEL_SCALAR 0
+// Runs of ASCII 16 bytes at a time, the rest like the scalar one
+#define TEXT_KERNEL_SSE2 1
+// 32 bytes at a time, validating multibyte sequences with the lookup tables
+// from "Validating UTF-8 In Less Than One Instruction Per Byte" (Keiser,
+// Lemire 2021)
+#define TEXT_KERNEL_AVX2 2
+
+// What's known about a text after a single pass over it
+typedef struct TextStats {
+  // Each invalid sequence counts as one, like the U+FFFD replacing it would
+  std::size_t codepoints{0};
+  // Runs of characters between Unicode whitespace
+  unsigned int words{0};
+  unsigned int lines{0};
+  bool validUTF8{true};
+} TextStats;
+
+// The fastest kernel the CPU supports, checked once
+int bestTextKernel();
+TextStats scanText(std::string_view text);
+// Only kernels up to bestTextKernel() can be used
+TextStats scanText(std::string_view text, int kernel);
+// Each maximal invalid subsequence is replaced by U+FFFD, as recommended by the
+// Unicode standard (3.9, "U+FFFD Substitution of Maximal Subparts")
+std::string repairUTF8(std::string_view text);
+
+#endif
@@ -0,0 +1,43 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#include <charconv>
+#include <sstream>
+
+#include "text_kernel.hpp"
+#include "text_utils.hpp"
+
+std::string join(std::vector<std::string>& vec, char separator) {
+    std::ostringstream o;
+    auto cur = vec.begin();
+    if (cur != vec.end()) {
+        o << *cur++;
+        for (; cur != vec.end(); ++cur)
+            o << separator << *cur;
+    }
+    return o.str();
+}
+
+unsigned int getNumberOfWordsInString(std::string_view text) {
+  return scanText(text).words;
+}
+
+std::string_view formatCompoundID(IDBuffer& buffer, std::initializer_list<std::int64_t> ids) {
+  char* pos = buffer.data();
+  char* end = buffer.data() + buffer.size();
+  for(std::int64_t id : ids) {
+    if(pos != buffer.data()) {
+      *pos++ = ':';
+    }
+    pos = std::to_chars(pos, end, id).ptr;
+  }
+  return std::string_view(buffer.data(), pos - buffer.data());
+}
+
+std::string getCompoundMessageID(std::int64_t chatID, std::int64_t messageID) {
+  IDBuffer buffer;
+  return std::string(formatCompoundID(buffer, {chatID, messageID}));
+}
@@ -0,0 +1,31 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#ifndef TEXT_UTILS_HPP
+#define TEXT_UTILS_HPP
+
+#include <array>
+#include <cstdint>
+#include <initializer_list>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Fits three 64-bit IDs joined by ':', like a file origin ID before hashing
+#define ID_BUFFER_SIZE 64
+
+typedef std::array<char, ID_BUFFER_SIZE> IDBuffer;
+
+std::string join(std::vector<std::string>& vec, char separator = '.');
+// Split by any Unicode whitespace, see scanText()
+unsigned int getNumberOfWordsInString(std::string_view text);
+// Writes the IDs joined by ':' into the buffer, without allocating. The view
+// returned is valid as long as the buffer is.
+std::string_view formatCompoundID(IDBuffer& buffer, std::initializer_list<std::int64_t> ids);
+// ID of a message in the DB, <chat ID>:<message ID>
+std::string getCompoundMessageID(std::int64_t chatID, std::int64_t messageID);
+
+#endif
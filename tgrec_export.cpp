@@ -0,0 +1,116 @@
+//
+// Copyright (c) 2022, Imanol-Mikel Barba Sabariego
+// All rights reserved.
+//
+// Distributed under BSD 3-Clause License. See LICENSE.
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SPDLOG_ACTIVE_LEVEL SPDLOG_LEVEL_TRACE
+#include <spdlog/spdlog.h>
+#include <spdlog/sinks/stdout_color_sinks.h>
+
+#include "history_export.hpp"
+
+static struct option longopts[] = {
+    { "output",   required_argument,  NULL, 'o'},
+    { "format",   required_argument,  NULL, 'f'},
+    { "chat",     required_argument,  NULL, 'c'},
+    { "sender",   required_argument,  NULL, 'u'},
+    { "since",    required_argument,  NULL, 's'},
+    { "until",    required_argument,  NULL, 'U'},
+    { "threads",  required_argument,  NULL, 'j'},
+    { "zstd",     optional_argument,  NULL, 'z'},
+    { "help",     no_argument,        NULL, 'h'},
+    { NULL,       0,                  NULL, 0  }
+};
+
+void printHelp(const char* argv) {
+    std::cout << argv << " [options] <db file>" << std::endl;
+    std::cout << " -o | --output FILE  Write to FILE instead of the standard output" << std::endl;
+    std::cout << " -f | --format F     jsonl or csv (default jsonl)" << std::endl;
+    std::cout << " -c | --chat ID      Only export this chat, can be repeated" << std::endl;
+    std::cout << " -u | --sender ID    Only export messages from this user or chat, can be repeated" << std::endl;
+    std::cout << " -s | --since T      Only export messages sent at T or later" << std::endl;
+    std::cout << " -U | --until T      Only export messages sent before T" << std::endl;
+    std::cout << " -j | --threads N    Chats exported at the same time (default " << DEFAULT_EXPORT_THREADS << ")" << std::endl;
+    std::cout << " -z | --zstd[=N]     Compress with zstd at level N (default " << DEFAULT_EXPORT_ZSTD_LEVEL << ")" << std::endl;
+    std::cout << " -h | --help         Show this help" << std::endl;
+    std::cout << "Times are Unix timestamps, or YYYY-MM-DD or YYYY-MM-DDTHH:MM:SS in UTC" << std::endl;
+}
+
+int main(int argc, char** argv) {
+  // The export may go to the standard output
+  spdlog::set_default_logger(spdlog::stderr_color_mt("tgrec-export"));
+  ExportParams params;
+  std::string outputFile;
+
+  int longIndex = 0;
+  int c;
+  while ((c = getopt_long(argc, argv, "o:f:c:u:s:U:j:z::h", longopts, &longIndex)) != -1) {
+    if(c == 'o') {
+      outputFile = optarg;
+    } else if(c == 'f' && !strcmp(optarg, "jsonl")) {
+      params.format = EXPORT_JSONL;
+    } else if(c == 'f' && !strcmp(optarg, "csv")) {
+      params.format = EXPORT_CSV;
+    } else if(c == 'c') {
+      params.chatIDs.push_back(strtoll(optarg, NULL, 10));
+    } else if(c == 'u') {
+      params.senderIDs.push_back(strtoll(optarg, NULL, 10));
+    } else if(c == 's' && parseExportTime(optarg, params.since)) {
+      continue;
+    } else if(c == 'U' && parseExportTime(optarg, params.until)) {
+      continue;
+    } else if(c == 'j') {
+      params.threads = strtoul(optarg, NULL, 10);
+    } else if(c == 'z') {
+      params.zstdLevel = optarg ? atoi(optarg) : DEFAULT_EXPORT_ZSTD_LEVEL;
+    } else {
+      if(c != 'h') {
+        SPDLOG_ERROR("Invalid argument: {}", argv[optind - 1]);
+      }
+      printHelp(argv[0]);
+      return c == 'h' ? 0 : 1;
+    }
+  }
+  if(optind != argc - 1) {
+    printHelp(argv[0]);
+    return 1;
+  }
+  params.dbFile = argv[optind];
+
+  int fd = STDOUT_FILENO;
+  if(outputFile != "") {
+    fd = open(outputFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) {
+      SPDLOG_ERROR("Unable to open {}: {}", outputFile, strerror(errno));
+      return 1;
+    }
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  ExportStats stats;
+  bool ok = exportHistory(params, fd, stats);
+  if(fd != STDOUT_FILENO && close(fd) < 0) {
+    SPDLOG_ERROR("Unable to close {}: {}", outputFile, strerror(errno));
+    ok = false;
+  }
+  double elapsedSec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  if(!ok) {
+    SPDLOG_ERROR("Export failed after {} messages from {} chats", stats.messages, stats.chats);
+    return 1;
+  }
+  SPDLOG_INFO("Exported {} messages from {} chats ({:.1f} MiB) in {:.1f}s, {:.0f} messages/s", stats.messages, stats.chats,
+              stats.bytes / (1024.0 * 1024.0), elapsedSec, stats.messages / std::max(elapsedSec, 1e-9));
+  return 0;
+}